@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CBATTICON_BACKEND_H
+#define CBATTICON_BACKEND_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * toolkit backend interface
+ *
+ * A backend is a shared object, cbatticon-NAME.so, that shows the tray
+ * icons with one toolkit. It is only loaded when an icon is needed, and
+ * exports cbatticon_backend_get, which returns a backend description whose
+ * api_version is CBATTICON_BACKEND_API_VERSION. The toolkit main loop must
+ * dispatch the default glib main context (gtk does, and so does Qt with its
+ * glib event dispatcher), where D-Bus, the notifications, the commands and
+ * the configuration are watched. A backend whose main loop has timers and
+ * file descriptor watches of its own can also run the updates and the
+ * sockets there, with timeout_add, fd_add and source_remove; they are then
+ * dispatched without going through glib. A main loop that waits elsewhere
+ * than in the glib poll function reports its wakeups with on_wakeup, so that
+ * they are still counted.
+ *
+ * init         : initialise the toolkit with the command line, 0 on success
+ * has_icon     : whether the icon theme has the named icon
+ * theme_name   : the name of the icon theme, allocated with malloc (NULL if
+ *                unknown); it keys the cache of the available icon types
+ * icon_new     : create a hidden tray icon
+ * icon_set_icon: set the icon from the icon theme
+ * icon_set_text: set the tooltip
+ * icon_show    : show the icon
+ * icon_free    : hide and destroy the icon
+ * icon_on_click: call func when the icon is clicked
+ * run          : run the main loop until quit is called
+ * timeout_add  : (optional) call func every seconds, with a coarse timer
+ *                that may fire up to a second late, until it returns 0;
+ *                returns an id above 0
+ * fd_add       : (optional) call func when fd meets condition, a set of
+ *                CBATTICON_FD_* flags, until it returns 0; func is given the
+ *                flags that woke it up (a hang up or an error may wake up a
+ *                read or a write watch, as with poll); returns an id above 0
+ * source_remove: (optional) stop a timeout or a watch that is still active
+ * icon_on_popup: (optional) call func when the icon is right clicked
+ * popup_show   : (optional, with icon_on_popup) show a popup next to the
+ *                icon with the sparklines of the power draw and of the
+ *                charge of the samples (oldest first, at most
+ *                CBATTICON_HISTORY_COLUMNS) and a text under them; closed
+ *                is called once the user has closed it; when the popup is
+ *                already shown, draw it again with the samples and the
+ *                text instead, where it is
+ * popup_update : while the popup is shown, scroll its sparklines by one
+ *                column and draw sample in the new one (unless sample is
+ *                NULL), and set its text
+ * on_wakeup    : (optional) call func each time the main loop returns from a
+ *                wait that was not done in the poll function of the default
+ *                glib main context
+ */
+
+#define CBATTICON_BACKEND_API_VERSION 6
+#define CBATTICON_BACKEND_SYMBOL      "cbatticon_backend_get"
+
+typedef struct cbatticon_tray_icon cbatticon_tray_icon;
+
+typedef void (*cbatticon_click_func) (cbatticon_tray_icon *icon, void *user_data);
+typedef int  (*cbatticon_timeout_func) (void *user_data);
+typedef int  (*cbatticon_fd_func) (int fd, int condition, void *user_data);
+
+typedef void (*cbatticon_closed_func) (void *user_data);
+typedef void (*cbatticon_wakeup_func) (void);
+
+#define CBATTICON_FD_IN  1  /* G_IO_IN */
+#define CBATTICON_FD_PRI 2  /* G_IO_PRI */
+#define CBATTICON_FD_OUT 4  /* G_IO_OUT */
+#define CBATTICON_FD_ERR 8  /* G_IO_ERR */
+#define CBATTICON_FD_HUP 16 /* G_IO_HUP */
+
+#define CBATTICON_HISTORY_COLUMNS 240 /* an hour, a column every 15 seconds */
+
+struct cbatticon_history_sample {
+    float power;      /* mean draw, in W (A when the battery reports charges), -1 when unknown */
+    float percentage; /* -1 when unknown */
+};
+
+struct cbatticon_backend {
+    int                    api_version;
+    const char            *name;
+    int                  (*init)          (int *argc, char ***argv);
+    int                  (*has_icon)      (const char *name);
+    char*                (*theme_name)    (void);
+    cbatticon_tray_icon* (*icon_new)      (void);
+    void                 (*icon_set_icon) (cbatticon_tray_icon *icon, const char *name);
+    void                 (*icon_set_text) (cbatticon_tray_icon *icon, const char *text);
+    void                 (*icon_show)     (cbatticon_tray_icon *icon);
+    void                 (*icon_free)     (cbatticon_tray_icon *icon);
+    void                 (*icon_on_click) (cbatticon_tray_icon *icon, cbatticon_click_func func, void *user_data);
+    void                 (*run)           (void);
+    void                 (*quit)          (void);
+    unsigned int         (*timeout_add)   (unsigned int seconds, cbatticon_timeout_func func, void *user_data);
+    unsigned int         (*fd_add)        (int fd, int condition, cbatticon_fd_func func, void *user_data);
+    void                 (*source_remove) (unsigned int id);
+    void                 (*icon_on_popup) (cbatticon_tray_icon *icon, cbatticon_click_func func, void *user_data);
+    void                 (*popup_show)    (cbatticon_tray_icon *icon, const struct cbatticon_history_sample *samples, int num_samples,
+                                           const char *text, cbatticon_closed_func closed, void *user_data);
+    void                 (*popup_update)  (const struct cbatticon_history_sample *sample, const char *text);
+    void                 (*on_wakeup)     (cbatticon_wakeup_func func);
+};
+
+typedef const struct cbatticon_backend* (*cbatticon_backend_get_func) (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * gtk backend (built against gtk3 as cbatticon-gtk3.so, and against gtk2 as
+ * cbatticon-gtk2.so)
+ */
+
+#include <gtk/gtk.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../backend.h"
+
+#define GTK_ICON(icon) ((GtkStatusIcon*)(icon))
+
+static int gtk_backend_init (int *argc, char ***argv)
+{
+    return gtk_init_check (argc, argv) == TRUE ? 0 : -1;
+}
+
+static int gtk_backend_has_icon (const char *name)
+{
+    return gtk_icon_theme_has_icon (gtk_icon_theme_get_default (), name);
+}
+
+static char* gtk_backend_theme_name (void)
+{
+    gchar *name = NULL;
+    char *theme_name = NULL;
+
+    g_object_get (gtk_settings_get_default (), "gtk-icon-theme-name", &name, NULL);
+
+    if (name != NULL) {
+        size_t length = strlen (name) + 1;
+
+        theme_name = malloc (length);
+        if (theme_name != NULL) {
+            memcpy (theme_name, name, length);
+        }
+        g_free (name);
+    }
+
+    return theme_name;
+}
+
+static cbatticon_tray_icon* gtk_backend_icon_new (void)
+{
+    return (cbatticon_tray_icon*)gtk_status_icon_new ();
+}
+
+static void gtk_backend_icon_set_icon (cbatticon_tray_icon *icon, const char *name)
+{
+    gtk_status_icon_set_from_icon_name (GTK_ICON (icon), name);
+}
+
+static void gtk_backend_icon_set_text (cbatticon_tray_icon *icon, const char *text)
+{
+    gtk_status_icon_set_tooltip_text (GTK_ICON (icon), text);
+}
+
+static void gtk_backend_icon_show (cbatticon_tray_icon *icon)
+{
+    gtk_status_icon_set_visible (GTK_ICON (icon), TRUE);
+}
+
+static void gtk_backend_icon_free (cbatticon_tray_icon *icon)
+{
+    g_object_unref (GTK_ICON (icon));
+}
+
+static void gtk_backend_icon_on_click (cbatticon_tray_icon *icon, cbatticon_click_func func, void *user_data)
+{
+    g_signal_connect (G_OBJECT (GTK_ICON (icon)), "activate", G_CALLBACK (func), user_data);
+}
+
+/*
+ * history popup
+ *
+ * The sparklines are drawn into an image when the popup is shown; each new
+ * sample then moves the image left by one column and only draws the new
+ * column, unless its power draw needs a higher scale.
+ */
+
+#define POPUP_LINE_HEIGHT 32
+#define POPUP_GAP         4
+#define POPUP_WIDTH       CBATTICON_HISTORY_COLUMNS
+#define POPUP_HEIGHT      (2 * POPUP_LINE_HEIGHT + POPUP_GAP)
+
+static struct {
+    cbatticon_click_func             on_popup;
+    void                            *on_popup_data;
+    GtkWidget                       *window;
+    GtkWidget                       *area;
+    GtkWidget                       *label;
+    cairo_surface_t                 *surface;
+    struct cbatticon_history_sample  samples[CBATTICON_HISTORY_COLUMNS]; /* as drawn, oldest at head */
+    int                              head;
+    int                              count;
+    float                            scale;                              /* power draw of a full column */
+    cbatticon_closed_func            closed;
+    void                            *closed_data;
+} gtk_popup;
+
+static float gtk_popup_get_scale (float power)
+{
+    return power > 1 ? ceilf (power) : 1;
+}
+
+static void gtk_popup_draw_column (cairo_t *cr, int x, const struct cbatticon_history_sample *sample)
+{
+    double height;
+
+    cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+    cairo_rectangle (cr, x, 0, 1, POPUP_HEIGHT);
+    cairo_fill (cr);
+    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+
+    if (sample->power >= 0) {
+        height = MIN (sample->power / gtk_popup.scale, 1) * POPUP_LINE_HEIGHT;
+        cairo_set_source_rgb (cr, 0.9, 0.5, 0.1);
+        cairo_rectangle (cr, x, POPUP_LINE_HEIGHT - height, 1, height);
+        cairo_fill (cr);
+    }
+
+    if (sample->percentage >= 0) {
+        height = MIN (sample->percentage / 100, 1) * POPUP_LINE_HEIGHT;
+        cairo_set_source_rgb (cr, 0.3, 0.7, 0.3);
+        cairo_rectangle (cr, x, POPUP_HEIGHT - height, 1, height);
+        cairo_fill (cr);
+    }
+}
+
+static void gtk_popup_draw_all (void)
+{
+    cairo_t *cr = cairo_create (gtk_popup.surface);
+    int i, first = (gtk_popup.head - gtk_popup.count + CBATTICON_HISTORY_COLUMNS) % CBATTICON_HISTORY_COLUMNS;
+
+    cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint (cr);
+
+    for (i = 0; i < gtk_popup.count; i++) {
+        gtk_popup_draw_column (cr, POPUP_WIDTH - gtk_popup.count + i,
+            &gtk_popup.samples[(first + i) % CBATTICON_HISTORY_COLUMNS]);
+    }
+
+    cairo_destroy (cr);
+}
+
+static void gtk_popup_scroll (const struct cbatticon_history_sample *sample)
+{
+    unsigned char *data;
+    int stride, y;
+    cairo_t *cr;
+
+    cairo_surface_flush (gtk_popup.surface);
+    data   = cairo_image_surface_get_data (gtk_popup.surface);
+    stride = cairo_image_surface_get_stride (gtk_popup.surface);
+
+    for (y = 0; y < POPUP_HEIGHT; y++) {
+        memmove (data + y * stride, data + y * stride + 4, (POPUP_WIDTH - 1) * 4);
+    }
+
+    cairo_surface_mark_dirty (gtk_popup.surface);
+
+    cr = cairo_create (gtk_popup.surface);
+    gtk_popup_draw_column (cr, POPUP_WIDTH - 1, sample);
+    cairo_destroy (cr);
+}
+
+#if GTK_MAJOR_VERSION >= 3
+static gboolean gtk_popup_on_draw (GtkWidget *widget, cairo_t *cr, gpointer user_data)
+{
+    cairo_set_source_surface (cr, gtk_popup.surface, 0, 0);
+    cairo_paint (cr);
+
+    return FALSE;
+}
+#else
+static gboolean gtk_popup_on_expose (GtkWidget *widget, GdkEventExpose *event, gpointer user_data)
+{
+    cairo_t *cr = gdk_cairo_create (gtk_widget_get_window (widget));
+
+    gdk_cairo_region (cr, event->region);
+    cairo_clip (cr);
+    cairo_set_source_surface (cr, gtk_popup.surface, 0, 0);
+    cairo_paint (cr);
+    cairo_destroy (cr);
+
+    return FALSE;
+}
+#endif
+
+static gboolean gtk_popup_on_close_event (GtkWidget *widget, GdkEvent *event, gpointer user_data)
+{
+    gtk_widget_destroy (gtk_popup.window);
+
+    return TRUE;
+}
+
+static void gtk_popup_on_destroy (GtkWidget *widget, gpointer user_data)
+{
+    cairo_surface_destroy (gtk_popup.surface);
+    gtk_popup.surface = NULL;
+    gtk_popup.window  = NULL;
+
+    gtk_popup.closed (gtk_popup.closed_data);
+}
+
+static void gtk_backend_on_popup_menu (GtkStatusIcon *status_icon, guint button, guint activate_time, gpointer user_data)
+{
+    gtk_popup.on_popup ((cbatticon_tray_icon*)status_icon, gtk_popup.on_popup_data);
+}
+
+static void gtk_backend_icon_on_popup (cbatticon_tray_icon *icon, cbatticon_click_func func, void *user_data)
+{
+    gtk_popup.on_popup      = func;
+    gtk_popup.on_popup_data = user_data;
+
+    g_signal_connect (G_OBJECT (GTK_ICON (icon)), "popup-menu", G_CALLBACK (gtk_backend_on_popup_menu), NULL);
+}
+
+static void gtk_popup_set_samples (const struct cbatticon_history_sample *samples, int num_samples)
+{
+    float power = 0;
+    int i;
+
+    gtk_popup.count = MIN (num_samples, CBATTICON_HISTORY_COLUMNS);
+    gtk_popup.head  = gtk_popup.count % CBATTICON_HISTORY_COLUMNS;
+    memcpy (gtk_popup.samples, samples, gtk_popup.count * sizeof (*samples));
+
+    for (i = 0; i < gtk_popup.count; i++) {
+        power = MAX (power, samples[i].power);
+    }
+
+    gtk_popup.scale = gtk_popup_get_scale (power);
+}
+
+static void gtk_backend_popup_show (cbatticon_tray_icon *icon, const struct cbatticon_history_sample *samples, int num_samples,
+                                    const char *text, cbatticon_closed_func closed, void *user_data)
+{
+    GtkWidget *box;
+
+    /* already shown: drawn again where it is */
+
+    if (gtk_popup.window != NULL) {
+        gtk_popup_set_samples (samples, num_samples);
+        gtk_popup_draw_all ();
+        gtk_label_set_text (GTK_LABEL (gtk_popup.label), text);
+        gtk_widget_queue_draw (gtk_popup.area);
+        return;
+    }
+
+    gtk_popup_set_samples (samples, num_samples);
+
+    gtk_popup.closed      = closed;
+    gtk_popup.closed_data = user_data;
+
+    gtk_popup.surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, POPUP_WIDTH, POPUP_HEIGHT);
+    gtk_popup_draw_all ();
+
+    gtk_popup.window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_decorated (GTK_WINDOW (gtk_popup.window), FALSE);
+    gtk_window_set_resizable (GTK_WINDOW (gtk_popup.window), FALSE);
+    gtk_window_set_skip_taskbar_hint (GTK_WINDOW (gtk_popup.window), TRUE);
+    gtk_window_set_keep_above (GTK_WINDOW (gtk_popup.window), TRUE);
+    gtk_window_set_type_hint (GTK_WINDOW (gtk_popup.window), GDK_WINDOW_TYPE_HINT_UTILITY);
+    gtk_window_set_position (GTK_WINDOW (gtk_popup.window), GTK_WIN_POS_MOUSE);
+    gtk_container_set_border_width (GTK_CONTAINER (gtk_popup.window), 6);
+    gtk_widget_add_events (gtk_popup.window, GDK_BUTTON_PRESS_MASK);
+
+#if GTK_MAJOR_VERSION >= 3
+    box = gtk_box_new (GTK_ORIENTATION_VERTICAL, 6);
+#else
+    box = gtk_vbox_new (FALSE, 6);
+#endif
+    gtk_container_add (GTK_CONTAINER (gtk_popup.window), box);
+
+    gtk_popup.area = gtk_drawing_area_new ();
+    gtk_widget_set_size_request (gtk_popup.area, POPUP_WIDTH, POPUP_HEIGHT);
+    gtk_box_pack_start (GTK_BOX (box), gtk_popup.area, FALSE, FALSE, 0);
+
+    gtk_popup.label = gtk_label_new (text);
+    gtk_box_pack_start (GTK_BOX (box), gtk_popup.label, FALSE, FALSE, 0);
+
+#if GTK_MAJOR_VERSION >= 3
+    g_signal_connect (G_OBJECT (gtk_popup.area), "draw", G_CALLBACK (gtk_popup_on_draw), NULL);
+#else
+    g_signal_connect (G_OBJECT (gtk_popup.area), "expose-event", G_CALLBACK (gtk_popup_on_expose), NULL);
+#endif
+    g_signal_connect (G_OBJECT (gtk_popup.window), "focus-out-event", G_CALLBACK (gtk_popup_on_close_event), NULL);
+    g_signal_connect (G_OBJECT (gtk_popup.window), "button-press-event", G_CALLBACK (gtk_popup_on_close_event), NULL);
+    g_signal_connect (G_OBJECT (gtk_popup.window), "key-press-event", G_CALLBACK (gtk_popup_on_close_event), NULL);
+    g_signal_connect (G_OBJECT (gtk_popup.window), "destroy", G_CALLBACK (gtk_popup_on_destroy), NULL);
+
+    gtk_widget_show_all (gtk_popup.window);
+    gtk_window_present (GTK_WINDOW (gtk_popup.window));
+}
+
+static void gtk_backend_popup_update (const struct cbatticon_history_sample *sample, const char *text)
+{
+    if (gtk_popup.window == NULL) {
+        return;
+    }
+
+    gtk_label_set_text (GTK_LABEL (gtk_popup.label), text);
+
+    if (sample == NULL) {
+        return;
+    }
+
+    gtk_popup.samples[gtk_popup.head] = *sample;
+    gtk_popup.head  = (gtk_popup.head + 1) % CBATTICON_HISTORY_COLUMNS;
+    gtk_popup.count = MIN (gtk_popup.count + 1, CBATTICON_HISTORY_COLUMNS);
+
+    if (sample->power > gtk_popup.scale) {
+        gtk_popup.scale = gtk_popup_get_scale (sample->power);
+        gtk_popup_draw_all ();
+    } else {
+        gtk_popup_scroll (sample);
+    }
+
+    gtk_widget_queue_draw (gtk_popup.area);
+}
+
+static void gtk_backend_run (void)
+{
+    gtk_main ();
+}
+
+static void gtk_backend_quit (void)
+{
+    gtk_main_quit ();
+}
+
+static const struct cbatticon_backend gtk_backend = {
+    CBATTICON_BACKEND_API_VERSION,
+#if GTK_MAJOR_VERSION >= 3
+    "gtk3",
+#else
+    "gtk2",
+#endif
+    gtk_backend_init,
+    gtk_backend_has_icon,
+    gtk_backend_theme_name,
+    gtk_backend_icon_new,
+    gtk_backend_icon_set_icon,
+    gtk_backend_icon_set_text,
+    gtk_backend_icon_show,
+    gtk_backend_icon_free,
+    gtk_backend_icon_on_click,
+    gtk_backend_run,
+    gtk_backend_quit,
+    NULL,
+    NULL,
+    NULL,
+    gtk_backend_icon_on_popup,
+    gtk_backend_popup_show,
+    gtk_backend_popup_update,
+    NULL
+};
+
+const struct cbatticon_backend* cbatticon_backend_get (void)
+{
+    return &gtk_backend;
+}
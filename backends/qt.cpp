@@ -0,0 +1,555 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Qt backend (built against Qt6 as cbatticon-qt6.so)
+ *
+ * The updates, the device polls and the metrics sockets run on QTimer and
+ * QSocketNotifier, so they are dispatched by the Qt event loop whichever
+ * event dispatcher it uses. When Qt does not run on glib (QT_NO_GLIB=1, or
+ * Qt built without it), the glib main context, where D-Bus, the
+ * notifications and the commands are watched, is dispatched from Qt: each
+ * time Qt is about to wait, the ready glib sources are dispatched, and the
+ * file descriptors glib polls and its next timeout are watched with socket
+ * notifiers and a timer, which wake Qt up for the next round. Qt then waits
+ * in its own poll, so its wakeups are reported to cbatticon (on_wakeup),
+ * which would otherwise only see the checks of the glib sources.
+ */
+
+#include <QAbstractEventDispatcher>
+#include <QApplication>
+#include <QCursor>
+#include <QHash>
+#include <QImage>
+#include <QPainter>
+#include <QScreen>
+#include <QSocketNotifier>
+#include <QSystemTrayIcon>
+#include <QTimer>
+#include <QWidget>
+#include <QtMath>
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "../backend.h"
+
+#define QT_ICON(icon) (reinterpret_cast<QSystemTrayIcon*>(icon))
+
+/* ids below the top bit, which cbatticon uses to tell them from glib ids */
+
+#define QT_SOURCE_MAX 0x7fffffffu
+
+static QHash<unsigned int, QObject*> qt_sources;
+static unsigned int qt_source_id = 0;
+
+static struct {
+    GMainContext                    *context;
+    GPollFD                         *fds;
+    gint                             num_fds;
+    gint                             allocated;
+    gint                             priority;
+    gboolean                         prepared;
+    gboolean                         dispatching; /* a nested Qt loop waits in a glib callback */
+    QHash<qint64, QSocketNotifier*>  notifiers; /* by fd and type */
+    QTimer                          *timer;
+    cbatticon_wakeup_func            wakeup;
+} qt_glib;
+
+static int qt_backend_init (int *argc, char ***argv)
+{
+    new QApplication (*argc, *argv);
+
+    return 0;
+}
+
+static int qt_backend_has_icon (const char *name)
+{
+    return QIcon::hasThemeIcon (name) ? 1 : 0;
+}
+
+static char* qt_backend_theme_name (void)
+{
+    QString name = QIcon::themeName ();
+
+    return name.isEmpty () ? NULL : strdup (name.toUtf8 ().constData ());
+}
+
+static cbatticon_tray_icon* qt_backend_icon_new (void)
+{
+    return reinterpret_cast<cbatticon_tray_icon*>(new QSystemTrayIcon);
+}
+
+static void qt_backend_icon_set_icon (cbatticon_tray_icon *icon, const char *name)
+{
+    QT_ICON (icon)->setIcon (QIcon::fromTheme (name));
+}
+
+static void qt_backend_icon_set_text (cbatticon_tray_icon *icon, const char *text)
+{
+    QT_ICON (icon)->setToolTip (text);
+}
+
+static void qt_backend_icon_show (cbatticon_tray_icon *icon)
+{
+    QT_ICON (icon)->show ();
+}
+
+static void qt_backend_icon_free (cbatticon_tray_icon *icon)
+{
+    delete QT_ICON (icon);
+}
+
+static void qt_backend_icon_on_click (cbatticon_tray_icon *icon, cbatticon_click_func func, void *user_data)
+{
+    QObject::connect (QT_ICON (icon), &QSystemTrayIcon::activated, [icon, func, user_data] (QSystemTrayIcon::ActivationReason reason) {
+        if (reason != QSystemTrayIcon::Context) {
+            func (icon, user_data);
+        }
+    });
+}
+
+/*
+ * history popup
+ *
+ * As in the gtk backend, the sparklines are drawn into an image when the
+ * popup is shown; each new sample then moves the image left by one column
+ * and only draws the new column, unless its power draw needs a higher scale.
+ */
+
+#define POPUP_LINE_HEIGHT 32
+#define POPUP_GAP         4
+#define POPUP_MARGIN      6
+#define POPUP_WIDTH       CBATTICON_HISTORY_COLUMNS
+#define POPUP_HEIGHT      (2 * POPUP_LINE_HEIGHT + POPUP_GAP)
+
+class QtPopup : public QWidget
+{
+public:
+    QtPopup () : QWidget (nullptr, Qt::Popup) { setAttribute (Qt::WA_DeleteOnClose); }
+
+protected:
+    void paintEvent (QPaintEvent *event) override;
+    void mousePressEvent (QMouseEvent *event) override { close (); }
+};
+
+static struct {
+    QtPopup                         *widget;
+    QImage                           image;
+    QString                          text;
+    struct cbatticon_history_sample  samples[CBATTICON_HISTORY_COLUMNS]; /* as drawn, oldest at head */
+    int                              head;
+    int                              count;
+    float                            scale;                              /* power draw of a full column */
+} qt_popup;
+
+void QtPopup::paintEvent (QPaintEvent *event)
+{
+    QPainter painter (this);
+
+    painter.drawImage (POPUP_MARGIN, POPUP_MARGIN, qt_popup.image);
+    painter.drawText (QRect (POPUP_MARGIN, 2 * POPUP_MARGIN + POPUP_HEIGHT, POPUP_WIDTH, height () - 3 * POPUP_MARGIN - POPUP_HEIGHT),
+                      Qt::TextWordWrap, qt_popup.text);
+}
+
+static float qt_popup_get_scale (float power)
+{
+    return power > 1 ? qCeil (power) : 1;
+}
+
+static void qt_popup_draw_column (QPainter &painter, int x, const struct cbatticon_history_sample *sample)
+{
+    qreal height;
+
+    painter.setCompositionMode (QPainter::CompositionMode_Clear);
+    painter.fillRect (x, 0, 1, POPUP_HEIGHT, Qt::transparent);
+    painter.setCompositionMode (QPainter::CompositionMode_SourceOver);
+
+    if (sample->power >= 0) {
+        height = qMin (sample->power / qt_popup.scale, 1.0f) * POPUP_LINE_HEIGHT;
+        painter.fillRect (QRectF (x, POPUP_LINE_HEIGHT - height, 1, height), QColor (230, 128, 25));
+    }
+
+    if (sample->percentage >= 0) {
+        height = qMin (sample->percentage / 100, 1.0f) * POPUP_LINE_HEIGHT;
+        painter.fillRect (QRectF (x, POPUP_HEIGHT - height, 1, height), QColor (77, 179, 77));
+    }
+}
+
+static void qt_popup_draw_all (void)
+{
+    QPainter painter (&qt_popup.image);
+    int first = (qt_popup.head - qt_popup.count + CBATTICON_HISTORY_COLUMNS) % CBATTICON_HISTORY_COLUMNS;
+
+    qt_popup.image.fill (Qt::transparent);
+
+    for (int i = 0; i < qt_popup.count; i++) {
+        qt_popup_draw_column (painter, POPUP_WIDTH - qt_popup.count + i,
+                              &qt_popup.samples[(first + i) % CBATTICON_HISTORY_COLUMNS]);
+    }
+}
+
+static void qt_popup_scroll (const struct cbatticon_history_sample *sample)
+{
+    for (int y = 0; y < POPUP_HEIGHT; y++) {
+        uchar *line = qt_popup.image.scanLine (y);
+
+        memmove (line, line + 4, (POPUP_WIDTH - 1) * 4);
+    }
+
+    QPainter painter (&qt_popup.image);
+
+    qt_popup_draw_column (painter, POPUP_WIDTH - 1, sample);
+}
+
+static void qt_popup_set_text (const char *text)
+{
+    int text_height;
+
+    qt_popup.text = QString::fromUtf8 (text);
+    text_height = qt_popup.widget->fontMetrics ().boundingRect (QRect (0, 0, POPUP_WIDTH, 0), Qt::TextWordWrap, qt_popup.text).height ();
+    qt_popup.widget->setFixedSize (POPUP_WIDTH + 2 * POPUP_MARGIN, POPUP_HEIGHT + text_height + 3 * POPUP_MARGIN);
+}
+
+static void qt_backend_icon_on_popup (cbatticon_tray_icon *icon, cbatticon_click_func func, void *user_data)
+{
+    QObject::connect (QT_ICON (icon), &QSystemTrayIcon::activated, [icon, func, user_data] (QSystemTrayIcon::ActivationReason reason) {
+        if (reason == QSystemTrayIcon::Context) {
+            func (icon, user_data);
+        }
+    });
+}
+
+static void qt_popup_set_samples (const struct cbatticon_history_sample *samples, int num_samples)
+{
+    float power = 0;
+
+    qt_popup.count = qMin (num_samples, CBATTICON_HISTORY_COLUMNS);
+    qt_popup.head  = qt_popup.count % CBATTICON_HISTORY_COLUMNS;
+    memcpy (qt_popup.samples, samples, qt_popup.count * sizeof (*samples));
+
+    for (int i = 0; i < qt_popup.count; i++) {
+        power = qMax (power, samples[i].power);
+    }
+
+    qt_popup.scale = qt_popup_get_scale (power);
+}
+
+static void qt_backend_popup_show (cbatticon_tray_icon *icon, const struct cbatticon_history_sample *samples, int num_samples,
+                                   const char *text, cbatticon_closed_func closed, void *user_data)
+{
+    QPoint position = QCursor::pos ();
+    QScreen *screen = QGuiApplication::screenAt (position);
+
+    /* already shown: drawn again where it is */
+
+    if (qt_popup.widget != nullptr) {
+        qt_popup_set_samples (samples, num_samples);
+        qt_popup_draw_all ();
+        qt_popup_set_text (text);
+        qt_popup.widget->update ();
+        return;
+    }
+
+    qt_popup_set_samples (samples, num_samples);
+    qt_popup.image = QImage (POPUP_WIDTH, POPUP_HEIGHT, QImage::Format_ARGB32_Premultiplied);
+    qt_popup_draw_all ();
+
+    qt_popup.widget = new QtPopup;
+    qt_popup_set_text (text);
+
+    QObject::connect (qt_popup.widget, &QObject::destroyed, [closed, user_data] {
+        qt_popup.widget = nullptr;
+        qt_popup.image  = QImage ();
+        closed (user_data);
+    });
+
+    /* above the pointer, which is on the icon, unless there is no room */
+
+    position -= QPoint (qt_popup.widget->width () / 2, qt_popup.widget->height ());
+
+    if (screen != nullptr) {
+        QRect area = screen->availableGeometry ();
+
+        position.setX (qBound (area.left (), position.x (), area.right () - qt_popup.widget->width ()));
+        position.setY (qBound (area.top (), position.y (), area.bottom () - qt_popup.widget->height ()));
+    }
+
+    qt_popup.widget->move (position);
+    qt_popup.widget->show ();
+}
+
+static void qt_backend_popup_update (const struct cbatticon_history_sample *sample, const char *text)
+{
+    if (qt_popup.widget == nullptr) {
+        return;
+    }
+
+    qt_popup_set_text (text);
+
+    if (sample != NULL) {
+        qt_popup.samples[qt_popup.head] = *sample;
+        qt_popup.head  = (qt_popup.head + 1) % CBATTICON_HISTORY_COLUMNS;
+        qt_popup.count = qMin (qt_popup.count + 1, CBATTICON_HISTORY_COLUMNS);
+
+        if (sample->power > qt_popup.scale) {
+            qt_popup.scale = qt_popup_get_scale (sample->power);
+            qt_popup_draw_all ();
+        } else {
+            qt_popup_scroll (sample);
+        }
+    }
+
+    qt_popup.widget->update ();
+}
+
+static unsigned int qt_backend_add_source (QObject *source)
+{
+    do {
+        qt_source_id = qt_source_id < QT_SOURCE_MAX ? qt_source_id + 1 : 1;
+    } while (qt_sources.contains (qt_source_id));
+
+    qt_sources.insert (qt_source_id, source);
+
+    return qt_source_id;
+}
+
+/* a source may be removed from its own callback: it is stopped at once */
+/* and deleted once the callback has returned                            */
+
+static void qt_backend_source_remove (unsigned int id)
+{
+    QObject *source = qt_sources.take (id);
+
+    if (source == NULL) {
+        return;
+    }
+
+    if (QTimer *timer = qobject_cast<QTimer*> (source)) {
+        timer->stop ();
+    }
+
+    for (QSocketNotifier *notifier : source->findChildren<QSocketNotifier*> ()) {
+        notifier->setEnabled (false);
+    }
+
+    source->deleteLater ();
+}
+
+static unsigned int qt_backend_timeout_add (unsigned int seconds, cbatticon_timeout_func func, void *user_data)
+{
+    QTimer *timer = new QTimer;
+    unsigned int id = qt_backend_add_source (timer);
+
+    /* like g_timeout_add_seconds: rounded to the second, so that the */
+    /* timers of the session can fire together                        */
+
+    timer->setTimerType (Qt::VeryCoarseTimer);
+    timer->setInterval (seconds * 1000);
+
+    QObject::connect (timer, &QTimer::timeout, [id, func, user_data] {
+        if (func (user_data) == 0) {
+            qt_backend_source_remove (id);
+        }
+    });
+
+    timer->start ();
+
+    return id;
+}
+
+/* a watch has a notifier for each type in its condition; a hang up or */
+/* an error wakes up the ones poll reports it to                       */
+
+static unsigned int qt_backend_fd_add (int fd, int condition, cbatticon_fd_func func, void *user_data)
+{
+    static const struct {
+        QSocketNotifier::Type type;
+        int                   condition;
+    } types[] = {
+        { QSocketNotifier::Read     , CBATTICON_FD_IN  },
+        { QSocketNotifier::Write    , CBATTICON_FD_OUT },
+        { QSocketNotifier::Exception, CBATTICON_FD_PRI }
+    };
+
+    QObject *watch = new QObject;
+    unsigned int id = qt_backend_add_source (watch);
+
+    for (const auto &type : types) {
+        int woken = type.condition;
+
+        if ((condition & type.condition) == 0) {
+            continue;
+        }
+
+        QSocketNotifier *notifier = new QSocketNotifier (fd, type.type, watch);
+
+        QObject::connect (notifier, &QSocketNotifier::activated, [id, fd, woken, func, user_data] {
+            if (func (fd, woken, user_data) == 0) {
+                qt_backend_source_remove (id);
+            }
+        });
+    }
+
+    return id;
+}
+
+static void qt_glib_watch (int fd, QSocketNotifier::Type type, QHash<qint64, QSocketNotifier*> *watched)
+{
+    qint64 key = (qint64)fd * 3 + type;
+    QSocketNotifier *notifier = qt_glib.notifiers.take (key);
+
+    /* the notifiers only wake Qt up, glib is dispatched before it waits again */
+
+    if (notifier == NULL) {
+        notifier = new QSocketNotifier (fd, type);
+    }
+
+    watched->insert (key, notifier);
+}
+
+static void qt_glib_iterate (void)
+{
+    QHash<qint64, QSocketNotifier*> watched;
+    gint timeout;
+
+    if (qt_glib.dispatching == TRUE) {
+        return;
+    }
+
+    /* dispatch the sources that are ready */
+
+    if (qt_glib.prepared == TRUE) {
+        g_main_context_get_poll_func (qt_glib.context) (qt_glib.fds, qt_glib.num_fds, 0);
+
+        if (g_main_context_check (qt_glib.context, qt_glib.priority, qt_glib.fds, qt_glib.num_fds) == TRUE) {
+            qt_glib.dispatching = TRUE;
+            g_main_context_dispatch (qt_glib.context);
+            qt_glib.dispatching = FALSE;
+        }
+    }
+
+    /* and watch what the others wait for */
+
+    g_main_context_prepare (qt_glib.context, &qt_glib.priority);
+
+    while ((qt_glib.num_fds = g_main_context_query (qt_glib.context, qt_glib.priority, &timeout,
+                                                    qt_glib.fds, qt_glib.allocated)) > qt_glib.allocated) {
+        qt_glib.allocated = qt_glib.num_fds;
+        qt_glib.fds       = g_renew (GPollFD, qt_glib.fds, qt_glib.allocated);
+    }
+
+    qt_glib.prepared = TRUE;
+
+    for (gint i = 0; i < qt_glib.num_fds; i++) {
+        if ((qt_glib.fds[i].events & (G_IO_IN | G_IO_HUP | G_IO_ERR)) != 0) {
+            qt_glib_watch (qt_glib.fds[i].fd, QSocketNotifier::Read, &watched);
+        }
+
+        if ((qt_glib.fds[i].events & G_IO_OUT) != 0) {
+            qt_glib_watch (qt_glib.fds[i].fd, QSocketNotifier::Write, &watched);
+        }
+    }
+
+    qDeleteAll (qt_glib.notifiers);
+    qt_glib.notifiers = watched;
+
+    if (timeout >= 0) {
+        qt_glib.timer->start (timeout);
+    } else {
+        qt_glib.timer->stop ();
+    }
+}
+
+static void qt_glib_start (QAbstractEventDispatcher *dispatcher)
+{
+    qt_glib.context     = g_main_context_default ();
+    qt_glib.fds         = NULL;
+    qt_glib.num_fds     = 0;
+    qt_glib.allocated   = 0;
+    qt_glib.priority    = G_PRIORITY_DEFAULT;
+    qt_glib.prepared    = FALSE;
+    qt_glib.dispatching = FALSE;
+    qt_glib.timer       = new QTimer;
+
+    g_main_context_acquire (qt_glib.context);
+
+    qt_glib.timer->setSingleShot (true);
+    qt_glib.timer->setTimerType (Qt::PreciseTimer);
+
+    QObject::connect (dispatcher, &QAbstractEventDispatcher::aboutToBlock, qt_glib_iterate);
+    QObject::connect (dispatcher, &QAbstractEventDispatcher::awake, [] {
+        if (qt_glib.wakeup != NULL) {
+            qt_glib.wakeup ();
+        }
+    });
+}
+
+static void qt_backend_run (void)
+{
+    QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance ();
+
+    if (dispatcher->inherits ("QEventDispatcherGlib") == false) {
+        qt_glib_start (dispatcher);
+    }
+
+    qApp->exec ();
+}
+
+static void qt_backend_quit (void)
+{
+    qApp->quit ();
+}
+
+/* only used when Qt does not run on glib, whose poll function sees the waits */
+
+static void qt_backend_on_wakeup (cbatticon_wakeup_func func)
+{
+    qt_glib.wakeup = func;
+}
+
+static const struct cbatticon_backend qt_backend = {
+    CBATTICON_BACKEND_API_VERSION,
+    "qt6",
+    qt_backend_init,
+    qt_backend_has_icon,
+    qt_backend_theme_name,
+    qt_backend_icon_new,
+    qt_backend_icon_set_icon,
+    qt_backend_icon_set_text,
+    qt_backend_icon_show,
+    qt_backend_icon_free,
+    qt_backend_icon_on_click,
+    qt_backend_run,
+    qt_backend_quit,
+    qt_backend_timeout_add,
+    qt_backend_fd_add,
+    qt_backend_source_remove,
+    qt_backend_icon_on_popup,
+    qt_backend_popup_show,
+    qt_backend_popup_update,
+    qt_backend_on_wakeup
+};
+
+extern "C" const struct cbatticon_backend* cbatticon_backend_get (void)
+{
+    return &qt_backend;
+}
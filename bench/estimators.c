@@ -0,0 +1,642 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * estimators: compares the time remaining estimators over a directory of traces.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <glib.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../libcbatticon.h"
+#include "../trace.h"
+#include "../tray.h"
+
+/*
+ * estimator benchmark
+ *
+ * The batteries of each trace are found and read as cbatticon would at each
+ * tick of the trace, the estimators are compared on the first battery, on a
+ * clock that follows the times of the trace. The actual remaining time is
+ * only known for the segments that run until the battery is empty or full:
+ * the error of each estimator is taken as the battery crosses a few
+ * checkpoints of those segments, along with the time to its first estimate
+ * of each segment and the CPU time of an estimate.
+ */
+
+#define BENCHMARK_CHECKPOINTS 4
+
+static const gint benchmark_checkpoints[BENCHMARK_CHECKPOINTS] = { 90, 50, 20, 5 };
+
+struct estimator_sample {
+    gint64   time;
+    gint     status;
+    gboolean use_charge;
+    gdouble  full;
+    gdouble  now;
+    gdouble  rate;       /* power_now/current_now, or -1 when unavailable */
+    gint     percentage;
+    gdouble  actual;     /* actual remaining minutes, or -1 when unknown */
+};
+
+struct estimator {
+    const gchar *name;
+    void     (*reset) (void);
+    gboolean (*estimate) (const struct estimator_sample *sample, gdouble *rate);
+};
+
+struct estimator_result {
+    gdouble error_sum[BENCHMARK_CHECKPOINTS];
+    gint    error_count[BENCHMARK_CHECKPOINTS];
+    gdouble first_estimate_sum;
+    gint    first_estimate_count;
+    gint64  cpu_time;
+    gint    num_samples;
+};
+
+#define SYSFS_PATH    "/sys/class/power_supply"
+#define MAX_BATTERIES 8
+
+/* the trace being read, its time and the battery context reading it */
+
+static struct {
+    struct trace_reader  reader;
+    gint64               time;
+    cbatticon_context   *context;
+} benchmark;
+
+static void on_benchmark_clock (struct timespec *time, void *user_data)
+{
+    time->tv_sec  = benchmark.time / G_USEC_PER_SEC;
+    time->tv_nsec = benchmark.time % G_USEC_PER_SEC * 1000;
+}
+
+static gboolean benchmark_read (const gchar *path, const gchar *attribute, gchar **value)
+{
+    gchar *filename = g_build_filename (path, attribute, NULL);
+    gboolean status;
+
+    if (trace_reader_take (&benchmark.reader, TRACE_RECORD_READ, filename, &status, value) == FALSE) {
+        status = FALSE;
+    }
+
+    g_free (filename);
+
+    return status;
+}
+
+static gboolean benchmark_read_double (const gchar *path, const gchar *attribute, gdouble *value)
+{
+    gchar *string;
+    gdouble double_value;
+
+    if (benchmark_read (path, attribute, &string) == FALSE) {
+        return FALSE;
+    }
+
+    double_value = g_ascii_strtod (string, NULL);
+    g_free (string);
+
+    if (double_value < 0.01) {
+        return FALSE;
+    }
+
+    *value = double_value;
+
+    return TRUE;
+}
+
+static int on_benchmark_read (const char *path, const char *attribute, char **value, void *user_data)
+{
+    return benchmark_read (path, attribute, value) == TRUE ? 0 : -1;
+}
+
+static char** on_benchmark_list (const char *path, void *user_data)
+{
+    gchar **names = NULL;
+    gchar *joined_names;
+    gboolean status;
+
+    if (trace_reader_take (&benchmark.reader, TRACE_RECORD_LIST, path, &status, &joined_names) == TRUE && status == TRUE) {
+        names = g_strsplit (joined_names, "\n", -1);
+        g_free (joined_names);
+    }
+
+    return names;
+}
+
+/* current estimator: mean of the rate reported by the battery, */
+/* otherwise capacity change over the sample window             */
+
+static void estimator_filter_reset (void)
+{
+    cbatticon_context_reset_estimate (benchmark.context);
+}
+
+static gboolean estimator_filter_estimate (const struct estimator_sample *sample, gdouble *rate)
+{
+    struct cbatticon_sample filter_sample;
+    gint percentage, minutes;
+
+    filter_sample.status             = sample->status;
+    filter_sample.use_charge         = sample->use_charge;
+    filter_sample.from_pct           = FALSE;
+    filter_sample.full_capacity      = sample->full;
+    filter_sample.remaining_capacity = sample->now;
+    filter_sample.rate               = sample->rate;
+
+    if (cbatticon_context_estimate (benchmark.context, &filter_sample, is_discharging_status (sample->status),
+                                    &percentage, &minutes, rate) != 0) {
+        return FALSE;
+    }
+
+    return *rate >= 0.01;
+}
+
+/* instantaneous rate, or capacity change since the previous sample */
+
+static struct estimator_sample instant_previous;
+
+static void estimator_instant_reset (void)
+{
+    instant_previous.time = -1;
+}
+
+static gboolean estimator_instant_estimate (const struct estimator_sample *sample, gdouble *rate)
+{
+    *rate = 0.0;
+
+    if (sample->rate > 0.0) {
+        *rate = sample->rate;
+    } else if (instant_previous.time >= 0 && sample->time > instant_previous.time) {
+        *rate = fabs (sample->now - instant_previous.now) * 3600.0 * G_USEC_PER_SEC
+            / (gdouble)(sample->time - instant_previous.time);
+    }
+
+    instant_previous = *sample;
+
+    return *rate >= 0.01;
+}
+
+/* exponentially weighted rate with a 5 minutes time constant, fed with */
+/* the rate reported by the battery or with each capacity change        */
+
+#define EWMA_TIME_CONSTANT 300.0
+
+static struct {
+    gdouble rate;
+    gint64  rate_time;
+    gdouble capacity;
+    gint64  capacity_time;
+} ewma;
+
+static void estimator_ewma_reset (void)
+{
+    ewma.rate          = 0.0;
+    ewma.rate_time     = -1;
+    ewma.capacity_time = -1;
+}
+
+static gboolean estimator_ewma_estimate (const struct estimator_sample *sample, gdouble *rate)
+{
+    gdouble rate_now = -1.0;
+
+    if (sample->rate > 0.0) {
+        rate_now = sample->rate;
+    } else if (ewma.capacity_time < 0) {
+        ewma.capacity      = sample->now;
+        ewma.capacity_time = sample->time;
+    } else if (sample->now != ewma.capacity) {
+        rate_now = fabs (sample->now - ewma.capacity) * 3600.0 * G_USEC_PER_SEC
+            / (gdouble)(sample->time - ewma.capacity_time);
+
+        ewma.capacity      = sample->now;
+        ewma.capacity_time = sample->time;
+    }
+
+    if (rate_now > 0.0) {
+        if (ewma.rate_time < 0) {
+            ewma.rate = rate_now;
+        } else {
+            gdouble elapsed = (gdouble)(sample->time - ewma.rate_time) / G_USEC_PER_SEC;
+            gdouble alpha   = 1.0 - exp (-elapsed / EWMA_TIME_CONSTANT);
+
+            ewma.rate += alpha * (rate_now - ewma.rate);
+        }
+
+        ewma.rate_time = sample->time;
+    }
+
+    *rate = ewma.rate;
+
+    return *rate >= 0.01;
+}
+
+/* least squares slope of the capacity over the sample window */
+
+#define REGRESSION_SAMPLES 60
+
+static struct {
+    gdouble samples[REGRESSION_SAMPLES];
+    struct timespec sample_times[REGRESSION_SAMPLES];
+    gint num_samples, next_sample;
+} regression;
+
+static void estimator_regression_reset (void)
+{
+    regression.num_samples = 0;
+    regression.next_sample = 0;
+}
+
+static gboolean estimator_regression_estimate (const struct estimator_sample *sample, gdouble *rate)
+{
+    gdouble times[REGRESSION_SAMPLES];
+    gdouble span;
+    gint a, b;
+    gdouble mean_time = 0.0, mean_value = 0.0, covariance = 0.0, variance = 0.0;
+
+    regression.samples[regression.next_sample] = sample->now;
+    on_benchmark_clock (&regression.sample_times[regression.next_sample], NULL);
+    regression.next_sample = (regression.next_sample + 1) % REGRESSION_SAMPLES;
+    regression.num_samples = MAX (regression.next_sample, regression.num_samples);
+
+    if (regression.num_samples < 2) {
+        return FALSE;
+    }
+
+    /* times relative to the newest sample, to keep the sums well conditioned */
+
+    for (gint i = 0; i < regression.num_samples; i++) {
+        times[i] = (gdouble)(regression.sample_times[i].tv_sec - sample->time / G_USEC_PER_SEC)
+            + (gdouble)regression.sample_times[i].tv_nsec / 1000000000.0;
+
+        mean_time  += times[i];
+        mean_value += regression.samples[i];
+    }
+
+    mean_time  /= regression.num_samples;
+    mean_value /= regression.num_samples;
+
+    for (gint i = 0; i < regression.num_samples; i++) {
+        covariance += (times[i] - mean_time) * (regression.samples[i] - mean_value);
+        variance   += (times[i] - mean_time) * (times[i] - mean_time);
+    }
+
+    a = (regression.next_sample + REGRESSION_SAMPLES - regression.num_samples) % REGRESSION_SAMPLES;
+    b = (regression.next_sample + REGRESSION_SAMPLES - 1) % REGRESSION_SAMPLES;
+
+    span = (gdouble)(regression.sample_times[b].tv_sec - regression.sample_times[a].tv_sec)
+        + ((gdouble)regression.sample_times[b].tv_nsec / 1000000000.0)
+        - ((gdouble)regression.sample_times[a].tv_nsec / 1000000000.0);
+
+    if (span < 60.0 || variance <= 0.0) {
+        return FALSE; // measure rate over 60s minimum
+    }
+
+    *rate = fabs (covariance / variance * 3600.0);
+
+    return *rate >= 0.01;
+}
+
+static const struct estimator estimators[] = {
+    { "filter"    , estimator_filter_reset    , estimator_filter_estimate     },
+    { "instant"   , estimator_instant_reset   , estimator_instant_estimate    },
+    { "ewma"      , estimator_ewma_reset      , estimator_ewma_estimate       },
+    { "regression", estimator_regression_reset, estimator_regression_estimate }
+};
+
+static GArray* benchmark_read_samples (void)
+{
+    GArray *samples = g_array_new (FALSE, TRUE, sizeof (struct estimator_sample));
+    struct cbatticon_battery batteries[MAX_BATTERIES];
+    gchar *ac_path = NULL;
+    gint num_batteries;
+
+    num_batteries = cbatticon_context_discover (benchmark.context, batteries, MAX_BATTERIES, &ac_path, NULL, NULL);
+
+    while (benchmark.reader.cursor < benchmark.reader.records->len) {
+        struct trace_record *record = &g_array_index (benchmark.reader.records, struct trace_record, benchmark.reader.cursor++);
+        struct estimator_sample sample = { 0 };
+        gchar *status;
+
+        if (record->consumed == TRUE || record->type != TRACE_RECORD_TICK || num_batteries <= 0) {
+            continue;
+        }
+
+        benchmark.time = record->time;
+
+        sample.time = record->time;
+        sample.rate = -1.0;
+
+        /* the estimators are compared on the first battery alone */
+
+        if (benchmark_read (batteries[0].path, "status", &status) == FALSE) {
+            continue;
+        }
+
+        sample.status = cbatticon_parse_status (status);
+        g_free (status);
+
+        sample.use_charge = benchmark_read_double (batteries[0].path, "energy_full", &sample.full) == FALSE;
+
+        if ((sample.use_charge == TRUE && benchmark_read_double (batteries[0].path, "charge_full", &sample.full) == FALSE) ||
+            benchmark_read_double (batteries[0].path, sample.use_charge == FALSE ? "energy_now" : "charge_now", &sample.now) == FALSE) {
+            continue;
+        }
+
+        benchmark_read_double (batteries[0].path, sample.use_charge == FALSE ? "power_now" : "current_now", &sample.rate);
+
+        sample.percentage = (gint)fmin (floor (sample.now / sample.full * 100.0), 100.0);
+        sample.actual     = -1.0;
+
+        g_array_append_val (samples, sample);
+    }
+
+    for (gint i = 0; i < num_batteries; i++) {
+        free (batteries[i].path);
+    }
+
+    free (ac_path);
+
+    /* the actual remaining time is only known for segments */
+    /* that run until the battery is empty or charged       */
+
+    for (guint start = 0, end; start < samples->len; start = end) {
+        struct estimator_sample *first = &g_array_index (samples, struct estimator_sample, start);
+        struct estimator_sample *last;
+        gboolean complete;
+
+        for (end = start + 1; end < samples->len; end++) {
+            if (g_array_index (samples, struct estimator_sample, end).status != first->status) {
+                break;
+            }
+        }
+
+        last = &g_array_index (samples, struct estimator_sample, end - 1);
+
+        if (is_discharging_status (first->status) == TRUE) {
+            complete = last->percentage <= 1;
+        } else if (is_charging_status (first->status) == TRUE) {
+            complete = last->percentage >= 99 ||
+                (end < samples->len && g_array_index (samples, struct estimator_sample, end).status == CHARGED);
+        } else {
+            complete = FALSE;
+        }
+
+        for (guint i = start; complete == TRUE && i < end; i++) {
+            struct estimator_sample *sample = &g_array_index (samples, struct estimator_sample, i);
+
+            sample->actual = (gdouble)(last->time - sample->time) / (60.0 * G_USEC_PER_SEC);
+        }
+    }
+
+    return samples;
+}
+
+static void benchmark_estimator (const struct estimator *estimator, GArray *samples, struct estimator_result *result)
+{
+    gdouble *predictions = g_new (gdouble, samples->len);
+    struct timespec cpu_start, cpu_end;
+    gint last_status = -1;
+    gint64 segment_start = 0;
+    gboolean segment_estimated = FALSE;
+    gboolean reached[BENCHMARK_CHECKPOINTS] = { FALSE };
+
+    /* predictions, timed on their own */
+
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+
+    for (guint i = 0; i < samples->len; i++) {
+        const struct estimator_sample *sample = &g_array_index (samples, struct estimator_sample, i);
+        gdouble rate;
+
+        predictions[i] = -1.0;
+
+        if (sample->status != last_status) {
+            last_status = sample->status;
+            estimator->reset ();
+        }
+
+        if (is_charging_status (sample->status) == FALSE && is_discharging_status (sample->status) == FALSE) {
+            continue;
+        }
+
+        benchmark.time = sample->time;
+
+        if (estimator->estimate (sample, &rate) == TRUE) {
+            if (is_charging_status (sample->status) == TRUE) {
+                predictions[i] = (sample->full - sample->now) / rate * 60.0;
+            } else {
+                predictions[i] = sample->now / rate * 60.0;
+            }
+        }
+    }
+
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+
+    result->cpu_time += (cpu_end.tv_sec - cpu_start.tv_sec) * G_GINT64_CONSTANT (1000000000)
+        + (cpu_end.tv_nsec - cpu_start.tv_nsec);
+    result->num_samples += samples->len;
+
+    /* accuracy at the checkpoints and time to the first estimate, per segment */
+
+    last_status = -1;
+
+    for (guint i = 0; i < samples->len; i++) {
+        const struct estimator_sample *sample = &g_array_index (samples, struct estimator_sample, i);
+
+        if (sample->status != last_status) {
+            last_status       = sample->status;
+            segment_start     = sample->time;
+            segment_estimated = FALSE;
+
+            for (gint c = 0; c < BENCHMARK_CHECKPOINTS; c++) {
+                /* a charge segment only crosses the checkpoints it starts below */
+                reached[c] = is_charging_status (sample->status) == TRUE && sample->percentage >= benchmark_checkpoints[c];
+            }
+        }
+
+        if (segment_estimated == FALSE && predictions[i] >= 0.0) {
+            segment_estimated = TRUE;
+
+            result->first_estimate_sum += (gdouble)(sample->time - segment_start) / G_USEC_PER_SEC;
+            result->first_estimate_count++;
+        }
+
+        if (sample->actual < 0.0) {
+            continue;
+        }
+
+        for (gint c = 0; c < BENCHMARK_CHECKPOINTS; c++) {
+            gboolean crossed = is_charging_status (sample->status) == TRUE ?
+                sample->percentage >= benchmark_checkpoints[c] : sample->percentage <= benchmark_checkpoints[c];
+
+            if (reached[c] == TRUE || crossed == FALSE) {
+                continue;
+            }
+
+            reached[c] = TRUE;
+
+            if (predictions[i] >= 0.0) {
+                result->error_sum[c] += fabs (predictions[i] - sample->actual);
+                result->error_count[c]++;
+            }
+        }
+    }
+
+    g_free (predictions);
+}
+
+static void benchmark_add_results (struct estimator_result *total, const struct estimator_result *result)
+{
+    for (gint c = 0; c < BENCHMARK_CHECKPOINTS; c++) {
+        total->error_sum[c]     += result->error_sum[c];
+        total->error_count[c] += result->error_count[c];
+    }
+
+    total->first_estimate_sum   += result->first_estimate_sum;
+    total->first_estimate_count += result->first_estimate_count;
+    total->cpu_time             += result->cpu_time;
+    total->num_samples          += result->num_samples;
+}
+
+static gint benchmark_compare_filenames (const gchar **a, const gchar **b)
+{
+    return g_strcmp0 (*a, *b);
+}
+
+static void benchmark_print_results (const struct estimator_result *results)
+{
+    g_print ("%-12s", "estimator");
+    for (gint c = 0; c < BENCHMARK_CHECKPOINTS; c++) {
+        g_print ("  err@%2d%% (min)", benchmark_checkpoints[c]);
+    }
+    g_print ("  first estimate  cpu/sample\n");
+
+    for (guint e = 0; e < G_N_ELEMENTS (estimators); e++) {
+        const struct estimator_result *result = &results[e];
+
+        g_print ("%-12s", estimators[e].name);
+
+        for (gint c = 0; c < BENCHMARK_CHECKPOINTS; c++) {
+            if (result->error_count[c] > 0) {
+                g_print ("  %13.1f", result->error_sum[c] / result->error_count[c]);
+            } else {
+                g_print ("  %13s", "-");
+            }
+        }
+
+        if (result->first_estimate_count > 0) {
+            g_print ("  %13.0fs", result->first_estimate_sum / result->first_estimate_count);
+        } else {
+            g_print ("  %14s", "-");
+        }
+
+        g_print ("  %8.0fns\n", result->num_samples > 0 ? (gdouble)result->cpu_time / result->num_samples : 0.0);
+    }
+}
+
+static gboolean benchmark_estimators (const gchar *directory_name)
+{
+    GError *error = NULL;
+
+    GDir *directory;
+    GPtrArray *filenames;
+    const gchar *file;
+    struct estimator_result total_results[G_N_ELEMENTS (estimators)];
+
+    directory = g_dir_open (directory_name, 0, &error);
+    if (directory == NULL) {
+        g_printerr ("Cannot open trace directory: %s (%s)\n", directory_name, error->message);
+        g_error_free (error); error = NULL;
+        return FALSE;
+    }
+
+    filenames = g_ptr_array_new_with_free_func (g_free);
+
+    file = g_dir_read_name (directory);
+    while (file != NULL) {
+        if (g_str_has_suffix (file, TRACE_SUFFIX) == TRUE) {
+            g_ptr_array_add (filenames, g_build_filename (directory_name, file, NULL));
+        }
+
+        file = g_dir_read_name (directory);
+    }
+
+    g_dir_close (directory);
+    g_ptr_array_sort (filenames, (GCompareFunc)benchmark_compare_filenames);
+
+    memset (total_results, 0, sizeof (total_results));
+
+    for (guint f = 0; f < filenames->len; f++) {
+        const gchar *filename = (const gchar *)g_ptr_array_index (filenames, f);
+        struct estimator_result results[G_N_ELEMENTS (estimators)];
+        GArray *samples;
+
+        if (trace_reader_load (&benchmark.reader, filename) == FALSE) {
+            continue;
+        }
+
+        benchmark.context = cbatticon_context_new (SYSFS_PATH, NULL);
+        cbatticon_context_set_clock (benchmark.context, on_benchmark_clock, NULL);
+        cbatticon_context_set_reader (benchmark.context, on_benchmark_list, on_benchmark_read, NULL);
+
+        samples = benchmark_read_samples ();
+
+        g_print ("%s: %u samples over %.1f hours\n", filename, samples->len, samples->len > 0 ?
+            (gdouble)g_array_index (samples, struct estimator_sample, samples->len - 1).time / (3600.0 * G_USEC_PER_SEC) : 0.0);
+
+        memset (results, 0, sizeof (results));
+
+        for (guint e = 0; e < G_N_ELEMENTS (estimators); e++) {
+            benchmark_estimator (&estimators[e], samples, &results[e]);
+            benchmark_add_results (&total_results[e], &results[e]);
+        }
+
+        benchmark_print_results (results);
+        g_print ("\n");
+
+        g_array_free (samples, TRUE);
+        cbatticon_context_free (benchmark.context);
+        trace_reader_free (&benchmark.reader);
+    }
+
+    if (filenames->len == 0) {
+        g_printerr ("No trace found in directory: %s\n", directory_name);
+    } else {
+        g_print ("all traces:\n");
+        benchmark_print_results (total_results);
+    }
+
+    g_ptr_array_free (filenames, TRUE);
+
+    return TRUE;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 2) {
+        g_printerr ("usage: %s DIRECTORY\n", argv[0]);
+        return 1;
+    }
+
+    return benchmark_estimators (argv[1]) == TRUE ? 0 : 1;
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * gentrace: writes the synthetic traces used by the cbatticon benchmarks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../trace.h"
+
+#define SYSFS_PATH    "/sys/class/power_supply"
+#define MAX_KEYS      16
+#define TICK_INTERVAL 5            /* seconds */
+#define ENERGY_FULL   50000000.0   /* µWh */
+
+enum { DISCHARGING, CHARGING, FULL };
+
+struct scenario {
+    const char *name;
+    int         status;
+    double      start_percentage;
+    int         has_power_now;
+    int         energy_update_interval;   /* seconds between energy_now updates */
+    double    (*power) (double time, double percentage);
+};
+
+static FILE *file;
+static const char *keys[MAX_KEYS];
+static int num_keys;
+static long long last_time;
+static unsigned int seed;
+
+static double noise (double amplitude)
+{
+    seed = seed * 1103515245u + 12345u;
+    return amplitude * (((seed >> 16) & 0x7fff) / 16383.5 - 1.0);
+}
+
+static void write_varint (unsigned long long value)
+{
+    do {
+        unsigned char byte = value & 0x7f;
+
+        value >>= 7;
+        fputc (value != 0 ? byte | 0x80 : byte, file);
+    } while (value != 0);
+}
+
+static void write_string (const char *string)
+{
+    size_t length = strlen (string);
+
+    write_varint (length);
+    fwrite (string, 1, length, file);
+}
+
+static void write_header (int type, long long time)
+{
+    write_varint (type);
+    write_varint (time - last_time);
+    last_time = time;
+}
+
+static void write_read (int type, long long time, const char *key, const char *value)
+{
+    int index;
+
+    for (index = 0; index < num_keys; index++) {
+        if (strcmp (keys[index], key) == 0) {
+            break;
+        }
+    }
+
+    if (index == num_keys) {
+        keys[num_keys++] = key;
+
+        write_header (TRACE_RECORD_KEY, time);
+        write_string (key);
+    }
+
+    write_header (type, time);
+    write_varint (index);
+    write_varint (value != NULL ? 1 : 0);
+    write_string (value != NULL ? value : "");
+}
+
+static void write_number (long long time, const char *key, double value)
+{
+    char string[32];
+
+    snprintf (string, sizeof (string), "%.0f\n", value);
+    write_read (TRACE_RECORD_READ, time, key, string);
+}
+
+/* the reads done by get_power_supplies */
+static void write_discovery (long long time, int online)
+{
+    write_read (TRACE_RECORD_LIST, time, SYSFS_PATH, "AC\nBAT0");
+    write_read (TRACE_RECORD_READ, time, SYSFS_PATH "/AC/type", "Mains\n");
+    write_read (TRACE_RECORD_READ, time, SYSFS_PATH "/AC/online", online ? "1\n" : "0\n");
+    write_read (TRACE_RECORD_READ, time, SYSFS_PATH "/BAT0/type", "Battery\n");
+    write_read (TRACE_RECORD_READ, time, SYSFS_PATH "/BAT0/present", "1\n");
+    write_read (TRACE_RECORD_READ, time, SYSFS_PATH "/BAT0/scope", NULL);
+}
+
+/* 10 W with a little noise */
+static double constant_power (double time, double percentage)
+{
+    return 10000000.0 + noise (300000.0);
+}
+
+/* 6 W with a one minute 30 W burst every ten minutes */
+static double bursty_power (double time, double percentage)
+{
+    return (fmod (time, 600.0) < 60.0 ? 30000000.0 : 6000000.0) + noise (500000.0);
+}
+
+/* 45 W constant current up to 80 %, then a constant voltage taper */
+static double cv_charging_power (double time, double percentage)
+{
+    static double taper_start = -1.0;
+
+    if (percentage < 80.0) {
+        return 45000000.0;
+    }
+
+    if (taper_start < 0.0) {
+        taper_start = time;
+    }
+
+    return 45000000.0 * exp (-(time - taper_start) / 800.0);
+}
+
+/* 8 W, on a driver without power_now that updates energy_now every minute */
+static double slow_driver_power (double time, double percentage)
+{
+    return 8000000.0 + noise (400000.0);
+}
+
+static const struct scenario scenarios[] = {
+    { "constant-load"    , DISCHARGING, 100.0, 1,  0, constant_power    },
+    { "bursty-load"      , DISCHARGING, 100.0, 1,  0, bursty_power      },
+    { "cv-charging"      , CHARGING   ,   5.0, 1,  0, cv_charging_power },
+    { "no-power-now"     , DISCHARGING,  90.0, 0, 60, slow_driver_power }
+};
+
+static int write_scenario (const char *directory, const struct scenario *scenario)
+{
+    static const char *status_strings[] = { "Discharging\n", "Charging\n", "Full\n" };
+    char filename[4096];
+    double energy = ENERGY_FULL * scenario->start_percentage / 100.0;
+    double reported_energy = energy;
+    long long time = 0;
+    int status = scenario->status;
+    int full_ticks = 0;
+
+    snprintf (filename, sizeof (filename), "%s/%s%s", directory, scenario->name, TRACE_SUFFIX);
+
+    file = fopen (filename, "wb");
+    if (file == NULL) {
+        perror (filename);
+        return 0;
+    }
+
+    num_keys  = 0;
+    last_time = 0;
+    seed      = 1;
+
+    fwrite (TRACE_MAGIC, 1, TRACE_MAGIC_LTH, file);
+
+    write_discovery (0, status == CHARGING);
+
+    /* one tick every TICK_INTERVAL seconds until the battery is empty or a while after it is full */
+
+    while (full_ticks < 12) {
+        long long now = time * 1000000LL;
+        double percentage = energy / ENERGY_FULL * 100.0;
+        double power = status == FULL ? 0.0 : scenario->power ((double)time, percentage);
+
+        if (scenario->energy_update_interval == 0 || time % scenario->energy_update_interval == 0) {
+            reported_energy = energy;
+        }
+
+        write_header (TRACE_RECORD_TICK, now);
+        write_read (TRACE_RECORD_LIST, now, SYSFS_PATH, "AC\nBAT0");
+
+        if (time == 0) {
+            write_discovery (now, status == CHARGING); /* first change detection */
+        }
+
+        write_read (TRACE_RECORD_READ, now, SYSFS_PATH "/BAT0/present", "1\n");
+        write_read (TRACE_RECORD_READ, now, SYSFS_PATH "/BAT0/status", status_strings[status]);
+        write_number (now, SYSFS_PATH "/BAT0/energy_full", ENERGY_FULL);
+        write_number (now, SYSFS_PATH "/BAT0/energy_now", reported_energy);
+
+        if (scenario->has_power_now) {
+            write_number (now, SYSFS_PATH "/BAT0/power_now", power);
+        } else {
+            write_read (TRACE_RECORD_READ, now, SYSFS_PATH "/BAT0/power_now", NULL);
+        }
+
+        if (status == DISCHARGING) {
+            energy -= power * TICK_INTERVAL / 3600.0;
+
+            if (energy <= ENERGY_FULL * 0.005) {
+                break;
+            }
+        } else if (status == CHARGING) {
+            energy += power * TICK_INTERVAL / 3600.0;
+
+            if (energy >= ENERGY_FULL * 0.995) {
+                energy = ENERGY_FULL;
+                status = FULL;
+            }
+        } else {
+            full_ticks++;
+        }
+
+        time += TICK_INTERVAL;
+    }
+
+    fclose (file);
+    printf ("%s\n", filename);
+
+    return 1;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf (stderr, "usage: %s DIRECTORY\n", argv[0]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof (scenarios) / sizeof (scenarios[0]); i++) {
+        if (write_scenario (argv[1], &scenarios[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
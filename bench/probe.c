@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * probe: measures the read latency of every power supply attribute.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <glib.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYSFS_PATH "/sys/class/power_supply"
+
+/*
+ * sysfs probe
+ *
+ * Every attribute of every power supply is read a number of times, with
+ * pread on a descriptor opened once like the updates of cbatticon, and the
+ * latency of the reads, the errors and whether the value changed from one
+ * read to the next are reported. It tells which driver attributes are slow
+ * on a given machine.
+ */
+
+#define DEFAULT_READS 20
+#define VALUE_LTH     4096
+
+static const gchar *sysfs_path     = SYSFS_PATH;
+static gint         probe_reads    = DEFAULT_READS;
+static gboolean     probe_parallel = FALSE;
+static gboolean     probe_json     = FALSE;
+
+struct probe_attribute {
+    gchar    *name;
+    gint64    min;
+    gint64    median;
+    gint64    p99;
+    gint64    max;
+    gint      errors;
+    gboolean  changed;
+};
+
+struct probe_supply {
+    gchar     *name;
+    gchar     *path;
+    gchar     *type;
+    GPtrArray *attributes;
+};
+
+static gint64 get_time (void)
+{
+    struct timespec time;
+
+    clock_gettime (CLOCK_MONOTONIC, &time);
+
+    return (gint64)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static gint probe_compare_names (const gchar **a, const gchar **b)
+{
+    return g_strcmp0 (*a, *b);
+}
+
+static gint probe_compare_durations (const void *a, const void *b)
+{
+    gint64 duration_a = *(const gint64 *)a, duration_b = *(const gint64 *)b;
+
+    return duration_a < duration_b ? -1 : duration_a > duration_b ? 1 : 0;
+}
+
+static void probe_free_attribute (gpointer data)
+{
+    struct probe_attribute *attribute = (struct probe_attribute *)data;
+
+    g_free (attribute->name);
+    g_free (attribute);
+}
+
+static void probe_attribute (const gchar *path, struct probe_attribute *attribute, gint reads)
+{
+    gchar buffer[VALUE_LTH];
+    gchar *filename = g_build_filename (path, attribute->name, NULL);
+    gchar *first_value = NULL;
+    gint64 *durations = g_new (gint64, reads);
+    gint fd = open (filename, O_RDONLY | O_CLOEXEC);
+
+    for (gint i = 0; i < reads; i++) {
+        gint64 start = get_time ();
+        gssize length = fd >= 0 ? pread (fd, buffer, sizeof (buffer), 0) : -1;
+
+        durations[i] = get_time () - start;
+
+        if (length < 0) {
+            attribute->errors++;
+        } else if (first_value == NULL) {
+            first_value = g_strndup (buffer, length);
+        } else if (strlen (first_value) != (gsize)length || memcmp (first_value, buffer, length) != 0) {
+            attribute->changed = TRUE;
+        }
+    }
+
+    qsort (durations, reads, sizeof (gint64), probe_compare_durations);
+
+    attribute->min    = durations[0];
+    attribute->median = durations[(reads - 1) / 2];
+    attribute->p99    = durations[(gint)((reads - 1) * 0.99 + 0.5)];
+    attribute->max    = durations[reads - 1];
+
+    if (fd >= 0) {
+        close (fd);
+    }
+
+    g_free (durations);
+    g_free (first_value);
+    g_free (filename);
+}
+
+static gpointer probe_supply_thread (gpointer data)
+{
+    struct probe_supply *supply = (struct probe_supply *)data;
+
+    for (guint i = 0; i < supply->attributes->len; i++) {
+        probe_attribute (supply->path, (struct probe_attribute *)g_ptr_array_index (supply->attributes, i), probe_reads);
+    }
+
+    return NULL;
+}
+
+static struct probe_supply* probe_get_supply (const gchar *name)
+{
+    struct probe_supply *supply = g_new0 (struct probe_supply, 1);
+    GPtrArray *names = g_ptr_array_new_with_free_func (g_free);
+    GDir *directory;
+    const gchar *file;
+
+    supply->name       = g_strdup (name);
+    supply->path       = g_build_filename (sysfs_path, name, NULL);
+    supply->attributes = g_ptr_array_new_with_free_func (probe_free_attribute);
+
+    directory = g_dir_open (supply->path, 0, NULL);
+    if (directory != NULL) {
+        while ((file = g_dir_read_name (directory)) != NULL) {
+            gchar *filename = g_build_filename (supply->path, file, NULL);
+
+            /* only readable files are attributes, subdirectories and links to them are not */
+
+            if (g_file_test (filename, G_FILE_TEST_IS_REGULAR) == TRUE && access (filename, R_OK) == 0) {
+                g_ptr_array_add (names, g_strdup (file));
+            }
+
+            g_free (filename);
+        }
+
+        g_dir_close (directory);
+    }
+
+    g_ptr_array_sort (names, (GCompareFunc)probe_compare_names);
+
+    for (guint i = 0; i < names->len; i++) {
+        struct probe_attribute *attribute = g_new0 (struct probe_attribute, 1);
+
+        attribute->name = g_strdup ((const gchar *)g_ptr_array_index (names, i));
+        g_ptr_array_add (supply->attributes, attribute);
+
+        if (g_strcmp0 (attribute->name, "type") == 0) {
+            gchar *filename = g_build_filename (supply->path, "type", NULL);
+
+            if (g_file_get_contents (filename, &supply->type, NULL, NULL) == TRUE) {
+                g_strstrip (supply->type);
+            }
+
+            g_free (filename);
+        }
+    }
+
+    g_ptr_array_free (names, TRUE);
+
+    return supply;
+}
+
+static void probe_free_supply (gpointer data)
+{
+    struct probe_supply *supply = (struct probe_supply *)data;
+
+    g_ptr_array_free (supply->attributes, TRUE);
+    g_free (supply->name);
+    g_free (supply->path);
+    g_free (supply->type);
+    g_free (supply);
+}
+
+static void probe_print_json_string (const gchar *string)
+{
+    g_print ("\"");
+
+    for (const gchar *c = string; c != NULL && *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            g_print ("\\%c", *c);
+        } else if ((guchar)*c < 0x20) {
+            g_print ("\\u%04x", (guint)(guchar)*c);
+        } else {
+            g_print ("%c", *c);
+        }
+    }
+
+    g_print ("\"");
+}
+
+static void probe_print_json (GPtrArray *supplies)
+{
+    g_print ("{\n  \"reads\": %d,\n  \"parallel\": %s,\n  \"supplies\": [", probe_reads,
+        probe_parallel == TRUE ? "true" : "false");
+
+    for (guint i = 0; i < supplies->len; i++) {
+        const struct probe_supply *supply = (const struct probe_supply *)g_ptr_array_index (supplies, i);
+
+        g_print ("%s\n    { \"name\": ", i > 0 ? "," : "");
+        probe_print_json_string (supply->name);
+        g_print (", \"type\": ");
+        probe_print_json_string (supply->type != NULL ? supply->type : "");
+        g_print (", \"attributes\": [");
+
+        for (guint j = 0; j < supply->attributes->len; j++) {
+            const struct probe_attribute *attribute = (const struct probe_attribute *)g_ptr_array_index (supply->attributes, j);
+
+            g_print ("%s\n      { \"name\": ", j > 0 ? "," : "");
+            probe_print_json_string (attribute->name);
+            g_print (", \"min_ns\": %" G_GINT64_FORMAT ", \"median_ns\": %" G_GINT64_FORMAT
+                     ", \"p99_ns\": %" G_GINT64_FORMAT ", \"max_ns\": %" G_GINT64_FORMAT
+                     ", \"errors\": %d, \"changed\": %s }",
+                     attribute->min, attribute->median, attribute->p99, attribute->max,
+                     attribute->errors, attribute->changed == TRUE ? "true" : "false");
+        }
+
+        g_print ("%s]\n    }", supply->attributes->len > 0 ? "\n    " : "");
+    }
+
+    g_print ("%s]\n}\n", supplies->len > 0 ? "\n  " : "");
+}
+
+static void probe_print_table (GPtrArray *supplies)
+{
+    g_print ("%-16s %-28s %10s %10s %10s %10s %7s %8s\n", "supply", "attribute (us)", "min", "median", "p99", "max", "errors", "changed");
+
+    for (guint i = 0; i < supplies->len; i++) {
+        const struct probe_supply *supply = (const struct probe_supply *)g_ptr_array_index (supplies, i);
+
+        for (guint j = 0; j < supply->attributes->len; j++) {
+            const struct probe_attribute *attribute = (const struct probe_attribute *)g_ptr_array_index (supply->attributes, j);
+
+            g_print ("%-16s %-28s %10.1f %10.1f %10.1f %10.1f %7d %8s\n", supply->name, attribute->name,
+                attribute->min / 1000.0, attribute->median / 1000.0, attribute->p99 / 1000.0, attribute->max / 1000.0,
+                attribute->errors, attribute->changed == TRUE ? "yes" : "no");
+        }
+    }
+}
+
+static gboolean probe_power_supplies (void)
+{
+    GError *error = NULL;
+    GDir *directory;
+    GPtrArray *files;
+    GPtrArray *supplies;
+    GPtrArray *threads;
+    const gchar *file;
+
+    directory = g_dir_open (sysfs_path, 0, &error);
+    if (directory == NULL) {
+        g_printerr ("Cannot list power supplies: %s\n", error->message);
+        g_error_free (error); error = NULL;
+
+        return FALSE;
+    }
+
+    files    = g_ptr_array_new_with_free_func (g_free);
+    supplies = g_ptr_array_new_with_free_func (probe_free_supply);
+    threads  = g_ptr_array_new ();
+
+    while ((file = g_dir_read_name (directory)) != NULL) {
+        g_ptr_array_add (files, g_strdup (file));
+    }
+
+    g_dir_close (directory);
+    g_ptr_array_sort (files, (GCompareFunc)probe_compare_names);
+
+    for (guint i = 0; i < files->len; i++) {
+        g_ptr_array_add (supplies, probe_get_supply ((const gchar *)g_ptr_array_index (files, i)));
+    }
+
+    /* in parallel, each supply is read by its own thread */
+
+    for (guint i = 0; i < supplies->len; i++) {
+        if (probe_parallel == TRUE) {
+            g_ptr_array_add (threads, g_thread_new ("probe", probe_supply_thread, g_ptr_array_index (supplies, i)));
+        } else {
+            probe_supply_thread (g_ptr_array_index (supplies, i));
+        }
+    }
+
+    for (guint i = 0; i < threads->len; i++) {
+        g_thread_join ((GThread *)g_ptr_array_index (threads, i));
+    }
+
+    if (probe_json == TRUE) {
+        probe_print_json (supplies);
+    } else {
+        probe_print_table (supplies);
+    }
+
+    g_ptr_array_free (threads, TRUE);
+    g_ptr_array_free (supplies, TRUE);
+    g_ptr_array_free (files, TRUE);
+
+    return TRUE;
+}
+
+int main (int argc, char **argv)
+{
+    GError *error = NULL;
+
+    GOptionContext *option_context;
+    GOptionEntry option_entries[] = {
+        { "reads"   , 'r', 0, G_OPTION_ARG_INT , &probe_reads   , "Set the number of reads of each attribute", NULL },
+        { "parallel", 'p', 0, G_OPTION_ARG_NONE, &probe_parallel, "Probe the power supplies in parallel"     , NULL },
+        { "json"    , 'j', 0, G_OPTION_ARG_NONE, &probe_json    , "Print the results as JSON"                , NULL },
+        { NULL }
+    };
+
+    option_context = g_option_context_new ("[DIRECTORY]");
+    g_option_context_add_main_entries (option_context, option_entries, NULL);
+
+    if (g_option_context_parse (option_context, &argc, &argv, &error) == FALSE) {
+        g_printerr ("Cannot parse command line arguments: %s\n", error->message);
+        g_error_free (error); error = NULL;
+
+        return 1;
+    }
+
+    g_option_context_free (option_context);
+
+    if (probe_reads < 1) {
+        g_printerr ("The number of reads must be at least 1\n");
+        return 1;
+    }
+
+    if (argc > 1) {
+        sysfs_path = argv[1];
+    }
+
+    return probe_power_supplies () == TRUE ? 0 : 1;
+}
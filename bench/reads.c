@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * reads: times the sysfs attribute reads of one cbatticon update.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <glib.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../sysattr.h"
+
+/*
+ * attribute read benchmark
+ *
+ * The attributes an update reads from a battery directory are read over and
+ * over, the way cbatticon did before it cached the descriptors (open, read
+ * and close each time), from the descriptors cached by sysattr.c, and in an
+ * io_uring batch when built with WITH_IO_URING, with the system calls each
+ * way takes per update and the time of an update.
+ */
+
+#define ITERATIONS 10000
+
+static gint64 get_time (void)
+{
+    struct timespec time;
+
+    clock_gettime (CLOCK_MONOTONIC, &time);
+
+    return (gint64)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static gint compare_durations (const void *a, const void *b)
+{
+    gint64 duration_a = *(const gint64 *)a, duration_b = *(const gint64 *)b;
+
+    return duration_a < duration_b ? -1 : duration_a > duration_b ? 1 : 0;
+}
+
+static gboolean benchmark_reads (const gchar *path)
+{
+    static const gchar *attributes[] = { "present", "status", "energy_full", "energy_now", "power_now" };
+    static const gchar *modes[] = { "open/read/close", "cached fd", "io_uring batch" };
+    const gint num_attributes = G_N_ELEMENTS (attributes);
+    gchar *filenames[G_N_ELEMENTS (attributes)];
+    GPtrArray *batch = g_ptr_array_new ();
+    gint64 *durations = g_new (gint64, ITERATIONS);
+
+    for (gint i = 0; i < num_attributes; i++) {
+        filenames[i] = g_build_filename (path, attributes[i], NULL);
+        g_ptr_array_add (batch, filenames[i]);
+    }
+
+    g_print ("%-16s %14s %10s %10s %10s\n", "reads (us)", "syscalls/tick", "mean", "p50", "p99");
+
+    for (gint mode = 0; mode < (gint)G_N_ELEMENTS (modes); mode++) {
+        guint64 syscalls = sysattr_get_syscalls ();
+        gint64 sum = 0;
+        gint failures = 0;
+
+        if (mode == 2 && sysattr_can_prefetch () == FALSE) {
+            g_print ("%-16s %s\n", modes[mode], "unavailable");
+            continue;
+        }
+
+        sysattr_close_all ();
+
+        for (gint iteration = 0; iteration < ITERATIONS; iteration++) {
+            gint64 start = get_time ();
+
+            if (mode == 2) {
+                sysattr_prefetch (batch);
+            }
+
+            for (gint i = 0; i < num_attributes; i++) {
+                gchar *value = NULL;
+                gboolean status = FALSE;
+
+                if (mode == 0) {
+                    gchar buffer[SYSATTR_VALUE_LTH];
+                    gint fd = open (filenames[i], O_RDONLY | O_CLOEXEC);
+                    gssize length = fd >= 0 ? read (fd, buffer, sizeof (buffer)) : -1;
+
+                    sysattr_add_syscalls (fd >= 0 ? 3 : 1);
+                    if (fd >= 0) {
+                        close (fd);
+                    }
+
+                    if ((status = length >= 0) == TRUE) {
+                        value = g_strndup (buffer, length);
+                    }
+                } else if (mode == 1 || sysattr_take_prefetched (filenames[i], &status, &value) == FALSE) {
+                    status = sysattr_read (filenames[i], &value);
+                }
+
+                failures += status == FALSE ? 1 : 0;
+                g_free (value);
+            }
+
+            durations[iteration] = get_time () - start;
+            sum += durations[iteration];
+        }
+
+        qsort (durations, ITERATIONS, sizeof (gint64), compare_durations);
+
+        g_print ("%-16s %14.1f %10.2f %10.2f %10.2f%s\n", modes[mode],
+            (gdouble)(sysattr_get_syscalls () - syscalls) / ITERATIONS,
+            (gdouble)sum / ITERATIONS / 1000.0,
+            (gdouble)durations[(ITERATIONS - 1) / 2] / 1000.0,
+            (gdouble)durations[(gint)((ITERATIONS - 1) * 0.99 + 0.5)] / 1000.0,
+            failures > 0 ? "  (some reads failed)" : "");
+    }
+
+    sysattr_close_all ();
+    g_ptr_array_free (batch, TRUE);
+    g_free (durations);
+
+    return TRUE;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 2) {
+        g_printerr ("usage: %s DIRECTORY\n", argv[0]);
+        return 1;
+    }
+
+    return benchmark_reads (argv[1]) == TRUE ? 0 : 1;
+}
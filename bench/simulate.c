@@ -0,0 +1,597 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * simulate: runs the status steps of cbatticon on synthetic batteries.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+
+#include <math.h>
+#include <string.h>
+
+#include "../tray.h"
+
+/*
+ * status simulator
+ *
+ * The status steps of tray.c run on synthetic batteries, spread over one
+ * thread per processor, each battery with its own levels, hysteresis and
+ * rules and its own driver quirks drawn at random: unknown or missing
+ * statuses, not charging flips near full charge, removals, a jittery
+ * percentage, charge reads that fail and an unreadable AC. The session is
+ * locked or unlocked at random too, and a tick is one update, lasting the
+ * interval the step asked for. The actions of every tick are checked
+ * against the readings of the battery so far, not against a model of the
+ * steps: a status change is notified once; each level and rule warns, and
+ * runs its hooks or its command, only while discharging at or under its
+ * threshold, once per crossing, that is again only after the readings rose
+ * past its re-arm level (or charged, for a minute rule) or the power
+ * supplies changed, and it does warn when an armed threshold is reached,
+ * but for the first discharge after a change of the power supplies, which
+ * only warns the nearest of the thresholds it is under; the icon of an
+ * active session is updated every update interval, and a
+ * locked or idle one is not left longer than SESSION_MAX_INTERVAL, nor
+ * past the time the readings give to the nearest armed threshold. The
+ * violations are printed with their battery and tick. Each battery is
+ * seeded with its number, so a run is reproducible.
+ */
+
+#define DEFAULT_BATTERIES       1000
+#define DEFAULT_TICKS           10000
+#define DEFAULT_UPDATE_INTERVAL 5
+
+#define SIMULATE_VIOLATIONS 10 /* printed per thread */
+#define SIMULATE_RULES      4  /* at most, per battery */
+
+static gint update_interval = DEFAULT_UPDATE_INTERVAL;
+
+enum {
+    SIMULATE_UNKNOWN = 0,
+    SIMULATE_MISSING,
+    SIMULATE_FLAP,
+    SIMULATE_REMOVAL,
+    SIMULATE_UNREADABLE,
+    SIMULATE_QUIRKS
+};
+
+static const gchar *simulate_quirk_names[SIMULATE_QUIRKS] = {
+    "unknown statuses", "missing statuses", "flaps", "removals", "unreadable charges"
+};
+
+struct simulate_battery {
+    GRand   *rand;
+    gdouble  level;        /* actual charge, in percent */
+    gboolean plugged;
+    gboolean removed;
+    gboolean visible;      /* the session is active */
+    gdouble  load;         /* percent per update interval */
+    gdouble  noise;        /* percent */
+    gdouble  quirks[SIMULATE_QUIRKS];
+    gboolean ac_unknown;
+};
+
+/* the low level, the critical level and the rules */
+
+struct simulate_threshold {
+    gint     kind;         /* RULE_PERCENTAGE or RULE_MINUTES */
+    gint     level;
+    gint     rearm;
+    gint     rule;         /* in the rule set, for the rules */
+    gboolean warned;       /* since the power supplies changed */
+    gint     highest;      /* reading since the last warning, G_MAXINT after a charge */
+};
+
+struct simulate_expected {
+    gint                      status;      /* last notified status, -1 when none */
+    gboolean                  ac_only;
+    gboolean                  started[RULE_KINDS]; /* discharged since the power supplies changed */
+    struct simulate_threshold thresholds[2 + SIMULATE_RULES];
+    gint                      num_thresholds;
+};
+
+struct simulate_result {
+    gint     first;        /* batteries first..last - 1 */
+    gint     last;
+    gint     ticks;
+    guint64  total_ticks;
+    guint64  notifications;
+    guint64  warnings;
+    guint64  hooks;
+    guint64  rules;
+    guint64  inactive_ticks;
+    guint64  seconds;
+    guint64  quirks[SIMULATE_QUIRKS];
+    guint64  violations;
+    GString *report;
+};
+
+static gboolean simulate_quirk (struct simulate_battery *battery, gint quirk, guint64 *counts)
+{
+    if (g_rand_double (battery->rand) >= battery->quirks[quirk]) {
+        return FALSE;
+    }
+
+    counts[quirk]++;
+
+    return TRUE;
+}
+
+static void simulate_violation (struct simulate_result *result, gint battery, gint tick, const gchar *violation)
+{
+    if (result->violations++ < SIMULATE_VIOLATIONS) {
+        g_string_append_printf (result->report, "battery %d, tick %d: %s\n", battery, tick, violation);
+    }
+}
+
+static gboolean simulate_warned (const struct simulate_expected *expected, const struct tray_actions *actions, gint threshold)
+{
+    if (threshold < 2) {
+        return (actions->flags & (threshold == 0 ? TRAY_ACTION_LOW : TRAY_ACTION_CRITICAL)) != 0;
+    }
+
+    for (gint i = 0; i < actions->num_fired; i++) {
+        if (actions->fired_rules[i] == expected->thresholds[threshold].rule) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void simulate_check_thresholds (struct simulate_result *result, gint battery, gint tick, const struct tray_config *config,
+                                       const struct tray_snapshot *snapshot, const struct tray_actions *actions,
+                                       struct simulate_expected *expected)
+{
+    gboolean discharging = is_discharging_status (snapshot->status);
+    gboolean charging = snapshot->status == CHARGING || snapshot->status == CHARGED;
+    gdouble seconds = G_MAXDOUBLE;
+    gint readings[RULE_KINDS], nearest[RULE_KINDS];
+
+    /* what the battery showed, -1 when nothing */
+
+    readings[RULE_PERCENTAGE] = snapshot->status == CHARGED ? 100 : discharging == TRUE || charging == TRUE ? snapshot->percentage : -1;
+    readings[RULE_MINUTES]    = charging == TRUE ? G_MAXINT : discharging == TRUE ? snapshot->time : -1;
+
+    /* the first discharge after a change of the power supplies only warns */
+    /* the nearest of the thresholds it is already under                   */
+
+    for (gint kind = 0; kind < RULE_KINDS; kind++) {
+        nearest[kind] = G_MAXINT;
+
+        if (discharging == FALSE || readings[kind] == -1 || expected->started[kind] == TRUE) {
+            continue;
+        }
+
+        for (gint i = 0; i < expected->num_thresholds; i++) {
+            if (expected->thresholds[i].kind == kind && readings[kind] <= expected->thresholds[i].level) {
+                nearest[kind] = MIN (nearest[kind], expected->thresholds[i].level);
+            }
+        }
+
+        expected->started[kind] = TRUE;
+    }
+
+    for (gint i = 0; i < expected->num_thresholds; i++) {
+        struct simulate_threshold *threshold = &expected->thresholds[i];
+        gint reading = readings[threshold->kind];
+        gboolean armed;
+
+        threshold->highest = MAX (threshold->highest, reading);
+        armed = threshold->warned == FALSE || threshold->highest > threshold->rearm;
+
+        if (threshold->level > nearest[threshold->kind] && reading <= threshold->level) {
+            if (simulate_warned (expected, actions, i) == TRUE) {
+                simulate_violation (result, battery, tick, "warned past the nearest threshold after a reset");
+            }
+
+            threshold->warned  = TRUE;
+            threshold->highest = reading;
+        } else if (simulate_warned (expected, actions, i) == TRUE) {
+            if (discharging == FALSE || reading == -1 || reading > threshold->level) {
+                simulate_violation (result, battery, tick, "warned while not discharging at or under the threshold");
+            }
+
+            if (armed == FALSE) {
+                simulate_violation (result, battery, tick, "warned again without re-arming");
+            }
+
+            threshold->warned  = TRUE;
+            threshold->highest = reading;
+            result->warnings  += i < 2;
+            result->rules     += i >= 2;
+        } else if (discharging == TRUE && reading != -1 && reading <= threshold->level && armed == TRUE) {
+            simulate_violation (result, battery, tick, "threshold reached without a warning");
+        } else if (discharging == TRUE && armed == TRUE && snapshot->time > 0 && snapshot->percentage > 0) {
+            seconds = MIN (seconds, threshold->kind == RULE_PERCENTAGE ?
+                (gdouble)(snapshot->percentage - threshold->level) / snapshot->percentage * snapshot->time * 60 :
+                (gdouble)(snapshot->time - threshold->level) * 60);
+        }
+    }
+
+    if (((actions->flags & TRAY_ACTION_LOW_HOOKS) != 0) != simulate_warned (expected, actions, 0) ||
+        ((actions->flags & TRAY_ACTION_CRITICAL_HOOKS) != 0) != simulate_warned (expected, actions, 1)) {
+        simulate_violation (result, battery, tick, "level hooks not run with their warning");
+    }
+
+    if (snapshot->visible == FALSE && actions->interval > MAX ((guint)config->update_interval, seconds)) {
+        simulate_violation (result, battery, tick, "locked or idle past the time to a threshold");
+    }
+}
+
+static void simulate_check (struct simulate_result *result, gint battery, gint tick, const struct tray_config *config,
+                            const struct tray_snapshot *snapshot, const struct tray_actions *actions,
+                            struct simulate_expected *expected)
+{
+    gint status = is_discharging_status (snapshot->status) == TRUE ? DISCHARGING : snapshot->status;
+
+    if (snapshot->visible == TRUE && actions->interval != 0) {
+        simulate_violation (result, battery, tick, "active session not updated every update interval");
+    }
+
+    if (snapshot->visible == FALSE && (actions->interval < (guint)config->update_interval || actions->interval > SESSION_MAX_INTERVAL)) {
+        simulate_violation (result, battery, tick, "locked or idle interval out of bounds");
+    }
+
+    if (snapshot->num_batteries == 0) {
+        if (((actions->flags & TRAY_ACTION_AC_ONLY) != 0) == expected->ac_only) {
+            simulate_violation (result, battery, tick, expected->ac_only == TRUE ? "no battery notified twice" : "no battery not notified");
+        }
+
+        if ((actions->flags & ~TRAY_ACTION_AC_ONLY) != 0 || actions->num_fired > 0) {
+            simulate_violation (result, battery, tick, "battery shown without a battery");
+        }
+
+        expected->ac_only = TRUE;
+        return;
+    }
+
+    if (((actions->flags & TRAY_ACTION_STATUS) != 0) == (status == expected->status)) {
+        simulate_violation (result, battery, tick, status == expected->status ? "status notified twice" : "status change not notified");
+    }
+
+    if ((actions->flags & TRAY_ACTION_STATUS) != 0) {
+        result->notifications++;
+
+        if (actions->old_status != expected->status) {
+            simulate_violation (result, battery, tick, "status hooks given the wrong old status");
+        }
+    }
+
+    expected->status = status;
+
+    simulate_check_thresholds (result, battery, tick, config, snapshot, actions, expected);
+}
+
+static void simulate_reset (struct simulate_expected *expected)
+{
+    expected->status  = -1;
+    expected->ac_only = FALSE;
+
+    for (gint kind = 0; kind < RULE_KINDS; kind++) {
+        expected->started[kind] = FALSE;
+    }
+
+    for (gint i = 0; i < expected->num_thresholds; i++) {
+        expected->thresholds[i].warned  = FALSE;
+        expected->thresholds[i].highest = -1;
+    }
+}
+
+/* the low and critical levels, then the rules, drawn at random */
+
+static void simulate_rules (struct simulate_battery *battery, const struct tray_config *config, struct level_rule_set *rules,
+                            struct simulate_expected *expected)
+{
+    gint levels[] = { config->low_level, config->critical_level };
+
+    expected->num_thresholds = 2 + g_rand_int_range (battery->rand, 0, SIMULATE_RULES + 1);
+
+    for (gint i = 0; i < expected->num_thresholds; i++) {
+        struct simulate_threshold *threshold = &expected->thresholds[i];
+
+        if (i < 2) {
+            threshold->kind  = RULE_PERCENTAGE;
+            threshold->level = levels[i];
+            threshold->rearm = levels[i] + config->level_hysteresis;
+        } else {
+            threshold->kind  = g_rand_boolean (battery->rand) == TRUE ? RULE_PERCENTAGE : RULE_MINUTES;
+            threshold->level = g_rand_int_range (battery->rand, 1, 61);
+            threshold->rearm = threshold->level + (g_rand_boolean (battery->rand) == TRUE ? g_rand_int_range (battery->rand, 0, 11) : config->level_hysteresis);
+        }
+    }
+
+    /* the rule set, as compile_level_rules of cbatticon.c builds it */
+
+    rules->num_rules = 0;
+    add_level_rule_levels (rules);
+    set_level_rule_levels (rules, config);
+
+    for (gint i = 2; i < expected->num_thresholds; i++) {
+        struct level_rule *rule = &rules->rules[rules->num_rules];
+
+        rule->kind      = expected->thresholds[i].kind;
+        rule->threshold = expected->thresholds[i].level;
+        rule->rearm     = expected->thresholds[i].rearm;
+        rule->urgency   = RULE_URGENCY_NORMAL;
+        rule->command   = NULL;
+        rule->level     = -1;
+        rule->number    = rules->num_rules++;
+    }
+
+    build_level_rule_set (rules);
+
+    for (gint i = 0; i < rules->num_rules; i++) {
+        expected->thresholds[rules->rules[i].number].rule = i;
+    }
+
+    simulate_reset (expected);
+}
+
+static void simulate_battery (struct simulate_result *result, gint number, struct tray_config *config)
+{
+    struct simulate_battery battery;
+    struct simulate_expected expected;
+    struct level_rule_set rules;
+    struct tray_state state;
+    guint interval = 0;
+
+    battery.rand    = g_rand_new_with_seed (number);
+    battery.level   = g_rand_double_range (battery.rand, 0.0, 100.0);
+    battery.plugged = g_rand_boolean (battery.rand);
+    battery.removed = FALSE;
+    battery.visible = TRUE;
+    battery.load    = g_rand_double_range (battery.rand, 0.05, 1.0);
+    battery.noise   = g_rand_double_range (battery.rand, 0.0, 3.0);
+
+    /* about half the batteries have each quirk */
+
+    for (gint quirk = 0; quirk < SIMULATE_QUIRKS; quirk++) {
+        battery.quirks[quirk] = g_rand_boolean (battery.rand) == TRUE ? g_rand_double_range (battery.rand, 0.0, 0.05) : 0.0;
+    }
+
+    battery.quirks[SIMULATE_REMOVAL] /= 20.0;
+    battery.ac_unknown = g_rand_int_range (battery.rand, 0, 10) == 0;
+
+    config->low_level        = g_rand_int_range (battery.rand, 5, 41);
+    config->critical_level   = g_rand_int_range (battery.rand, 1, config->low_level + 1);
+    config->level_hysteresis = g_rand_boolean (battery.rand) == TRUE ? g_rand_int_range (battery.rand, 1, 11) : 0;
+
+    simulate_rules (&battery, config, &rules, &expected);
+    tray_state_init (&state);
+
+    for (gint tick = 0; tick < result->ticks; tick++) {
+        struct tray_snapshot snapshot;
+        struct tray_actions actions;
+        gboolean changed = FALSE;
+        gint status, percentage;
+        gdouble drain;
+
+        /* the actual battery, over the interval of the last update */
+
+        drain = battery.load * (interval != 0 ? interval : (guint)config->update_interval) / config->update_interval;
+
+        if (g_rand_int_range (battery.rand, 0, 100) == 0) {
+            battery.plugged = !battery.plugged;
+        }
+
+        if (battery.plugged == TRUE) {
+            battery.level = MIN (battery.level + drain * 2.0, 100.0);
+        } else {
+            battery.level = MAX (battery.level - drain * g_rand_double_range (battery.rand, 0.5, 1.5), 0.0);
+
+            /* the user plugs the AC before it is empty */
+
+            if (battery.level == 0.0) {
+                battery.plugged = TRUE;
+            }
+        }
+
+        if (simulate_quirk (&battery, SIMULATE_REMOVAL, result->quirks) == TRUE) {
+            battery.removed = !battery.removed;
+            changed         = TRUE;
+        }
+
+        if (g_rand_int_range (battery.rand, 0, 50) == 0) {
+            battery.visible = !battery.visible;
+        }
+
+        /* as read from the driver */
+
+        if (changed == TRUE) {
+            tray_state_init (&state);
+            simulate_reset (&expected);
+        }
+
+        snapshot.num_batteries = battery.removed == TRUE ? 0 : 1;
+        snapshot.status        = MISSING;
+        snapshot.percentage    = 0;
+        snapshot.time          = -1;
+        snapshot.visible       = battery.visible;
+
+        percentage = (gint)CLAMP (floor (battery.level + g_rand_double_range (battery.rand, -battery.noise, battery.noise)), 0, 100);
+
+        if (snapshot.num_batteries > 0) {
+            if (battery.plugged == FALSE) {
+                status = DISCHARGING;
+            } else if (battery.level >= 100.0) {
+                status = CHARGED;
+            } else {
+                status = CHARGING;
+            }
+
+            if (battery.plugged == TRUE && battery.level > 95.0 && simulate_quirk (&battery, SIMULATE_FLAP, result->quirks) == TRUE) {
+                status = g_rand_boolean (battery.rand) == TRUE ? NOT_CHARGING : DISCHARGING;
+            }
+
+            if (simulate_quirk (&battery, SIMULATE_UNKNOWN, result->quirks) == TRUE) {
+                status = UNKNOWN;
+            }
+
+            if (simulate_quirk (&battery, SIMULATE_MISSING, result->quirks) == TRUE) {
+                status = MISSING;
+            }
+
+            if (simulate_quirk (&battery, SIMULATE_UNREADABLE, result->quirks) == TRUE) {
+                percentage = -1;
+            }
+
+            if (status == UNKNOWN) {
+                status = tray_resolve_status (&state, status, battery.ac_unknown == TRUE ? -1 : battery.plugged,
+                                              battery.plugged == TRUE ? percentage : -1, &state);
+            }
+
+            snapshot.status = status;
+
+            if (status == CHARGING || is_discharging_status (status) == TRUE) {
+                if (percentage == -1) {
+                    interval = 0;
+                    result->total_ticks++;
+                    continue;
+                }
+
+                snapshot.percentage = percentage;
+                snapshot.time       = (gint)((status == CHARGING ? (100.0 - battery.level) / (battery.load * 2.0) :
+                                                                   battery.level / battery.load) * config->update_interval / 60);
+            }
+        }
+
+        tray_step (&state, &snapshot, config, &rules, &state, &actions);
+        simulate_check (result, number, tick, config, &snapshot, &actions, &expected);
+
+        interval = actions.interval;
+
+        result->hooks          += ((actions.flags & TRAY_ACTION_LOW_HOOKS) != 0) + ((actions.flags & TRAY_ACTION_CRITICAL_HOOKS) != 0);
+        result->inactive_ticks += snapshot.visible == FALSE;
+        result->seconds        += interval != 0 ? interval : (guint)config->update_interval;
+
+        result->total_ticks++;
+    }
+
+    g_rand_free (battery.rand);
+}
+
+static gpointer simulate_thread (gpointer data)
+{
+    struct simulate_result *result = (struct simulate_result *)data;
+    struct tray_config config = { update_interval };
+
+    for (gint number = result->first; number < result->last; number++) {
+        simulate_battery (result, number, &config);
+    }
+
+    return NULL;
+}
+
+static gboolean simulate_batteries (gint num_batteries, gint ticks)
+{
+    gint num_threads = MIN ((gint)g_get_num_processors (), num_batteries);
+    struct simulate_result *results;
+    struct simulate_result total;
+    GThread **threads;
+    gint64 start, elapsed;
+
+    results = g_new0 (struct simulate_result, num_threads);
+    threads = g_new (GThread *, num_threads);
+
+    memset (&total, 0, sizeof (total));
+
+    start = g_get_monotonic_time ();
+
+    for (gint t = 0; t < num_threads; t++) {
+        results[t].first  = (gint)((gint64)num_batteries * t / num_threads);
+        results[t].last   = (gint)((gint64)num_batteries * (t + 1) / num_threads);
+        results[t].ticks  = ticks;
+        results[t].report = g_string_new (NULL);
+
+        threads[t] = g_thread_new ("simulate", simulate_thread, &results[t]);
+    }
+
+    for (gint t = 0; t < num_threads; t++) {
+        g_thread_join (threads[t]);
+
+        total.total_ticks    += results[t].total_ticks;
+        total.notifications  += results[t].notifications;
+        total.warnings       += results[t].warnings;
+        total.hooks          += results[t].hooks;
+        total.rules          += results[t].rules;
+        total.inactive_ticks += results[t].inactive_ticks;
+        total.seconds        += results[t].seconds;
+        total.violations     += results[t].violations;
+
+        for (gint quirk = 0; quirk < SIMULATE_QUIRKS; quirk++) {
+            total.quirks[quirk] += results[t].quirks[quirk];
+        }
+
+        g_print ("%s", results[t].report->str);
+        g_string_free (results[t].report, TRUE);
+    }
+
+    elapsed = MAX (g_get_monotonic_time () - start, 1);
+
+    g_print ("%d batteries, %d ticks each, on %d threads: %" G_GUINT64_FORMAT " ticks in %.2f s (%.0f ticks/s, %.0f ns/tick/thread)\n",
+        num_batteries, ticks, num_threads, total.total_ticks, elapsed / 1e6,
+        total.total_ticks * 1e6 / elapsed, total.total_ticks > 0 ? elapsed * 1e3 * num_threads / total.total_ticks : 0.0);
+    g_print ("actions: %" G_GUINT64_FORMAT " status notifications, %" G_GUINT64_FORMAT " level warnings, %" G_GUINT64_FORMAT " level hooks, %"
+        G_GUINT64_FORMAT " rules fired\n", total.notifications, total.warnings, total.hooks, total.rules);
+    g_print ("session: %" G_GUINT64_FORMAT " ticks locked or idle, %.1f simulated hours per battery\n",
+        total.inactive_ticks, num_batteries > 0 ? total.seconds / 3600.0 / num_batteries : 0.0);
+
+    g_print ("quirks:");
+    for (gint quirk = 0; quirk < SIMULATE_QUIRKS; quirk++) {
+        g_print ("%s %" G_GUINT64_FORMAT " %s", quirk > 0 ? "," : "", total.quirks[quirk], simulate_quirk_names[quirk]);
+    }
+    g_print ("\n");
+
+    g_print ("violations: %" G_GUINT64_FORMAT "\n", total.violations);
+
+    g_free (threads);
+    g_free (results);
+
+    return total.violations == 0;
+}
+
+int main (int argc, char **argv)
+{
+    GError *error = NULL;
+
+    GOptionContext *option_context;
+    gint batteries = DEFAULT_BATTERIES, ticks = DEFAULT_TICKS;
+    GOptionEntry option_entries[] = {
+        { "batteries"      , 'b', 0, G_OPTION_ARG_INT, &batteries      , "Set the number of synthetic batteries"                      , NULL },
+        { "ticks"          , 't', 0, G_OPTION_ARG_INT, &ticks          , "Set the number of updates of each battery"                  , NULL },
+        { "update-interval", 'u', 0, G_OPTION_ARG_INT, &update_interval, "Set the update interval of an active session (in seconds)", NULL },
+        { NULL }
+    };
+
+    option_context = g_option_context_new (NULL);
+    g_option_context_add_main_entries (option_context, option_entries, NULL);
+
+    if (g_option_context_parse (option_context, &argc, &argv, &error) == FALSE) {
+        g_printerr ("Cannot parse command line arguments: %s\n", error->message);
+        g_error_free (error); error = NULL;
+
+        return 1;
+    }
+
+    g_option_context_free (option_context);
+
+    if (batteries < 1 || ticks < 1 || update_interval < 1) {
+        g_printerr ("The batteries, the ticks and the update interval must be at least 1\n");
+        return 1;
+    }
+
+    return simulate_batteries (batteries, ticks) == TRUE ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# wakeups.sh: counts the wakeups of cbatticon per minute, by source.
+#
+# usage: bench/wakeups.sh SECONDS BUDGET COMMAND...
+#
+# The command (cbatticon and its options) is left to settle for a few
+# seconds first, which leaves out the startup wakeups (discovery, toolkit,
+# notification server); the totals it prints on SIGUSR1 are then taken at
+# the start and at the end of SECONDS, along with its voluntary context
+# switches and CPU time. The script fails when the wakeups exceed BUDGET per
+# minute (0 for no limit).
+
+SETTLE=5
+
+if [ $# -lt 3 ]; then
+    echo "usage: $0 SECONDS BUDGET COMMAND..." >&2
+    exit 2
+fi
+
+seconds=$1
+budget=$2
+shift 2
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+"$@" > /dev/null 2> "$log" &
+pid=$!
+
+# sample: the wakeups by source (timer, dbus, toolkit, uevent, other), the
+# voluntary context switches and the CPU time in clock ticks
+
+sample () {
+    printed=$(grep -c '^wakeups: ' "$log")
+
+    if ! kill -USR1 $pid 2> /dev/null; then
+        echo "$0: the command exited" >&2
+        cat "$log" >&2
+        exit 1
+    fi
+
+    for i in $(seq 100); do
+        [ "$(grep -c '^wakeups: ' "$log")" -gt "$printed" ] && break
+        sleep 0.1
+    done
+
+    grep '^wakeups: ' "$log" | tail -n 1 | awk -F ', ' '{
+        for (i = 2; i <= NF; i++) {
+            split($i, field, " ")
+            printf "%s ", field[2]
+        }
+    }'
+    awk '$1 == "voluntary_ctxt_switches:" { printf "%s ", $2 }' /proc/$pid/status
+    sed 's/.*) //' /proc/$pid/stat | awk '{ print $12 + $13 }'
+}
+
+sleep $SETTLE
+start=$(sample)
+sleep "$seconds"
+end=$(sample)
+
+kill -TERM $pid
+wait $pid
+
+sed '/^phase (us)/,$d' "$log"
+
+awk -v start="$start" -v end="$end" -v seconds="$seconds" -v budget="$budget" -v ticks="$(getconf CLK_TCK)" 'BEGIN {
+    split("timer dbus toolkit uevent other", names, " ")
+    split(start, first, " ")
+    split(end, last, " ")
+    minutes = seconds / 60
+
+    # the last SIGUSR1 is a wakeup of its own
+    last[5]--
+
+    printf "%-12s %10s\n", "source", "per minute"
+    for (i = 1; i <= 5; i++) {
+        rate = (last[i] - first[i]) / minutes
+        total += rate
+        printf "%-12s %10.1f\n", names[i], rate
+    }
+    printf "%-12s %10.1f\n", "total", total
+
+    printf "context switches: %.1f per minute, cpu time: %.2f s\n", (last[6] - first[6]) / minutes, (last[7] - first[7]) / ticks
+
+    if (budget > 0) {
+        printf "budget: %d per minute, %s\n", budget, (total > budget ? "exceeded" : "met")
+        exit (total > budget)
+    }
+}'
@@ -25,75 +25,150 @@
 #define CBATTICON_VERSION_STRING "1.6.13"
 #define CBATTICON_STRING         "cbatticon"
 
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 
+#include <gio/gio.h>
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <glib/gprintf.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 
 #ifdef WITH_NOTIFY
 #include <libnotify/notify.h>
 #endif
 
-#ifdef WITH_QT6
-#include <QApplication>
-#include <QSystemTrayIcon>
-#else
-#include <gtk/gtk.h>
-#endif
-
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libintl.h>
 #include <locale.h>
 #include <math.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
-#ifdef WITH_QT6
+#include <linux/netlink.h>
 
-#define TrayIcon                        QSystemTrayIcon
-#define TRAY_ICON_NEW                   new QSystemTrayIcon
-#define TRAY_ICON_HAS_ICON(name)        QIcon::hasThemeIcon (name)
-#define TRAY_ICON_SET_ICON(icon, name)  icon->setIcon (QIcon::fromTheme (name))
-#define TRAY_ICON_SET_TEXT(icon, text)  icon->setToolTip (text)
-#define TRAY_ICON_SHOW(icon)            icon->show ()
+#include "backend.h"
+#include "libcbatticon.h"
+#include "plugin.h"
+#include "sysattr.h"
+#include "trace.h"
+#include "tray.h"
 
-#else /* GTK */
+/* the toolkit backend, loaded once a tray icon is needed */
 
-#define TrayIcon                        GtkStatusIcon
-#define TRAY_ICON_NEW                   gtk_status_icon_new ()
-#define TRAY_ICON_HAS_ICON(name)        gtk_icon_theme_has_icon (gtk_icon_theme_get_default (), name)
-#define TRAY_ICON_SET_ICON(icon, name)  gtk_status_icon_set_from_icon_name (icon, name);
-#define TRAY_ICON_SET_TEXT(icon, text)  gtk_status_icon_set_tooltip_text (icon, text)
-#define TRAY_ICON_SHOW(icon)            gtk_status_icon_set_visible (icon, TRUE)
+static const struct cbatticon_backend *backend = NULL;
 
-#endif
+#define TrayIcon                        cbatticon_tray_icon
+#define TRAY_ICON_NEW                   backend->icon_new ()
+#define TRAY_ICON_HAS_ICON(name)        backend->has_icon (name)
+#define TRAY_ICON_SET_ICON(icon, name)  backend->icon_set_icon (icon, name)
+#define TRAY_ICON_SET_TEXT(icon, text)  backend->icon_set_text (icon, text)
+#define TRAY_ICON_SHOW(icon)            backend->icon_show (icon)
+#define TRAY_ICON_FREE(icon)            backend->icon_free (icon)
+#define TRAY_ICON_ON_CLICK(icon, func)  backend->icon_on_click (icon, func, NULL)
+#define TRAY_ICON_ON_POPUP(icon, func)  backend->icon_on_popup (icon, func, NULL)
+
+#define HAS_STANDARD_ICON_TYPE          has_icon_type (BATTERY_ICON)
+#define HAS_NOTIFICATION_ICON_TYPE      has_icon_type (BATTERY_ICON_NOTIFICATION)
+#define HAS_SYMBOLIC_ICON_TYPE          has_icon_type (BATTERY_ICON_SYMBOLIC)
+
+#define TOOLKIT_MAIN()                  backend->run ()
+#define TOOLKIT_MAIN_QUIT()             backend->quit ()
+
+/* the tray icon of the system batteries, NULL until it is created */
+
+static TrayIcon *battery_tray_icon = NULL;
 
 static gint get_options (int *argc, char ***argv);
+static gboolean load_configuration (void);
 static gboolean changed_power_supplies (void);
 static void get_power_supplies (void);
-
+static gchar* get_battery_paths (void);
+
+static gboolean trace_start_recording (const gchar *filename);
+static void trace_record (gint type, const gchar *key, gboolean status, const gchar *value);
+static gboolean trace_replay (gint type, const gchar *key, gboolean *status, gchar **value);
+static gboolean replay_trace (const gchar *filename);
+static void replay_log (const gchar *format, ...) G_GNUC_PRINTF (1, 2);
+static void get_clock_time (struct timespec *time);
+static gint64 get_boot_time (void);
+static void ring_dump (gboolean all);
+static void metrics_stop_socket (const gchar *path);
+
+static gchar** get_power_supply_names (GError **error);
 static gboolean get_sysattr_string (const gchar *path, const gchar *attribute, gchar **value);
-static gboolean get_sysattr_double (const gchar *path, const gchar *attribute, gdouble *value);
 
 static gboolean get_ac_online (const gchar *path, gboolean *online);
-static gboolean get_battery_present (const gchar *path, gboolean *present);
 
-static gboolean get_battery_status (gint *status);
+static gint parse_battery_status (const gchar *value);
 
-static gboolean get_battery_full_capacity (gboolean *use_charge, gdouble *capacity);
-static gboolean get_battery_remaining_capacity (gboolean use_charge, gdouble *capacity);
-static gboolean get_battery_remaining_capacity_pct (gdouble *capacity);
-static gboolean get_battery_current_rate (gboolean use_charge, gdouble *rate);
 static void reset_battery_current_rate (void);
+static void reset_status_debounce (void);
+
+static gboolean read_battery_statuses (void);
+static void read_battery_capacities (void);
+static gboolean read_batteries (void);
+
+static void set_devices (GPtrArray *paths);
+static void start_devices (void);
+static void restart_devices (void);
+static gboolean on_device_read (gpointer user_data);
 
 static gboolean get_battery_charge (gboolean remaining, gint *percentage, gint *time);
+static gboolean is_status_pending (void);
+
+static gboolean upower_changed_power_supplies (void);
+static gboolean upower_read_batteries (void);
+static gboolean upower_get_battery_charge (gboolean remaining, gint *percentage, gint *time);
+static gboolean upower_get_ac_online (gboolean *online);
+static gboolean compute_battery_charge (gboolean remaining, gint *percentage, gint *time);
 
 static void create_tray_icon (void);
+static void schedule_tray_icon_updates (TrayIcon *tray_icon);
 static gboolean update_tray_icon (TrayIcon *tray_icon);
 static void update_tray_icon_status (TrayIcon *tray_icon);
+static void reload_level_rules (void);
+static void set_tray_icon_text (TrayIcon *tray_icon, const gchar *text);
+static void set_tray_icon_name (TrayIcon *tray_icon, const gchar *name);
 static void on_tray_icon_click (TrayIcon *tray_icon, gpointer user_data);
+static void on_tray_icon_popup (TrayIcon *tray_icon, gpointer user_data);
+static gboolean spawn_command (gint hook, const gchar *command, const struct cbatticon_snapshot *snapshot, GError **error);
+
+static gboolean load_plugins (void);
+static gboolean compile_level_rules (void);
+static void unload_plugins (void);
+
+static void start_upower (GDBusConnection *connection);
+static void start_sleep_watch (void);
+static void start_session_watch (GDBusConnection *connection);
+static void check_sleep_gap (void);
+static void sleep_flush (gboolean suspend);
+
+static gboolean load_backend (int *argc, char ***argv);
+static guint toolkit_timeout_add (guint seconds, GSourceFunc func, gpointer user_data);
+static guint toolkit_fd_add (gint fd, GIOCondition condition, GUnixFDSourceFunc func, gpointer user_data);
+static void toolkit_source_remove (guint id);
+static gboolean has_icon_type (gint icon_type);
+
+static void startup_start_workers (void);
+static void startup_join_workers (void);
+static void startup_stop_workers (void);
+#ifdef WITH_NOTIFY
+static void startup_join_notification (void);
+#endif
+static void startup_add (gint phase, gint64 start);
 
 #ifdef WITH_NOTIFY
 static void notify_message (NotifyNotification **notification, gchar *summary, gchar *body, gint timeout, NotifyUrgency urgency);
@@ -109,9 +184,13 @@ static gchar* get_icon_name (gint state, gint percentage);
 
 #define SYSFS_PATH "/sys/class/power_supply"
 
-#define DEFAULT_UPDATE_INTERVAL 5
-#define DEFAULT_LOW_LEVEL       20
-#define DEFAULT_CRITICAL_LEVEL  5
+#define DEFAULT_UPDATE_INTERVAL  5
+#define DEFAULT_LOW_LEVEL        20
+#define DEFAULT_CRITICAL_LEVEL   5
+#define DEFAULT_DEVICE_INTERVAL  60
+#define DEFAULT_STATUS_DWELL     0
+#define DEFAULT_LEVEL_HYSTERESIS 0
+#define DEFAULT_COMMAND_RUNNING  1
 
 #define STR_LTH 256
 
@@ -123,14 +202,17 @@ enum {
 };
 
 enum {
-    MISSING = 0,
-    UNKNOWN,
-    CHARGED,
-    CHARGING,
-    DISCHARGING,
-    NOT_CHARGING,
-    LOW_LEVEL,
-    CRITICAL_LEVEL
+    SOURCE_AUTO = 0,
+    SOURCE_SYSFS,
+    SOURCE_UPOWER
+};
+
+enum {
+    HOOK_LEFT_CLICK = 0,
+    HOOK_LOW_LEVEL,
+    HOOK_CRITICAL_LEVEL,
+    HOOK_LEVEL_RULE,
+    HOOKS
 };
 
 struct configuration {
@@ -148,6 +230,27 @@ struct configuration {
 #endif
     gboolean list_icon_types;
     gboolean list_power_supplies;
+    gchar   *record_file;
+    gchar   *replay_file;
+    gboolean print_profile;
+    gboolean dump_events;
+    gchar   *metrics_socket;
+    gchar   *metrics_file;
+    gint     device_interval;
+    gboolean device_icons;
+    gint     status_dwell;
+    gint     level_hysteresis;
+    gchar  **plugin_files;
+    gint     command_timeout;
+    gint     command_max_running;
+    gchar   *toolkit;
+    gboolean startup_trace;
+    gchar   *config_file;
+    gchar   *icon_type_name;
+    gint     wakeup_budget;
+    gchar   *source_name;
+    gint     source;
+    gchar  **rules;
 } configuration = {
     FALSE,
     FALSE,
@@ -157,644 +260,5061 @@ struct configuration {
     DEFAULT_CRITICAL_LEVEL,
     NULL,
     NULL,
+    NULL,
 #ifdef WITH_NOTIFY
     FALSE,
 #endif
     FALSE,
-    FALSE
+    FALSE,
+    NULL,
+    NULL,
+    FALSE,
+    FALSE,
+    NULL,
+    NULL,
+    DEFAULT_DEVICE_INTERVAL,
+    FALSE,
+    DEFAULT_STATUS_DWELL,
+    DEFAULT_LEVEL_HYSTERESIS,
+    NULL,
+    0,
+    DEFAULT_COMMAND_RUNNING,
+    NULL,
+    FALSE,
+    NULL,
+    NULL,
+    0,
+    NULL,
+    SOURCE_AUTO,
+    NULL
 };
 
+#define MAX_BATTERIES 8
+
 static gchar *battery_suffix = NULL;
-static gchar *battery_path   = NULL;
 static gchar *ac_path        = NULL;
 
+static struct cbatticon_battery batteries[MAX_BATTERIES];
+static gint                     num_batteries = 0;
+
+/* peripheral batteries, polled separately */
+
+#define MAX_DEVICES 16
+
+struct device {
+    gchar    *path;
+    gchar    *name;
+    gint      status;
+    gint      percentage; /* -1 when unavailable */
+    gboolean  low;
+    gboolean  polling;
+    TrayIcon *tray_icon;
+#ifdef WITH_NOTIFY
+    NotifyNotification *notification;
+#endif
+};
+
+static struct {
+    struct device devices[MAX_DEVICES];
+    gint          num_devices;
+    gboolean      started;
+    guint         timer;
+    GThreadPool  *readers;
+    guint         uevent_source;
+} devices;
+
+/* all the batteries combined */
+
+static struct {
+    gboolean present;
+    gint     status;
+    gboolean use_charge;
+    gdouble  full_capacity;
+    gboolean from_pct;
+    gdouble  remaining_capacity; /* -1 when unavailable */
+    gdouble  rate;               /* -1 when unavailable */
+} aggregate;
+
+/* batteries read from UPower instead of sysfs */
+
+static struct {
+    GDBusConnection *connection;
+    guint       watch;
+    guint       generation;                /* of the device enumeration, stale results are dropped */
+    gint        pending;                   /* device proxies being created */
+    GDBusProxy *daemon;
+    GDBusProxy *display;                   /* all the batteries combined */
+    GPtrArray  *devices;
+    GPtrArray  *loading;                   /* devices of the enumeration in progress */
+    GDBusProxy *loading_display;
+    GDBusProxy *batteries[MAX_BATTERIES];  /* device of each battery */
+    gboolean    active;
+    gboolean    changed;                   /* source or devices changed since the last update */
+    guint       update;
+    guint       dwell;
+} upower;
+
 /*
- * current/power filtering
+ * wakeup accounting
+ *
+ * Every wakeup of the process costs power on the battery it monitors. The
+ * timers are whole seconds (g_timeout_add_seconds), which lets GLib fire
+ * them together with the other timers of the session, and the timer slack
+ * of the process is raised so that the kernel can merge its wakeups with
+ * those of other processes. The main loop poll is wrapped to count the
+ * returns of the blocking polls; each wakeup is attributed to the first of
+ * our callbacks dispatched after it (timer, D-Bus, kernel uevent or other:
+ * signals, sockets, worker threads, file monitor), and those not claimed by
+ * any are the toolkit's (X events, redraws). A toolkit that waits in its own loop
+ * (Qt without glib) reports its wakeups instead. The counts of each minute are printed
+ * with --debug, marked when over --wakeup-budget, and bench/wakeups.sh measures the
+ * rates from the totals printed on SIGUSR1.
  */
-#define MAX_SAMPLES 60
 
-struct filter {
-    gdouble samples[MAX_SAMPLES];
-    struct timespec sample_times[MAX_SAMPLES];
-    gint num_samples, next_sample;
+#define WAKEUP_TIMER_SLACK       50000000 /* ns */
+
+enum {
+    WAKEUP_TIMER = 0,
+    WAKEUP_DBUS,
+    WAKEUP_TOOLKIT,
+    WAKEUP_UEVENT,
+    WAKEUP_OTHER,
+    WAKEUP_SOURCES
+};
+
+static const gchar *wakeup_source_names[WAKEUP_SOURCES] = {
+    "timer",
+    "dbus",
+    "toolkit",
+    "uevent",
+    "other"
 };
 
-static void filter_append (struct filter *f, gdouble value)
-{
-    f->samples[f->next_sample] = value;
-    clock_gettime (CLOCK_MONOTONIC, &f->sample_times[f->next_sample]);
-    f->next_sample = (f->next_sample + 1) % MAX_SAMPLES;
-    f->num_samples = MAX (f->next_sample, f->num_samples);
-}
+static struct {
+    GPollFunc poll;
+    gboolean  pending;                  /* last wakeup not attributed yet */
+    guint64   counts[WAKEUP_SOURCES];   /* since start */
+    guint64   minute[WAKEUP_SOURCES];   /* in the current minute */
+    gint64    minute_start;
+} wakeups;
 
-static gdouble filter_get_mean (struct filter *f)
+static guint64 wakeup_sum (const guint64 *counts)
 {
-    gdouble sum = 0.0;
+    guint64 sum = 0;
 
-    for (gint i = 0; i < f->num_samples; i++) {
-        sum += f->samples[i];
+    for (gint source = 0; source < WAKEUP_SOURCES; source++) {
+        sum += counts[source];
     }
 
-    return sum / (gdouble)f->num_samples;
+    return sum;
 }
 
-static gdouble filter_get_rate (struct filter *f, const char *attribute)
+static void wakeup_claim (gint source)
 {
-    if (f->num_samples < 2) {
-        return 0.0;
-    }
-
-    int a = (f->next_sample + MAX_SAMPLES - f->num_samples) % MAX_SAMPLES;
-    int b = (f->next_sample + MAX_SAMPLES - 1) % MAX_SAMPLES;
-
-    gdouble value_diff = f->samples[b] - f->samples[a];
-    gdouble time_diff =
-        (gdouble)(f->sample_times[b].tv_sec - f->sample_times[a].tv_sec)
-            + ((gdouble)f->sample_times[b].tv_nsec / 1000000000.0)
-            - ((gdouble)f->sample_times[a].tv_nsec / 1000000000.0);
-
-    if (time_diff < 60.0) {
-        return 0.0; // measure rate over 60s minimum
-    }
-
-    if (configuration.debug_output == TRUE) {
-        g_print ("estimate %s from delta of %g over %g seconds\n",
-            attribute, value_diff, time_diff);
+    if (wakeups.pending == FALSE) {
+        return;
     }
 
-    return value_diff / time_diff * 3600.0; // rate per hour
+    wakeups.pending = FALSE;
+    wakeups.counts[source]++;
+    wakeups.minute[source]++;
 }
 
-static struct filter energy_filter;
-static struct filter charge_filter;
-static struct filter power_filter;
-static struct filter current_filter;
+static void wakeup_print_minute (void)
+{
+    guint64 total = wakeup_sum (wakeups.minute);
 
-/*
- * command line options function
- */
+    g_printf ("wakeups in the last minute: %" G_GUINT64_FORMAT " (timer %" G_GUINT64_FORMAT ", dbus %" G_GUINT64_FORMAT
+              ", toolkit %" G_GUINT64_FORMAT ", uevent %" G_GUINT64_FORMAT ", other %" G_GUINT64_FORMAT ")%s\n", total,
+        wakeups.minute[WAKEUP_TIMER], wakeups.minute[WAKEUP_DBUS], wakeups.minute[WAKEUP_TOOLKIT], wakeups.minute[WAKEUP_UEVENT],
+        wakeups.minute[WAKEUP_OTHER], configuration.wakeup_budget > 0 && total > (guint64)configuration.wakeup_budget ? ", over budget" : "");
+}
 
-static gint get_options (int *argc, char ***argv)
+static void wakeup_woken (void)
 {
-    GError *error = NULL;
-
-    gchar *icon_type_string = NULL;
-    GOptionContext *option_context;
-    GOptionEntry option_entries[] = {
-        { "version"               , 'v', 0, G_OPTION_ARG_NONE  , &configuration.display_version       , N_("Display the version")                                      , NULL },
-        { "debug"                 , 'd', 0, G_OPTION_ARG_NONE  , &configuration.debug_output          , N_("Display debug information")                                , NULL },
-        { "update-interval"       , 'u', 0, G_OPTION_ARG_INT   , &configuration.update_interval       , N_("Set update interval (in seconds)")                         , NULL },
-        { "icon-type"             , 'i', 0, G_OPTION_ARG_STRING, &icon_type_string                    , N_("Set icon type ('standard', 'notification' or 'symbolic')") , NULL },
-        { "low-level"             , 'l', 0, G_OPTION_ARG_INT   , &configuration.low_level             , N_("Set low battery level (in percent)")                       , NULL },
-        { "critical-level"        , 'r', 0, G_OPTION_ARG_INT   , &configuration.critical_level        , N_("Set critical battery level (in percent)")                  , NULL },
-        { "command-low-level"     , 'o', 0, G_OPTION_ARG_STRING, &configuration.command_low_level     , N_("Command to execute when low battery level is reached")     , NULL },
-        { "command-critical-level", 'c', 0, G_OPTION_ARG_STRING, &configuration.command_critical_level, N_("Command to execute when critical battery level is reached"), NULL },
-        { "command-left-click"    , 'x', 0, G_OPTION_ARG_STRING, &configuration.command_left_click    , N_("Command to execute when left clicking on tray icon")       , NULL },
-#ifdef WITH_NOTIFY
-        { "hide-notification"     , 'n', 0, G_OPTION_ARG_NONE  , &configuration.hide_notification     , N_("Hide the notification popups")                             , NULL },
-#endif
-        { "list-icon-types"       , 't', 0, G_OPTION_ARG_NONE  , &configuration.list_icon_types       , N_("List available icon types")                                , NULL },
-        { "list-power-supplies"   , 'p', 0, G_OPTION_ARG_NONE  , &configuration.list_power_supplies   , N_("List available power supplies (battery and AC)")           , NULL },
-        { NULL }
-    };
+    gint64 now = g_get_monotonic_time ();
 
-    option_context = g_option_context_new (_("[BATTERY ID]"));
-    g_option_context_add_main_entries (option_context, option_entries, CBATTICON_STRING);
+    wakeups.pending = TRUE;
 
-    if (g_option_context_parse (option_context, argc, argv, &error) == FALSE) {
-        g_printerr (_("Cannot parse command line arguments: %s\n"), error->message);
-        g_error_free (error); error = NULL;
+    if (now - wakeups.minute_start >= 60 * G_USEC_PER_SEC) {
+        if (configuration.debug_output == TRUE) {
+            wakeup_print_minute ();
+        }
 
-        return -1;
+        memset (wakeups.minute, 0, sizeof (wakeups.minute));
+        wakeups.minute_start = now;
     }
+}
 
-    g_option_context_free (option_context);
-
-    /* option : display the version */
+static gint wakeup_poll (GPollFD *fds, guint nfds, gint timeout)
+{
+    gint ret;
 
-    if (configuration.display_version == TRUE) {
-        g_print (_("cbatticon: a lightweight and fast battery icon that sits in your system tray\n"));
-        g_print (_("version %s\n"), CBATTICON_VERSION_STRING);
+    /* a non blocking poll is only the main loop checking its sources */
 
-        return 0;
+    if (timeout == 0) {
+        return wakeups.poll (fds, nfds, timeout);
     }
 
-    /* option : list available power supplies (battery and AC) */
+    wakeup_claim (WAKEUP_TOOLKIT);
 
-    if (configuration.list_power_supplies == TRUE) {
-        g_print (_("List of available power supplies:\n"));
-        get_power_supplies ();
+    ret = wakeups.poll (fds, nfds, timeout);
 
-        return 0;
-    }
+    wakeup_woken ();
 
-    /* option : list available icon types */
+    return ret;
+}
 
-#ifdef WITH_QT6
-    new QApplication (*argc, *argv);
-#else
-    gtk_init (argc, argv); /* gtk is required as from this point */
-#endif
+/* a toolkit that waits in its own loop: the previous wakeup is claimed late */
 
-    #define HAS_STANDARD_ICON_TYPE     TRAY_ICON_HAS_ICON ("battery-full")
-    #define HAS_NOTIFICATION_ICON_TYPE TRAY_ICON_HAS_ICON ("notification-battery-100")
-    #define HAS_SYMBOLIC_ICON_TYPE     TRAY_ICON_HAS_ICON ("battery-full-symbolic")
+static void on_toolkit_wakeup (void)
+{
+    wakeup_claim (WAKEUP_TOOLKIT);
+    wakeup_woken ();
+}
 
-    if (configuration.list_icon_types == TRUE) {
-        g_print (_("List of available icon types:\n"));
-        g_print ("standard\t%s\n"    , HAS_STANDARD_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
-        g_print ("notification\t%s\n", HAS_NOTIFICATION_ICON_TYPE == TRUE ? _("available") : _("unavailable"));
-        g_print ("symbolic\t%s\n"    , HAS_SYMBOLIC_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
+static void wakeup_print (void)
+{
+    g_printerr ("wakeups: %" G_GUINT64_FORMAT, wakeup_sum (wakeups.counts));
 
-        return 0;
+    for (gint source = 0; source < WAKEUP_SOURCES; source++) {
+        g_printerr (", %s %" G_GUINT64_FORMAT, wakeup_source_names[source], wakeups.counts[source]);
     }
 
-    /* option : set icon type */
+    g_printerr ("\n");
+}
 
-    if (icon_type_string != NULL) {
-        if (g_strcmp0 (icon_type_string, "standard") == 0 && HAS_STANDARD_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON;
-        else if (g_strcmp0 (icon_type_string, "notification") == 0 && HAS_NOTIFICATION_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_NOTIFICATION;
-        else if (g_strcmp0 (icon_type_string, "symbolic") == 0 && HAS_SYMBOLIC_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_SYMBOLIC;
-        else g_printerr (_("Unknown icon type: %s\n"), icon_type_string);
+static void start_wakeup_accounting (void)
+{
+    GMainContext *context = g_main_context_default ();
 
-        g_free (icon_type_string);
-    }
+    /* the timers may fire this much later to share a wakeup */
 
-    if (configuration.icon_type == UNKNOWN_ICON) {
-        if (HAS_STANDARD_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON;
-        else if (HAS_NOTIFICATION_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_NOTIFICATION;
-        else if (HAS_SYMBOLIC_ICON_TYPE == TRUE)
-            configuration.icon_type = BATTERY_ICON_SYMBOLIC;
-        else g_printerr (_("No icon type found!\n"));
+    if (prctl (PR_SET_TIMERSLACK, WAKEUP_TIMER_SLACK, 0, 0, 0) != 0 && configuration.debug_output == TRUE) {
+        g_printf ("cannot set the timer slack (%s)\n", g_strerror (errno));
     }
 
-    /* option : update interval */
+    wakeups.poll         = g_main_context_get_poll_func (context);
+    wakeups.minute_start = g_get_monotonic_time ();
+    g_main_context_set_poll_func (context, wakeup_poll);
 
-    if (configuration.update_interval <= 0) {
-        configuration.update_interval = DEFAULT_UPDATE_INTERVAL;
-        g_printerr (_("Invalid update interval! It has been reset to default (%d seconds)\n"), DEFAULT_UPDATE_INTERVAL);
+    if (backend != NULL && backend->on_wakeup != NULL) {
+        backend->on_wakeup (on_toolkit_wakeup);
     }
+}
 
-    /* option : low and critical levels */
+/*
+ * tick profiling
+ *
+ * Each phase of a tick is timed with the monotonic clock into a histogram
+ * of power of two buckets (in nanoseconds), which costs two clock reads and
+ * a few increments per phase. The histograms are printed on SIGUSR1.
+ */
+#define PROFILE_BUCKETS        36
+#define PROFILE_MAX_ATTRIBUTES 16
 
-    if (configuration.low_level < 0 || configuration.low_level > 100) {
-        configuration.low_level = DEFAULT_LOW_LEVEL;
-        g_printerr (_("Invalid low level! It has been reset to default (%d percent)\n"), DEFAULT_LOW_LEVEL);
-    }
+enum {
+    PROFILE_TICK = 0,
+    PROFILE_SUPPLY_CHANGE,
+    PROFILE_ESTIMATION,
+    PROFILE_STRINGS,
+    PROFILE_TOOLKIT,
+    PROFILE_NOTIFICATION,
+    PROFILE_PHASES
+};
 
-    if (configuration.critical_level < 0 || configuration.critical_level > 100) {
-        configuration.critical_level = DEFAULT_CRITICAL_LEVEL;
-        g_printerr (_("Invalid critical level! It has been reset to default (%d percent)\n"), DEFAULT_CRITICAL_LEVEL);
-    }
+static const gchar *profile_phase_names[PROFILE_PHASES] = {
+    "tick",
+    "supply change",
+    "estimation",
+    "strings",
+    "toolkit",
+    "notification"
+};
 
-    if (configuration.critical_level > configuration.low_level) {
-        configuration.critical_level = DEFAULT_CRITICAL_LEVEL;
-        configuration.low_level = DEFAULT_LOW_LEVEL;
-        g_printerr (_("Critical level is higher than low level! They have been reset to default\n"));
-    }
+struct histogram {
+    guint64 buckets[PROFILE_BUCKETS];
+    guint64 count;
+    gint64  sum;
+    gint64  max;
+};
 
-    return 1;
-}
+static struct {
+    struct histogram phases[PROFILE_PHASES];
+    struct histogram attributes[PROFILE_MAX_ATTRIBUTES];
+    const gchar     *attribute_names[PROFILE_MAX_ATTRIBUTES];
+    gint             num_attributes;
+    gint64           last_tick;
+    guint64          stalls;
+    guint64          overruns;
+} profile;
+
+static gint64 profile_get_time (void)
+{
+    struct timespec time;
 
-/*
- * sysfs functions
- */
+    clock_gettime (CLOCK_MONOTONIC, &time);
 
-static gboolean changed_power_supplies (void)
-{
-    GDir *directory;
-    const gchar *file;
+    return (gint64)time.tv_sec * 1000000000 + time.tv_nsec;
+}
 
-    static gint old_num_ps = 0;
-    static gint old_total_ps = 0;
-    gint num_ps = 0;
-    gint total_ps = 0;
-    gboolean power_supplies_changed;
+static void histogram_add (struct histogram *histogram, gint64 duration)
+{
+    gint bucket = duration > 0 ? g_bit_storage ((gulong)duration) : 0;
 
-    directory = g_dir_open (SYSFS_PATH, 0, NULL);
-    if (directory != NULL) {
-        file = g_dir_read_name (directory);
-        while (file != NULL) {
-            if (ac_path != NULL && g_str_has_suffix (ac_path, file) == TRUE) {
-                num_ps++;
-            }
+    histogram->buckets[MIN (bucket, PROFILE_BUCKETS - 1)]++;
+    histogram->count++;
+    histogram->sum += duration;
+    histogram->max  = MAX (histogram->max, duration);
+}
 
-            if (battery_path != NULL && g_str_has_suffix (battery_path, file) == TRUE) {
-                num_ps++;
-            }
+static void profile_add (gint phase, gint64 start)
+{
+    histogram_add (&profile.phases[phase], profile_get_time () - start);
+}
 
-            total_ps++;
+static void profile_add_attribute (const gchar *attribute, gint64 start)
+{
+    gint64 duration = profile_get_time () - start;
+    gint i;
 
-            file = g_dir_read_name (directory);
+    for (i = 0; i < profile.num_attributes; i++) {
+        if (strcmp (profile.attribute_names[i], attribute) == 0) {
+            break;
         }
-
-        g_dir_close (directory);
     }
 
-    power_supplies_changed = (num_ps != old_num_ps) || (total_ps != old_total_ps);
+    if (i == profile.num_attributes) {
+        if (i == PROFILE_MAX_ATTRIBUTES) {
+            return;
+        }
 
-    if (configuration.debug_output == TRUE && power_supplies_changed == TRUE) {
-        g_printf ("power supplies changed: old total/num ps=%d/%d, new total/num ps=%d/%d\n",
-            old_total_ps, old_num_ps, total_ps, num_ps);
+        profile.attribute_names[i] = g_intern_string (attribute);
+        profile.num_attributes++;
     }
 
-    old_num_ps = num_ps;
-    old_total_ps = total_ps;
-
-    if (power_supplies_changed) {
+    histogram_add (&profile.attributes[i], duration);
+}
 
-        /* redetect power supply paths */
+static void profile_add_tick (gint64 start, gint update_interval)
+{
+    gint64 interval = (gint64)update_interval * 1000000000;
 
-        gchar *old_battery_path = battery_path; battery_path = NULL;
-        gchar *old_ac_path = ac_path; ac_path = NULL;
+    /* a tick that starts well after its due time means the main loop stalled, */
+    /* a tick that lasts longer than the update interval is an overrun         */
 
-        get_power_supplies ();
-        power_supplies_changed =
-            (g_strcmp0 (battery_path, old_battery_path) != 0) ||
-            (g_strcmp0 (ac_path, old_ac_path) != 0);
+    if (profile.last_tick != 0 && start - profile.last_tick > interval + interval / 2) {
+        profile.stalls++;
+    }
 
-        g_free (old_battery_path);
-        g_free (old_ac_path);
+    if (profile_get_time () - start > interval) {
+        profile.overruns++;
     }
 
-    return power_supplies_changed;
+    profile.last_tick = start;
+    profile_add (PROFILE_TICK, start);
 }
 
-static void get_power_supplies (void)
+static gint64 histogram_get_percentile (const struct histogram *histogram, gdouble percentile)
 {
-    GError *error = NULL;
-
-    GDir *directory;
-    const gchar *file;
-    gchar *path;
-    gchar *sysattr_value;
-    gboolean sysattr_status;
+    guint64 rank = (guint64)ceil (histogram->count * percentile), total = 0;
 
-    /* reset power supplies information */
-
-    g_free (battery_path); battery_path = NULL;
-    g_free (ac_path); ac_path = NULL;
+    for (gint bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        total += histogram->buckets[bucket];
+        if (total >= rank) {
+            return MIN ((gint64)1 << bucket, histogram->max); /* bucket upper bound */
+        }
+    }
 
-    /* retrieve power supplies information */
+    return histogram->max;
+}
 
-    directory = g_dir_open (SYSFS_PATH, 0, &error);
-    if (directory != NULL) {
-        file = g_dir_read_name (directory);
-        while (file != NULL) {
-            path = g_build_filename (SYSFS_PATH, file, NULL);
-            sysattr_status = get_sysattr_string (path, "type", &sysattr_value);
-            if (sysattr_status == TRUE) {
-
-                /* process battery */
-
-                if (g_str_has_prefix (sysattr_value, "Battery") == TRUE &&
-                    get_battery_present (path, NULL) == TRUE) {
-                    if (configuration.list_power_supplies == TRUE) {
-                        gchar *power_supply_id = g_path_get_basename (path);
-                        g_print (_("type: %-*.*s\tid: %-*.*s\tpath: %s\n"), 12, 12, _("Battery"), 12, 12, power_supply_id, path);
-                        g_free (power_supply_id);
-                    }
-
-                    if (battery_path == NULL) {
-                        if (battery_suffix == NULL ||
-                            g_str_has_suffix (path, battery_suffix) == TRUE) {
-                            battery_path = g_strdup (path);
-
-                            if (configuration.debug_output == TRUE) {
-                                g_printf ("battery path: %s\n", battery_path);
-                            }
-                        }
-                    }
-                }
+static void histogram_print (const gchar *name, const struct histogram *histogram)
+{
+    if (histogram->count == 0) {
+        return;
+    }
 
-                /* process AC */
+    g_printerr ("%-24s %8" G_GUINT64_FORMAT " %10.1f %10.1f %10.1f %10.1f ", name, histogram->count,
+        (gdouble)histogram->sum / histogram->count / 1000.0,
+        (gdouble)histogram_get_percentile (histogram, 0.5) / 1000.0,
+        (gdouble)histogram_get_percentile (histogram, 0.99) / 1000.0,
+        (gdouble)histogram->max / 1000.0);
 
-                if (g_str_has_prefix (sysattr_value, "Mains") == TRUE &&
-                    get_ac_online (path, NULL) == TRUE) {
-                    if (configuration.list_power_supplies == TRUE) {
-                        gchar *power_supply_id = g_path_get_basename (path);
-                        g_print (_("type: %-*.*s\tid: %-*.*s\tpath: %s\n"), 12, 12, _("AC"), 12, 12, power_supply_id, path);
-                        g_free (power_supply_id);
-                    }
+    for (gint bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        if (histogram->buckets[bucket] > 0) {
+            g_printerr (" <%gus:%" G_GUINT64_FORMAT, (gdouble)((gint64)1 << bucket) / 1000.0, histogram->buckets[bucket]);
+        }
+    }
 
-                    if (ac_path == NULL) {
-                        ac_path = g_strdup (path);
+    g_printerr ("\n");
+}
 
-                        if (configuration.debug_output == TRUE) {
-                            g_printf ("ac path: %s\n", ac_path);
-                        }
-                    }
-                }
+static void profile_print (void)
+{
+    g_printerr ("%-24s %8s %10s %10s %10s %10s  %s\n", "phase (us)", "count", "mean", "p50", "p99", "max", "histogram");
 
-                g_free (sysattr_value);
-            }
+    for (gint phase = 0; phase < PROFILE_PHASES; phase++) {
+        histogram_print (profile_phase_names[phase], &profile.phases[phase]);
+    }
 
-            g_free (path);
-            file = g_dir_read_name (directory);
-        }
+    for (gint i = 0; i < profile.num_attributes; i++) {
+        gchar *name = g_strconcat ("read ", profile.attribute_names[i], NULL);
 
-        g_dir_close (directory);
-    } else {
-        g_printerr (_("Cannot open sysfs directory: %s (%s)\n"), SYSFS_PATH, error->message);
-        g_error_free (error); error = NULL;
-        return;
+        histogram_print (name, &profile.attributes[i]);
+        g_free (name);
     }
 
-    if (configuration.list_power_supplies == FALSE && battery_path == NULL) {
-        if (battery_suffix != NULL) {
-            g_printerr (_("No battery with suffix %s found!\n"), battery_suffix);
-            return;
-        }
+    g_printerr ("main loop stalls: %" G_GUINT64_FORMAT ", update interval overruns: %" G_GUINT64_FORMAT "\n",
+        profile.stalls, profile.overruns);
 
-        if (ac_path == NULL) {
-            g_printerr (_("No battery nor AC power supply found!\n"));
-            return;
-        }
-    }
+    wakeup_print ();
 }
 
-static gboolean get_sysattr_string (const gchar *path, const gchar *attribute, gchar **value)
+static gboolean on_profile_signal (gpointer user_data)
 {
-    gchar *sysattr_filename;
-    gboolean sysattr_status;
+    wakeup_claim (WAKEUP_OTHER);
 
-    g_return_val_if_fail (path != NULL, FALSE);
-    g_return_val_if_fail (attribute != NULL, FALSE);
-    g_return_val_if_fail (value != NULL, FALSE);
-
-    sysattr_filename = g_build_filename (path, attribute, NULL);
-    sysattr_status = g_file_get_contents (sysattr_filename, value, NULL, NULL);
-    g_free (sysattr_filename);
+    profile_print ();
 
-    return sysattr_status;
+    return G_SOURCE_CONTINUE;
 }
 
-static gboolean get_sysattr_double (const gchar *path, const gchar *attribute, gdouble *value)
+static gboolean on_exit_signal (gpointer user_data)
 {
-    gchar *sysattr_filename, *sysattr_value;
-    gboolean sysattr_status;
+    wakeup_claim (WAKEUP_OTHER);
 
-    g_return_val_if_fail (path != NULL, FALSE);
-    g_return_val_if_fail (attribute != NULL, FALSE);
-
-    sysattr_filename = g_build_filename (path, attribute, NULL);
-    sysattr_status = g_file_get_contents (sysattr_filename, &sysattr_value, NULL, NULL);
-    g_free (sysattr_filename);
+    if (configuration.print_profile == TRUE) {
+        profile_print ();
+    }
 
-    if (sysattr_status == TRUE) {
-        gdouble double_value = g_ascii_strtod (sysattr_value, NULL);
+    if (configuration.dump_events == TRUE) {
+        ring_dump (TRUE);
+    }
 
-        if (errno != 0 || double_value < 0.01) {
-            sysattr_status = FALSE;
-        }
+    if (configuration.metrics_socket != NULL) {
+        metrics_stop_socket (configuration.metrics_socket);
+    }
 
-        if (value != NULL) {
-            *value = double_value;
-        }
+    unload_plugins ();
 
-        g_free (sysattr_value);
+    if (backend != NULL) {
+        TOOLKIT_MAIN_QUIT ();
     }
 
-    return sysattr_status;
+    return G_SOURCE_REMOVE;
 }
 
-static gboolean get_ac_online (const gchar *path, gboolean *online)
-{
-    gchar *sysattr_value;
-    gboolean sysattr_status;
+/*
+ * record and replay (see trace.h for the file format, trace.c for the reads)
+ */
+
+static struct {
+    FILE                *file;
+    GHashTable          *keys;
+    gint64               start_time;
+    gint64               last_time;
+
+    struct trace_reader  reader;
+    guint                unmatched_reads;
+    gint64               virtual_time;
+} trace;
+
+#define REPLAYING (trace.reader.records != NULL)
+
+static void trace_write_varint (guint64 value)
+{
+    do {
+        guchar byte = value & 0x7f;
+
+        value >>= 7;
+        fputc (value != 0 ? byte | 0x80 : byte, trace.file);
+    } while (value != 0);
+}
+
+static void trace_write_string (const gchar *string)
+{
+    gsize length = string != NULL ? strlen (string) : 0;
+
+    trace_write_varint (length);
+    fwrite (string, 1, length, trace.file);
+}
+
+static void trace_write_header (gint type)
+{
+    gint64 time = get_boot_time () - trace.start_time;
+
+    trace_write_varint (type);
+    trace_write_varint (time - trace.last_time);
+    trace.last_time = time;
+}
+
+static gboolean trace_start_recording (const gchar *filename)
+{
+    trace.file = g_fopen (filename, "wbe");
+    if (trace.file == NULL) {
+        g_printerr (_("Cannot open trace file: %s (%s)\n"), filename, g_strerror (errno));
+        return FALSE;
+    }
+
+    /* spawned commands must not inherit it */
+
+    fcntl (fileno (trace.file), F_SETFD, FD_CLOEXEC);
+
+    trace.keys       = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    trace.start_time = get_boot_time ();
+    trace.last_time  = 0;
+
+    fwrite (TRACE_MAGIC, 1, TRACE_MAGIC_LTH, trace.file);
+
+    return TRUE;
+}
+
+static void trace_record (gint type, const gchar *key, gboolean status, const gchar *value)
+{
+    guint index;
+
+    if (trace.file == NULL) {
+        return;
+    }
+
+    if (type == TRACE_RECORD_TICK) {
+        trace_write_header (type);
+        return;
+    }
+
+    if (type == TRACE_RECORD_SLEEP) {
+        trace_write_header (type);
+        trace_write_varint (status == TRUE ? 1 : 0);
+        return;
+    }
+
+    index = GPOINTER_TO_UINT (g_hash_table_lookup (trace.keys, key));
+    if (index == 0) {
+        index = g_hash_table_size (trace.keys) + 1;
+        g_hash_table_insert (trace.keys, g_strdup (key), GUINT_TO_POINTER (index));
+
+        trace_write_header (TRACE_RECORD_KEY);
+        trace_write_string (key);
+    }
+
+    trace_write_header (type);
+    trace_write_varint (index - 1);
+    trace_write_varint (status == TRUE ? 1 : 0);
+    trace_write_string (status == TRUE ? value : NULL);
+}
+
+static gboolean trace_replay (gint type, const gchar *key, gboolean *status, gchar **value)
+{
+    if (trace_reader_take (&trace.reader, type, key, status, value) == TRUE) {
+        return TRUE;
+    }
+
+    trace.unmatched_reads++;
+    replay_log ("unmatched read: %s", key);
+
+    return FALSE;
+}
+
+static gboolean replay_trace (const gchar *filename)
+{
+    guint ticks = 0, unused_records = 0;
+
+    if (trace_reader_load (&trace.reader, filename) == FALSE) {
+        return FALSE;
+    }
+
+    /* keep replayed runs out of the system log */
+
+    setlogmask (LOG_MASK (LOG_EMERG));
+
+    get_power_supplies ();
+
+    while (trace.reader.cursor < trace.reader.records->len) {
+        struct trace_record *record = &g_array_index (trace.reader.records, struct trace_record, trace.reader.cursor++);
+
+        if (record->consumed == TRUE) {
+            continue;
+        }
+
+        if (record->type == TRACE_RECORD_TICK) {
+            gint64 profile_start = profile_get_time ();
+
+            trace.virtual_time = record->time;
+            ticks++;
+
+            update_tray_icon_status (NULL);
+            profile_add (PROFILE_TICK, profile_start);
+
+            if (configuration.debug_output == TRUE) {
+                ring_dump (FALSE);
+            }
+        } else if (record->type == TRACE_RECORD_SLEEP) {
+            trace.virtual_time = record->time;
+
+            replay_log ("%s", record->status == TRUE ? "suspend" : "resume");
+            sleep_flush (record->status);
+        } else {
+            unused_records++;
+        }
+    }
+
+    g_printerr ("replayed %u ticks, %u unmatched reads, %u unused records\n", ticks, trace.unmatched_reads, unused_records);
+
+    if (configuration.print_profile == TRUE) {
+        profile_print ();
+    }
+
+    if (configuration.dump_events == TRUE) {
+        ring_dump (TRUE);
+    }
+
+    return TRUE;
+}
+
+static void replay_log (const gchar *format, ...)
+{
+    va_list args;
+
+    g_print ("%5" G_GINT64_FORMAT ".%03d ", trace.virtual_time / G_USEC_PER_SEC,
+        (gint)(trace.virtual_time % G_USEC_PER_SEC / 1000));
+
+    va_start (args, format);
+    g_vprintf (format, args);
+    va_end (args);
+
+    g_print ("\n");
+}
+
+static void get_clock_time (struct timespec *time)
+{
+    if (REPLAYING) {
+        time->tv_sec  = trace.virtual_time / G_USEC_PER_SEC;
+        time->tv_nsec = trace.virtual_time % G_USEC_PER_SEC * 1000;
+        return;
+    }
+
+    clock_gettime (CLOCK_BOOTTIME, time);
+}
+
+static gint64 get_boot_time (void)
+{
+    struct timespec time;
+
+    clock_gettime (CLOCK_BOOTTIME, &time);
+
+    return (gint64)time.tv_sec * G_USEC_PER_SEC + time.tv_nsec / 1000;
+}
+
+/*
+ * event ring
+ *
+ * Debug events are written as compact binary records (event id, timestamp
+ * and a few numeric arguments) into a fixed size ring and only formatted
+ * when the ring is dumped: after each tick with --debug, on SIGUSR2, and on
+ * exit with --trace-dump. Writers reserve a slot with an atomic increment
+ * and publish it with its sequence number, so logging never blocks and a
+ * dump skips slots that are being written.
+ */
+#define EVENT_RING_SIZE 2048 /* power of two */
+#define EVENT_ARGS      4
+
+enum {
+    EVENT_TICK = 1,
+    EVENT_SUPPLIES_CHANGED,
+    EVENT_AC_ONLINE,
+    EVENT_BATTERY_PRESENT,
+    EVENT_BATTERY_STATUS,
+    EVENT_CAPACITY_RATE,
+    EVENT_CURRENT_RATE,
+    EVENT_UNAVAILABLE,
+    EVENT_TOOLTIP,
+    EVENT_BATTERY_STRING,
+    EVENT_TIME_STRING,
+    EVENT_ICON_NAME,
+    EVENT_BATTERIES,
+    EVENT_DEVICE,
+    EVENT_STATUS_FLAP,
+    EVENT_CHILD_EXIT,
+    EVENT_SLEEP,
+    EVENT_SPAWN_REJECTED
+};
+
+struct ring_event {
+    gint         sequence;
+    gint         id;
+    gint64       time;
+    const gchar *label;  /* static string only */
+    gdouble      args[EVENT_ARGS];
+};
+
+static struct {
+    struct ring_event events[EVENT_RING_SIZE];
+    gint              head;
+    gint              dumped;
+    gboolean          dumping;
+} ring;
+
+#define LOG_EVENT(id, label, a, b, c, d) ring_log_event (id, label, a, b, c, d)
+
+static void ring_log_event (gint id, const gchar *label, gdouble a, gdouble b, gdouble c, gdouble d)
+{
+    gint sequence;
+    struct ring_event *event;
+
+    if (ring.dumping == TRUE) {
+        return;
+    }
+
+    sequence = g_atomic_int_add (&ring.head, 1);
+    event = &ring.events[sequence & (EVENT_RING_SIZE - 1)];
+
+    g_atomic_int_set (&event->sequence, 0);
+
+    event->id      = id;
+    event->time    = REPLAYING ? trace.virtual_time : g_get_monotonic_time ();
+    event->label   = label;
+    event->args[0] = a;
+    event->args[1] = b;
+    event->args[2] = c;
+    event->args[3] = d;
+
+    g_atomic_int_set (&event->sequence, sequence + 1);
+}
+
+static const gchar* get_status_name (gint status)
+{
+    static const gchar *status_names[] = {
+        "missing", "unknown", "charged", "charging", "discharging", "not charging", "low level", "critical level"
+    };
+
+    return status >= 0 && status < (gint)G_N_ELEMENTS (status_names) ? status_names[status] : "invalid";
+}
+
+static void ring_print_event (const struct ring_event *event)
+{
+    const gdouble *args = event->args;
+
+    g_printf ("%5" G_GINT64_FORMAT ".%06d ", event->time / G_USEC_PER_SEC, (gint)(event->time % G_USEC_PER_SEC));
+
+    switch (event->id) {
+        case EVENT_TICK:
+            g_printf ("tick\n");
+            break;
+
+        case EVENT_SUPPLIES_CHANGED:
+            g_printf ("power supplies changed: old total/num ps=%d/%d, new total/num ps=%d/%d\n",
+                (gint)args[0], (gint)args[1], (gint)args[2], (gint)args[3]);
+            break;
+
+        case EVENT_AC_ONLINE:
+            g_printf ("ac online: %d\n", (gint)args[0]);
+            break;
+
+        case EVENT_BATTERY_PRESENT:
+            g_printf ("battery present: %d\n", (gint)args[0]);
+            break;
+
+        case EVENT_BATTERY_STATUS:
+            g_printf ("battery status: %d - %s\n", (gint)args[0], get_status_name ((gint)args[0]));
+            break;
+
+        case EVENT_CAPACITY_RATE:
+            g_printf ("estimate %s from delta of %g over %g seconds\n", event->label, args[0], args[1]);
+            break;
+
+        case EVENT_CURRENT_RATE:
+            g_printf ("%s = %g, average = %g\n", event->label, args[0], args[1]);
+            break;
+
+        case EVENT_UNAVAILABLE:
+            g_printf ("%s: unavailable\n", event->label);
+            break;
+
+        case EVENT_TOOLTIP:
+            g_printf ("tooltip: %s\n", (gint)args[0] == 2 ? "battery and time strings" : "battery string");
+            break;
+
+        /* only the recorded arguments are printed: building the strings again */
+        /* would overwrite the buffers of the update and count in its profile  */
+
+        case EVENT_BATTERY_STRING:
+            g_printf ("battery string: %s, %d%%\n", get_status_name ((gint)args[0]), (gint)args[1]);
+            break;
+
+        case EVENT_TIME_STRING:
+            g_printf ("time string: %d minutes\n", (gint)args[0]);
+            break;
+
+        case EVENT_ICON_NAME:
+            g_printf ("icon name: %s, %d%%\n", get_status_name ((gint)args[0]), (gint)args[1]);
+            break;
+
+        case EVENT_BATTERIES:
+            g_printf ("batteries: %d read, remaining = %g, full = %g, rate = %g\n", (gint)args[0], args[1], args[2], args[3]);
+            break;
+
+        case EVENT_DEVICE:
+            g_printf ("device %d: status %s, %d%%\n", (gint)args[0], get_status_name ((gint)args[1]), (gint)args[2]);
+            break;
+
+        case EVENT_STATUS_FLAP:
+            g_printf ("status flap: %s for %d s, kept %s\n", get_status_name ((gint)args[0]), (gint)args[2], get_status_name ((gint)args[1]));
+            break;
+
+        case EVENT_CHILD_EXIT:
+            g_printf ("command %d (pid %d) exited: %d after %.1f s\n", (gint)args[0], (gint)args[1], (gint)args[2], args[3]);
+            break;
+
+        case EVENT_SLEEP:
+            g_printf ("%s: filters flushed, attributes reopened\n", (gint)args[0] == 1 ? "suspend" : "resume");
+            break;
+
+        case EVENT_SPAWN_REJECTED:
+            g_printf ("command %d not spawned: %d already running\n", (gint)args[0], (gint)args[1]);
+            break;
+
+        default:
+            g_printf ("unknown event %d\n", event->id);
+            break;
+    }
+}
+
+static void ring_dump (gboolean all)
+{
+    gint head = g_atomic_int_get (&ring.head);
+    gint first = MAX (all == TRUE ? 0 : ring.dumped, head - EVENT_RING_SIZE);
+
+    ring.dumping = TRUE;
+
+    for (gint sequence = first; sequence < head; sequence++) {
+        const struct ring_event *event = &ring.events[sequence & (EVENT_RING_SIZE - 1)];
+
+        if (g_atomic_int_get (&event->sequence) == sequence + 1) {
+            ring_print_event (event);
+        }
+    }
+
+    ring.dumped  = head;
+    ring.dumping = FALSE;
+}
+
+static gboolean on_ring_signal (gpointer user_data)
+{
+    wakeup_claim (WAKEUP_OTHER);
+
+    ring_dump (TRUE);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * metrics exporter
+ *
+ * The values computed by each tick are kept as gauges and exported, with a
+ * few counters and the tick profiling histograms, in the Prometheus text
+ * format: to the clients of the --metrics-socket Unix socket (as an HTTP
+ * response if they send a GET request, as plain text otherwise) and into
+ * the --metrics-file textfile after each tick. Exporting never reads sysfs.
+ */
+#define METRICS_FIRST_BUCKET    10 /* 1.024us */
+#define METRICS_REQUEST_LTH     1024
+#define METRICS_REQUEST_TIMEOUT 5
+
+static struct {
+    gint     status;             /* -1 when unknown */
+    gint     percentage;         /* -1 when unknown */
+    gint     time;               /* -1 when unknown */
+    gint     ac_online;          /* -1 when unknown */
+    gboolean use_charge;
+    gdouble  full_capacity;      /* -1 when unknown */
+    gdouble  remaining_capacity; /* -1 when unknown */
+    gdouble  current_rate;       /* -1 when unknown */
+    guint64  read_errors;
+    guint64  notifications;
+    guint64  spawns;
+    guint64  spawn_errors;
+    guint64  spawn_timeouts;
+    guint64  rediscoveries;
+    guint64  status_flaps;
+    guint64  resumes;
+    gint     socket_fd;
+    gboolean file_failed;
+} metrics = {
+    -1,
+    -1,
+    -1,
+    -1,
+    FALSE,
+    -1,
+    -1,
+    -1,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    -1,
+    FALSE
+};
+
+struct metrics_request {
+    gint   fd;
+    guint  source;
+    guint  timeout;
+    gchar  data[METRICS_REQUEST_LTH];
+    gsize  length;
+    gchar *response;
+    gsize  response_length;
+    gsize  sent;
+};
+
+static void metrics_update_battery (gint status, gint percentage, gint time)
+{
+    metrics.status     = status;
+    metrics.percentage = status == MISSING || status == UNKNOWN ? -1 : percentage;
+    metrics.time       = time;
+
+    /* the AC state follows from the battery status when it is not read */
+
+    if (status == CHARGING || status == CHARGED || status == NOT_CHARGING) {
+        metrics.ac_online = TRUE;
+    } else if (status == DISCHARGING) {
+        metrics.ac_online = FALSE;
+    }
+}
+
+static void metrics_append_header (GString *out, const gchar *name, const gchar *type, const gchar *help)
+{
+    g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_append_sample (GString *out, const gchar *name, const gchar *labels, gdouble value)
+{
+    gchar buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+    /* g_ascii_formatd is locale independent, unlike printf */
+
+    g_string_append_printf (out, "%s%s%s%s %s\n", name,
+        labels != NULL ? "{" : "", labels != NULL ? labels : "", labels != NULL ? "}" : "",
+        g_ascii_formatd (buffer, sizeof (buffer), "%.15g", value));
+}
+
+static void metrics_append_gauge (GString *out, const gchar *name, const gchar *help, gdouble value)
+{
+    if (value < 0) {
+        return;
+    }
+
+    metrics_append_header (out, name, "gauge", help);
+    metrics_append_sample (out, name, NULL, value);
+}
+
+static void metrics_append_counter (GString *out, const gchar *name, const gchar *help, guint64 value)
+{
+    metrics_append_header (out, name, "counter", help);
+    metrics_append_sample (out, name, NULL, (gdouble)value);
+}
+
+static void metrics_append_histogram (GString *out, const gchar *name, const gchar *label, const gchar *value, const struct histogram *histogram)
+{
+    gchar bucket_name[STR_LTH], labels[STR_LTH], bound[G_ASCII_DTOSTR_BUF_SIZE];
+    guint64 total = 0;
+
+    /* profiling buckets hold durations below 2^bucket ns, the last one is unbounded */
+
+    g_snprintf (bucket_name, STR_LTH, "%s_bucket", name);
+
+    for (gint bucket = 0; bucket < PROFILE_BUCKETS - 1; bucket++) {
+        total += histogram->buckets[bucket];
+
+        if (bucket >= METRICS_FIRST_BUCKET && (bucket - METRICS_FIRST_BUCKET) % 2 == 0) {
+            g_snprintf (labels, STR_LTH, "%s=\"%s\",le=\"%s\"", label, value,
+                g_ascii_formatd (bound, sizeof (bound), "%.15g", (gdouble)((gint64)1 << bucket) / 1e9));
+            metrics_append_sample (out, bucket_name, labels, (gdouble)total);
+        }
+    }
+
+    g_snprintf (labels, STR_LTH, "%s=\"%s\",le=\"+Inf\"", label, value);
+    metrics_append_sample (out, bucket_name, labels, (gdouble)histogram->count);
+
+    g_snprintf (labels, STR_LTH, "%s=\"%s\"", label, value);
+    g_snprintf (bucket_name, STR_LTH, "%s_sum", name);
+    metrics_append_sample (out, bucket_name, labels, (gdouble)histogram->sum / 1e9);
+    g_snprintf (bucket_name, STR_LTH, "%s_count", name);
+    metrics_append_sample (out, bucket_name, labels, (gdouble)histogram->count);
+}
+
+static gchar* metrics_get_text (void)
+{
+    GString *out = g_string_sized_new (16384);
+    gchar labels[STR_LTH];
+
+    /* sysfs reports energy in uWh, power in uW, charge in uAh and current in uA */
+
+    metrics_append_gauge (out, "cbatticon_battery_percent", "Battery charge in percent", metrics.percentage);
+
+    if (metrics.use_charge == FALSE) {
+        metrics_append_gauge (out, "cbatticon_battery_energy_joules", "Remaining battery energy",
+            metrics.remaining_capacity < 0 ? -1 : metrics.remaining_capacity * 3.6e-3);
+        metrics_append_gauge (out, "cbatticon_battery_energy_full_joules", "Battery energy when full",
+            metrics.full_capacity < 0 ? -1 : metrics.full_capacity * 3.6e-3);
+        metrics_append_gauge (out, "cbatticon_battery_power_watts", "Battery charge or discharge power",
+            metrics.current_rate < 0 ? -1 : metrics.current_rate * 1e-6);
+    } else {
+        metrics_append_gauge (out, "cbatticon_battery_charge_coulombs", "Remaining battery charge",
+            metrics.remaining_capacity < 0 ? -1 : metrics.remaining_capacity * 3.6e-3);
+        metrics_append_gauge (out, "cbatticon_battery_charge_full_coulombs", "Battery charge when full",
+            metrics.full_capacity < 0 ? -1 : metrics.full_capacity * 3.6e-3);
+        metrics_append_gauge (out, "cbatticon_battery_current_amperes", "Battery charge or discharge current",
+            metrics.current_rate < 0 ? -1 : metrics.current_rate * 1e-6);
+    }
+
+    metrics_append_gauge (out, "cbatticon_battery_time_seconds", "Estimated time until the battery is empty (discharging) or full (charging)",
+        metrics.time < 0 ? -1 : metrics.time * 60.0);
+    metrics_append_gauge (out, "cbatticon_ac_online", "Whether the AC power supply is online", metrics.ac_online);
+
+    if (metrics.status >= 0) {
+        metrics_append_header (out, "cbatticon_battery_status", "gauge", "Battery status");
+
+        for (gint status = MISSING; status <= NOT_CHARGING; status++) {
+            g_snprintf (labels, STR_LTH, "status=\"%s\"", get_status_name (status));
+            metrics_append_sample (out, "cbatticon_battery_status", labels, status == metrics.status ? 1 : 0);
+        }
+    }
+
+    metrics_append_counter (out, "cbatticon_ticks_total", "Battery status updates", profile.phases[PROFILE_TICK].count);
+    metrics_append_counter (out, "cbatticon_sysfs_read_errors_total", "Failed sysfs attribute reads", metrics.read_errors);
+    metrics_append_counter (out, "cbatticon_notifications_total", "Notifications shown", metrics.notifications);
+    metrics_append_counter (out, "cbatticon_commands_spawned_total", "Commands spawned", metrics.spawns);
+    metrics_append_counter (out, "cbatticon_command_spawn_errors_total", "Commands that could not be spawned", metrics.spawn_errors);
+    metrics_append_counter (out, "cbatticon_command_timeouts_total", "Commands terminated after their timeout", metrics.spawn_timeouts);
+    metrics_append_counter (out, "cbatticon_power_supply_rediscoveries_total", "Power supply rediscoveries", metrics.rediscoveries);
+    metrics_append_counter (out, "cbatticon_status_flaps_total", "Status changes that did not last the dwell time", metrics.status_flaps);
+    metrics_append_counter (out, "cbatticon_resumes_total", "Resumes from suspend", metrics.resumes);
+    metrics_append_counter (out, "cbatticon_main_loop_stalls_total", "Updates started well after their due time", profile.stalls);
+    metrics_append_counter (out, "cbatticon_update_overruns_total", "Updates that lasted longer than the update interval", profile.overruns);
+
+    metrics_append_header (out, "cbatticon_wakeups_total", "counter", "Main loop wakeups by source");
+    for (gint source = 0; source < WAKEUP_SOURCES; source++) {
+        g_snprintf (labels, STR_LTH, "source=\"%s\"", wakeup_source_names[source]);
+        metrics_append_sample (out, "cbatticon_wakeups_total", labels, (gdouble)wakeups.counts[source]);
+    }
+
+    metrics_append_header (out, "cbatticon_phase_duration_seconds", "histogram", "Duration of each update phase");
+    for (gint phase = 0; phase < PROFILE_PHASES; phase++) {
+        metrics_append_histogram (out, "cbatticon_phase_duration_seconds", "phase", profile_phase_names[phase], &profile.phases[phase]);
+    }
+
+    metrics_append_header (out, "cbatticon_sysfs_read_duration_seconds", "histogram", "Duration of each sysfs attribute read");
+    for (gint i = 0; i < profile.num_attributes; i++) {
+        metrics_append_histogram (out, "cbatticon_sysfs_read_duration_seconds", "attribute", profile.attribute_names[i], &profile.attributes[i]);
+    }
+
+    return g_string_free (out, FALSE);
+}
+
+static void metrics_write_file (const gchar *filename)
+{
+    GError *error = NULL;
+    gchar *text = metrics_get_text ();
+
+    /* g_file_set_contents replaces the file atomically, collectors never see a partial file */
+
+    if (g_file_set_contents (filename, text, -1, &error) == FALSE) {
+        if (metrics.file_failed == FALSE) {
+            g_printerr (_("Cannot write metrics file: %s\n"), error->message);
+        }
+
+        metrics.file_failed = TRUE;
+        g_error_free (error); error = NULL;
+    } else {
+        metrics.file_failed = FALSE;
+    }
+
+    g_free (text);
+}
+
+/* sends what the socket takes without blocking; TRUE once the response */
+/* is sent or cannot be, FALSE when the rest must wait for the client   */
+
+static gboolean metrics_send (struct metrics_request *request)
+{
+    while (request->sent < request->response_length) {
+        ssize_t sent = send (request->fd, request->response + request->sent,
+                             request->response_length - request->sent, MSG_NOSIGNAL);
+
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno != EAGAIN && errno != EWOULDBLOCK;
+        }
+
+        request->sent += sent;
+    }
+
+    return TRUE;
+}
+
+static void metrics_close_request (struct metrics_request *request)
+{
+    toolkit_source_remove (request->source);
+    toolkit_source_remove (request->timeout);
+    close (request->fd);
+    g_free (request->response);
+    g_free (request);
+}
+
+static gboolean on_metrics_response (gint fd, GIOCondition condition, gpointer user_data)
+{
+    struct metrics_request *request = (struct metrics_request *)user_data;
+
+    wakeup_claim (WAKEUP_OTHER);
+
+    if (metrics_send (request) == FALSE) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    metrics_close_request (request);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* a slow client never holds the main loop: the rest of the response is sent */
+/* whenever its socket can take more, until the request timeout closes it    */
+
+static gboolean metrics_answer_request (struct metrics_request *request)
+{
+    gchar *text = metrics_get_text ();
+
+    if (g_str_has_prefix (request->data, "GET ") == TRUE) {
+        request->response = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+                                             "Content-Type: text/plain; version=0.0.4\r\n"
+                                             "Content-Length: %" G_GSIZE_FORMAT "\r\n"
+                                             "Connection: close\r\n\r\n%s", strlen (text), text);
+        g_free (text);
+    } else {
+        request->response = text;
+    }
+
+    request->response_length = strlen (request->response);
+
+    if (metrics_send (request) == TRUE) {
+        return TRUE;
+    }
+
+    toolkit_source_remove (request->source);
+    request->source = toolkit_fd_add (request->fd, (GIOCondition)(G_IO_OUT | G_IO_HUP | G_IO_ERR), on_metrics_response, request);
+
+    return FALSE;
+}
+
+static gboolean on_metrics_request (gint fd, GIOCondition condition, gpointer user_data)
+{
+    struct metrics_request *request = (struct metrics_request *)user_data;
+    ssize_t length = recv (fd, request->data + request->length, METRICS_REQUEST_LTH - 1 - request->length, 0);
+
+    wakeup_claim (WAKEUP_OTHER);
+
+    if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (length > 0) {
+        request->length += length;
+        request->data[request->length] = '\0';
+
+        /* an HTTP request is answered once its headers are complete, anything else right away */
+
+        if (g_str_has_prefix (request->data, "GET ") == TRUE &&
+            strstr (request->data, "\r\n\r\n") == NULL && strstr (request->data, "\n\n") == NULL &&
+            request->length < METRICS_REQUEST_LTH - 1) {
+            return G_SOURCE_CONTINUE;
+        }
+    }
+
+    if (length >= 0 && metrics_answer_request (request) == FALSE) {
+        return G_SOURCE_REMOVE;
+    }
+
+    metrics_close_request (request);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_metrics_request_timeout (gpointer user_data)
+{
+    wakeup_claim (WAKEUP_TIMER);
+
+    metrics_close_request ((struct metrics_request *)user_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_metrics_connection (gint fd, GIOCondition condition, gpointer user_data)
+{
+    struct metrics_request *request;
+    gint client_fd = accept (fd, NULL, NULL);
+
+    wakeup_claim (WAKEUP_OTHER);
+
+    if (client_fd < 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    g_unix_set_fd_nonblocking (client_fd, TRUE, NULL);
+    fcntl (client_fd, F_SETFD, FD_CLOEXEC);
+
+    request = g_new0 (struct metrics_request, 1);
+    request->fd      = client_fd;
+    request->source  = toolkit_fd_add (client_fd, (GIOCondition)(G_IO_IN | G_IO_HUP | G_IO_ERR), on_metrics_request, request);
+    request->timeout = toolkit_timeout_add (METRICS_REQUEST_TIMEOUT, on_metrics_request_timeout, request);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean metrics_start_socket (const gchar *path)
+{
+    struct sockaddr_un address;
+    gint fd;
+
+    if (strlen (path) >= sizeof (address.sun_path)) {
+        g_printerr (_("Metrics socket path is too long: %s\n"), path);
+        return FALSE;
+    }
+
+    memset (&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    g_strlcpy (address.sun_path, path, sizeof (address.sun_path));
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        g_printerr (_("Cannot create metrics socket: %s\n"), g_strerror (errno));
+        return FALSE;
+    }
+
+    /* remove the socket left by a previous instance, unless it is still served */
+
+    if (connect (fd, (struct sockaddr *)&address, sizeof (address)) == 0) {
+        g_printerr (_("Metrics socket is already in use: %s\n"), path);
+        close (fd);
+        return FALSE;
+    }
+
+    if (errno == ECONNREFUSED) {
+        g_unlink (path);
+    }
+
+    close (fd);
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0 || bind (fd, (struct sockaddr *)&address, sizeof (address)) != 0 || listen (fd, 8) != 0) {
+        g_printerr (_("Cannot create metrics socket: %s (%s)\n"), path, g_strerror (errno));
+
+        if (fd >= 0) {
+            close (fd);
+        }
+
+        return FALSE;
+    }
+
+    metrics.socket_fd = fd;
+
+    return TRUE;
+}
+
+/* watched once the toolkit is loaded, so that it runs in its main loop */
+
+static void metrics_watch_socket (void)
+{
+    if (metrics.socket_fd >= 0) {
+        toolkit_fd_add (metrics.socket_fd, G_IO_IN, on_metrics_connection, NULL);
+    }
+}
+
+static void metrics_stop_socket (const gchar *path)
+{
+    if (metrics.socket_fd >= 0) {
+        close (metrics.socket_fd);
+        g_unlink (path);
+
+        metrics.socket_fd = -1;
+    }
+}
+
+/*
+ * battery context
+ *
+ * The discovery, the battery reads, their aggregation, the rate filters and
+ * the estimation are done by libcbatticon. Its context reads through
+ * get_sysattr_string and lists through get_power_supply_names, so that
+ * every read is still recorded, replayed and batched, and it is given the
+ * replay aware clock and the event ring.
+ */
+
+static GError *battery_list_error = NULL; /* of the last listing */
+
+static void on_battery_clock (struct timespec *time, void *user_data)
+{
+    get_clock_time (time);
+}
+
+static void on_battery_log (int event, const char *label, double a, double b, void *user_data)
+{
+    switch (event) {
+        case CBATTICON_LOG_CAPACITY_RATE:
+            LOG_EVENT (EVENT_CAPACITY_RATE, label, a, b, 0, 0);
+            break;
+
+        case CBATTICON_LOG_CURRENT_RATE:
+            LOG_EVENT (EVENT_CURRENT_RATE, label, a, b, 0, 0);
+            break;
+
+        case CBATTICON_LOG_BATTERY_PRESENT:
+            LOG_EVENT (EVENT_BATTERY_PRESENT, NULL, a, 0, 0, 0);
+            break;
+
+        case CBATTICON_LOG_BATTERY_STATUS:
+            LOG_EVENT (EVENT_BATTERY_STATUS, NULL, a, 0, 0, 0);
+            break;
+
+        case CBATTICON_LOG_AC_ONLINE:
+            LOG_EVENT (EVENT_AC_ONLINE, NULL, a, 0, 0, 0);
+            metrics.ac_online = (gint)a;
+            break;
+    }
+}
+
+static int on_battery_read (const char *path, const char *attribute, char **value, void *user_data)
+{
+    return get_sysattr_string (path, attribute, value) == TRUE ? 0 : -1;
+}
+
+static char** on_battery_list (const char *path, void *user_data)
+{
+    g_clear_error (&battery_list_error);
+
+    return get_power_supply_names (&battery_list_error);
+}
+
+static cbatticon_context* get_battery_context (void)
+{
+    static cbatticon_context *battery_context = NULL;
+
+    /* first used by the discovery, on the startup worker */
+
+    if (g_once_init_enter (&battery_context)) {
+        cbatticon_context *context = cbatticon_context_new (SYSFS_PATH, battery_suffix);
+
+        cbatticon_context_set_clock (context, on_battery_clock, NULL);
+        cbatticon_context_set_log (context, on_battery_log, NULL);
+        cbatticon_context_set_reader (context, on_battery_list, on_battery_read, NULL);
+
+        g_once_init_leave (&battery_context, context);
+    }
+
+    return battery_context;
+}
+
+/*
+ * command line options function
+ */
+
+static struct configuration configuration_defaults;
+static gchar **command_line = NULL;
+
+static void resolve_icon_type (struct configuration *config)
+{
+    if (config->icon_type_name != NULL) {
+        if (g_strcmp0 (config->icon_type_name, "standard") == 0 && HAS_STANDARD_ICON_TYPE == TRUE)
+            config->icon_type = BATTERY_ICON;
+        else if (g_strcmp0 (config->icon_type_name, "notification") == 0 && HAS_NOTIFICATION_ICON_TYPE == TRUE)
+            config->icon_type = BATTERY_ICON_NOTIFICATION;
+        else if (g_strcmp0 (config->icon_type_name, "symbolic") == 0 && HAS_SYMBOLIC_ICON_TYPE == TRUE)
+            config->icon_type = BATTERY_ICON_SYMBOLIC;
+        else g_printerr (_("Unknown icon type: %s\n"), config->icon_type_name);
+    }
+
+    if (config->icon_type == UNKNOWN_ICON) {
+        if (HAS_STANDARD_ICON_TYPE == TRUE)
+            config->icon_type = BATTERY_ICON;
+        else if (HAS_NOTIFICATION_ICON_TYPE == TRUE)
+            config->icon_type = BATTERY_ICON_NOTIFICATION;
+        else if (HAS_SYMBOLIC_ICON_TYPE == TRUE)
+            config->icon_type = BATTERY_ICON_SYMBOLIC;
+        else g_printerr (_("No icon type found!\n"));
+    }
+}
+
+static void validate_configuration (struct configuration *config)
+{
+    /* option : update interval */
+
+    if (config->update_interval <= 0) {
+        config->update_interval = DEFAULT_UPDATE_INTERVAL;
+        g_printerr (_("Invalid update interval! It has been reset to default (%d seconds)\n"), DEFAULT_UPDATE_INTERVAL);
+    }
+
+    /* option : peripheral device update interval */
+
+    if (config->device_interval < 0) {
+        config->device_interval = DEFAULT_DEVICE_INTERVAL;
+        g_printerr (_("Invalid device update interval! It has been reset to default (%d seconds)\n"), DEFAULT_DEVICE_INTERVAL);
+    }
+
+    /* option : low and critical levels */
+
+    if (config->low_level < 0 || config->low_level > 100) {
+        config->low_level = DEFAULT_LOW_LEVEL;
+        g_printerr (_("Invalid low level! It has been reset to default (%d percent)\n"), DEFAULT_LOW_LEVEL);
+    }
+
+    if (config->critical_level < 0 || config->critical_level > 100) {
+        config->critical_level = DEFAULT_CRITICAL_LEVEL;
+        g_printerr (_("Invalid critical level! It has been reset to default (%d percent)\n"), DEFAULT_CRITICAL_LEVEL);
+    }
+
+    if (config->critical_level > config->low_level) {
+        config->critical_level = DEFAULT_CRITICAL_LEVEL;
+        config->low_level = DEFAULT_LOW_LEVEL;
+        g_printerr (_("Critical level is higher than low level! They have been reset to default\n"));
+    }
+
+    /* option : status dwell time and level hysteresis */
+
+    if (config->status_dwell < 0) {
+        config->status_dwell = DEFAULT_STATUS_DWELL;
+        g_printerr (_("Invalid status dwell time! It has been reset to default (%d seconds)\n"), DEFAULT_STATUS_DWELL);
+    }
+
+    if (config->level_hysteresis < 0 || config->level_hysteresis > 100) {
+        config->level_hysteresis = DEFAULT_LEVEL_HYSTERESIS;
+        g_printerr (_("Invalid level hysteresis! It has been reset to default (%d percent)\n"), DEFAULT_LEVEL_HYSTERESIS);
+    }
+
+    /* option : command timeout and concurrency */
+
+    if (config->command_timeout < 0) {
+        config->command_timeout = 0;
+        g_printerr (_("Invalid command timeout! It has been reset to default (no limit)\n"));
+    }
+
+    if (config->command_max_running < 1) {
+        config->command_max_running = DEFAULT_COMMAND_RUNNING;
+        g_printerr (_("Invalid number of running commands! It has been reset to default (%d)\n"), DEFAULT_COMMAND_RUNNING);
+    }
+
+    /* option : battery source */
+
+    if (config->source_name == NULL || g_strcmp0 (config->source_name, "auto") == 0) {
+        config->source = SOURCE_AUTO;
+    } else if (g_strcmp0 (config->source_name, "sysfs") == 0) {
+        config->source = SOURCE_SYSFS;
+    } else if (g_strcmp0 (config->source_name, "upower") == 0) {
+        config->source = SOURCE_UPOWER;
+    } else {
+        config->source = SOURCE_AUTO;
+        g_printerr (_("Unknown battery source: %s\n"), config->source_name);
+    }
+
+    /* option : wakeup budget */
+
+    if (config->wakeup_budget < 0) {
+        config->wakeup_budget = 0;
+        g_printerr (_("Invalid wakeup budget! It has been reset to default (no limit)\n"));
+    }
+}
+
+static GOptionContext* new_option_context (struct configuration *config)
+{
+    GOptionContext *option_context;
+    GOptionEntry option_entries[] = {
+        { "version"               , 'v', 0, G_OPTION_ARG_NONE  , &config->display_version       , N_("Display the version")                                      , NULL },
+        { "debug"                 , 'd', 0, G_OPTION_ARG_NONE  , &config->debug_output          , N_("Display debug information")                                , NULL },
+        { "config"                ,  0 , 0, G_OPTION_ARG_FILENAME, &config->config_file         , N_("Read the settings from a configuration file")              , N_("FILE") },
+        { "update-interval"       , 'u', 0, G_OPTION_ARG_INT   , &config->update_interval       , N_("Set update interval (in seconds)")                         , NULL },
+        { "icon-type"             , 'i', 0, G_OPTION_ARG_STRING, &config->icon_type_name              , N_("Set icon type ('standard', 'notification' or 'symbolic')") , NULL },
+        { "toolkit"               ,  0 , 0, G_OPTION_ARG_STRING, &config->toolkit               , N_("Set the toolkit ('gtk3', 'gtk2' or 'qt6', or the file of a backend)"), N_("NAME") },
+        { "source"                ,  0 , 0, G_OPTION_ARG_STRING, &config->source_name           , N_("Set where the batteries are read ('auto', 'sysfs' or 'upower')"), N_("NAME") },
+        { "low-level"             , 'l', 0, G_OPTION_ARG_INT   , &config->low_level             , N_("Set low battery level (in percent)")                       , NULL },
+        { "critical-level"        , 'r', 0, G_OPTION_ARG_INT   , &config->critical_level        , N_("Set critical battery level (in percent)")                  , NULL },
+        { "status-dwell"          ,  0 , 0, G_OPTION_ARG_INT   , &config->status_dwell          , N_("Set how long a new battery status must last to be shown (in seconds)"), NULL },
+        { "level-hysteresis"      ,  0 , 0, G_OPTION_ARG_INT   , &config->level_hysteresis      , N_("Set how far above a level the battery must recharge to warn again (in percent)"), NULL },
+        { "rule"                  ,  0 , 0, G_OPTION_ARG_STRING_ARRAY, &config->rules           , N_("Add a level with its own urgency and command, in percent or minutes remaining (can be repeated)"), N_("LEVEL[/HYSTERESIS][:URGENCY[:COMMAND]]") },
+        { "command-low-level"     , 'o', 0, G_OPTION_ARG_STRING, &config->command_low_level     , N_("Command to execute when low battery level is reached")     , NULL },
+        { "command-critical-level", 'c', 0, G_OPTION_ARG_STRING, &config->command_critical_level, N_("Command to execute when critical battery level is reached"), NULL },
+        { "command-left-click"    , 'x', 0, G_OPTION_ARG_STRING, &config->command_left_click    , N_("Command to execute when left clicking on tray icon")       , NULL },
+        { "command-timeout"       ,  0 , 0, G_OPTION_ARG_INT   , &config->command_timeout       , N_("Terminate commands running longer than this (in seconds, 0 for no limit)"), NULL },
+        { "command-max-running"   ,  0 , 0, G_OPTION_ARG_INT   , &config->command_max_running   , N_("Set how many commands of each hook may run at once")       , NULL },
+        { "plugin"                ,  0 , 0, G_OPTION_ARG_FILENAME_ARRAY, &config->plugin_files , N_("Load an action plugin (can be repeated)")                  , N_("FILE[:ARGUMENT]") },
+#ifdef WITH_NOTIFY
+        { "hide-notification"     , 'n', 0, G_OPTION_ARG_NONE  , &config->hide_notification     , N_("Hide the notification popups")                             , NULL },
+#endif
+        { "list-icon-types"       , 't', 0, G_OPTION_ARG_NONE  , &config->list_icon_types       , N_("List available icon types")                                , NULL },
+        { "list-power-supplies"   , 'p', 0, G_OPTION_ARG_NONE  , &config->list_power_supplies   , N_("List available power supplies (battery and AC)")           , NULL },
+        { "record"                ,  0 , 0, G_OPTION_ARG_FILENAME, &config->record_file         , N_("Record all sysfs reads into a trace file")                 , N_("FILE") },
+        { "replay"                ,  0 , 0, G_OPTION_ARG_FILENAME, &config->replay_file         , N_("Replay a trace file and log the resulting actions")       , N_("FILE") },
+        { "wakeup-budget"         ,  0 , 0, G_OPTION_ARG_INT   , &config->wakeup_budget         , N_("Mark the minutes of --debug that wake up more often than this (0 for no limit)"), NULL },
+        { "profile"               ,  0 , 0, G_OPTION_ARG_NONE  , &config->print_profile         , N_("Print the tick timing histograms on exit")                 , NULL },
+        { "trace-dump"            ,  0 , 0, G_OPTION_ARG_NONE  , &config->dump_events           , N_("Print the debug event ring on exit")                       , NULL },
+        { "metrics-socket"        ,  0 , 0, G_OPTION_ARG_FILENAME, &config->metrics_socket      , N_("Export metrics on a Unix socket")                          , N_("PATH") },
+        { "metrics-file"          ,  0 , 0, G_OPTION_ARG_FILENAME, &config->metrics_file        , N_("Export metrics into a textfile after each update")         , N_("FILE") },
+        { "device-interval"       ,  0 , 0, G_OPTION_ARG_INT   , &config->device_interval       , N_("Set peripheral device update interval (in seconds, 0 to disable)"), NULL },
+        { "device-icons"          ,  0 , 0, G_OPTION_ARG_NONE  , &config->device_icons          , N_("Show a tray icon for each peripheral device")              , NULL },
+        { "startup-trace"         ,  0 , 0, G_OPTION_ARG_NONE  , &config->startup_trace         , N_("Print the time spent in each startup step")                , NULL },
+        { NULL }
+    };
+
+    option_context = g_option_context_new (_("[BATTERY ID]"));
+    g_option_context_add_main_entries (option_context, option_entries, CBATTICON_STRING);
+
+    return option_context;
+}
+
+static gint get_options (int *argc, char ***argv)
+{
+    GError *error = NULL;
+
+    GOptionContext *option_context;
+
+    /* kept to parse the command line again over the configuration file */
+
+    configuration_defaults = configuration;
+    command_line = g_strdupv (*argv);
+
+    option_context = new_option_context (&configuration);
+
+    if (g_option_context_parse (option_context, argc, argv, &error) == FALSE) {
+        g_printerr (_("Cannot parse command line arguments: %s\n"), error->message);
+        g_error_free (error); error = NULL;
+
+        return -1;
+    }
+
+    g_option_context_free (option_context);
+
+    /* option : read the settings from a configuration file */
+
+    if (load_configuration () == FALSE && configuration.config_file != NULL) {
+        return -1;
+    }
+
+    if (*argc > 1) {
+        battery_suffix = (*argv)[1];
+    }
+
+    /* option : display the version */
+
+    if (configuration.display_version == TRUE) {
+        g_print (_("cbatticon: a lightweight and fast battery icon that sits in your system tray\n"));
+        g_print (_("version %s\n"), CBATTICON_VERSION_STRING);
+
+        return 0;
+    }
+
+    /* option : list available power supplies (battery and AC) */
+
+    if (configuration.list_power_supplies == TRUE) {
+        g_print (_("List of available power supplies:\n"));
+        get_power_supplies ();
+
+        return 0;
+    }
+
+    /* option : level rules, before a replay so that it runs them */
+
+    if (compile_level_rules () == FALSE) {
+        return -1;
+    }
+
+    /* option : replay a trace file */
+
+    if (configuration.replay_file != NULL) {
+        return replay_trace (configuration.replay_file) == TRUE ? 0 : -1;
+    }
+
+    /* option : record a trace file */
+
+    if (configuration.record_file != NULL) {
+        if (trace_start_recording (configuration.record_file) == FALSE) {
+            return -1;
+        }
+    }
+
+    /* option : export metrics on a Unix socket */
+
+    if (configuration.metrics_socket != NULL) {
+        if (metrics_start_socket (configuration.metrics_socket) == FALSE) {
+            return -1;
+        }
+    }
+
+    /* option : list available icon types */
+
+    if (configuration.list_icon_types == TRUE) {
+        if (load_backend (argc, argv) == FALSE) {
+            return -1;
+        }
+
+        g_print (_("List of available icon types:\n"));
+        g_print ("standard\t%s\n"    , HAS_STANDARD_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
+        g_print ("notification\t%s\n", HAS_NOTIFICATION_ICON_TYPE == TRUE ? _("available") : _("unavailable"));
+        g_print ("symbolic\t%s\n"    , HAS_SYMBOLIC_ICON_TYPE     == TRUE ? _("available") : _("unavailable"));
+
+        return 0;
+    }
+
+    /* options : intervals, levels and commands */
+
+    validate_configuration (&configuration);
+    reload_level_rules ();
+
+    /* option : load action plugins */
+
+    if (load_plugins () == FALSE) {
+        return -1;
+    }
+
+    /* from here on an icon is shown: the power supplies are discovered and   */
+    /* the notification server is connected to on worker threads, while the   */
+    /* toolkit is loaded and the icon types are probed; the settings, the     */
+    /* plugins and the trace are set up before, and the main thread touches   */
+    /* no power supply state until it joins the discovery                     */
+
+    startup_start_workers ();
+
+    if (load_backend (argc, argv) == FALSE) {
+        startup_stop_workers ();
+        return -1;
+    }
+
+    metrics_watch_socket ();
+
+    /* option : set icon type */
+
+    resolve_icon_type (&configuration);
+
+    return 1;
+}
+
+/*
+ * configuration file functions
+ *
+ * The settings can also be given in a key file, $XDG_CONFIG_HOME/cbatticon/
+ * config unless --config is used, whose keys are the long option names in a
+ * [cbatticon] group; the command line has the last word. The file is read
+ * again on SIGHUP or when it changes: a worker thread builds and validates
+ * the new configuration (the defaults, then the file, then the command line
+ * again) and the main loop swaps it in between two updates. The tray icon,
+ * the notifications, the rate filters and the power supplies are kept, and
+ * only what depends on a changed setting is restarted: the update and device
+ * timers, the status debounce, and the icon is updated at once when the icon
+ * type or a level changed. A file that cannot be read keeps the running
+ * configuration; the toolkit, the battery source, the device icons and the
+ * plugins are only changed by a restart.
+ */
+
+#define CONFIGURATION_GROUP "cbatticon"
+
+struct configuration_key {
+    const gchar *name;
+    GOptionArg   type;
+    gsize        offset;
+    gboolean     reloaded; /* FALSE when only changed by a restart */
+};
+
+#define CONFIGURATION_KEY(name, type, field, reloaded) { name, type, G_STRUCT_OFFSET (struct configuration, field), reloaded }
+
+static const struct configuration_key configuration_keys[] = {
+    CONFIGURATION_KEY ("debug"                 , G_OPTION_ARG_NONE          , debug_output          , TRUE ),
+    CONFIGURATION_KEY ("update-interval"       , G_OPTION_ARG_INT           , update_interval       , TRUE ),
+    CONFIGURATION_KEY ("icon-type"             , G_OPTION_ARG_STRING        , icon_type_name        , TRUE ),
+    CONFIGURATION_KEY ("toolkit"               , G_OPTION_ARG_STRING        , toolkit               , FALSE),
+    CONFIGURATION_KEY ("source"                , G_OPTION_ARG_STRING        , source_name           , FALSE),
+    CONFIGURATION_KEY ("low-level"             , G_OPTION_ARG_INT           , low_level             , TRUE ),
+    CONFIGURATION_KEY ("critical-level"        , G_OPTION_ARG_INT           , critical_level        , TRUE ),
+    CONFIGURATION_KEY ("status-dwell"          , G_OPTION_ARG_INT           , status_dwell          , TRUE ),
+    CONFIGURATION_KEY ("level-hysteresis"      , G_OPTION_ARG_INT           , level_hysteresis      , TRUE ),
+    CONFIGURATION_KEY ("rule"                  , G_OPTION_ARG_STRING_ARRAY  , rules                 , FALSE),
+    CONFIGURATION_KEY ("command-low-level"     , G_OPTION_ARG_STRING        , command_low_level     , TRUE ),
+    CONFIGURATION_KEY ("command-critical-level", G_OPTION_ARG_STRING        , command_critical_level, TRUE ),
+    CONFIGURATION_KEY ("command-left-click"    , G_OPTION_ARG_STRING        , command_left_click    , TRUE ),
+    CONFIGURATION_KEY ("command-timeout"       , G_OPTION_ARG_INT           , command_timeout       , TRUE ),
+    CONFIGURATION_KEY ("command-max-running"   , G_OPTION_ARG_INT           , command_max_running   , TRUE ),
+    CONFIGURATION_KEY ("plugin"                , G_OPTION_ARG_FILENAME_ARRAY, plugin_files          , FALSE),
+#ifdef WITH_NOTIFY
+    CONFIGURATION_KEY ("hide-notification"     , G_OPTION_ARG_NONE          , hide_notification     , TRUE ),
+#endif
+    CONFIGURATION_KEY ("metrics-file"          , G_OPTION_ARG_FILENAME      , metrics_file          , TRUE ),
+    CONFIGURATION_KEY ("wakeup-budget"         , G_OPTION_ARG_INT           , wakeup_budget         , TRUE ),
+    CONFIGURATION_KEY ("device-interval"       , G_OPTION_ARG_INT           , device_interval       , TRUE ),
+    CONFIGURATION_KEY ("device-icons"          , G_OPTION_ARG_NONE          , device_icons          , FALSE)
+};
+
+static struct {
+    GFileMonitor *monitor;
+    gboolean      loading;
+    gboolean      pending;
+} reload;
+
+static gchar* get_configuration_filename (void)
+{
+    if (configuration.config_file != NULL) {
+        return g_strdup (configuration.config_file);
+    }
+
+    return g_build_filename (g_get_user_config_dir (), CBATTICON_STRING, "config", NULL);
+}
+
+static void clear_configuration (struct configuration *config)
+{
+    g_free (config->command_low_level);
+    g_free (config->command_critical_level);
+    g_free (config->command_left_click);
+    g_free (config->record_file);
+    g_free (config->replay_file);
+    g_free (config->metrics_socket);
+    g_free (config->metrics_file);
+    g_strfreev (config->plugin_files);
+    g_strfreev (config->rules);
+    g_free (config->toolkit);
+    g_free (config->config_file);
+    g_free (config->icon_type_name);
+    g_free (config->source_name);
+}
+
+static const struct configuration_key* get_configuration_key (const gchar *name)
+{
+    for (guint i = 0; i < G_N_ELEMENTS (configuration_keys); i++) {
+        if (g_strcmp0 (configuration_keys[i].name, name) == 0) {
+            return &configuration_keys[i];
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean read_configuration_file (struct configuration *config, const gchar *filename, GError **error)
+{
+    GKeyFile *key_file = g_key_file_new ();
+    gchar **keys;
+
+    if (g_key_file_load_from_file (key_file, filename, G_KEY_FILE_NONE, error) == FALSE) {
+        g_key_file_free (key_file);
+        return FALSE;
+    }
+
+    keys = g_key_file_get_keys (key_file, CONFIGURATION_GROUP, NULL, NULL);
+
+    for (gchar **name = keys; name != NULL && *name != NULL; name++) {
+        const struct configuration_key *key = get_configuration_key (*name);
+        GError *key_error = NULL;
+        gpointer field;
+        gint value;
+
+        if (key == NULL) {
+            g_printerr (_("Unknown setting in configuration file: %s\n"), *name);
+            continue;
+        }
+
+        field = G_STRUCT_MEMBER_P (config, key->offset);
+
+        switch (key->type) {
+            case G_OPTION_ARG_NONE:
+                value = g_key_file_get_boolean (key_file, CONFIGURATION_GROUP, *name, &key_error);
+                if (key_error == NULL) {
+                    *(gboolean *)field = value;
+                }
+                break;
+
+            case G_OPTION_ARG_INT:
+                value = g_key_file_get_integer (key_file, CONFIGURATION_GROUP, *name, &key_error);
+                if (key_error == NULL) {
+                    *(gint *)field = value;
+                }
+                break;
+
+            case G_OPTION_ARG_FILENAME_ARRAY:
+            case G_OPTION_ARG_STRING_ARRAY:
+                *(gchar ***)field = g_key_file_get_string_list (key_file, CONFIGURATION_GROUP, *name, NULL, &key_error);
+                break;
+
+            default:
+                *(gchar **)field = g_key_file_get_string (key_file, CONFIGURATION_GROUP, *name, &key_error);
+                break;
+        }
+
+        if (key_error != NULL) {
+            g_printerr (_("Invalid setting in configuration file: %s (%s)\n"), *name, key_error->message);
+            g_error_free (key_error);
+        }
+    }
+
+    g_strfreev (keys);
+    g_key_file_free (key_file);
+
+    return TRUE;
+}
+
+static gboolean build_configuration (struct configuration *config)
+{
+    GError *error = NULL;
+
+    GOptionContext *option_context;
+    gchar *filename = get_configuration_filename ();
+    gchar **arguments;
+
+    *config = configuration_defaults;
+
+    /* without --config, a missing file only leaves the defaults */
+
+    if (read_configuration_file (config, filename, &error) == FALSE) {
+        if (configuration.config_file != NULL || g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT) == FALSE) {
+            g_printerr (_("Cannot read configuration file: %s (%s)\n"), filename, error->message);
+            g_error_free (error);
+            g_free (filename);
+
+            return FALSE;
+        }
+
+        g_error_free (error); error = NULL;
+    }
+
+    g_free (filename);
+
+    /* the command line was parsed once already, it cannot fail now */
+
+    arguments = g_strdupv (command_line);
+    option_context = new_option_context (config);
+    g_option_context_parse_strv (option_context, &arguments, NULL);
+    g_option_context_free (option_context);
+    g_strfreev (arguments);
+
+    return TRUE;
+}
+
+static gboolean load_configuration (void)
+{
+    struct configuration config;
+    gchar *filename = get_configuration_filename ();
+    gboolean found = g_file_test (filename, G_FILE_TEST_EXISTS);
+
+    g_free (filename);
+
+    if (found == FALSE && configuration.config_file == NULL) {
+        return TRUE;
+    }
+
+    if (build_configuration (&config) == FALSE) {
+        return FALSE;
+    }
+
+    clear_configuration (&configuration);
+    configuration = config;
+
+    return TRUE;
+}
+
+static void apply_configuration (struct configuration *config)
+{
+    struct configuration old = configuration;
+
+    resolve_icon_type (config);
+
+    /* the changed values are swapped, so that the old ones are freed */
+    /* with the new configuration                                      */
+
+    for (guint i = 0; i < G_N_ELEMENTS (configuration_keys); i++) {
+        const struct configuration_key *key = &configuration_keys[i];
+        gpointer field = G_STRUCT_MEMBER_P (&configuration, key->offset);
+        gpointer value = G_STRUCT_MEMBER_P (config, key->offset);
+        gboolean changed;
+
+        if (key->type == G_OPTION_ARG_NONE || key->type == G_OPTION_ARG_INT) {
+            changed = *(gint *)field != *(gint *)value;
+        } else if (key->type == G_OPTION_ARG_FILENAME_ARRAY || key->type == G_OPTION_ARG_STRING_ARRAY) {
+            const gchar * const *old_files = *(const gchar * const **)field;
+            const gchar * const *new_files = *(const gchar * const **)value;
+
+            changed = old_files == NULL || new_files == NULL ? old_files != new_files : g_strv_equal (old_files, new_files) == FALSE;
+        } else {
+            changed = g_strcmp0 (*(gchar **)field, *(gchar **)value) != 0;
+        }
+
+        if (changed == FALSE) {
+            continue;
+        }
+
+        if (key->reloaded == FALSE) {
+            g_printerr (_("The %s setting is only changed by a restart\n"), key->name);
+            continue;
+        }
+
+        if (key->type == G_OPTION_ARG_NONE || key->type == G_OPTION_ARG_INT) {
+            gint swap = *(gint *)field;
+
+            *(gint *)field = *(gint *)value;
+            *(gint *)value = swap;
+        } else {
+            gpointer swap = *(gpointer *)field;
+
+            *(gpointer *)field = *(gpointer *)value;
+            *(gpointer *)value = swap;
+        }
+    }
+
+    configuration.icon_type = config->icon_type;
+
+    if (configuration.update_interval != old.update_interval) {
+        schedule_tray_icon_updates (battery_tray_icon);
+    }
+
+    if (configuration.device_interval != old.device_interval) {
+        restart_devices ();
+    }
+
+    if (configuration.status_dwell != old.status_dwell) {
+        reset_status_debounce ();
+    }
+
+    if (configuration.low_level != old.low_level || configuration.critical_level != old.critical_level ||
+        configuration.level_hysteresis != old.level_hysteresis) {
+        reload_level_rules ();
+        update_tray_icon (battery_tray_icon);
+    } else if (configuration.icon_type != old.icon_type) {
+        update_tray_icon (battery_tray_icon);
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("configuration reloaded\n");
+    }
+}
+
+static void reload_configuration (void);
+
+static gboolean on_configuration_loaded (gpointer user_data)
+{
+    struct configuration *config = (struct configuration *)user_data;
+
+    wakeup_claim (WAKEUP_OTHER);
+
+    if (config != NULL) {
+        apply_configuration (config);
+        clear_configuration (config);
+        g_free (config);
+    }
+
+    reload.loading = FALSE;
+
+    if (reload.pending == TRUE) {
+        reload.pending = FALSE;
+        reload_configuration ();
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer reload_thread (gpointer data)
+{
+    struct configuration *config = g_new (struct configuration, 1);
+
+    if (build_configuration (config) == TRUE) {
+        validate_configuration (config);
+    } else {
+        g_free (config);
+        config = NULL;
+    }
+
+    g_idle_add (on_configuration_loaded, config);
+
+    return NULL;
+}
+
+static void reload_configuration (void)
+{
+    /* a change during a reload is read once the reload is applied */
+
+    if (reload.loading == TRUE) {
+        reload.pending = TRUE;
+        return;
+    }
+
+    reload.loading = TRUE;
+    g_thread_unref (g_thread_new ("configuration", reload_thread, NULL));
+}
+
+static gboolean on_reload_signal (gpointer user_data)
+{
+    wakeup_claim (WAKEUP_OTHER);
+
+    reload_configuration ();
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void on_configuration_changed (GFileMonitor *monitor, GFile *file, GFile *other_file, GFileMonitorEvent event_type, gpointer user_data)
+{
+    wakeup_claim (WAKEUP_OTHER);
+
+    if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT || event_type == G_FILE_MONITOR_EVENT_CREATED ||
+        event_type == G_FILE_MONITOR_EVENT_DELETED) {
+        reload_configuration ();
+    }
+}
+
+static void start_configuration_watch (void)
+{
+    gchar *filename = get_configuration_filename ();
+    GFile *file = g_file_new_for_path (filename);
+
+    g_unix_signal_add (SIGHUP, on_reload_signal, NULL);
+
+    /* the file may not exist yet, its directory is watched */
+
+    reload.monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, NULL);
+    if (reload.monitor != NULL) {
+        g_signal_connect (reload.monitor, "changed", G_CALLBACK (on_configuration_changed), NULL);
+    }
+
+    g_object_unref (file);
+    g_free (filename);
+}
+
+/*
+ * sysfs functions
+ */
+
+static gboolean changed_power_supplies (void)
+{
+    gchar **files;
+
+    static gint old_num_ps = 0;
+    static gint old_total_ps = 0;
+    gint num_ps = 0;
+    gint total_ps = 0;
+    gboolean power_supplies_changed;
+    gint64 profile_start = profile_get_time ();
+
+    if (upower.active == TRUE || upower.changed == TRUE) {
+        power_supplies_changed = upower_changed_power_supplies ();
+        profile_add (PROFILE_SUPPLY_CHANGE, profile_start);
+
+        return power_supplies_changed;
+    }
+
+    files = get_power_supply_names (NULL);
+    if (files != NULL) {
+        for (gchar **file = files; *file != NULL; file++) {
+            if (ac_path != NULL && g_str_has_suffix (ac_path, *file) == TRUE) {
+                num_ps++;
+            }
+
+            for (gint i = 0; i < num_batteries; i++) {
+                if (g_str_has_suffix (batteries[i].path, *file) == TRUE) {
+                    num_ps++;
+                }
+            }
+
+            total_ps++;
+        }
+
+        g_strfreev (files);
+    }
+
+    power_supplies_changed = (num_ps != old_num_ps) || (total_ps != old_total_ps);
+
+    if (power_supplies_changed == TRUE) {
+        LOG_EVENT (EVENT_SUPPLIES_CHANGED, NULL, old_total_ps, old_num_ps, total_ps, num_ps);
+        metrics.rediscoveries++;
+    }
+
+    old_num_ps = num_ps;
+    old_total_ps = total_ps;
+
+    if (power_supplies_changed) {
+
+        /* redetect power supply paths */
+
+        gchar *old_battery_paths = get_battery_paths ();
+        gchar *old_ac_path = ac_path; ac_path = NULL;
+        gchar *battery_paths;
+
+        get_power_supplies ();
+        battery_paths = get_battery_paths ();
+        power_supplies_changed =
+            (g_strcmp0 (battery_paths, old_battery_paths) != 0) ||
+            (g_strcmp0 (ac_path, old_ac_path) != 0);
+
+        g_free (battery_paths);
+        g_free (old_battery_paths);
+        g_free (old_ac_path);
+    }
+
+    profile_add (PROFILE_SUPPLY_CHANGE, profile_start);
+
+    return power_supplies_changed;
+}
+
+static gchar* get_battery_paths (void)
+{
+    GString *paths = g_string_new (NULL);
+
+    for (gint i = 0; i < num_batteries; i++) {
+        g_string_append (paths, batteries[i].path);
+        g_string_append_c (paths, '\n');
+    }
+
+    return g_string_free (paths, FALSE);
+}
+
+static void on_power_supply (const char *path, int type, int selected, void *user_data)
+{
+    GPtrArray *device_paths = (GPtrArray *)user_data;
+
+    if (configuration.list_power_supplies == TRUE) {
+        gchar *power_supply_id = g_path_get_basename (path);
+        const gchar *type_name = type == CBATTICON_SUPPLY_BATTERY ? _("Battery") : type == CBATTICON_SUPPLY_DEVICE ? _("Device") : _("AC");
+
+        g_print (_("type: %-*.*s\tid: %-*.*s\tpath: %s\n"), 12, 12, type_name, 12, 12, power_supply_id, path);
+        g_free (power_supply_id);
+    }
+
+    if (selected == TRUE && configuration.debug_output == TRUE) {
+        g_printf (type == CBATTICON_SUPPLY_AC ? "ac path: %s\n" : "battery path: %s\n", path);
+    }
+
+    if (selected == FALSE && type == CBATTICON_SUPPLY_DEVICE) {
+        g_ptr_array_add (device_paths, g_strdup (path));
+    }
+}
+
+static void get_power_supplies (void)
+{
+    GPtrArray *device_paths;
+
+    /* reset power supplies information */
+
+    for (gint i = 0; i < num_batteries; i++) {
+        g_free (batteries[i].path);
+    }
+
+    num_batteries = 0;
+    g_free (ac_path); ac_path = NULL;
+
+    sysattr_close_all ();
+
+    /* retrieve power supplies information */
+
+    device_paths  = g_ptr_array_new_with_free_func (g_free);
+    num_batteries = cbatticon_context_discover (get_battery_context (), batteries, MAX_BATTERIES, &ac_path, on_power_supply, device_paths);
+
+    if (num_batteries < 0) {
+        num_batteries = 0;
+        g_ptr_array_free (device_paths, TRUE);
+
+        g_printerr (_("Cannot open sysfs directory: %s (%s)\n"), SYSFS_PATH,
+                    battery_list_error != NULL ? battery_list_error->message : g_strerror (ENOENT));
+        g_clear_error (&battery_list_error);
+        return;
+    }
+
+    set_devices (device_paths);
+    g_ptr_array_free (device_paths, TRUE);
+
+    if (configuration.list_power_supplies == FALSE && num_batteries == 0) {
+        if (battery_suffix != NULL) {
+            g_printerr (_("No battery with suffix %s found!\n"), battery_suffix);
+            return;
+        }
+
+        if (ac_path == NULL) {
+            g_printerr (_("No battery nor AC power supply found!\n"));
+            return;
+        }
+    }
+}
+
+static gchar** get_power_supply_names (GError **error)
+{
+    GDir *directory;
+    GPtrArray *names;
+    const gchar *file;
+    gchar **files = NULL;
+    gchar *joined_files;
+    gboolean status;
+
+    if (REPLAYING) {
+        if (trace_replay (TRACE_RECORD_LIST, SYSFS_PATH, &status, &joined_files) == TRUE && status == TRUE) {
+            files = g_strsplit (joined_files, "\n", -1);
+            g_free (joined_files);
+        } else {
+            g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "%s", _("not found in trace"));
+        }
+
+        return files;
+    }
+
+    directory = g_dir_open (SYSFS_PATH, 0, error);
+    if (directory != NULL) {
+        names = g_ptr_array_new ();
+
+        file = g_dir_read_name (directory);
+        while (file != NULL) {
+            g_ptr_array_add (names, g_strdup (file));
+            file = g_dir_read_name (directory);
+        }
+
+        g_ptr_array_add (names, NULL);
+        g_dir_close (directory);
+
+        files = (gchar **)g_ptr_array_free (names, FALSE);
+    }
+
+    if (trace.file != NULL) {
+        joined_files = files != NULL ? g_strjoinv ("\n", files) : NULL;
+        trace_record (TRACE_RECORD_LIST, SYSFS_PATH, files != NULL, joined_files);
+        g_free (joined_files);
+    }
+
+    return files;
+}
+
+static gboolean get_sysattr_string (const gchar *path, const gchar *attribute, gchar **value)
+{
+    gchar *sysattr_filename;
+    gboolean sysattr_status;
+    gint64 profile_start = profile_get_time ();
+
+    g_return_val_if_fail (path != NULL, FALSE);
+    g_return_val_if_fail (attribute != NULL, FALSE);
+    g_return_val_if_fail (value != NULL, FALSE);
+
+    sysattr_filename = g_build_filename (path, attribute, NULL);
+
+    if (REPLAYING) {
+        if (trace_replay (TRACE_RECORD_READ, sysattr_filename, &sysattr_status, value) == FALSE) {
+            sysattr_status = FALSE;
+        }
+    } else {
+        if (sysattr_take_prefetched (sysattr_filename, &sysattr_status, value) == FALSE) {
+            sysattr_status = sysattr_read (sysattr_filename, value);
+        }
+
+        trace_record (TRACE_RECORD_READ, sysattr_filename, sysattr_status, sysattr_status == TRUE ? *value : NULL);
+    }
+
+    g_free (sysattr_filename);
+
+    if (sysattr_status == FALSE) {
+        metrics.read_errors++;
+    }
+
+    profile_add_attribute (attribute, profile_start);
+
+    return sysattr_status;
+}
+
+static gboolean get_ac_online (const gchar *path, gboolean *online)
+{
+    gint online_value = cbatticon_context_read_ac_online (get_battery_context (), path);
+
+    if (online_value < 0) {
+        return FALSE;
+    }
+
+    if (online != NULL) {
+        *online = online_value;
+    }
+
+    return TRUE;
+}
+
+static gint parse_battery_status (const gchar *value)
+{
+    return cbatticon_parse_status (value);
+}
+
+static void reset_battery_current_rate (void)
+{
+    cbatticon_context_reset_estimate (get_battery_context ());
+}
+
+/*
+ * battery aggregation functions
+ *
+ * All the system batteries are read in a single pass per tick (statuses
+ * first, then capacities and rates unless no battery is in use) and
+ * combined by libcbatticon into the aggregate that the tray icon, the
+ * thresholds and the time remaining work on.
+ */
+
+static gboolean read_battery_statuses (void)
+{
+    gint status = cbatticon_context_read_statuses (get_battery_context (), batteries, num_batteries);
+
+    if (status < 0) {
+        return FALSE;
+    }
+
+    aggregate.present = FALSE;
+    for (gint i = 0; i < num_batteries; i++) {
+        aggregate.present = aggregate.present || batteries[i].present;
+    }
+
+    aggregate.status = status;
+
+    return TRUE;
+}
+
+static void read_battery_capacities (void)
+{
+    struct cbatticon_sample sample;
+    gint num_read = cbatticon_context_read_sample (get_battery_context (), batteries, num_batteries, aggregate.status, &sample);
+
+    aggregate.full_capacity      = sample.full_capacity;
+    aggregate.remaining_capacity = sample.remaining_capacity;
+    aggregate.rate               = sample.rate;
+
+    if (num_read <= 0) {
+        return;
+    }
+
+    aggregate.use_charge = sample.use_charge;
+    aggregate.from_pct   = sample.from_pct;
+
+    LOG_EVENT (EVENT_BATTERIES, NULL, num_read, aggregate.remaining_capacity, aggregate.full_capacity, aggregate.rate);
+}
+
+static void prefetch_batteries (gint previous_status)
+{
+    GPtrArray *filenames;
+    gint64 profile_start;
+
+    if (REPLAYING || sysattr_can_prefetch () == FALSE) {
+        return;
+    }
+
+    /* the reads the tick will most likely do, based on the previous status */
+
+    filenames = g_ptr_array_new_with_free_func (g_free);
+
+    for (gint i = 0; i < num_batteries; i++) {
+        const struct cbatticon_battery *battery = &batteries[i];
+
+        g_ptr_array_add (filenames, g_build_filename (battery->path, "present", NULL));
+        g_ptr_array_add (filenames, g_build_filename (battery->path, "status", NULL));
+
+        if (previous_status != MISSING && previous_status != CHARGED) {
+            g_ptr_array_add (filenames, g_build_filename (battery->path, battery->use_charge == FALSE ? "energy_full" : "charge_full", NULL));
+            g_ptr_array_add (filenames, g_build_filename (battery->path, battery->use_charge == FALSE ? "energy_now" : "charge_now", NULL));
+            g_ptr_array_add (filenames, g_build_filename (battery->path, battery->use_charge == FALSE ? "power_now" : "current_now", NULL));
+        }
+    }
+
+    if (previous_status == UNKNOWN && ac_path != NULL) {
+        g_ptr_array_add (filenames, g_build_filename (ac_path, "online", NULL));
+    }
+
+    profile_start = profile_get_time ();
+    sysattr_prefetch (filenames);
+    profile_add_attribute ("io_uring batch", profile_start);
+
+    g_ptr_array_free (filenames, TRUE);
+}
+
+static gboolean read_batteries (void)
+{
+    if (upower.active == TRUE) {
+        return upower_read_batteries ();
+    }
+
+    prefetch_batteries (aggregate.status);
+
+    if (read_battery_statuses () == FALSE) {
+        return FALSE;
+    }
+
+    read_battery_capacities ();
+
+    return TRUE;
+}
+
+/*
+ * computation functions
+ */
+
+static gboolean get_battery_charge (gboolean remaining, gint *percentage, gint *time)
+{
+    gint64 profile_start = profile_get_time ();
+    gboolean status = upower.active == TRUE ? upower_get_battery_charge (remaining, percentage, time) :
+                                              compute_battery_charge (remaining, percentage, time);
+
+    profile_add (PROFILE_ESTIMATION, profile_start);
+
+    return status;
+}
+
+static gboolean compute_battery_charge (gboolean remaining, gint *percentage, gint *time)
+{
+    struct cbatticon_sample sample;
+    gdouble current_rate;
+
+    g_return_val_if_fail (percentage != NULL, FALSE);
+
+    sample.status             = aggregate.status;
+    sample.use_charge         = aggregate.use_charge;
+    sample.from_pct           = aggregate.from_pct;
+    sample.full_capacity      = aggregate.full_capacity;
+    sample.remaining_capacity = aggregate.remaining_capacity;
+    sample.rate               = aggregate.rate;
+
+    if (cbatticon_context_estimate (get_battery_context (), &sample, remaining, percentage, time, &current_rate) != 0) {
+        LOG_EVENT (EVENT_UNAVAILABLE, "battery capacity", 0, 0, 0, 0);
+
+        return FALSE;
+    }
+
+    metrics.use_charge         = sample.use_charge;
+    metrics.full_capacity      = sample.full_capacity;
+    metrics.remaining_capacity = sample.remaining_capacity;
+
+    if (time == NULL) {
+        return TRUE;
+    }
+
+    if (current_rate < 0) {
+        LOG_EVENT (EVENT_UNAVAILABLE, "current rate", 0, 0, 0, 0);
+    }
+
+    metrics.current_rate = current_rate;
+
+    return TRUE;
+}
+
+/*
+ * status debouncing functions
+ *
+ * Some drivers flap between charging, not charging and discharging near
+ * full charge. With a dwell time, a new status only takes effect once it
+ * has been read for that long; until then the confirmed status is kept, so
+ * the notification, the icon and the rate filter only follow confirmed
+ * transitions. A missing battery is always confirmed at once.
+ */
+
+static struct {
+    gint   status;         /* confirmed status, -1 when none yet */
+    gint   pending_status; /* -1 when none */
+    gint64 pending_since;  /* in seconds */
+} debounce = { -1, -1, 0 };
+
+static void reset_status_debounce (void)
+{
+    debounce.status         = -1;
+    debounce.pending_status = -1;
+}
+
+static gint debounce_status (gint status)
+{
+    struct timespec now;
+
+    get_clock_time (&now);
+
+    if (configuration.status_dwell <= 0 || debounce.status == -1 || status == MISSING || debounce.status == MISSING) {
+        debounce.status         = status;
+        debounce.pending_status = -1;
+
+        return status;
+    }
+
+    if (status == debounce.status) {
+        if (debounce.pending_status != -1) {
+            LOG_EVENT (EVENT_STATUS_FLAP, NULL, debounce.pending_status, debounce.status, now.tv_sec - debounce.pending_since, 0);
+            metrics.status_flaps++;
+            debounce.pending_status = -1;
+        }
+
+        return status;
+    }
+
+    if (status != debounce.pending_status) {
+        debounce.pending_status = status;
+        debounce.pending_since  = now.tv_sec;
+    }
+
+    if (now.tv_sec - debounce.pending_since >= configuration.status_dwell) {
+        debounce.status         = status;
+        debounce.pending_status = -1;
+    }
+
+    return debounce.status;
+}
+
+static gboolean is_status_pending (void)
+{
+    return debounce.pending_status != -1;
+}
+
+/*
+ * peripheral device functions
+ *
+ * Batteries with a Device scope (mice, keyboards, headsets) are polled in
+ * their own slow class, every --device-interval seconds, and immediately
+ * when the power supplies change. In between, the kernel uevents of the
+ * power_supply class (NETLINK_KOBJECT_UEVENT) carry their changes: a
+ * uevent with the status and the capacity is taken as it is, any other one
+ * has the device read at once. Querying a Bluetooth battery can block for
+ * seconds, so each device is read by a pool of worker threads that post
+ * their readings back to the main loop; the main battery tick never waits
+ * for them, and a stuck device does not hold the others. The workers read
+ * sysfs directly, without recording, replaying or profiling, which are not
+ * thread safe.
+ */
+
+#define DEVICE_UEVENT_LTH 4096
+
+struct device_reading {
+    gchar   *path;
+    gchar   *name;       /* NULL when already known */
+    gint     status;
+    gint     percentage; /* -1 when unavailable */
+};
+
+static gchar* read_device_attribute (const gchar *path, const gchar *attribute)
+{
+    gchar *filename = g_build_filename (path, attribute, NULL);
+    gchar *value = NULL;
+
+    if (g_file_get_contents (filename, &value, NULL, NULL) == TRUE) {
+        g_strstrip (value);
+    }
+
+    g_free (filename);
+
+    return value;
+}
+
+static void read_device (struct device_reading *reading, gboolean read_name)
+{
+    gchar *value;
+
+    reading->status     = UNKNOWN;
+    reading->percentage = -1;
+
+    if (read_name == TRUE) {
+        reading->name = read_device_attribute (reading->path, "model_name");
+    }
+
+    value = read_device_attribute (reading->path, "status");
+    if (value != NULL) {
+        reading->status = parse_battery_status (value);
+        g_free (value);
+    }
+
+    /* some devices only report a coarse level */
+
+    value = read_device_attribute (reading->path, "capacity");
+    if (value != NULL) {
+        reading->percentage = CLAMP ((gint)g_ascii_strtoll (value, NULL, 10), 0, 100);
+        g_free (value);
+    } else {
+        value = read_device_attribute (reading->path, "capacity_level");
+        if (value != NULL) {
+                 if (g_strcmp0 (value, "Full") == 0)     reading->percentage = 100;
+            else if (g_strcmp0 (value, "High") == 0)     reading->percentage = 80;
+            else if (g_strcmp0 (value, "Normal") == 0)   reading->percentage = 50;
+            else if (g_strcmp0 (value, "Low") == 0)      reading->percentage = 20;
+            else if (g_strcmp0 (value, "Critical") == 0) reading->percentage = 5;
+
+            g_free (value);
+        }
+    }
+}
+
+static void read_device_job (gpointer data, gpointer user_data)
+{
+    struct device_reading *reading = (struct device_reading *)data;
+
+    read_device (reading, reading->name == NULL);
+    g_idle_add (on_device_read, reading);
+}
+
+static void start_device_read (struct device *device)
+{
+    struct device_reading *reading;
+
+    /* a device that is still being read is skipped */
+
+    if (device->polling == TRUE) {
+        return;
+    }
+
+    /* the workers are kept between the polls, one per device at most */
+
+    if (devices.readers == NULL) {
+        devices.readers = g_thread_pool_new (read_device_job, NULL, MAX_DEVICES, FALSE, NULL);
+    }
+
+    reading = g_new0 (struct device_reading, 1);
+    reading->path = g_strdup (device->path);
+    reading->name = device->name == NULL ? NULL : g_strdup ("");
+
+    device->polling = TRUE;
+    g_thread_pool_push (devices.readers, reading, NULL);
+}
+
+static void start_device_poll (void)
+{
+    if (devices.started == FALSE) {
+        return;
+    }
+
+    for (gint i = 0; i < devices.num_devices; i++) {
+        start_device_read (&devices.devices[i]);
+    }
+}
+
+static gboolean on_device_timer (gpointer user_data)
+{
+    wakeup_claim (WAKEUP_TIMER);
+
+    start_device_poll ();
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_devices_changed (gpointer user_data)
+{
+    wakeup_claim (WAKEUP_OTHER);
+
+    start_device_poll ();
+
+    return G_SOURCE_REMOVE;
+}
+
+static void update_device (struct device *device)
+{
+    gchar text[STR_LTH];
+    gint state;
+
+    /* the low level notification is shown once per discharge */
+
+    if (device->percentage < 0 || device->percentage > configuration.low_level || device->status == CHARGING) {
+        device->low = FALSE;
+    } else if (device->low == FALSE) {
+        device->low = TRUE;
+
+        g_snprintf (text, STR_LTH, _("%s battery level is low! (%i%% remaining)"), device->name, device->percentage);
+        NOTIFY_MESSAGE (&device->notification, text, NULL, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL);
+    }
+
+    if (configuration.device_icons == FALSE) {
+        return;
+    }
+
+    if (device->tray_icon == NULL) {
+        device->tray_icon = TRAY_ICON_NEW;
+        TRAY_ICON_SHOW (device->tray_icon);
+    }
+
+    if (device->percentage < 0) {
+        g_strlcpy (text, device->name, STR_LTH);
+        state = UNKNOWN;
+    } else {
+        g_snprintf (text, STR_LTH, _("%s: %i%%"), device->name, device->percentage);
+        state = device->status == CHARGING || device->status == CHARGED ? device->status : DISCHARGING;
+    }
+
+    TRAY_ICON_SET_TEXT (device->tray_icon, text);
+    TRAY_ICON_SET_ICON (device->tray_icon, get_icon_name (state, device->percentage));
+}
+
+static gboolean on_device_read (gpointer user_data)
+{
+    struct device_reading *reading = (struct device_reading *)user_data;
+
+    wakeup_claim (WAKEUP_OTHER);
+
+    /* the device may have gone while it was read */
+
+    for (gint i = 0; i < devices.num_devices; i++) {
+        struct device *device = &devices.devices[i];
+
+        if (g_strcmp0 (device->path, reading->path) != 0) {
+            continue;
+        }
+
+        if (device->name == NULL) {
+            device->name = reading->name != NULL && reading->name[0] != '\0' ?
+                g_strdup (reading->name) : g_path_get_basename (device->path);
+        }
+
+        device->status     = reading->status;
+        device->percentage = reading->percentage;
+        device->polling    = FALSE;
+
+        LOG_EVENT (EVENT_DEVICE, NULL, i, device->status, device->percentage, 0);
+
+        update_device (device);
+    }
+
+    g_free (reading->path);
+    g_free (reading->name);
+    g_free (reading);
+
+    return G_SOURCE_REMOVE;
+}
+
+static struct device* get_device (const gchar *name)
+{
+    for (gint i = 0; i < devices.num_devices; i++) {
+        const gchar *basename = strrchr (devices.devices[i].path, G_DIR_SEPARATOR);
+
+        if (g_strcmp0 (basename != NULL ? basename + 1 : devices.devices[i].path, name) == 0) {
+            return &devices.devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean on_device_uevent (gint fd, GIOCondition condition, gpointer user_data)
+{
+    gchar buffer[DEVICE_UEVENT_LTH];
+    struct sockaddr_nl sender;
+    struct iovec iov = { buffer, sizeof (buffer) - 1 };
+    struct msghdr message;
+    const gchar *name = NULL, *status = NULL, *capacity = NULL;
+    gboolean power_supply = FALSE;
+    struct device *device;
+    ssize_t length;
+
+    wakeup_claim (WAKEUP_UEVENT);
+
+    memset (&sender, 0, sizeof (sender));
+    memset (&message, 0, sizeof (message));
+    message.msg_name    = &sender;
+    message.msg_namelen = sizeof (sender);
+    message.msg_iov     = &iov;
+    message.msg_iovlen  = 1;
+
+    length = recvmsg (fd, &message, MSG_DONTWAIT);
+    if (length < 0) {
+        /* uevents were dropped, the devices may have changed meanwhile */
+
+        if (errno == ENOBUFS) {
+            start_device_poll ();
+        }
+
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* only the kernel is trusted, other processes can send here too */
+
+    if (sender.nl_pid != 0 || length == 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    buffer[length] = '\0';
+
+    /* ACTION@DEVPATH, then KEY=VALUE fields, each ended by a NUL */
+
+    for (gchar *field = buffer; field < buffer + length; field += strlen (field) + 1) {
+        if (strcmp (field, "SUBSYSTEM=power_supply") == 0) {
+            power_supply = TRUE;
+        } else if (g_str_has_prefix (field, "POWER_SUPPLY_NAME=") == TRUE) {
+            name = field + strlen ("POWER_SUPPLY_NAME=");
+        } else if (g_str_has_prefix (field, "POWER_SUPPLY_STATUS=") == TRUE) {
+            status = field + strlen ("POWER_SUPPLY_STATUS=");
+        } else if (g_str_has_prefix (field, "POWER_SUPPLY_CAPACITY=") == TRUE) {
+            capacity = field + strlen ("POWER_SUPPLY_CAPACITY=");
+        }
+    }
+
+    if (power_supply == FALSE || name == NULL || (device = get_device (name)) == NULL) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (status == NULL || capacity == NULL || device->name == NULL || device->polling == TRUE) {
+        start_device_read (device);
+        return G_SOURCE_CONTINUE;
+    }
+
+    device->status     = parse_battery_status (status);
+    device->percentage = CLAMP ((gint)g_ascii_strtoll (capacity, NULL, 10), 0, 100);
+
+    LOG_EVENT (EVENT_DEVICE, NULL, device - devices.devices, device->status, device->percentage, 0);
+
+    update_device (device);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void start_device_uevents (void)
+{
+    struct sockaddr_nl address;
+    gint fd;
+
+    if (devices.uevent_source != 0) {
+        return;
+    }
+
+    /* without uevents (e.g. in a network namespace), the devices are only polled */
+
+    fd = socket (AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        return;
+    }
+
+    memset (&address, 0, sizeof (address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1; /* the kernel uevents, not the udev ones */
+
+    if (bind (fd, (struct sockaddr *)&address, sizeof (address)) != 0) {
+        if (configuration.debug_output == TRUE) {
+            g_printf ("no device uevents, devices only polled (%s)\n", g_strerror (errno));
+        }
+
+        close (fd);
+        return;
+    }
+
+    devices.uevent_source = toolkit_fd_add (fd, G_IO_IN, on_device_uevent, NULL);
+}
+
+static void free_device (struct device *device)
+{
+    if (device->tray_icon != NULL) {
+        TRAY_ICON_FREE (device->tray_icon);
+    }
+
+#ifdef WITH_NOTIFY
+    g_clear_object (&device->notification);
+#endif
+
+    g_free (device->path);
+    g_free (device->name);
+}
+
+static void set_devices (GPtrArray *paths)
+{
+    struct device old_devices[MAX_DEVICES];
+    gint old_num_devices = devices.num_devices;
+    gboolean added = FALSE;
+
+    /* keep the state of the devices that are still there */
+
+    memcpy (old_devices, devices.devices, sizeof (old_devices));
+    memset (devices.devices, 0, sizeof (devices.devices));
+    devices.num_devices = 0;
+
+    for (guint i = 0; i < paths->len && i < MAX_DEVICES; i++) {
+        const gchar *path = (const gchar *)g_ptr_array_index (paths, i);
+        struct device *device = &devices.devices[devices.num_devices++];
+        gint j;
+
+        for (j = 0; j < old_num_devices; j++) {
+            if (g_strcmp0 (old_devices[j].path, path) == 0) {
+                break;
+            }
+        }
+
+        if (j < old_num_devices) {
+            *device = old_devices[j];
+            old_devices[j].path = NULL;
+        } else {
+            device->path       = g_strdup (path);
+            device->status     = UNKNOWN;
+            device->percentage = -1;
+
+            added = TRUE;
+        }
+    }
+
+    for (gint j = 0; j < old_num_devices; j++) {
+        if (old_devices[j].path != NULL) {
+            free_device (&old_devices[j]);
+        }
+    }
+
+    if (added == TRUE) {
+        g_idle_add (on_devices_changed, NULL);
+    }
+}
+
+static void start_devices (void)
+{
+    if (configuration.device_interval == 0 || REPLAYING) {
+        return;
+    }
+
+    devices.started = TRUE;
+
+    start_device_uevents ();
+    start_device_poll ();
+    devices.timer = toolkit_timeout_add (configuration.device_interval, on_device_timer, NULL);
+}
+
+static void restart_devices (void)
+{
+    if (devices.timer != 0) {
+        toolkit_source_remove (devices.timer);
+        devices.timer = 0;
+    }
+
+    devices.started = FALSE;
+    start_devices ();
+}
+
+/*
+ * action plugin functions
+ *
+ * The hooks (left click, low and critical levels, status changes) are
+ * dispatched to the built-in shell plugin, which spawns the configured
+ * commands, then to the plugins loaded with --plugin, in order. Callbacks
+ * receive a snapshot of the last update, so they need no sysfs read.
+ */
+#define MAX_PLUGINS 8
+
+G_STATIC_ASSERT ((gint)CBATTICON_STATUS_MISSING      == (gint)MISSING);
+G_STATIC_ASSERT ((gint)CBATTICON_STATUS_UNKNOWN      == (gint)UNKNOWN);
+G_STATIC_ASSERT ((gint)CBATTICON_STATUS_CHARGED      == (gint)CHARGED);
+G_STATIC_ASSERT ((gint)CBATTICON_STATUS_CHARGING     == (gint)CHARGING);
+G_STATIC_ASSERT ((gint)CBATTICON_STATUS_DISCHARGING  == (gint)DISCHARGING);
+G_STATIC_ASSERT ((gint)CBATTICON_STATUS_NOT_CHARGING == (gint)NOT_CHARGING);
+
+static void shell_on_click (const struct cbatticon_snapshot *snapshot)
+{
+    GError *error = NULL;
+
+    if (configuration.command_left_click != NULL) {
+        if (spawn_command (HOOK_LEFT_CLICK, configuration.command_left_click, snapshot, &error) == FALSE) {
+            syslog (LOG_ERR, _("Cannot spawn left click command: %s\n"), error->message);
+
+            g_printerr (_("Cannot spawn left click command: %s\n"), error->message);
+            g_error_free (error); error = NULL;
+
+#ifdef WITH_NOTIFY
+            static NotifyNotification *spawn_notification = NULL;
+            NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn left click command!"), configuration.command_left_click, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_CRITICAL);
+#endif
+        }
+    }
+}
+
+static void shell_on_level (gint level, const struct cbatticon_snapshot *snapshot)
+{
+    GError *error = NULL;
+
+    if (level == CBATTICON_LEVEL_LOW && configuration.command_low_level != NULL) {
+        if (spawn_command (HOOK_LOW_LEVEL, configuration.command_low_level, snapshot, &error) == FALSE) {
+            syslog (LOG_CRIT, _("Cannot spawn low battery level command: %s\n"), error->message);
+
+            g_printerr (_("Cannot spawn low battery level command: %s\n"), error->message);
+            g_error_free (error); error = NULL;
+
+#ifdef WITH_NOTIFY
+            static NotifyNotification *spawn_notification = NULL;
+            NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn low battery level command!"), configuration.command_low_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
+#endif
+        }
+    }
+
+    if (level == CBATTICON_LEVEL_CRITICAL && configuration.command_critical_level != NULL) {
+        if (spawn_command (HOOK_CRITICAL_LEVEL, configuration.command_critical_level, snapshot, &error) == FALSE) {
+            syslog (LOG_CRIT, _("Cannot spawn critical battery level command: %s\n"), error->message);
+
+            g_printerr (_("Cannot spawn critical battery level command: %s\n"), error->message);
+            g_error_free (error); error = NULL;
+
+#ifdef WITH_NOTIFY
+            static NotifyNotification *spawn_notification = NULL;
+            NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn critical battery level command!"), configuration.command_critical_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
+#endif
+        }
+    }
+}
+
+static const struct cbatticon_plugin shell_plugin = {
+    CBATTICON_PLUGIN_API_VERSION,
+    "shell",
+    NULL,
+    shell_on_click,
+    shell_on_level,
+    NULL,
+    NULL
+};
+
+static struct {
+    const struct cbatticon_plugin *plugins[MAX_PLUGINS];
+    void                          *handles[MAX_PLUGINS]; /* NULL for the shell plugin */
+    gint                           num_plugins;
+    guint                          level_sources[2]; /* pending level hooks, by level */
+} plugins = { { &shell_plugin }, { NULL }, 1, { 0, 0 } };
+
+static gboolean load_plugin (const gchar *specification)
+{
+    gchar **parts = g_strsplit (specification, ":", 2);
+    const struct cbatticon_plugin *plugin = NULL;
+    cbatticon_plugin_get_func get_plugin;
+    void *handle;
+
+    if (plugins.num_plugins == MAX_PLUGINS) {
+        g_printerr (_("Cannot load plugin %s: too many plugins\n"), parts[0]);
+        g_strfreev (parts);
+
+        return FALSE;
+    }
+
+    handle = dlopen (parts[0], RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        g_printerr (_("Cannot load plugin %s: %s\n"), parts[0], dlerror ());
+        g_strfreev (parts);
+
+        return FALSE;
+    }
+
+    get_plugin = (cbatticon_plugin_get_func)dlsym (handle, CBATTICON_PLUGIN_SYMBOL);
+    if (get_plugin != NULL) {
+        plugin = get_plugin ();
+    }
+
+    if (plugin == NULL || plugin->api_version != CBATTICON_PLUGIN_API_VERSION) {
+        g_printerr (_("Cannot load plugin %s: not a cbatticon plugin (API version %d)\n"), parts[0], CBATTICON_PLUGIN_API_VERSION);
+        dlclose (handle);
+        g_strfreev (parts);
+
+        return FALSE;
+    }
+
+    if (plugin->init != NULL && plugin->init (parts[1]) != 0) {
+        g_printerr (_("Cannot load plugin %s: initialization failed\n"), parts[0]);
+        dlclose (handle);
+        g_strfreev (parts);
+
+        return FALSE;
+    }
+
+    plugins.plugins[plugins.num_plugins] = plugin;
+    plugins.handles[plugins.num_plugins] = handle;
+    plugins.num_plugins++;
+
+    g_strfreev (parts);
+
+    return TRUE;
+}
+
+static gboolean load_plugins (void)
+{
+    for (gchar **file = configuration.plugin_files; file != NULL && *file != NULL; file++) {
+        if (load_plugin (*file) == FALSE) {
+            unload_plugins ();
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void unload_plugins (void)
+{
+    for (gint i = plugins.num_plugins - 1; i >= 0; i--) {
+        if (plugins.plugins[i]->fini != NULL) {
+            plugins.plugins[i]->fini ();
+        }
+
+        if (plugins.handles[i] != NULL) {
+            dlclose (plugins.handles[i]);
+        }
+    }
+
+    plugins.num_plugins = 0;
+}
+
+static void get_snapshot (struct cbatticon_snapshot *snapshot)
+{
+    snapshot->status             = metrics.status != -1 ? metrics.status : MISSING;
+    snapshot->percentage         = metrics.percentage;
+    snapshot->time               = metrics.time;
+    snapshot->ac_online          = metrics.ac_online;
+    snapshot->num_batteries      = num_batteries;
+    snapshot->full_capacity      = metrics.full_capacity;
+    snapshot->remaining_capacity = metrics.remaining_capacity;
+    snapshot->rate               = metrics.current_rate;
+    snapshot->use_charge         = metrics.use_charge;
+}
+
+static void run_click_hooks (void)
+{
+    struct cbatticon_snapshot snapshot;
+
+    get_snapshot (&snapshot);
+
+    for (gint i = 0; i < plugins.num_plugins; i++) {
+        if (plugins.plugins[i]->on_click != NULL) {
+            plugins.plugins[i]->on_click (&snapshot);
+        }
+    }
+}
+
+static void fire_level_hooks (gint level)
+{
+    struct cbatticon_snapshot snapshot;
+
+    if (read_battery_statuses () == TRUE) {
+        if (aggregate.status != DISCHARGING && aggregate.status != NOT_CHARGING) {
+            if (level == CBATTICON_LEVEL_LOW) {
+                syslog (LOG_NOTICE, _("Skipping low battery level command, no longer discharging"));
+            } else {
+                syslog (LOG_NOTICE, _("Skipping critical battery level command, no longer discharging"));
+            }
+
+            return;
+        }
+    }
+
+    get_snapshot (&snapshot);
+
+    for (gint i = 0; i < plugins.num_plugins; i++) {
+        if (plugins.plugins[i]->on_level != NULL) {
+            plugins.plugins[i]->on_level (level, &snapshot);
+        }
+    }
+}
+
+static gboolean on_level_hooks_due (gpointer user_data)
+{
+    gint level = GPOINTER_TO_INT (user_data);
+
+    wakeup_claim (WAKEUP_TIMER);
+
+    plugins.level_sources[level] = 0;
+    fire_level_hooks (level);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void run_level_hooks (gint level)
+{
+    const gchar *command = level == CBATTICON_LEVEL_LOW ? configuration.command_low_level : configuration.command_critical_level;
+    gboolean hooked = command != NULL;
+
+    for (gint i = 1; i < plugins.num_plugins; i++) {
+        hooked = hooked || plugins.plugins[i]->on_level != NULL;
+    }
+
+    if (hooked == FALSE || plugins.level_sources[level] != 0) {
+        return;
+    }
+
+    /* give the user some time to plug the AC before running the actions, */
+    /* from a timer so that the updates go on meanwhile                    */
+
+    if (level == CBATTICON_LEVEL_LOW) {
+        if (command != NULL) {
+            syslog (LOG_CRIT, _("Spawning low battery level command in 5 seconds: %s"), command);
+        } else {
+            syslog (LOG_CRIT, _("Running low battery level plugins in 5 seconds"));
+        }
+    } else {
+        if (command != NULL) {
+            syslog (LOG_CRIT, _("Spawning critical battery level command in 30 seconds: %s"), command);
+        } else {
+            syslog (LOG_CRIT, _("Running critical battery level plugins in 30 seconds"));
+        }
+    }
+
+    if (REPLAYING) {
+        fire_level_hooks (level);
+        return;
+    }
+
+    plugins.level_sources[level] = toolkit_timeout_add (level == CBATTICON_LEVEL_LOW ? 5 : 30, on_level_hooks_due, GINT_TO_POINTER (level));
+}
+
+static void run_status_hooks (gint old_status)
+{
+    struct cbatticon_snapshot snapshot;
+
+    get_snapshot (&snapshot);
+
+    for (gint i = 0; i < plugins.num_plugins; i++) {
+        if (plugins.plugins[i]->on_status != NULL) {
+            plugins.plugins[i]->on_status (old_status, &snapshot);
+        }
+    }
+}
+
+/*
+ * child process supervisor functions
+ *
+ * Commands are parsed like a shell command line and started with
+ * posix_spawnp in their own process group, with the battery state of the
+ * last update in CBATTICON_PERCENT, CBATTICON_STATUS and CBATTICON_MINUTES.
+ * Each child is reaped by a child watch, which logs its exit status and run
+ * time. A hook only runs a limited number of commands at once, and with a
+ * timeout, the process group of a command still running is sent SIGTERM,
+ * then SIGKILL a few seconds later.
+ */
+#define CHILD_KILL_DELAY 5
+
+static const gchar *hook_names[HOOKS] = {
+    "left click",
+    "low level",
+    "critical level",
+    "level rule"
+};
+
+struct child {
+    GPid     pid;
+    gint     hook;
+    gint64   start_time;
+    guint    timeout;    /* 0 when none */
+    gboolean terminated; /* SIGTERM sent */
+};
+
+static gint running_children[HOOKS];
+
+static void on_child_exit (GPid pid, gint wait_status, gpointer user_data)
+{
+    struct child *child = (struct child *)user_data;
+    gdouble run_time = (g_get_monotonic_time () - child->start_time) / (gdouble)G_USEC_PER_SEC;
+
+    wakeup_claim (WAKEUP_OTHER);
+
+    if (WIFEXITED (wait_status)) {
+        syslog (LOG_INFO, _("%s command (pid %d) exited with status %d after %.1f seconds"),
+            hook_names[child->hook], (gint)pid, WEXITSTATUS (wait_status), run_time);
+        LOG_EVENT (EVENT_CHILD_EXIT, NULL, child->hook, pid, WEXITSTATUS (wait_status), run_time);
+    } else if (WIFSIGNALED (wait_status)) {
+        syslog (LOG_INFO, _("%s command (pid %d) killed by signal %d after %.1f seconds"),
+            hook_names[child->hook], (gint)pid, WTERMSIG (wait_status), run_time);
+        LOG_EVENT (EVENT_CHILD_EXIT, NULL, child->hook, pid, -WTERMSIG (wait_status), run_time);
+    }
+
+    if (child->timeout != 0) {
+        g_source_remove (child->timeout);
+    }
+
+    running_children[child->hook]--;
+
+    g_spawn_close_pid (pid);
+    g_free (child);
+}
+
+static gboolean on_child_timeout (gpointer user_data)
+{
+    struct child *child = (struct child *)user_data;
+
+    wakeup_claim (WAKEUP_TIMER);
+
+    if (child->terminated == FALSE) {
+        syslog (LOG_NOTICE, _("%s command (pid %d) timed out, terminating it"), hook_names[child->hook], (gint)child->pid);
+        kill (-child->pid, SIGTERM);
+        metrics.spawn_timeouts++;
+
+        child->terminated = TRUE;
+        child->timeout    = g_timeout_add_seconds (CHILD_KILL_DELAY, on_child_timeout, child);
+    } else {
+        kill (-child->pid, SIGKILL);
+        child->timeout = 0;
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static gchar** get_command_environment (const struct cbatticon_snapshot *snapshot)
+{
+    gchar **environment = g_get_environ ();
+    gchar value[STR_LTH];
+
+    g_snprintf (value, STR_LTH, "%d", snapshot->percentage);
+    environment = g_environ_setenv (environment, "CBATTICON_PERCENT", snapshot->percentage >= 0 ? value : "", TRUE);
+
+    environment = g_environ_setenv (environment, "CBATTICON_STATUS", get_status_name (snapshot->status), TRUE);
+
+    g_snprintf (value, STR_LTH, "%d", snapshot->time);
+    environment = g_environ_setenv (environment, "CBATTICON_MINUTES", snapshot->time >= 0 ? value : "", TRUE);
+
+    return environment;
+}
+
+static gboolean spawn_command (gint hook, const gchar *command, const struct cbatticon_snapshot *snapshot, GError **error)
+{
+    posix_spawnattr_t attributes;
+    sigset_t default_signals;
+    struct child *child;
+    gchar **arguments = NULL;
+    gchar **environment;
+    pid_t pid;
+    gint status;
+
+    if (REPLAYING) {
+        replay_log ("spawn: %s", command);
+        return TRUE;
+    }
+
+    if (running_children[hook] >= configuration.command_max_running) {
+        g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, _("%s command not spawned, %d already running"), hook_names[hook], running_children[hook]);
+        LOG_EVENT (EVENT_SPAWN_REJECTED, NULL, hook, running_children[hook], 0, 0);
+
+        return FALSE;
+    }
+
+    if (g_shell_parse_argv (command, NULL, &arguments, error) == FALSE) {
+        metrics.spawn_errors++;
+        return FALSE;
+    }
+
+    /* own process group, so that a timeout kills the whole command; every */
+    /* descriptor but the standard streams is opened close on exec          */
+
+    sigemptyset (&default_signals);
+    sigaddset (&default_signals, SIGPIPE);
+
+    posix_spawnattr_init (&attributes);
+    posix_spawnattr_setflags (&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup (&attributes, 0);
+    posix_spawnattr_setsigdefault (&attributes, &default_signals);
+
+    environment = get_command_environment (snapshot);
+    status = posix_spawnp (&pid, arguments[0], NULL, &attributes, arguments, environment);
+
+    posix_spawnattr_destroy (&attributes);
+    g_strfreev (environment);
+
+    if (status != 0) {
+        g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, _("Failed to execute child process \"%s\" (%s)"), arguments[0], g_strerror (status));
+        g_strfreev (arguments);
+        metrics.spawn_errors++;
+
+        return FALSE;
+    }
+
+    g_strfreev (arguments);
+
+    child = g_new0 (struct child, 1);
+    child->pid        = pid;
+    child->hook       = hook;
+    child->start_time = g_get_monotonic_time ();
+
+    if (configuration.command_timeout > 0) {
+        child->timeout = g_timeout_add_seconds (configuration.command_timeout, on_child_timeout, child);
+    }
+
+    g_child_watch_add (pid, on_child_exit, child);
+
+    running_children[hook]++;
+    metrics.spawns++;
+
+    return TRUE;
+}
+
+/*
+ * startup functions
+ *
+ * Until the first icon is shown, the steps that do not depend on each other
+ * are overlapped: the power supplies are discovered and the notification
+ * server is connected to (a D-Bus round trip) on worker threads, while the
+ * main thread loads the toolkit and probes the icon types. The discovery is
+ * joined before the first update, the notification worker only before the
+ * first notification, so that a slow notification server does not delay the
+ * icon. With --startup-trace, the time of each step is printed once the icon
+ * is shown.
+ */
+
+enum {
+    STARTUP_OPTIONS = 0,
+    STARTUP_DISCOVERY,
+    STARTUP_NOTIFICATION,
+    STARTUP_TOOLKIT_LOAD,
+    STARTUP_TOOLKIT_INIT,
+    STARTUP_ICON_TYPES,
+    STARTUP_DISCOVERY_WAIT,
+    STARTUP_FIRST_UPDATE,
+    STARTUP_PHASES
+};
+
+static const gchar *startup_phase_names[STARTUP_PHASES] = {
+    "options",
+    "discovery (worker)",
+    "notification (worker)",
+    "toolkit load",
+    "toolkit init",
+    "icon types",
+    "discovery wait",
+    "first update"
+};
+
+static struct {
+    gint64    origin;
+    gint64    start[STARTUP_PHASES];
+    gint64    end[STARTUP_PHASES];
+    gboolean  icon_types_cached;
+    GThread  *discovery;
+    GThread  *notification;
+} startup;
+
+static void startup_add (gint phase, gint64 start)
+{
+    startup.start[phase] = start;
+    startup.end[phase]   = profile_get_time ();
+}
+
+static gpointer startup_discovery_thread (gpointer data)
+{
+    gint64 profile_start = profile_get_time ();
+
+    get_power_supplies ();
+
+    startup_add (STARTUP_DISCOVERY, profile_start);
+
+    return NULL;
+}
+
+#ifdef WITH_NOTIFY
+static gpointer startup_notification_thread (gpointer data)
+{
+    gint64 profile_start = profile_get_time ();
+    GList *caps;
+
+    /* asking for the server capabilities creates the connection the first */
+    /* notification would otherwise wait for                               */
+
+    if (notify_init (CBATTICON_STRING) == TRUE) {
+        caps = notify_get_server_caps ();
+        g_list_free_full (caps, g_free);
+    }
+
+    startup_add (STARTUP_NOTIFICATION, profile_start);
+
+    return NULL;
+}
+#endif
+
+static void startup_start_workers (void)
+{
+    startup_add (STARTUP_OPTIONS, startup.origin);
+
+    startup.discovery = g_thread_new ("discovery", startup_discovery_thread, NULL);
+
+#ifdef WITH_NOTIFY
+    if (configuration.hide_notification == FALSE) {
+        startup.notification = g_thread_new ("notification", startup_notification_thread, NULL);
+    }
+#endif
+}
+
+static void startup_join_workers (void)
+{
+    gint64 profile_start = profile_get_time ();
+
+    if (startup.discovery != NULL) {
+        g_thread_join (startup.discovery);
+        startup.discovery = NULL;
+    } else {
+        get_power_supplies ();
+    }
+
+    startup_add (STARTUP_DISCOVERY_WAIT, profile_start);
+}
+
+#ifdef WITH_NOTIFY
+static void startup_join_notification (void)
+{
+    if (startup.notification != NULL) {
+        g_thread_join (startup.notification);
+        startup.notification = NULL;
+    }
+}
+#endif
+
+/* on a startup error, the workers are waited for before exiting */
+
+static void startup_stop_workers (void)
+{
+    if (startup.discovery != NULL) {
+        g_thread_join (startup.discovery);
+        startup.discovery = NULL;
+    }
+
+#ifdef WITH_NOTIFY
+    startup_join_notification ();
+#endif
+}
+
+static void startup_print (void)
+{
+#ifdef WITH_NOTIFY
+    startup_join_notification ();
+#endif
+
+    g_printerr ("%-24s %10s %10s %10s\n", "startup (ms)", "start", "end", "duration");
+
+    for (gint phase = 0; phase < STARTUP_PHASES; phase++) {
+        if (startup.end[phase] == 0) {
+            continue;
+        }
+
+        g_printerr ("%-24s %10.3f %10.3f %10.3f%s\n", startup_phase_names[phase],
+            (startup.start[phase] - startup.origin) / 1e6,
+            (startup.end[phase] - startup.origin) / 1e6,
+            (startup.end[phase] - startup.start[phase]) / 1e6,
+            phase == STARTUP_ICON_TYPES && startup.icon_types_cached == TRUE ? "  (cached)" : "");
+    }
+
+    g_printerr ("first icon shown after %.3f ms\n", (startup.end[STARTUP_FIRST_UPDATE] - startup.origin) / 1e6);
+}
+
+/*
+ * toolkit backend functions
+ *
+ * The toolkit is only loaded, with dlopen, once the options need an icon,
+ * so the listing, probing, replay and benchmark options start without it.
+ * Without --toolkit, the backend matching the desktop is tried first, then
+ * the default one, then the others; a backend that cannot be loaded (not
+ * installed, or its toolkit missing) is skipped, but one that fails to
+ * initialise is not, since two toolkits cannot share the process.
+ */
+
+static const gchar *toolkit_names[] = { "gtk3", "qt6", "gtk2" };
+
+static gchar* get_backend_filename (const gchar *toolkit)
+{
+    if (strchr (toolkit, '/') != NULL) {
+        return g_strdup (toolkit);
+    }
+
+    return g_strdup_printf ("%s/cbatticon-%s.so", BACKENDDIR, toolkit);
+}
+
+static gboolean open_backend (const gchar *toolkit, gboolean verbose)
+{
+    gchar *filename = get_backend_filename (toolkit);
+    void *handle = dlopen (filename, RTLD_NOW | RTLD_LOCAL);
+    cbatticon_backend_get_func get_backend;
+    const struct cbatticon_backend *candidate = NULL;
+
+    if (handle == NULL) {
+        if (verbose == TRUE) {
+            g_printerr (_("Cannot load toolkit backend %s: %s\n"), filename, dlerror ());
+        }
+
+        g_free (filename);
+        return FALSE;
+    }
+
+    *(void **)(&get_backend) = dlsym (handle, CBATTICON_BACKEND_SYMBOL);
+    if (get_backend != NULL) {
+        candidate = get_backend ();
+    }
+
+    if (candidate == NULL || candidate->api_version != CBATTICON_BACKEND_API_VERSION) {
+        g_printerr (_("Invalid toolkit backend: %s\n"), filename);
+
+        dlclose (handle);
+        g_free (filename);
+        return FALSE;
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("toolkit backend: %s (%s)\n", candidate->name, filename);
+    }
+
+    backend = candidate;
+
+    g_free (filename);
+    return TRUE;
+}
+
+static const gchar* get_desktop_toolkit (void)
+{
+    const gchar *desktop = g_getenv ("XDG_CURRENT_DESKTOP");
+
+    if (desktop != NULL && (strstr (desktop, "KDE") != NULL || strstr (desktop, "LXQt") != NULL)) {
+        return "qt6";
+    }
+
+    return NULL;
+}
+
+static gboolean load_backend (int *argc, char ***argv)
+{
+    const gchar *desktop_toolkit = get_desktop_toolkit ();
+    gint64 profile_start = profile_get_time ();
+
+    if (configuration.toolkit != NULL) {
+        open_backend (configuration.toolkit, TRUE);
+    } else {
+        if (desktop_toolkit != NULL) {
+            open_backend (desktop_toolkit, FALSE);
+        }
+
+        if (backend == NULL) {
+            open_backend (DEFAULT_TOOLKIT, FALSE);
+        }
+
+        for (guint i = 0; backend == NULL && i < G_N_ELEMENTS (toolkit_names); i++) {
+            open_backend (toolkit_names[i], FALSE);
+        }
+
+        if (backend == NULL) {
+            g_printerr (_("No toolkit backend found in %s!\n"), BACKENDDIR);
+        }
+    }
+
+    if (backend == NULL) {
+        return FALSE;
+    }
+
+    startup_add (STARTUP_TOOLKIT_LOAD, profile_start);
+    profile_start = profile_get_time ();
+
+    if (backend->init (argc, argv) != 0) {
+        g_printerr (_("Cannot initialize toolkit %s!\n"), backend->name);
+        return FALSE;
+    }
+
+    startup_add (STARTUP_TOOLKIT_INIT, profile_start);
+
+    return TRUE;
+}
+
+/* the updates, the device polls and the metrics sockets run in the toolkit */
+/* main loop when the backend can, the rest stays in the glib main context; */
+/* the ids of the toolkit sources have their top bit set, which the glib    */
+/* ids never reach                                                          */
+
+#define TOOLKIT_SOURCE 0x80000000u
+
+G_STATIC_ASSERT (CBATTICON_FD_IN  == G_IO_IN);
+G_STATIC_ASSERT (CBATTICON_FD_PRI == G_IO_PRI);
+G_STATIC_ASSERT (CBATTICON_FD_OUT == G_IO_OUT);
+G_STATIC_ASSERT (CBATTICON_FD_ERR == G_IO_ERR);
+G_STATIC_ASSERT (CBATTICON_FD_HUP == G_IO_HUP);
+
+static guint toolkit_timeout_add (guint seconds, GSourceFunc func, gpointer user_data)
+{
+    if (backend != NULL && backend->timeout_add != NULL) {
+        return backend->timeout_add (seconds, (cbatticon_timeout_func)func, user_data) | TOOLKIT_SOURCE;
+    }
+
+    return g_timeout_add_seconds (seconds, func, user_data);
+}
+
+static guint toolkit_fd_add (gint fd, GIOCondition condition, GUnixFDSourceFunc func, gpointer user_data)
+{
+    if (backend != NULL && backend->fd_add != NULL) {
+        return backend->fd_add (fd, condition, (cbatticon_fd_func)func, user_data) | TOOLKIT_SOURCE;
+    }
+
+    return g_unix_fd_add (fd, condition, func, user_data);
+}
+
+static void toolkit_source_remove (guint id)
+{
+    if ((id & TOOLKIT_SOURCE) != 0) {
+        backend->source_remove (id & ~TOOLKIT_SOURCE);
+    } else {
+        g_source_remove (id);
+    }
+}
+
+/*
+ * icon type functions
+ *
+ * Looking an icon up loads the whole icon theme, so the icon types are
+ * probed once, and the result is cached in $XDG_CACHE_HOME/cbatticon,
+ * keyed by the theme name and the modification time of the directories of
+ * the theme, of the themes it inherits from and of hicolor (icon installs
+ * and cache updates change them). A cached result skips loading the theme.
+ */
+
+static const gchar *icon_type_probes[] = {
+    NULL,                       /* UNKNOWN_ICON              */
+    "battery-full",             /* BATTERY_ICON              */
+    "battery-full-symbolic",    /* BATTERY_ICON_SYMBOLIC     */
+    "notification-battery-100"  /* BATTERY_ICON_NOTIFICATION */
+};
+
+static gint icon_types = -1; /* bit mask of the available icon types, -1 until probed */
+
+static gint64 get_icon_theme_mtime (const gchar *theme)
+{
+    const gchar * const *data_dirs = g_get_system_data_dirs ();
+    GPtrArray *dirs = g_ptr_array_new_with_free_func (g_free);
+    GPtrArray *themes = g_ptr_array_new_with_free_func (g_free);
+    gint64 mtime = 0;
+
+    g_ptr_array_add (dirs, g_build_filename (g_get_user_data_dir (), "icons", NULL));
+    g_ptr_array_add (dirs, g_build_filename (g_get_home_dir (), ".icons", NULL));
+    for (gint i = 0; data_dirs[i] != NULL; i++) {
+        g_ptr_array_add (dirs, g_build_filename (data_dirs[i], "icons", NULL));
+    }
+
+    g_ptr_array_add (themes, g_strdup (theme));
+    g_ptr_array_add (themes, g_strdup ("hicolor"));
+
+    for (guint i = 0; i < themes->len; i++) {
+        for (guint j = 0; j < dirs->len; j++) {
+            gchar *path = g_build_filename ((const gchar *)g_ptr_array_index (dirs, j), (const gchar *)g_ptr_array_index (themes, i), NULL);
+            gchar *index = g_build_filename (path, "index.theme", NULL);
+            GKeyFile *key_file;
+            GStatBuf path_stat;
+
+            if (g_stat (path, &path_stat) == 0) {
+                mtime = MAX (mtime, (gint64)path_stat.st_mtime);
+            }
+
+            /* the themes inherited by the selected one */
+
+            key_file = g_key_file_new ();
+            if (i == 0 && g_key_file_load_from_file (key_file, index, G_KEY_FILE_NONE, NULL) == TRUE) {
+                gchar **inherits = g_key_file_get_string_list (key_file, "Icon Theme", "Inherits", NULL, NULL);
+
+                for (gint k = 0; inherits != NULL && inherits[k] != NULL; k++) {
+                    g_ptr_array_add (themes, g_strdup (inherits[k]));
+                }
+
+                g_strfreev (inherits);
+            }
+            g_key_file_free (key_file);
+
+            g_free (index);
+            g_free (path);
+        }
+    }
+
+    g_ptr_array_free (themes, TRUE);
+    g_ptr_array_free (dirs, TRUE);
+
+    return mtime;
+}
+
+static gchar* get_icon_cache_filename (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), CBATTICON_STRING, "icon-types", NULL);
+}
+
+static gboolean read_icon_cache (const gchar *theme, gint64 mtime, gint *types)
+{
+    gchar *filename = get_icon_cache_filename ();
+    GKeyFile *key_file = g_key_file_new ();
+    gboolean found = FALSE;
+
+    if (g_key_file_load_from_file (key_file, filename, G_KEY_FILE_NONE, NULL) == TRUE) {
+        gchar *cached_theme = g_key_file_get_string (key_file, "icon-types", "theme", NULL);
+        gint64 cached_mtime = g_key_file_get_int64 (key_file, "icon-types", "mtime", NULL);
+        GError *error = NULL;
+
+        *types = g_key_file_get_integer (key_file, "icon-types", "types", &error);
+
+        found = error == NULL && g_strcmp0 (cached_theme, theme) == 0 && cached_mtime == mtime;
+
+        g_clear_error (&error);
+        g_free (cached_theme);
+    }
+
+    g_key_file_free (key_file);
+    g_free (filename);
+
+    return found;
+}
+
+static void write_icon_cache (const gchar *theme, gint64 mtime, gint types)
+{
+    gchar *filename = get_icon_cache_filename ();
+    gchar *directory = g_path_get_dirname (filename);
+    GKeyFile *key_file = g_key_file_new ();
+    gchar *data;
+    gsize length;
+
+    g_key_file_set_string (key_file, "icon-types", "theme", theme);
+    g_key_file_set_int64 (key_file, "icon-types", "mtime", mtime);
+    g_key_file_set_integer (key_file, "icon-types", "types", types);
+
+    data = g_key_file_to_data (key_file, &length, NULL);
+
+    /* a cache that cannot be written is only a slower next start */
+
+    if (g_mkdir_with_parents (directory, 0700) == 0) {
+        g_file_set_contents (filename, data, (gssize)length, NULL);
+    }
+
+    g_free (data);
+    g_key_file_free (key_file);
+    g_free (directory);
+    g_free (filename);
+}
+
+static gint probe_icon_types (void)
+{
+    gint types = 0;
+
+    for (gint icon_type = BATTERY_ICON; icon_type <= BATTERY_ICON_NOTIFICATION; icon_type++) {
+        if (TRAY_ICON_HAS_ICON (icon_type_probes[icon_type]) == TRUE) {
+            types |= 1 << icon_type;
+        }
+    }
+
+    return types;
+}
+
+static gboolean has_icon_type (gint icon_type)
+{
+    gint64 profile_start;
+    char *theme;
+    gint64 mtime;
+
+    if (icon_types != -1) {
+        return (icon_types & (1 << icon_type)) != 0 ? TRUE : FALSE;
+    }
+
+    profile_start = profile_get_time ();
+
+    theme = backend->theme_name != NULL ? backend->theme_name () : NULL;
+    mtime = theme != NULL ? get_icon_theme_mtime (theme) : 0;
+
+    /* --list-icon-types always looks at the theme itself */
+
+    if (theme != NULL && configuration.list_icon_types == FALSE && read_icon_cache (theme, mtime, &icon_types) == TRUE) {
+        startup.icon_types_cached = TRUE;
+    } else {
+        icon_types = probe_icon_types ();
+
+        if (theme != NULL) {
+            write_icon_cache (theme, mtime, icon_types);
+        }
+    }
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("icon theme: %s, icon types: %d%s\n", theme != NULL ? theme : "unknown", icon_types,
+            startup.icon_types_cached == TRUE ? " (cached)" : "");
+    }
+
+    free (theme);
+
+    startup_add (STARTUP_ICON_TYPES, profile_start);
+
+    return (icon_types & (1 << icon_type)) != 0 ? TRUE : FALSE;
+}
+
+/*
+ * UPower source functions
+ *
+ * Most desktops run upowerd, which already polls the batteries. Unless
+ * --source=sysfs is used, once UPower is found on the system bus the
+ * batteries are read from its devices instead of sysfs: proxies follow the
+ * properties of the display device (all the batteries combined) and of each
+ * battery, the tray icon is updated when they change (PropertiesChanged),
+ * and the update timer is stopped. Percentage, State, TimeToEmpty,
+ * TimeToFull, Energy, EnergyFull and EnergyRate take the place of the sysfs
+ * reads and of the estimation. The first update, before the bus is joined,
+ * still reads sysfs, and so do all the updates again if UPower leaves the
+ * bus. Recording and replaying always read sysfs.
+ */
+
+#define UPOWER_NAME             "org.freedesktop.UPower"
+#define UPOWER_PATH             "/org/freedesktop/UPower"
+#define UPOWER_INTERFACE        "org.freedesktop.UPower"
+#define UPOWER_DEVICE_INTERFACE "org.freedesktop.UPower.Device"
+#define UPOWER_DISPLAY_DEVICE   "/org/freedesktop/UPower/devices/DisplayDevice"
+
+#define UPOWER_TYPE_BATTERY 2
+#define UPOWER_UPDATE_DELAY 100 /* ms */
+
+enum {
+    UPOWER_STATE_UNKNOWN = 0,
+    UPOWER_STATE_CHARGING,
+    UPOWER_STATE_DISCHARGING,
+    UPOWER_STATE_EMPTY,
+    UPOWER_STATE_FULLY_CHARGED,
+    UPOWER_STATE_PENDING_CHARGE,
+    UPOWER_STATE_PENDING_DISCHARGE
+};
+
+static GVariant* upower_get_property (GDBusProxy *proxy, const gchar *name, const gchar *type)
+{
+    GVariant *value;
+
+    if (proxy == NULL) {
+        return NULL;
+    }
+
+    value = g_dbus_proxy_get_cached_property (proxy, name);
+    if (value != NULL && g_variant_is_of_type (value, G_VARIANT_TYPE (type)) == FALSE) {
+        g_variant_unref (value);
+        value = NULL;
+    }
+
+    return value;
+}
+
+static gboolean upower_get_boolean (GDBusProxy *proxy, const gchar *name, gboolean fallback)
+{
+    GVariant *value = upower_get_property (proxy, name, "b");
+    gboolean result = fallback;
+
+    if (value != NULL) {
+        result = g_variant_get_boolean (value);
+        g_variant_unref (value);
+    }
+
+    return result;
+}
+
+static guint upower_get_uint (GDBusProxy *proxy, const gchar *name, guint fallback)
+{
+    GVariant *value = upower_get_property (proxy, name, "u");
+    guint result = fallback;
+
+    if (value != NULL) {
+        result = g_variant_get_uint32 (value);
+        g_variant_unref (value);
+    }
+
+    return result;
+}
+
+static gint64 upower_get_int64 (GDBusProxy *proxy, const gchar *name, gint64 fallback)
+{
+    GVariant *value = upower_get_property (proxy, name, "x");
+    gint64 result = fallback;
+
+    if (value != NULL) {
+        result = g_variant_get_int64 (value);
+        g_variant_unref (value);
+    }
+
+    return result;
+}
+
+static gdouble upower_get_double (GDBusProxy *proxy, const gchar *name, gdouble fallback)
+{
+    GVariant *value = upower_get_property (proxy, name, "d");
+    gdouble result = fallback;
+
+    if (value != NULL) {
+        result = g_variant_get_double (value);
+        g_variant_unref (value);
+    }
+
+    return result;
+}
+
+static gchar* upower_get_string (GDBusProxy *proxy, const gchar *name)
+{
+    GVariant *value = upower_get_property (proxy, name, "s");
+    gchar *result = NULL;
+
+    if (value != NULL) {
+        result = g_strdup (g_variant_get_string (value, NULL));
+        g_variant_unref (value);
+    }
+
+    return result;
+}
+
+static gint upower_get_status (GDBusProxy *proxy)
+{
+    switch (upower_get_uint (proxy, "State", UPOWER_STATE_UNKNOWN)) {
+        case UPOWER_STATE_CHARGING:          return CHARGING;
+        case UPOWER_STATE_DISCHARGING:       return DISCHARGING;
+        case UPOWER_STATE_EMPTY:             return DISCHARGING;
+        case UPOWER_STATE_FULLY_CHARGED:     return CHARGED;
+        case UPOWER_STATE_PENDING_CHARGE:    return NOT_CHARGING;
+        case UPOWER_STATE_PENDING_DISCHARGE: return DISCHARGING;
+        default:                             return UNKNOWN;
+    }
+}
+
+/* the display device combines the batteries, a battery id selects one */
+
+static GDBusProxy* upower_get_source (void)
+{
+    return battery_suffix == NULL ? upower.display : upower.batteries[0];
+}
+
+static void upower_read_device (GDBusProxy *proxy, struct cbatticon_battery *battery)
+{
+    gdouble full, remaining, rate;
+
+    /* UPower reports energy in Wh and power in W */
+
+    full      = upower_get_double (proxy, "EnergyFull", 0);
+    remaining = upower_get_double (proxy, "Energy", -1);
+    rate      = upower_get_double (proxy, "EnergyRate", -1);
+
+    battery->present            = upower_get_boolean (proxy, "IsPresent", FALSE);
+    battery->status             = battery->present == TRUE ? upower_get_status (proxy) : MISSING;
+    battery->use_charge         = FALSE;
+    battery->from_pct           = FALSE;
+    battery->full_capacity      = full * 1e6;
+    battery->remaining_capacity = full > 0 && remaining >= 0 ? remaining * 1e6 : -1;
+    battery->rate               = rate > 0 ? rate * 1e6 : -1;
+}
+
+static void upower_get_batteries (void)
+{
+    for (gint i = 0; i < num_batteries; i++) {
+        g_free (batteries[i].path);
+        upower.batteries[i] = NULL;
+    }
+
+    num_batteries = 0;
+
+    for (guint i = 0; i < upower.devices->len && num_batteries < MAX_BATTERIES; i++) {
+        GDBusProxy *proxy = (GDBusProxy *)g_ptr_array_index (upower.devices, i);
+        gchar *native_path, *name;
+
+        if (upower_get_uint (proxy, "Type", 0) != UPOWER_TYPE_BATTERY || upower_get_boolean (proxy, "PowerSupply", FALSE) == FALSE) {
+            continue;
+        }
+
+        native_path = upower_get_string (proxy, "NativePath");
+        name = g_path_get_basename (native_path != NULL ? native_path : g_dbus_proxy_get_object_path (proxy));
+
+        if (battery_suffix == NULL || (num_batteries == 0 && g_str_has_suffix (name, battery_suffix) == TRUE)) {
+            struct cbatticon_battery *battery = &batteries[num_batteries];
+
+            battery->path = g_build_filename (SYSFS_PATH, name, NULL);
+            upower.batteries[num_batteries++] = proxy;
+
+            if (configuration.debug_output == TRUE) {
+                g_printf ("battery device: %s\n", g_dbus_proxy_get_object_path (proxy));
+            }
+        }
+
+        g_free (native_path);
+        g_free (name);
+    }
+
+    if (num_batteries == 0 && battery_suffix != NULL) {
+        g_printerr (_("No battery with suffix %s found!\n"), battery_suffix);
+    }
+}
+
+static gboolean upower_changed_power_supplies (void)
+{
+    if (upower.changed == FALSE) {
+        return FALSE;
+    }
+
+    upower.changed = FALSE;
+    metrics.rediscoveries++;
+    LOG_EVENT (EVENT_SUPPLIES_CHANGED, NULL, 0, 0, 0, 0);
+
+    /* back to sysfs when UPower left */
+
+    if (upower.active == TRUE) {
+        upower_get_batteries ();
+    } else {
+        get_power_supplies ();
+    }
+
+    return TRUE;
+}
+
+static gboolean upower_read_batteries (void)
+{
+    GDBusProxy *source = upower_get_source ();
+    struct cbatticon_battery combined;
+
+    if (source == NULL) {
+        return FALSE;
+    }
+
+    for (gint i = 0; i < num_batteries; i++) {
+        upower_read_device (upower.batteries[i], &batteries[i]);
+    }
+
+    upower_read_device (source, &combined);
+
+    aggregate.present            = combined.present;
+    aggregate.status             = combined.status;
+    aggregate.use_charge         = FALSE;
+    aggregate.from_pct           = FALSE;
+    aggregate.full_capacity      = combined.full_capacity;
+    aggregate.remaining_capacity = combined.remaining_capacity;
+    aggregate.rate               = combined.rate;
+
+    LOG_EVENT (EVENT_BATTERIES, NULL, num_batteries, aggregate.remaining_capacity, aggregate.full_capacity, aggregate.rate);
+
+    return TRUE;
+}
+
+static gboolean upower_get_battery_charge (gboolean remaining, gint *percentage, gint *time)
+{
+    GDBusProxy *source = upower_get_source ();
+    gdouble value = upower_get_double (source, "Percentage", -1);
+    gint64 seconds;
+
+    g_return_val_if_fail (percentage != NULL, FALSE);
+
+    if (value < 0) {
+        LOG_EVENT (EVENT_UNAVAILABLE, "battery capacity", 0, 0, 0, 0);
+
+        return FALSE;
+    }
+
+    *percentage = (gint)fmin (floor (value), 100.0);
+
+    metrics.use_charge         = FALSE;
+    metrics.full_capacity      = aggregate.remaining_capacity < 0 ? -1 : aggregate.full_capacity;
+    metrics.remaining_capacity = aggregate.remaining_capacity;
+
+    if (time == NULL) {
+        return TRUE;
+    }
+
+    /* UPower reports 0 until it has an estimate */
+
+    seconds = upower_get_int64 (source, remaining == TRUE ? "TimeToEmpty" : "TimeToFull", 0);
+    *time = seconds > 0 ? (gint)(seconds / 60) : -1;
+
+    if (*time < 0) {
+        LOG_EVENT (EVENT_UNAVAILABLE, "time remaining", 0, 0, 0, 0);
+    }
+
+    metrics.current_rate = aggregate.rate;
+
+    return TRUE;
+}
+
+static gboolean upower_get_ac_online (gboolean *online)
+{
+    GVariant *value = upower_get_property (upower.daemon, "OnBattery", "b");
+
+    if (value == NULL) {
+        return FALSE;
+    }
+
+    *online = g_variant_get_boolean (value) == FALSE;
+    g_variant_unref (value);
+
+    LOG_EVENT (EVENT_AC_ONLINE, NULL, *online, 0, 0, 0);
+
+    return TRUE;
+}
+
+static gboolean on_upower_update (gpointer user_data)
+{
+    guint *source = (guint *)user_data;
+
+    *source = 0;
+
+    if (upower.active == TRUE || upower.changed == TRUE) {
+        update_tray_icon (battery_tray_icon);
+    }
+
+    /* without ticks, a status waiting for --status-dwell is read again once it is over */
+
+    if (upower.active == TRUE && is_status_pending () == TRUE && upower.dwell == 0) {
+        upower.dwell = g_timeout_add_seconds (configuration.status_dwell, on_upower_update, &upower.dwell);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void upower_queue_update (void)
+{
+    /* the devices and the display device signal their changes one after the */
+    /* other, they are read once                                             */
+
+    if (upower.update == 0) {
+        upower.update = g_timeout_add (UPOWER_UPDATE_DELAY, on_upower_update, &upower.update);
+    }
+}
+
+static void on_upower_properties_changed (GDBusProxy *proxy, GVariant *changed_properties, GStrv invalidated_properties,
+                                          gpointer user_data)
+{
+    wakeup_claim (WAKEUP_DBUS);
+
+    upower_queue_update ();
+}
+
+static void upower_clear_devices (void)
+{
+    g_clear_pointer (&upower.devices, g_ptr_array_unref);
+    g_clear_object (&upower.display);
+    memset (upower.batteries, 0, sizeof (upower.batteries));
+}
+
+static void upower_clear_loading (void)
+{
+    g_clear_pointer (&upower.loading, g_ptr_array_unref);
+    g_clear_object (&upower.loading_display);
+    upower.pending = 0;
+}
+
+static void upower_set_devices (void)
+{
+    if (upower.loading_display == NULL) {
+        upower_clear_loading ();
+        return;
+    }
+
+    upower_clear_devices ();
+
+    upower.devices         = upower.loading;
+    upower.display         = upower.loading_display;
+    upower.loading         = NULL;
+    upower.loading_display = NULL;
+
+    g_signal_connect (upower.display, "g-properties-changed", G_CALLBACK (on_upower_properties_changed), NULL);
+    for (guint i = 0; i < upower.devices->len; i++) {
+        g_signal_connect (g_ptr_array_index (upower.devices, i), "g-properties-changed", G_CALLBACK (on_upower_properties_changed), NULL);
+    }
+
+    if (upower.active == FALSE) {
+        upower.active = TRUE;
+
+        if (configuration.debug_output == TRUE) {
+            g_printf ("batteries read from UPower\n");
+        }
+
+        schedule_tray_icon_updates (battery_tray_icon);
+    }
+
+    upower.changed = TRUE;
+    upower_queue_update ();
+}
+
+static void on_upower_device (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GDBusProxy *proxy = g_dbus_proxy_new_finish (result, NULL);
+
+    wakeup_claim (WAKEUP_DBUS);
+
+    if (GPOINTER_TO_UINT (user_data) != upower.generation) {
+        if (proxy != NULL) {
+            g_object_unref (proxy);
+        }
+
+        return;
+    }
+
+    if (proxy != NULL) {
+        if (g_strcmp0 (g_dbus_proxy_get_object_path (proxy), UPOWER_DISPLAY_DEVICE) == 0) {
+            upower.loading_display = proxy;
+        } else {
+            g_ptr_array_add (upower.loading, proxy);
+        }
+    }
+
+    if (--upower.pending == 0) {
+        upower_set_devices ();
+    }
+}
+
+static void upower_new_device (const gchar *path)
+{
+    upower.pending++;
+    g_dbus_proxy_new (upower.connection, G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START, NULL, UPOWER_NAME, path,
+                      UPOWER_DEVICE_INTERFACE, NULL, on_upower_device, GUINT_TO_POINTER (upower.generation));
+}
+
+static void on_upower_devices (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GVariant *paths = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), result, NULL);
+    GVariantIter *iter;
+    const gchar *path;
+
+    wakeup_claim (WAKEUP_DBUS);
+
+    if (paths == NULL) {
+        return;
+    }
+
+    if (GPOINTER_TO_UINT (user_data) != upower.generation) {
+        g_variant_unref (paths);
+        return;
+    }
+
+    /* the devices are swapped in once all their proxies are created */
+
+    upower_clear_loading ();
+    upower.loading = g_ptr_array_new_with_free_func (g_object_unref);
+
+    upower_new_device (UPOWER_DISPLAY_DEVICE);
+
+    g_variant_get (paths, "(ao)", &iter);
+    while (g_variant_iter_next (iter, "&o", &path) == TRUE) {
+        upower_new_device (path);
+    }
+
+    g_variant_iter_free (iter);
+    g_variant_unref (paths);
+}
+
+static void upower_enumerate_devices (void)
+{
+    upower.generation++;
+
+    g_dbus_proxy_call (upower.daemon, "EnumerateDevices", NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, on_upower_devices,
+                       GUINT_TO_POINTER (upower.generation));
+}
+
+static void on_upower_signal (GDBusProxy *proxy, const gchar *sender_name, const gchar *signal_name, GVariant *parameters,
+                              gpointer user_data)
+{
+    wakeup_claim (WAKEUP_DBUS);
+
+    if (g_strcmp0 (signal_name, "DeviceAdded") == 0 || g_strcmp0 (signal_name, "DeviceRemoved") == 0) {
+        upower_enumerate_devices ();
+    }
+}
+
+static void on_upower_daemon (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GDBusProxy *daemon = g_dbus_proxy_new_finish (result, NULL);
+
+    wakeup_claim (WAKEUP_DBUS);
+
+    if (daemon == NULL) {
+        return;
+    }
+
+    if (GPOINTER_TO_UINT (user_data) != upower.generation) {
+        g_object_unref (daemon);
+        return;
+    }
+
+    upower.daemon = daemon;
+
+    g_signal_connect (daemon, "g-signal", G_CALLBACK (on_upower_signal), NULL);
+    g_signal_connect (daemon, "g-properties-changed", G_CALLBACK (on_upower_properties_changed), NULL);
+
+    upower_enumerate_devices ();
+}
+
+static void on_upower_appeared (GDBusConnection *connection, const gchar *name, const gchar *name_owner, gpointer user_data)
+{
+    wakeup_claim (WAKEUP_DBUS);
+
+    upower.generation++;
+
+    g_dbus_proxy_new (connection, G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START, NULL, UPOWER_NAME, UPOWER_PATH, UPOWER_INTERFACE,
+                      NULL, on_upower_daemon, GUINT_TO_POINTER (upower.generation));
+}
+
+static void upower_unavailable (void)
+{
+    static gboolean reported = FALSE;
+
+    if (configuration.source == SOURCE_UPOWER && reported == FALSE) {
+        g_printerr (_("UPower is not running, the batteries are read from sysfs\n"));
+        reported = TRUE;
+    }
+}
+
+static void on_upower_vanished (GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+    wakeup_claim (WAKEUP_DBUS);
+
+    /* the results still on the way are dropped */
 
-    if (path == NULL) {
-        return FALSE;
+    upower.generation++;
+    upower_clear_loading ();
+    upower_clear_devices ();
+    g_clear_object (&upower.daemon);
+
+    if (upower.active == FALSE) {
+        upower_unavailable ();
+        return;
     }
 
-    sysattr_status = get_sysattr_string (path, "online", &sysattr_value);
-    if (sysattr_status == TRUE) {
-        if (online != NULL) {
-            *online = g_str_has_prefix (sysattr_value, "1") ? TRUE : FALSE;
-        }
+    upower.active  = FALSE;
+    upower.changed = TRUE;
 
-        if (configuration.debug_output == TRUE) {
-            g_printf ("ac online: %s", sysattr_value);
+    if (configuration.debug_output == TRUE) {
+        g_printf ("UPower left, batteries read from sysfs\n");
+    }
+
+    schedule_tray_icon_updates (battery_tray_icon);
+    upower_queue_update ();
+}
+
+static void start_upower (GDBusConnection *connection)
+{
+    /* a trace records sysfs reads */
+
+    if (configuration.source == SOURCE_SYSFS || REPLAYING || trace.file != NULL) {
+        return;
+    }
+
+    if (connection == NULL) {
+        upower_unavailable ();
+        return;
+    }
+
+    upower.connection = connection;
+    upower.watch = g_bus_watch_name_on_connection (connection, UPOWER_NAME, G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                   on_upower_appeared, on_upower_vanished, NULL, NULL);
+}
+
+/*
+ * history functions
+ *
+ * The power draw and the charge of the last hour are kept in a ring of
+ * columns of 15 seconds, filled by the updates rather than by a timer of
+ * their own: a column without update repeats the one before it, and the
+ * columns of a suspend are left unknown. A right click on the icon shows
+ * them as sparklines in a popup, with the current, mean and peak draw.
+ * While the popup is shown, each new column is handed to the backend, which
+ * scrolls its cached drawing by one column and only draws the new one;
+ * while it is closed, the updates only store their sample. The history
+ * starts again when the batteries switch between energy and charge, and a
+ * popup then shown is drawn again from the start. The columns are not taken
+ * from the energy and power filters of the battery context: those only keep
+ * the last 60 reads (five minutes at the default interval), and are
+ * flushed when charging starts or stops and on every suspend, where an hour
+ * of 240 columns must outlast both.
+ */
+
+#define HISTORY_COLUMN 15 /* seconds */
+
+static struct {
+    struct cbatticon_history_sample columns[CBATTICON_HISTORY_COLUMNS];
+    gfloat   peaks[CBATTICON_HISTORY_COLUMNS]; /* -1 when unknown */
+    gint     head;                             /* next column */
+    gint     count;
+    gint64   column_start;                     /* 0 before the first update */
+    gdouble  power_sum;                        /* of the current column */
+    gint     power_count;
+    gdouble  power_peak;
+    gint     percentage;                       /* last of the current column, -1 when unknown */
+    gdouble  power;                            /* last update, -1 when unknown */
+    gboolean use_charge;
+    gboolean suspended;
+    gboolean popup_shown;
+} history;
+
+static const gchar* history_get_text (void)
+{
+    static gchar text[STR_LTH];
+    const gchar *unit = history.use_charge == TRUE ? "A" : "W";
+    gdouble sum = 0, peak = -1;
+    gint i, count = 0;
+
+    for (i = 0; i < history.count; i++) {
+        if (history.columns[i].power >= 0) {
+            sum += history.columns[i].power;
+            count++;
         }
 
-        g_free (sysattr_value);
+        peak = MAX (peak, history.peaks[i]);
     }
 
-    return sysattr_status;
+    if (history.power_count > 0) {
+        sum += history.power_sum / history.power_count;
+        count++;
+        peak = MAX (peak, history.power_peak);
+    }
+
+    if (count == 0) {
+        g_strlcpy (text, _("Power draw unknown"), STR_LTH);
+    } else if (history.power < 0) {
+        g_snprintf (text, STR_LTH, _("Power draw: %.1f %s mean, %.1f %s peak"), sum / count, unit, peak, unit);
+    } else {
+        g_snprintf (text, STR_LTH, _("Power draw: %.1f %s now, %.1f %s mean, %.1f %s peak"),
+            history.power, unit, sum / count, unit, peak, unit);
+    }
+
+    return text;
 }
 
-static gboolean get_battery_present (const gchar *path, gboolean *present)
+static void history_push (gfloat power, gfloat peak, gfloat percentage)
 {
-    gchar *sysattr_value;
-    gboolean sysattr_status;
+    struct cbatticon_history_sample *sample = &history.columns[history.head];
 
-    if (path == NULL) {
-        return FALSE;
+    sample->power      = power;
+    sample->percentage = percentage;
+    history.peaks[history.head] = peak;
+
+    history.head = (history.head + 1) % CBATTICON_HISTORY_COLUMNS;
+    history.count = MIN (history.count + 1, CBATTICON_HISTORY_COLUMNS);
+
+    if (history.popup_shown == TRUE) {
+        backend->popup_update (sample, history_get_text ());
+    }
+}
+
+static void on_history_popup_closed (gpointer user_data)
+{
+    wakeup_claim (WAKEUP_TOOLKIT);
+
+    history.popup_shown = FALSE;
+}
+
+/* shows the popup, or draws it again from the start when it is shown */
+
+static void history_show_popup (TrayIcon *tray_icon)
+{
+    struct cbatticon_history_sample samples[CBATTICON_HISTORY_COLUMNS];
+    gint i, first;
+
+    first = (history.head - history.count + CBATTICON_HISTORY_COLUMNS) % CBATTICON_HISTORY_COLUMNS;
+    for (i = 0; i < history.count; i++) {
+        samples[i] = history.columns[(first + i) % CBATTICON_HISTORY_COLUMNS];
     }
 
-    sysattr_status = get_sysattr_string (path, "present", &sysattr_value);
-    if (sysattr_status == TRUE) {
-        if (present != NULL) {
-            *present = g_str_has_prefix (sysattr_value, "1") ? TRUE : FALSE;
+    history.popup_shown = TRUE;
+    backend->popup_show (tray_icon, samples, history.count, history_get_text (), on_history_popup_closed, NULL);
+}
+
+static void history_add (gdouble rate, gboolean use_charge, gint percentage)
+{
+    struct timespec time;
+    struct cbatticon_history_sample last;
+    gint64 columns;
+    gint i;
+
+    get_clock_time (&time);
+
+    if (history.column_start == 0 || use_charge != history.use_charge) {
+        history.head         = 0;
+        history.count        = 0;
+        history.column_start = time.tv_sec;
+        history.power_count  = 0;
+        history.power_sum    = 0;
+        history.power_peak   = -1;
+        history.use_charge   = use_charge;
+        history.suspended    = FALSE;
+
+        /* the columns shown are in the other unit */
+
+        if (history.popup_shown == TRUE) {
+            history_show_popup (battery_tray_icon);
         }
+    }
 
-        if (configuration.debug_output == TRUE) {
-            g_printf ("battery present: %s", sysattr_value);
+    /* close the current column, then fill the ones without update */
+
+    columns = (time.tv_sec - history.column_start) / HISTORY_COLUMN;
+
+    if (columns > 0) {
+        last.power      = history.power_count > 0 ? history.power_sum / history.power_count : -1;
+        last.percentage = history.percentage;
+        history_push (last.power, history.power_peak, last.percentage);
+
+        for (i = 1; i < MIN (columns, CBATTICON_HISTORY_COLUMNS); i++) {
+            if (history.suspended == TRUE) {
+                history_push (-1, -1, -1);
+            } else {
+                history_push (last.power, last.power, last.percentage);
+            }
         }
 
-        g_free (sysattr_value);
+        history.column_start += columns * HISTORY_COLUMN;
+        history.power_count   = 0;
+        history.power_sum     = 0;
+        history.power_peak    = -1;
+        history.suspended     = FALSE;
     }
 
-    return sysattr_status;
+    history.power      = rate < 0 ? -1 : rate * 1e-6;
+    history.percentage = percentage;
+
+    if (history.power >= 0) {
+        history.power_sum += history.power;
+        history.power_count++;
+        history.power_peak = MAX (history.power_peak, history.power);
+    }
+
+    if (history.popup_shown == TRUE) {
+        backend->popup_update (NULL, history_get_text ());
+    }
 }
 
-static gboolean get_battery_status (gint *status)
+static void history_suspend (void)
 {
-    gchar *sysattr_value;
-    gboolean sysattr_status;
+    history.suspended = TRUE;
+}
 
-    g_return_val_if_fail (status != NULL, FALSE);
-
-    sysattr_status = get_sysattr_string (battery_path, "status", &sysattr_value);
-    if (sysattr_status == TRUE) {
-        if (g_str_has_prefix (sysattr_value, "Charging") == TRUE)
-            *status = CHARGING;
-        else if (g_str_has_prefix (sysattr_value, "Discharging") == TRUE)
-            *status = DISCHARGING;
-        else if (g_str_has_prefix (sysattr_value, "Not charging") == TRUE)
-            *status = NOT_CHARGING;
-        else if (g_str_has_prefix (sysattr_value, "Full") == TRUE)
-            *status = CHARGED;
-        else
-            *status = UNKNOWN;
+static void on_tray_icon_popup (TrayIcon *tray_icon, gpointer user_data)
+{
+    wakeup_claim (WAKEUP_TOOLKIT);
 
-        if (configuration.debug_output == TRUE) {
-            g_printf ("battery status: %d - %s", *status, sysattr_value);
-        }
+    if (history.popup_shown == TRUE) {
+        return;
+    }
+
+    history_show_popup (tray_icon);
+}
+
+/*
+ * suspend and resume functions
+ *
+ * The samples are timed with CLOCK_BOOTTIME, which keeps counting while the
+ * system is suspended, so that a capacity drop over a suspend is never
+ * divided by the awake time only. The rate filters must still not average
+ * over a suspend, whose load is not the one of the running system: they are
+ * flushed when logind announces a suspend (PrepareForSleep) and again on
+ * resume, which also reopens the cached sysfs attributes (the power supplies
+ * may have been recreated) and updates the icon at once rather than after
+ * the update interval. Without logind, a suspend is found at the next update
+ * from the difference between CLOCK_BOOTTIME and CLOCK_MONOTONIC.
+ */
+
+#define SLEEP_MIN_GAP G_USEC_PER_SEC /* smaller differences are not a suspend */
+
+#define LOGIND_NAME      "org.freedesktop.login1"
+#define LOGIND_PATH      "/org/freedesktop/login1"
+#define LOGIND_INTERFACE "org.freedesktop.login1.Manager"
+
+static struct {
+    gboolean  sleeping;
+    gint64    boot_time;
+    gint64    monotonic_time;
+} sleep_watch;
+
+static void sleep_flush (gboolean suspend)
+{
+    trace_record (TRACE_RECORD_SLEEP, NULL, suspend, NULL);
+    LOG_EVENT (EVENT_SLEEP, NULL, suspend == TRUE ? 1 : 0, 0, 0, 0);
 
-        g_free (sysattr_value);
+    reset_battery_current_rate ();
+    reset_status_debounce ();
+    sysattr_close_all ();
+    history_suspend ();
+
+    if (suspend == FALSE) {
+        metrics.resumes++;
     }
+}
 
-    return sysattr_status;
+static void sleep_watch_sample (void)
+{
+    sleep_watch.boot_time      = get_boot_time ();
+    sleep_watch.monotonic_time = g_get_monotonic_time ();
 }
 
-static gboolean get_battery_full_capacity (gboolean *use_charge, gdouble *capacity)
+static void on_prepare_for_sleep (GDBusConnection *connection, const gchar *sender_name, const gchar *object_path,
+                                  const gchar *interface_name, const gchar *signal_name, GVariant *parameters, gpointer user_data)
 {
-    gboolean sysattr_status;
+    gboolean suspend;
 
-    g_return_val_if_fail (use_charge != NULL, FALSE);
-    g_return_val_if_fail (capacity != NULL, FALSE);
+    wakeup_claim (WAKEUP_DBUS);
 
-    sysattr_status = get_sysattr_double (battery_path, "energy_full", capacity);
-    *use_charge = FALSE;
+    if (g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(b)")) == FALSE) {
+        return;
+    }
 
-    if (sysattr_status == FALSE) {
-        sysattr_status = get_sysattr_double (battery_path, "charge_full", capacity);
-        *use_charge = TRUE;
+    g_variant_get (parameters, "(b)", &suspend);
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("%s\n", suspend == TRUE ? "suspending" : "resumed");
     }
 
-    return sysattr_status;
+    sleep_flush (suspend);
+    sleep_watch.sleeping = suspend;
+
+    /* the suspend is flushed: the clocks must not show it again to check_sleep_gap */
+
+    sleep_watch_sample ();
+
+    if (suspend == FALSE) {
+        update_tray_icon (battery_tray_icon);
+        schedule_tray_icon_updates (battery_tray_icon);
+        start_device_poll ();
+    }
 }
 
-static gboolean get_battery_remaining_capacity (gboolean use_charge, gdouble *capacity)
+static void on_system_bus (GObject *source_object, GAsyncResult *result, gpointer user_data)
 {
-    gboolean sysattr_status;
+    GError *error = NULL;
+    GDBusConnection *connection;
 
-    g_return_val_if_fail (capacity != NULL, FALSE);
+    wakeup_claim (WAKEUP_DBUS);
 
-    if (use_charge == FALSE) {
-        sysattr_status = get_sysattr_double (battery_path, "energy_now", capacity);
-        if (sysattr_status == TRUE) {
-            filter_append (&energy_filter, *capacity);
-        }
-    } else {
-        sysattr_status = get_sysattr_double (battery_path, "charge_now", capacity);
-        if (sysattr_status == TRUE) {
-            filter_append (&charge_filter, *capacity);
+    connection = g_bus_get_finish (result, &error);
+    if (connection == NULL) {
+        if (configuration.debug_output == TRUE) {
+            g_printf ("no system bus, suspends found from the clocks (%s)\n", error->message);
         }
+
+        g_error_free (error);
+        start_upower (NULL);
+        start_session_watch (NULL);
+        return;
     }
 
-    return sysattr_status;
+    /* the connection is kept until exit */
+
+    g_dbus_connection_signal_subscribe (connection, LOGIND_NAME, LOGIND_INTERFACE, "PrepareForSleep", LOGIND_PATH, NULL,
+                                        G_DBUS_SIGNAL_FLAGS_NONE, on_prepare_for_sleep, NULL, NULL);
+
+    start_upower (connection);
+    start_session_watch (connection);
 }
 
-static gboolean get_battery_remaining_capacity_pct (gdouble *capacity)
+static void start_sleep_watch (void)
 {
-    g_return_val_if_fail (capacity != NULL, FALSE);
+    /* connecting would delay the first icon, so it is done asynchronously */
 
-    return get_sysattr_double (battery_path, "capacity", capacity);
+    g_bus_get (G_BUS_TYPE_SYSTEM, NULL, on_system_bus, NULL);
 }
 
-static gboolean get_battery_current_rate (gboolean use_charge, gdouble *rate)
+static void check_sleep_gap (void)
 {
-    const gchar * attribute;
-    struct filter * f;
-    gdouble rate_now = 0;
+    gint64 boot_time      = sleep_watch.boot_time;
+    gint64 monotonic_time = sleep_watch.monotonic_time;
+    gint64 slept;
 
-    g_return_val_if_fail (rate != NULL, FALSE);
+    sleep_watch_sample ();
 
-    if (use_charge == FALSE) {
-        attribute = "power_now";
-        f = &power_filter;
-    } else {
-        attribute = "current_now";
-        f = &current_filter;
+    if (boot_time != 0 && sleep_watch.sleeping == FALSE) {
+        slept = (sleep_watch.boot_time - boot_time) - (sleep_watch.monotonic_time - monotonic_time);
+
+        if (slept > SLEEP_MIN_GAP) {
+            if (configuration.debug_output == TRUE) {
+                g_printf ("resumed after %" G_GINT64_FORMAT " s of suspend\n", slept / G_USEC_PER_SEC);
+            }
+
+            sleep_flush (FALSE);
+        }
     }
+}
 
-    if (get_sysattr_double (battery_path, attribute, &rate_now) == TRUE) {
-        // get rate from battery
-        filter_append (f, rate_now);
-        *rate = filter_get_mean (f);
-    } else {
-        // compute rate from capacity change
-        if (use_charge == FALSE) {
-            *rate = fabs (filter_get_rate (&energy_filter, "power"));
-        } else {
-            *rate = fabs (filter_get_rate (&charge_filter, "current"));
+/*
+ * level rule functions
+ *
+ * The rules are compiled from the low and critical levels and --rule, and
+ * carried out when tray_step fires them (see tray.c for the rule set and
+ * how the rules fire and are armed again).
+ */
+
+#ifdef WITH_NOTIFY
+G_STATIC_ASSERT ((gint)RULE_URGENCY_LOW      == (gint)NOTIFY_URGENCY_LOW);
+G_STATIC_ASSERT ((gint)RULE_URGENCY_NORMAL   == (gint)NOTIFY_URGENCY_NORMAL);
+G_STATIC_ASSERT ((gint)RULE_URGENCY_CRITICAL == (gint)NOTIFY_URGENCY_CRITICAL);
+#endif
+
+static struct {
+    struct level_rule_set   set;
+#ifdef WITH_NOTIFY
+    NotifyNotification     *notifications[MAX_LEVEL_RULES]; /* by number */
+#endif
+} level_rules;
+
+/* the settings of the status steps and the rules */
+
+static void get_tray_config (const struct configuration *config, struct tray_config *tray_config)
+{
+    tray_config->update_interval  = config->update_interval;
+    tray_config->low_level        = config->low_level;
+    tray_config->critical_level   = config->critical_level;
+    tray_config->level_hysteresis = config->level_hysteresis;
+}
+
+static gboolean compile_level_rules (void)
+{
+    struct level_rule_set *set = &level_rules.set;
+    struct tray_config tray_config;
+
+    get_tray_config (&configuration, &tray_config);
+
+    add_level_rule_levels (set);
+    set_level_rule_levels (set, &tray_config);
+
+    for (gchar **specification = configuration.rules; specification != NULL && *specification != NULL; specification++) {
+        struct level_rule *rule = &set->rules[set->num_rules];
+
+        if (set->num_rules == MAX_LEVEL_RULES) {
+            g_printerr (_("Cannot add rule %s: too many rules\n"), *specification);
+            return FALSE;
         }
 
-        if (*rate < 0.01) {
+        if (parse_level_rule (*specification, CLAMP (configuration.level_hysteresis, 0, 100), rule) == FALSE) {
+            g_printerr (_("Invalid rule: %s\n"), *specification);
             return FALSE;
         }
+
+        rule->level  = -1;
+        rule->number = set->num_rules++;
     }
 
+    build_level_rule_set (set);
+
     if (configuration.debug_output == TRUE) {
-        g_printf ("%s = %g, average = %g\n", attribute, rate_now, *rate);
+        for (gint i = 0; i < set->num_rules; i++) {
+            if (set->rules[i].level != -1) {
+                continue;
+            }
+
+            g_printf ("rule %d%s, armed again above %d, urgency %d, command %s\n", set->rules[i].threshold,
+                set->rules[i].kind == RULE_PERCENTAGE ? "%" : " min", set->rules[i].rearm,
+                set->rules[i].urgency, set->rules[i].command != NULL ? set->rules[i].command : "none");
+        }
     }
 
     return TRUE;
 }
 
-static void reset_battery_current_rate (void)
+static void run_level_rules (const gint *fired_rules, gint num_fired, gchar *time_string)
 {
-    energy_filter.num_samples = 0;
-    energy_filter.next_sample = 0;
-    charge_filter.num_samples = 0;
-    charge_filter.next_sample = 0;
-    power_filter.num_samples = 0;
-    power_filter.next_sample = 0;
-    current_filter.num_samples = 0;
-    current_filter.next_sample = 0;
+    struct cbatticon_snapshot snapshot;
+    GError *error = NULL;
+
+    get_snapshot (&snapshot);
+
+    for (gint i = 0; i < num_fired; i++) {
+        const struct level_rule *rule = &level_rules.set.rules[fired_rules[i]];
+
+        if (configuration.debug_output == TRUE) {
+            g_printf ("rule %d%s reached\n", rule->threshold, rule->kind == RULE_PERCENTAGE ? "%" : " min");
+        }
+
+#ifdef WITH_NOTIFY
+        if (rule->urgency != RULE_URGENCY_NONE) {
+            gchar summary[STR_LTH];
+
+            if (rule->kind == RULE_PERCENTAGE) {
+                g_snprintf (summary, STR_LTH, _("Battery level has reached %d%%!"), rule->threshold);
+            } else {
+                g_snprintf (summary, STR_LTH, _("Battery time remaining has reached %d minutes!"), rule->threshold);
+            }
+
+            NOTIFY_MESSAGE (&level_rules.notifications[rule->number], summary, time_string,
+                rule->urgency == RULE_URGENCY_CRITICAL ? NOTIFY_EXPIRES_NEVER : NOTIFY_EXPIRES_DEFAULT, (NotifyUrgency)rule->urgency);
+        }
+#endif
+
+        if (rule->command != NULL && spawn_command (HOOK_LEVEL_RULE, rule->command, &snapshot, &error) == FALSE) {
+            syslog (LOG_CRIT, _("Cannot spawn level rule command: %s\n"), error->message);
+
+            g_printerr (_("Cannot spawn level rule command: %s\n"), error->message);
+            g_error_free (error); error = NULL;
+        }
+    }
 }
 
 /*
- * computation functions
+ * session activity functions
+ *
+ * Nobody looks at the icon of a locked or idle session, that is while the
+ * logind session has its LockedHint or IdleHint set, or while a screensaver
+ * says it is active (ActiveChanged on the session bus). The updates then
+ * still read the batteries, keep the metrics and the history and run the
+ * hooks, the rules and their notifications, but build no text for the
+ * tooltip and the icon, and the timer only fires as often as the levels
+ * need: half the time left, at the current drain, until the nearest level
+ * that can still warn, within the update interval and SESSION_MAX_INTERVAL
+ * (tray_get_interval above, so that the simulator checks it too).
+ * Once the session is active again, the icon is updated at once and the
+ * update interval is restored. Without logind or a screensaver, the session
+ * is taken as always active.
  */
 
-static gboolean get_battery_charge (gboolean remaining, gint *percentage, gint *time)
+#define LOGIND_SESSION_INTERFACE "org.freedesktop.login1.Session"
+#define PROPERTIES_INTERFACE     "org.freedesktop.DBus.Properties"
+#define SCREENSAVER_NAME         "org.freedesktop.ScreenSaver"
+#define SCREENSAVER_PATH         "/org/freedesktop/ScreenSaver"
+#define SCREENSAVER_INTERFACE    "org.freedesktop.ScreenSaver"
+
+static struct {
+    gboolean locked;      /* LockedHint */
+    gboolean idle;        /* IdleHint */
+    gboolean screensaver; /* screensaver active */
+    guint    interval;    /* of the update timer, 0 for the update interval */
+} session;
+
+static gboolean is_session_inactive (void)
 {
-    gdouble full_capacity = 0, remaining_capacity = 0, current_rate;
-    gboolean use_charge;
+    return session.locked == TRUE || session.idle == TRUE || session.screensaver == TRUE;
+}
 
-    g_return_val_if_fail (percentage != NULL, FALSE);
+static guint get_update_interval (void)
+{
+    return session.interval != 0 ? session.interval : (guint)configuration.update_interval;
+}
 
-    if (get_battery_full_capacity (&use_charge, &full_capacity) == FALSE) {
-        if (configuration.debug_output == TRUE) {
-            g_printf ("full capacity: %s\n", "unavailable");
-        }
+static void set_session_interval (guint interval)
+{
+    if (interval == session.interval) {
+        return;
+    }
 
-        return FALSE;
+    session.interval = interval;
+
+    if (configuration.debug_output == TRUE) {
+        g_printf ("updates every %u s\n", get_update_interval ());
     }
 
-    if (get_battery_remaining_capacity (use_charge, &remaining_capacity) == FALSE) {
-        if (get_battery_remaining_capacity_pct (&remaining_capacity) == FALSE) {
-            if (configuration.debug_output == TRUE) {
-                g_printf ("remaining capacity: %s\n", "unavailable");
-            }
+    schedule_tray_icon_updates (battery_tray_icon);
+}
 
-            return FALSE;
-        }
+static void set_session_hint (gboolean *hint, gboolean value)
+{
+    gboolean was_inactive = is_session_inactive ();
+
+    *hint = value;
 
-        /* remaining capacity is percentage, compute the actual remaining capacity */
-        remaining_capacity *= full_capacity / 100.0;
+    if (is_session_inactive () == was_inactive) {
+        return;
     }
 
-    *percentage = (gint)fmin (floor (remaining_capacity / full_capacity * 100.0), 100.0);
+    if (configuration.debug_output == TRUE) {
+        g_printf ("session %s\n", was_inactive == TRUE ? "active" : "locked or idle");
+    }
 
-    if (time == NULL) {
-        return TRUE;
+    /* catch up with what was not shown; the interval is set by the next update */
+
+    if (was_inactive == TRUE) {
+        set_session_interval (0);
+        update_tray_icon (battery_tray_icon);
+    }
+}
+
+static void set_session_hints (GVariant *properties)
+{
+    gboolean value;
+
+    if (g_variant_lookup (properties, "LockedHint", "b", &value) == TRUE) {
+        set_session_hint (&session.locked, value);
+    }
+
+    if (g_variant_lookup (properties, "IdleHint", "b", &value) == TRUE) {
+        set_session_hint (&session.idle, value);
+    }
+}
+
+static void on_session_properties_changed (GDBusConnection *connection, const gchar *sender_name, const gchar *object_path,
+                                           const gchar *interface_name, const gchar *signal_name, GVariant *parameters, gpointer user_data)
+{
+    GVariant *changed_properties;
+
+    wakeup_claim (WAKEUP_DBUS);
+
+    if (g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sa{sv}as)")) == FALSE) {
+        return;
+    }
+
+    g_variant_get (parameters, "(&s@a{sv}@as)", NULL, &changed_properties, NULL);
+    set_session_hints (changed_properties);
+    g_variant_unref (changed_properties);
+}
+
+static void on_session_properties (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GVariant *reply, *properties;
+
+    wakeup_claim (WAKEUP_DBUS);
+
+    reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, NULL);
+    if (reply == NULL) {
+        return;
     }
 
-    if (get_battery_current_rate (use_charge, &current_rate) == FALSE) {
+    g_variant_get (reply, "(@a{sv})", &properties);
+    set_session_hints (properties);
+
+    g_variant_unref (properties);
+    g_variant_unref (reply);
+}
+
+static void on_session_path (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GDBusConnection *connection = G_DBUS_CONNECTION (source_object);
+    GError *error = NULL;
+    GVariant *reply;
+    const gchar *path;
+
+    wakeup_claim (WAKEUP_DBUS);
+
+    reply = g_dbus_connection_call_finish (connection, result, &error);
+    if (reply == NULL) {
         if (configuration.debug_output == TRUE) {
-            g_printf ("current rate: %s\n", "unavailable");
+            g_printf ("no logind session, its lock and idle hints are not followed (%s)\n", error->message);
         }
 
-        *time = -1;
-        return TRUE;
+        g_error_free (error);
+        return;
     }
 
-    if (remaining == TRUE) {
-        *time = (gint)(remaining_capacity / current_rate * 60.0);
-    } else {
-        *time = (gint)((full_capacity - remaining_capacity) / current_rate * 60.0);
+    g_variant_get (reply, "(&o)", &path);
+
+    /* subscribed before reading the hints, so that no change is missed */
+
+    g_dbus_connection_signal_subscribe (connection, LOGIND_NAME, PROPERTIES_INTERFACE, "PropertiesChanged", path,
+                                        LOGIND_SESSION_INTERFACE, G_DBUS_SIGNAL_FLAGS_NONE, on_session_properties_changed, NULL, NULL);
+    g_dbus_connection_call (connection, LOGIND_NAME, path, PROPERTIES_INTERFACE, "GetAll",
+                            g_variant_new ("(s)", LOGIND_SESSION_INTERFACE), G_VARIANT_TYPE ("(a{sv})"),
+                            G_DBUS_CALL_FLAGS_NONE, -1, NULL, on_session_properties, NULL);
+
+    g_variant_unref (reply);
+}
+
+static void on_screensaver_active_changed (GDBusConnection *connection, const gchar *sender_name, const gchar *object_path,
+                                           const gchar *interface_name, const gchar *signal_name, GVariant *parameters, gpointer user_data)
+{
+    gboolean active;
+
+    wakeup_claim (WAKEUP_DBUS);
+
+    if (g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(b)")) == FALSE) {
+        return;
     }
 
-    return TRUE;
+    g_variant_get (parameters, "(b)", &active);
+    set_session_hint (&session.screensaver, active);
+}
+
+static void on_screensaver_active (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GVariant *reply;
+    gboolean active;
+
+    wakeup_claim (WAKEUP_DBUS);
+
+    /* most sessions have no screensaver service */
+
+    reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), result, NULL);
+    if (reply == NULL) {
+        return;
+    }
+
+    g_variant_get (reply, "(b)", &active);
+    set_session_hint (&session.screensaver, active);
+
+    g_variant_unref (reply);
+}
+
+static void on_session_bus (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+    GDBusConnection *connection;
+
+    wakeup_claim (WAKEUP_DBUS);
+
+    connection = g_bus_get_finish (result, NULL);
+    if (connection == NULL) {
+        return;
+    }
+
+    /* the connection is kept until exit; the screensavers that implement */
+    /* the interface do not all own its name, so any sender is followed  */
+
+    g_dbus_connection_signal_subscribe (connection, NULL, SCREENSAVER_INTERFACE, "ActiveChanged", NULL, NULL,
+                                        G_DBUS_SIGNAL_FLAGS_NONE, on_screensaver_active_changed, NULL, NULL);
+    g_dbus_connection_call (connection, SCREENSAVER_NAME, SCREENSAVER_PATH, SCREENSAVER_INTERFACE, "GetActive",
+                            NULL, G_VARIANT_TYPE ("(b)"), G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, on_screensaver_active, NULL);
+}
+
+static void start_session_watch (GDBusConnection *connection)
+{
+    if (connection != NULL) {
+        g_dbus_connection_call (connection, LOGIND_NAME, LOGIND_PATH, LOGIND_INTERFACE, "GetSession",
+                                g_variant_new ("(s)", "auto"), G_VARIANT_TYPE ("(o)"),
+                                G_DBUS_CALL_FLAGS_NONE, -1, NULL, on_session_path, NULL);
+    }
+
+    g_bus_get (G_BUS_TYPE_SESSION, NULL, on_session_bus, NULL);
 }
 
 /*
@@ -803,289 +5323,302 @@ static gboolean get_battery_charge (gboolean remaining, gint *percentage, gint *
 
 static void create_tray_icon (void)
 {
+    gint64 profile_start = profile_get_time ();
     TrayIcon *tray_icon = TRAY_ICON_NEW;
 
+    battery_tray_icon = tray_icon;
+
     TRAY_ICON_SET_TEXT (tray_icon, CBATTICON_STRING);
     update_tray_icon (tray_icon);
     TRAY_ICON_SHOW (tray_icon);
 
-    g_timeout_add_seconds (configuration.update_interval, (GSourceFunc)update_tray_icon, (gpointer)tray_icon);
+    startup_add (STARTUP_FIRST_UPDATE, profile_start);
 
-#ifdef WITH_QT6
-    QObject::connect (tray_icon, &QSystemTrayIcon::activated, [tray_icon] {
-        on_tray_icon_click (tray_icon, NULL);
-    });
-#else
-    g_signal_connect (G_OBJECT (tray_icon), "activate", G_CALLBACK (on_tray_icon_click), NULL);
-#endif
+    schedule_tray_icon_updates (tray_icon);
+    start_sleep_watch ();
+
+    TRAY_ICON_ON_CLICK (tray_icon, on_tray_icon_click);
+
+    if (backend->icon_on_popup != NULL && backend->popup_show != NULL && backend->popup_update != NULL) {
+        TRAY_ICON_ON_POPUP (tray_icon, on_tray_icon_popup);
+    }
+}
+
+static void schedule_tray_icon_updates (TrayIcon *tray_icon)
+{
+    static guint update_source = 0;
+
+    if (update_source != 0) {
+        toolkit_source_remove (update_source);
+        update_source = 0;
+    }
+
+    /* UPower announces every change, there is nothing to poll */
+
+    if (upower.active == TRUE) {
+        return;
+    }
+
+    update_source = toolkit_timeout_add (get_update_interval (), (GSourceFunc)update_tray_icon, (gpointer)tray_icon);
 }
 
 static gboolean update_tray_icon (TrayIcon *tray_icon)
 {
+    gint64 profile_start = profile_get_time ();
+    guint update_interval = get_update_interval ();
+
+    wakeup_claim (WAKEUP_TIMER);
+
     g_return_val_if_fail (tray_icon != NULL, FALSE);
 
+    check_sleep_gap ();
     update_tray_icon_status (tray_icon);
+    profile_add_tick (profile_start, update_interval);
+
+    if (configuration.metrics_file != NULL) {
+        metrics_write_file (configuration.metrics_file);
+    }
+
+    if (configuration.debug_output == TRUE) {
+        ring_dump (FALSE);
+    }
+
+    if (trace.file != NULL) {
+        fflush (trace.file);
+    }
 
     return TRUE;
 }
 
-static void update_tray_icon_status (TrayIcon *tray_icon)
-{
-    GError *error = NULL;
+/* the state of the updates, kept between them */
 
-    gboolean battery_present = FALSE;
-    gboolean ac_online       = FALSE;
+static struct tray_state tray = { -1, FALSE, FALSE };
 
-    gint battery_status            = -1;
-    static gint old_battery_status = -1;
+/* the low and critical levels changed (by a reload, or by their validation) */
 
-    /* battery statuses:                                      */
-    /* not present => ac_only, battery_missing                */
-    /* present     => charging, charged, discharging, unknown */
-    /* (present and not present are exclusive)                */
+static void reload_level_rules (void)
+{
+    struct tray_config tray_config;
 
-    static gboolean ac_only                = FALSE;
-    static gboolean battery_low            = FALSE;
-    static gboolean battery_critical       = FALSE;
-    static gboolean spawn_command_low      = FALSE;
-    static gboolean spawn_command_critical = FALSE;
+    get_tray_config (&configuration, &tray_config);
+    move_level_rule_levels (&level_rules.set, &tray_config, &tray.rules);
+}
 
-    gint percentage, time;
+static void update_tray_icon_status (TrayIcon *tray_icon)
+{
+    struct tray_config tray_config;
+    struct tray_snapshot snapshot;
+    struct tray_actions actions;
+    gboolean ac_online = FALSE;
+    gint battery_status, percentage;
     gchar *battery_string, *time_string;
+    gboolean visible = is_session_inactive () == FALSE;
 
 #ifdef WITH_NOTIFY
     static NotifyNotification *notification = NULL;
 #endif
 
-    /* update power supplies */
-
-    if (changed_power_supplies () == TRUE)
-    {
-        old_battery_status = -1;
-
-        ac_only                = FALSE;
-        battery_low            = FALSE;
-        battery_critical       = FALSE;
-        spawn_command_low      = FALSE;
-        spawn_command_critical = FALSE;
-    }
+    trace_record (TRACE_RECORD_TICK, NULL, TRUE, NULL);
+    LOG_EVENT (EVENT_TICK, NULL, 0, 0, 0, 0);
 
-    /* update tray icon for AC only */
+    metrics.full_capacity      = -1;
+    metrics.remaining_capacity = -1;
+    metrics.current_rate       = -1;
 
-    if (battery_path == NULL) {
-        if (ac_only == FALSE) {
-            ac_only = TRUE;
+    /* values prefetched but not taken last tick are stale */
 
-            NOTIFY_MESSAGE (&notification, _("AC only, no battery!"), NULL, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
+    sysattr_clear_prefetch ();
 
-            TRAY_ICON_SET_TEXT (tray_icon, _("AC only, no battery!"));
-            TRAY_ICON_SET_ICON (tray_icon, "ac-adapter");
-        }
+    /* update power supplies */
 
-        return;
+    if (changed_power_supplies () == TRUE) {
+        tray_state_init (&tray);
+        reset_status_debounce ();
     }
 
-    /* update tray icon for battery */
+    snapshot.num_batteries = num_batteries;
+    snapshot.status        = MISSING;
+    snapshot.percentage    = 0;
+    snapshot.time          = -1;
+    snapshot.visible       = visible;
 
-    if (get_battery_present (battery_path, &battery_present) == FALSE) {
-        return;
-    }
+    /* read the batteries, the status first and then the charge it needs */
 
-    if (battery_present == FALSE) {
-        battery_status = MISSING;
-    } else {
-        if (get_battery_status (&battery_status) == FALSE) {
+    if (num_batteries > 0) {
+        if (read_batteries () == FALSE) {
             return;
         }
 
-        /* workaround for limited/bugged batteries/drivers */
-        /* that unduly return unknown status               */
+        battery_status = aggregate.present == TRUE ? aggregate.status : MISSING;
 
-        if (battery_status == UNKNOWN && get_ac_online (ac_path, &ac_online) == TRUE) {
-            if (ac_online == TRUE) {
-                battery_status = CHARGING;
-
-                if (get_battery_charge (FALSE, &percentage, NULL) == TRUE && percentage >= 99) {
-                    battery_status = CHARGED;
-                }
-            } else {
-                battery_status = DISCHARGING;
+        if (battery_status == UNKNOWN &&
+            (upower.active == TRUE ? upower_get_ac_online (&ac_online) : get_ac_online (ac_path, &ac_online)) == TRUE) {
+            if (ac_online == FALSE || get_battery_charge (FALSE, &percentage, NULL) == FALSE) {
+                percentage = -1;
             }
-        }
-    }
-
-    #define HANDLE_BATTERY_STATUS(PCT,TIM,EXP,URG)                                                          \
-                                                                                                            \
-            percentage = PCT;                                                                               \
-                                                                                                            \
-            battery_string = get_battery_string (battery_status, percentage);                               \
-            time_string    = get_time_string (TIM);                                                         \
-                                                                                                            \
-            if (old_battery_status != battery_status) {                                                     \
-                old_battery_status  = battery_status;                                                       \
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, EXP, URG);                      \
-            }                                                                                               \
-                                                                                                            \
-            TRAY_ICON_SET_TEXT (tray_icon, get_tooltip_string (battery_string, time_string));               \
-            TRAY_ICON_SET_ICON (tray_icon, get_icon_name (battery_status, percentage));
-
-    switch (battery_status) {
-        case MISSING:
-            HANDLE_BATTERY_STATUS (0, -1, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL)
-            break;
 
-        case UNKNOWN:
-            HANDLE_BATTERY_STATUS (0, -1, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
-            break;
+            battery_status = tray_resolve_status (&tray, battery_status, ac_online, percentage, &tray);
+        }
 
-        case CHARGED:
-            HANDLE_BATTERY_STATUS (100, -1, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
-            break;
+        snapshot.status = debounce_status (battery_status);
 
-        case CHARGING:
-            if (old_battery_status != CHARGING) {
-                reset_battery_current_rate ();
-            }
+        if (tray_needs_rate_reset (&tray, snapshot.status) == TRUE) {
+            reset_battery_current_rate ();
+        }
 
-            if (get_battery_charge (FALSE, &percentage, &time) == FALSE) {
+        if (snapshot.status == CHARGING || is_discharging_status (snapshot.status) == TRUE) {
+            if (get_battery_charge (snapshot.status != CHARGING, &snapshot.percentage, &snapshot.time) == FALSE) {
                 return;
             }
+        }
+    }
 
-            HANDLE_BATTERY_STATUS (percentage, time, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL)
-            break;
+    get_tray_config (&configuration, &tray_config);
+    tray_step (&tray, &snapshot, &tray_config, &level_rules.set, &tray, &actions);
 
-        case DISCHARGING:
-        case NOT_CHARGING:
-            if (old_battery_status != DISCHARGING) {
-                reset_battery_current_rate ();
-            }
+    /* update tray icon for AC only */
 
-            if (get_battery_charge (TRUE, &percentage, &time) == FALSE) {
-                return;
-            }
+    if ((actions.flags & TRAY_ACTION_AC_ONLY) != 0) {
+        metrics_update_battery (-1, -1, -1);
 
-            battery_string = get_battery_string (battery_status, percentage);
-            time_string    = get_time_string (time);
+        NOTIFY_MESSAGE (&notification, _("AC only, no battery!"), NULL, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
 
-            if (old_battery_status != DISCHARGING) {
-                old_battery_status  = DISCHARGING;
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL);
+        set_tray_icon_text (tray_icon, _("AC only, no battery!"));
+        set_tray_icon_name (tray_icon, "ac-adapter");
+    }
 
-                battery_low            = FALSE;
-                battery_critical       = FALSE;
-                spawn_command_low      = FALSE;
-                spawn_command_critical = FALSE;
-            }
+    if ((actions.flags & TRAY_ACTION_ICON) == 0) {
+        set_session_interval (actions.interval);
+        return;
+    }
 
-            if (battery_low == FALSE && percentage <= configuration.low_level) {
-                battery_low = TRUE;
+    /* update tray icon for battery */
 
-                battery_string = get_battery_string (LOW_LEVEL, percentage);
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
+    metrics_update_battery (actions.status, actions.percentage, actions.time);
+    history_add (metrics.current_rate, metrics.use_charge,
+        actions.status == MISSING || actions.status == UNKNOWN ? -1 : actions.percentage);
 
-                spawn_command_low = TRUE;
-            }
+    /* a locked or idle session only gets the notifications */
 
-            if (battery_critical == FALSE && percentage <= configuration.critical_level) {
-                battery_critical = TRUE;
+    if ((actions.flags & TRAY_ACTION_STATUS) != 0) {
+        run_status_hooks (actions.old_status);
+    }
 
-                battery_string = get_battery_string (CRITICAL_LEVEL, percentage);
-                NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
+    if (visible == TRUE || actions.num_fired > 0 ||
+        (actions.flags & (TRAY_ACTION_STATUS | TRAY_ACTION_LOW | TRAY_ACTION_CRITICAL)) != 0) {
+        battery_string = get_battery_string (actions.status, actions.percentage);
+        time_string    = get_time_string (actions.time);
 
-                spawn_command_critical = TRUE;
-            }
+        if ((actions.flags & TRAY_ACTION_STATUS) != 0) {
+            NOTIFY_MESSAGE (&notification, battery_string, time_string,
+                actions.status == MISSING ? NOTIFY_EXPIRES_NEVER : NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_NORMAL);
+        }
 
-            TRAY_ICON_SET_TEXT (tray_icon, get_tooltip_string (battery_string, time_string));
-            TRAY_ICON_SET_ICON (tray_icon, get_icon_name (battery_status, percentage));
+        if ((actions.flags & TRAY_ACTION_LOW) != 0) {
+            battery_string = get_battery_string (LOW_LEVEL, actions.percentage);
+            NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_NORMAL);
+        }
 
-            if (spawn_command_low == TRUE) {
-                spawn_command_low = FALSE;
+        if ((actions.flags & TRAY_ACTION_CRITICAL) != 0) {
+            battery_string = get_battery_string (CRITICAL_LEVEL, actions.percentage);
+            NOTIFY_MESSAGE (&notification, battery_string, time_string, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
+        }
 
-                if (configuration.command_low_level != NULL) {
-                    syslog (LOG_CRIT, _("Spawning low battery level command in 5 seconds: %s"), configuration.command_low_level);
-                    g_usleep (G_USEC_PER_SEC * 5);
+        if (visible == TRUE) {
+            set_tray_icon_text (tray_icon, get_tooltip_string (battery_string, time_string));
+            set_tray_icon_name (tray_icon, get_icon_name (actions.status, actions.percentage));
+        }
 
-                    if (get_battery_status (&battery_status) == TRUE) {
-                        if (battery_status != DISCHARGING && battery_status != NOT_CHARGING) {
-                            syslog (LOG_NOTICE, _("Skipping low battery level command, no longer discharging"));
-                            return;
-                        }
-                    }
+        if (actions.num_fired > 0) {
+            run_level_rules (actions.fired_rules, actions.num_fired, time_string);
+        }
+    }
 
-                    if (g_spawn_command_line_async (configuration.command_low_level, &error) == FALSE) {
-                        syslog (LOG_CRIT, _("Cannot spawn low battery level command: %s\n"), error->message);
+    set_session_interval (actions.interval);
 
-                        g_printerr (_("Cannot spawn low battery level command: %s\n"), error->message);
-                        g_error_free (error); error = NULL;
+    if ((actions.flags & TRAY_ACTION_LOW_HOOKS) != 0) {
+        run_level_hooks (CBATTICON_LEVEL_LOW);
+    }
 
-#ifdef WITH_NOTIFY
-                        static NotifyNotification *spawn_notification = NULL;
-                        NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn low battery level command!"), configuration.command_low_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
-#endif
-                    }
-                }
-            }
+    if ((actions.flags & TRAY_ACTION_CRITICAL_HOOKS) != 0) {
+        run_level_hooks (CBATTICON_LEVEL_CRITICAL);
+    }
+}
 
-            if (spawn_command_critical == TRUE) {
-                spawn_command_critical = FALSE;
+static void set_tray_icon_text (TrayIcon *tray_icon, const gchar *text)
+{
+    static gchar old_text[STR_LTH];
+    gchar log_text[STR_LTH];
+    gint64 profile_start;
+
+    if (REPLAYING) {
+        if (g_strcmp0 (old_text, text) != 0) {
+            g_strlcpy (old_text, text, STR_LTH);
+            g_strlcpy (log_text, text, STR_LTH);
+            replay_log ("tooltip: %s", g_strdelimit (log_text, "\n", '|'));
+        }
 
-                if (configuration.command_critical_level != NULL) {
-                    syslog (LOG_CRIT, _("Spawning critical battery level command in 30 seconds: %s"), configuration.command_critical_level);
-                    g_usleep (G_USEC_PER_SEC * 30);
+        return;
+    }
 
-                    if (get_battery_status (&battery_status) == TRUE) {
-                        if (battery_status != DISCHARGING && battery_status != NOT_CHARGING) {
-                            syslog (LOG_NOTICE, _("Skipping critical battery level command, no longer discharging"));
-                            return;
-                        }
-                    }
+    profile_start = profile_get_time ();
+    TRAY_ICON_SET_TEXT (tray_icon, text);
+    profile_add (PROFILE_TOOLKIT, profile_start);
+}
 
-                    if (g_spawn_command_line_async (configuration.command_critical_level, &error) == FALSE) {
-                        syslog (LOG_CRIT, _("Cannot spawn critical battery level command: %s\n"), error->message);
+static void set_tray_icon_name (TrayIcon *tray_icon, const gchar *name)
+{
+    static gchar old_name[STR_LTH];
+    gint64 profile_start;
 
-                        g_printerr (_("Cannot spawn critical battery level command: %s\n"), error->message);
-                        g_error_free (error); error = NULL;
+    if (REPLAYING) {
+        if (g_strcmp0 (old_name, name) != 0) {
+            g_strlcpy (old_name, name, STR_LTH);
+            replay_log ("icon: %s", name);
+        }
 
-#ifdef WITH_NOTIFY
-                        static NotifyNotification *spawn_notification = NULL;
-                        NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn critical battery level command!"), configuration.command_critical_level, NOTIFY_EXPIRES_NEVER, NOTIFY_URGENCY_CRITICAL);
-#endif
-                    }
-                }
-            }
-            break;
+        return;
     }
+
+    profile_start = profile_get_time ();
+    TRAY_ICON_SET_ICON (tray_icon, name);
+    profile_add (PROFILE_TOOLKIT, profile_start);
 }
 
 static void on_tray_icon_click (TrayIcon *tray_icon, gpointer user_data)
 {
-    GError *error = NULL;
-
-    if (configuration.command_left_click != NULL) {
-        if (g_spawn_command_line_async (configuration.command_left_click, &error) == FALSE) {
-            syslog (LOG_ERR, _("Cannot spawn left click command: %s\n"), error->message);
-
-            g_printerr (_("Cannot spawn left click command: %s\n"), error->message);
-            g_error_free (error); error = NULL;
+    wakeup_claim (WAKEUP_TOOLKIT);
 
-#ifdef WITH_NOTIFY
-            static NotifyNotification *spawn_notification = NULL;
-            NOTIFY_MESSAGE (&spawn_notification, _("Cannot spawn left click command!"), configuration.command_left_click, NOTIFY_EXPIRES_DEFAULT, NOTIFY_URGENCY_CRITICAL);
-#endif
-        }
-    }
+    run_click_hooks ();
 }
 
 #ifdef WITH_NOTIFY
 static void notify_message (NotifyNotification **notification, gchar *summary, gchar *body, gint timeout, NotifyUrgency urgency)
 {
+    gint64 profile_start;
+
     g_return_if_fail (notification != NULL);
     g_return_if_fail (summary != NULL);
 
+    if (REPLAYING) {
+        replay_log ("notify: %s%s%s (urgency %d, timeout %d)", summary,
+            body != NULL ? " - " : "", body != NULL ? body : "", urgency, timeout);
+        return;
+    }
+
     if (configuration.hide_notification == TRUE) {
         return;
     }
 
+    /* normally connected at startup, see startup_notification_thread */
+
+    startup_join_notification ();
+    if (notify_is_initted () == FALSE && notify_init (CBATTICON_STRING) == FALSE) {
+        return;
+    }
+
+    profile_start = profile_get_time ();
+
     if (*notification == NULL) {
 #if NOTIFY_CHECK_VERSION (0, 7, 0)
         *notification = notify_notification_new (summary, body, NULL);
@@ -1099,81 +5632,284 @@ static void notify_message (NotifyNotification **notification, gchar *summary, g
     notify_notification_set_timeout (*notification, timeout);
     notify_notification_set_urgency (*notification, urgency);
     notify_notification_show (*notification, NULL);
+    metrics.notifications++;
+
+    profile_add (PROFILE_NOTIFICATION, profile_start);
 }
 #endif
 
+/*
+ * message functions
+ *
+ * The tooltip and notification texts are built on every update from a few
+ * translated formats. The formats are looked up in the catalog and parsed
+ * once, into templates that keep their literal text and the place of each
+ * argument, and the plural forms of the minutes (0 to 59) and of the hours
+ * (below MESSAGE_HOURS) are resolved at the same time, so that building a
+ * text only copies the literal parts and writes the numbers. A translation
+ * using conversions that the templates do not support (widths, flags, ...)
+ * is still formatted with g_snprintf, as are the hours past MESSAGE_HOURS.
+ */
+
+#define MESSAGE_SLOTS 2   /* at most a number and a string */
+#define MESSAGE_FORMS 6   /* plural forms of a message */
+#define MESSAGE_HOURS 100
+
+struct message_template {
+    const gchar *format;                 /* translated format */
+    gchar        text[STR_LTH];          /* literal text, without the conversions */
+    gint         offsets[MESSAGE_SLOTS]; /* place of each argument in text */
+    gchar        types[MESSAGE_SLOTS];   /* 'd' or 's' */
+    gint         num_slots;              /* -1 when g_snprintf is used */
+    gboolean     string_first;           /* order of the arguments in the msgid */
+};
+
+struct message_plural {
+    struct message_template forms[MESSAGE_FORMS];
+    gint                    num_forms;
+    guint8                  form[MESSAGE_HOURS]; /* form of each number, MESSAGE_FORMS if none */
+};
+
+static struct {
+    gboolean                loaded;
+    struct message_template battery[CRITICAL_LEVEL + 1];
+    struct message_template battery_detail;
+    struct message_plural   minutes;
+    struct message_plural   minutes_remaining;
+    struct message_plural   hours_remaining;
+} messages;
+
+static void message_parse (struct message_template *message, const gchar *format, gboolean string_first)
+{
+    gint length = 0;
+    gboolean has_number = FALSE, has_string = FALSE;
+
+    message->format       = format;
+    message->num_slots    = 0;
+    message->string_first = string_first;
+
+    for (const gchar *c = format; *c != '\0'; c++) {
+        const gchar *digits;
+
+        if (length >= STR_LTH - 1) {
+            message->num_slots = -1;
+            return;
+        }
+
+        if (*c != '%') {
+            message->text[length++] = *c;
+            continue;
+        }
+
+        if (*++c == '%') {
+            message->text[length++] = '%';
+            continue;
+        }
+
+        /* with a single number and a single string, the type of a */
+        /* positional argument ("%1$d") tells which one it is       */
+
+        for (digits = c; g_ascii_isdigit (*c) == TRUE; c++);
+        if (c != digits && *c++ != '$') {
+            message->num_slots = -1;
+            return;
+        }
+
+        if ((*c == 'd' || *c == 'i') && has_number == FALSE) {
+            has_number = TRUE;
+        } else if (*c == 's' && has_string == FALSE) {
+            has_string = TRUE;
+        } else {
+            message->num_slots = -1;
+            return;
+        }
+
+        message->offsets[message->num_slots] = length;
+        message->types[message->num_slots]   = *c == 's' ? 's' : 'd';
+        message->num_slots++;
+    }
+
+    message->text[length] = '\0';
+}
+
+static void message_parse_plural (struct message_plural *plural, gint number, const gchar *format)
+{
+    gint form;
+
+    for (form = 0; form < plural->num_forms; form++) {
+        if (plural->forms[form].format == format || g_strcmp0 (plural->forms[form].format, format) == 0) {
+            break;
+        }
+    }
+
+    /* more forms than expected: the number keeps using g_dngettext */
+
+    if (form == plural->num_forms && form < MESSAGE_FORMS) {
+        message_parse (&plural->forms[form], format, FALSE);
+        plural->num_forms++;
+    }
+
+    plural->form[number] = (guint8)form;
+}
+
+static void load_messages (void)
+{
+    message_parse (&messages.battery[MISSING],        _("Battery is missing!"), FALSE);
+    message_parse (&messages.battery[UNKNOWN],        _("Battery status is unknown!"), FALSE);
+    message_parse (&messages.battery[CHARGED],        _("Battery is charged!"), FALSE);
+    message_parse (&messages.battery[CHARGING],       _("Battery is charging (%i%%)"), FALSE);
+    message_parse (&messages.battery[DISCHARGING],    _("Battery is discharging (%i%% remaining)"), FALSE);
+    message_parse (&messages.battery[NOT_CHARGING],   _("Battery is not charging (%i%% remaining)"), FALSE);
+    message_parse (&messages.battery[LOW_LEVEL],      _("Battery level is low! (%i%% remaining)"), FALSE);
+    message_parse (&messages.battery[CRITICAL_LEVEL], _("Battery level is critical! (%i%% remaining)"), FALSE);
+    message_parse (&messages.battery_detail,          _("%s: %i%%"), TRUE);
+
+    for (gint number = 0; number < 60; number++) {
+        message_parse_plural (&messages.minutes, number, g_dngettext (NULL, "%d minute", "%d minutes", number));
+        message_parse_plural (&messages.minutes_remaining, number,
+            g_dngettext (NULL, "%d minute remaining", "%d minutes remaining", number));
+    }
+
+    for (gint number = 0; number < MESSAGE_HOURS; number++) {
+        message_parse_plural (&messages.hours_remaining, number,
+            g_dngettext (NULL, "%d hour, %s remaining", "%d hours, %s remaining", number));
+    }
+
+    messages.loaded = TRUE;
+}
+
+static gint message_append (gchar *buffer, gint length, const gchar *data, gint size)
+{
+    size = MIN (size, STR_LTH - 1 - length);
+    memcpy (buffer + length, data, size);
+
+    return length + size;
+}
+
+static gint message_append_number (gchar *buffer, gint length, gint number)
+{
+    gchar digits[12];
+    gint count = 0;
+    guint value = number < 0 ? -(guint)number : (guint)number;
+
+    do {
+        digits[sizeof (digits) - 1 - count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+
+    if (number < 0) {
+        digits[sizeof (digits) - 1 - count++] = '-';
+    }
+
+    return message_append (buffer, length, digits + sizeof (digits) - count, count);
+}
+
+static void message_build (const struct message_template *message, gchar *buffer, gint number, const gchar *string)
+{
+    gint length = 0, position = 0;
+
+    if (message->num_slots < 0) {
+        if (message->string_first == TRUE) {
+            g_snprintf (buffer, STR_LTH, message->format, string, number);
+        } else {
+            g_snprintf (buffer, STR_LTH, message->format, number, string);
+        }
+        return;
+    }
+
+    for (gint slot = 0; slot < message->num_slots; slot++) {
+        length = message_append (buffer, length, message->text + position, message->offsets[slot] - position);
+        position = message->offsets[slot];
+
+        if (message->types[slot] == 'd') {
+            length = message_append_number (buffer, length, number);
+        } else if (string != NULL) {
+            length = message_append (buffer, length, string, strlen (string));
+        }
+    }
+
+    length = message_append (buffer, length, message->text + position, strlen (message->text + position));
+    buffer[length] = '\0';
+}
+
+static void message_build_plural (const struct message_plural *plural, gchar *buffer, gint number, const gchar *string,
+                                  const gchar *singular, const gchar *plural_format)
+{
+    if (number >= 0 && number < MESSAGE_HOURS && plural->form[number] < MESSAGE_FORMS) {
+        message_build (&plural->forms[plural->form[number]], buffer, number, string);
+    } else {
+        g_snprintf (buffer, STR_LTH, g_dngettext (NULL, singular, plural_format, number), number, string);
+    }
+}
+
 static gchar* get_tooltip_string (gchar *battery, gchar *time)
 {
     static gchar tooltip_string[STR_LTH];
+    gchar detail_string[STR_LTH];
+    gint64 profile_start = profile_get_time ();
 
     tooltip_string[0] = '\0';
 
     g_return_val_if_fail (battery != NULL, tooltip_string);
 
-    g_strlcpy (tooltip_string, battery, STR_LTH);
-
-    if (configuration.debug_output == TRUE) {
-        g_printf ("tooltip: %s\n", battery);
+    if (messages.loaded == FALSE) {
+        load_messages ();
     }
 
+    g_strlcpy (tooltip_string, battery, STR_LTH);
+
     if (time != NULL) {
         g_strlcat (tooltip_string, "\n", STR_LTH);
         g_strlcat (tooltip_string, time, STR_LTH);
-
-        if (configuration.debug_output == TRUE) {
-            g_printf ("tooltip: %s\n", time);
-        }
     }
 
-    return tooltip_string;
-}
+    /* detail of each battery when they are combined */
 
-static gchar* get_battery_string (gint state, gint percentage)
-{
-    static gchar battery_string[STR_LTH];
+    if (num_batteries > 1) {
+        gboolean first = TRUE;
 
-    switch (state) {
-        case MISSING:
-            g_strlcpy (battery_string, _("Battery is missing!"), STR_LTH);
-            break;
+        for (gint i = 0; i < num_batteries; i++) {
+            const struct cbatticon_battery *b = &batteries[i];
 
-        case UNKNOWN:
-            g_strlcpy (battery_string, _("Battery status is unknown!"), STR_LTH);
-            break;
+            if (b->present == FALSE || b->remaining_capacity < 0 || b->full_capacity <= 0) {
+                continue;
+            }
 
-        case CHARGED:
-            g_strlcpy (battery_string, _("Battery is charged!"), STR_LTH);
-            break;
+            message_build (&messages.battery_detail, detail_string,
+                (gint)fmin (floor (b->remaining_capacity / b->full_capacity * 100.0), 100.0), strrchr (b->path, '/') + 1);
 
-        case DISCHARGING:
-            g_snprintf (battery_string, STR_LTH, _("Battery is discharging (%i%% remaining)"), percentage);
-            break;
+            g_strlcat (tooltip_string, first == TRUE ? "\n" : ", ", STR_LTH);
+            g_strlcat (tooltip_string, detail_string, STR_LTH);
+            first = FALSE;
+        }
+    }
 
-        case NOT_CHARGING:
-            g_snprintf (battery_string, STR_LTH, _("Battery is not charging (%i%% remaining)"), percentage);
-            break;
+    LOG_EVENT (EVENT_TOOLTIP, NULL, time != NULL ? 2 : 1, 0, 0, 0);
 
-        case LOW_LEVEL:
-            g_snprintf (battery_string, STR_LTH, _("Battery level is low! (%i%% remaining)"), percentage);
-            break;
+    profile_add (PROFILE_STRINGS, profile_start);
 
-        case CRITICAL_LEVEL:
-            g_snprintf (battery_string, STR_LTH, _("Battery level is critical! (%i%% remaining)"), percentage);
-            break;
+    return tooltip_string;
+}
 
-        case CHARGING:
-            g_snprintf (battery_string, STR_LTH, _("Battery is charging (%i%%)"), percentage);
-            break;
+static gchar* get_battery_string (gint state, gint percentage)
+{
+    static gchar battery_string[STR_LTH];
+    gint64 profile_start = profile_get_time ();
 
-        default:
-            battery_string[0] = '\0';
-            break;
+    if (messages.loaded == FALSE) {
+        load_messages ();
     }
 
-    if (configuration.debug_output == TRUE) {
-        g_printf ("battery string: %s\n", battery_string);
+    if (state >= MISSING && state <= CRITICAL_LEVEL) {
+        message_build (&messages.battery[state], battery_string, percentage, NULL);
+    } else {
+        battery_string[0] = '\0';
     }
 
+    LOG_EVENT (EVENT_BATTERY_STRING, NULL, state, percentage, 0, 0);
+
+    profile_add (PROFILE_STRINGS, profile_start);
+
     return battery_string;
 }
 
@@ -1182,24 +5918,31 @@ static gchar* get_time_string (gint minutes)
     static gchar time_string[STR_LTH];
     static gchar minutes_string[STR_LTH];
     gint hours;
+    gint64 profile_start = profile_get_time ();
 
     if (minutes < 0) {
         return NULL;
     }
 
+    if (messages.loaded == FALSE) {
+        load_messages ();
+    }
+
+    LOG_EVENT (EVENT_TIME_STRING, NULL, minutes, 0, 0, 0);
+
     hours   = minutes / 60;
     minutes = minutes % 60;
 
     if (hours > 0) {
-        g_sprintf (minutes_string, g_dngettext (NULL, "%d minute", "%d minutes", minutes), minutes);
-        g_sprintf (time_string, g_dngettext (NULL, "%d hour, %s remaining", "%d hours, %s remaining", hours), hours, minutes_string);
+        message_build_plural (&messages.minutes, minutes_string, minutes, NULL, "%d minute", "%d minutes");
+        message_build_plural (&messages.hours_remaining, time_string, hours, minutes_string,
+            "%d hour, %s remaining", "%d hours, %s remaining");
     } else {
-        g_sprintf (time_string, g_dngettext (NULL, "%d minute remaining", "%d minutes remaining", minutes), minutes);
+        message_build_plural (&messages.minutes_remaining, time_string, minutes, NULL,
+            "%d minute remaining", "%d minutes remaining");
     }
 
-    if (configuration.debug_output == TRUE) {
-        g_printf ("time string: %s\n", time_string);
-    }
+    profile_add (PROFILE_STRINGS, profile_start);
 
     return time_string;
 }
@@ -1207,6 +5950,7 @@ static gchar* get_time_string (gint minutes)
 static gchar* get_icon_name (gint state, gint percentage)
 {
     static gchar icon_name[STR_LTH];
+    gint64 profile_start = profile_get_time ();
 
     if (configuration.icon_type == BATTERY_ICON_NOTIFICATION) {
         g_strlcpy (icon_name, "notification-battery", STR_LTH);
@@ -1245,9 +5989,9 @@ static gchar* get_icon_name (gint state, gint percentage)
         g_strlcat (icon_name, "-symbolic", STR_LTH);
     }
 
-    if (configuration.debug_output == TRUE) {
-        g_printf ("icon name: %s\n", icon_name);
-    }
+    LOG_EVENT (EVENT_ICON_NAME, NULL, state, percentage, 0, 0);
+
+    profile_add (PROFILE_STRINGS, profile_start);
 
     return icon_name;
 }
@@ -1256,36 +6000,43 @@ int main (int argc, char **argv)
 {
     gint ret;
 
+    startup.origin = profile_get_time ();
+
     setlocale (LC_ALL, "");
     bindtextdomain (CBATTICON_STRING, NLSDIR);
     bind_textdomain_codeset (CBATTICON_STRING, "UTF-8");
     textdomain (CBATTICON_STRING);
 
+    /* the plugins are finished on every exit, the signal handlers included */
+
     ret = get_options (&argc, &argv);
     if (ret <= 0) {
+        unload_plugins ();
         return ret;
     }
 
-#ifdef WITH_NOTIFY
-    if (configuration.hide_notification == FALSE) {
-        if (notify_init (CBATTICON_STRING) == FALSE) {
-            return -1;
-        }
-    }
-#endif
+    g_unix_signal_add (SIGUSR1, on_profile_signal, NULL);
+    g_unix_signal_add (SIGUSR2, on_ring_signal, NULL);
 
-    if (argc > 1) {
-        battery_suffix = argv[1];
+    if (configuration.print_profile == TRUE || configuration.dump_events == TRUE || configuration.metrics_socket != NULL ||
+        configuration.plugin_files != NULL) {
+        g_unix_signal_add (SIGINT, on_exit_signal, NULL);
+        g_unix_signal_add (SIGTERM, on_exit_signal, NULL);
     }
 
-    get_power_supplies();
+    startup_join_workers ();
     create_tray_icon ();
+    start_devices ();
+    start_configuration_watch ();
+    start_wakeup_accounting ();
 
-#ifdef WITH_QT6
-    qApp->exec();
-#else
-    gtk_main();
-#endif
+    if (configuration.startup_trace == TRUE) {
+        startup_print ();
+    }
+
+    TOOLKIT_MAIN ();
+
+    unload_plugins ();
 
     return 0;
 }
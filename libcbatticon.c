@@ -0,0 +1,914 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "libcbatticon.h"
+
+#include <glib.h>
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define SYSFS_PATH "/sys/class/power_supply"
+
+#define DEFAULT_INTERVAL 5
+#define MAX_SAMPLES      60
+#define MAX_BATTERIES    8
+
+/*
+ * current/power filtering
+ */
+
+struct filter {
+    gdouble samples[MAX_SAMPLES];
+    struct timespec sample_times[MAX_SAMPLES];
+    gint num_samples, next_sample;
+};
+
+struct cbatticon_context {
+    gchar *sysfs_path;
+    gchar *battery;
+    gint   interval;
+    gint   timer_fd;
+
+    cbatticon_clock_func clock;
+    gpointer             clock_data;
+    cbatticon_log_func   log;
+    gpointer             log_data;
+    cbatticon_list_func  list;
+    cbatticon_read_func  read;
+    gpointer             read_data;
+
+    struct filter energy_filter;
+    struct filter charge_filter;
+    struct filter power_filter;
+    struct filter current_filter;
+
+    gboolean                  estimate_charging; /* direction of the samples in the filters */
+    struct cbatticon_snapshot snapshot;
+
+    gint64 poll_boot_time;      /* clocks of the last poll, to find the suspends */
+    gint64 poll_monotonic_time;
+};
+
+static void get_context_time (cbatticon_context *context, struct timespec *time)
+{
+    if (context->clock != NULL) {
+        context->clock (time, context->clock_data);
+        return;
+    }
+
+    clock_gettime (CLOCK_BOOTTIME, time);
+}
+
+static void filter_reset (struct filter *f)
+{
+    f->num_samples = 0;
+    f->next_sample = 0;
+}
+
+static void filter_append (cbatticon_context *context, struct filter *f, gdouble value)
+{
+    f->samples[f->next_sample] = value;
+    get_context_time (context, &f->sample_times[f->next_sample]);
+    f->next_sample = (f->next_sample + 1) % MAX_SAMPLES;
+    f->num_samples = MAX (f->next_sample, f->num_samples);
+}
+
+static gdouble filter_get_mean (struct filter *f)
+{
+    gdouble sum = 0.0;
+
+    for (gint i = 0; i < f->num_samples; i++) {
+        sum += f->samples[i];
+    }
+
+    return sum / (gdouble)f->num_samples;
+}
+
+static gdouble filter_get_span (struct filter *f)
+{
+    if (f->num_samples < 2) {
+        return 0.0;
+    }
+
+    int a = (f->next_sample + MAX_SAMPLES - f->num_samples) % MAX_SAMPLES;
+    int b = (f->next_sample + MAX_SAMPLES - 1) % MAX_SAMPLES;
+
+    return (gdouble)(f->sample_times[b].tv_sec - f->sample_times[a].tv_sec)
+        + ((gdouble)f->sample_times[b].tv_nsec / 1000000000.0)
+        - ((gdouble)f->sample_times[a].tv_nsec / 1000000000.0);
+}
+
+static gdouble filter_get_rate (cbatticon_context *context, struct filter *f, const char *attribute)
+{
+    if (f->num_samples < 2) {
+        return 0.0;
+    }
+
+    int a = (f->next_sample + MAX_SAMPLES - f->num_samples) % MAX_SAMPLES;
+    int b = (f->next_sample + MAX_SAMPLES - 1) % MAX_SAMPLES;
+
+    gdouble value_diff = f->samples[b] - f->samples[a];
+    gdouble time_diff = filter_get_span (f);
+
+    if (time_diff < 60.0) {
+        return 0.0; // measure rate over 60s minimum
+    }
+
+    if (context->log != NULL) {
+        context->log (CBATTICON_LOG_CAPACITY_RATE, attribute, value_diff, time_diff, context->log_data);
+    }
+
+    return value_diff / time_diff * 3600.0; // rate per hour
+}
+
+/*
+ * estimation functions
+ */
+
+static gboolean get_current_rate (cbatticon_context *context, gboolean use_charge, gdouble rate_now, gdouble *rate)
+{
+    const gchar * attribute;
+    struct filter * f;
+
+    if (use_charge == FALSE) {
+        attribute = "power_now";
+        f = &context->power_filter;
+    } else {
+        attribute = "current_now";
+        f = &context->current_filter;
+    }
+
+    if (rate_now > 0) {
+        // get rate from batteries
+        filter_append (context, f, rate_now);
+        *rate = filter_get_mean (f);
+    } else {
+        // compute rate from capacity change
+        if (use_charge == FALSE) {
+            *rate = fabs (filter_get_rate (context, &context->energy_filter, "power"));
+        } else {
+            *rate = fabs (filter_get_rate (context, &context->charge_filter, "current"));
+        }
+
+        if (*rate < 0.01) {
+            return FALSE;
+        }
+    }
+
+    if (context->log != NULL) {
+        context->log (CBATTICON_LOG_CURRENT_RATE, attribute, rate_now, *rate, context->log_data);
+    }
+
+    return TRUE;
+}
+
+int cbatticon_context_estimate (cbatticon_context *context, const struct cbatticon_sample *sample, int remaining,
+                                int *percentage, int *minutes, double *rate)
+{
+    gdouble current_rate;
+
+    g_return_val_if_fail (context != NULL, -1);
+    g_return_val_if_fail (sample != NULL, -1);
+    g_return_val_if_fail (percentage != NULL, -1);
+
+    if (sample->full_capacity <= 0 || sample->remaining_capacity < 0) {
+        return -1;
+    }
+
+    /* capacity samples for the rate estimation, percentages are too coarse */
+
+    if (sample->from_pct == FALSE) {
+        filter_append (context, sample->use_charge == TRUE ? &context->charge_filter : &context->energy_filter,
+                       sample->remaining_capacity);
+    }
+
+    *percentage = (gint)fmin (floor (sample->remaining_capacity / sample->full_capacity * 100.0), 100.0);
+
+    if (minutes == NULL) {
+        return 0;
+    }
+
+    if (get_current_rate (context, sample->use_charge, sample->rate, &current_rate) == FALSE) {
+        if (rate != NULL) {
+            *rate = -1;
+        }
+
+        *minutes = -1;
+        return 0;
+    }
+
+    if (rate != NULL) {
+        *rate = current_rate;
+    }
+
+    if (remaining == TRUE) {
+        *minutes = (gint)(sample->remaining_capacity / current_rate * 60.0);
+    } else {
+        *minutes = (gint)((sample->full_capacity - sample->remaining_capacity) / current_rate * 60.0);
+    }
+
+    return 0;
+}
+
+void cbatticon_context_reset_estimate (cbatticon_context *context)
+{
+    g_return_if_fail (context != NULL);
+
+    filter_reset (&context->energy_filter);
+    filter_reset (&context->charge_filter);
+    filter_reset (&context->power_filter);
+    filter_reset (&context->current_filter);
+}
+
+/*
+ * sysfs functions
+ *
+ * Every attribute and the power supply directory are read through the read
+ * and list functions of the context, which default to reading the files; the
+ * values are only parsed here.
+ */
+
+static gboolean read_attribute (cbatticon_context *context, const gchar *path, const gchar *attribute, gchar **value)
+{
+    gchar *filename;
+    gboolean status;
+
+    if (context->read != NULL) {
+        return context->read (path, attribute, value, context->read_data) == 0;
+    }
+
+    filename = g_build_filename (path, attribute, NULL);
+    status   = g_file_get_contents (filename, value, NULL, NULL);
+
+    g_free (filename);
+
+    if (status == TRUE) {
+        g_strstrip (*value);
+    }
+
+    return status;
+}
+
+static gboolean read_attribute_double (cbatticon_context *context, const gchar *path, const gchar *attribute, gdouble *value)
+{
+    gchar *string_value;
+    gboolean status;
+
+    if (read_attribute (context, path, attribute, &string_value) == FALSE) {
+        return FALSE;
+    }
+
+    errno  = 0;
+    *value = g_ascii_strtod (string_value, NULL);
+    status = errno == 0 && *value >= 0.01;
+
+    g_free (string_value);
+
+    return status;
+}
+
+static gboolean read_attribute_flag (cbatticon_context *context, const gchar *path, const gchar *attribute, gboolean *flag)
+{
+    gchar *string_value;
+
+    if (read_attribute (context, path, attribute, &string_value) == FALSE) {
+        return FALSE;
+    }
+
+    *flag = g_str_has_prefix (string_value, "1");
+
+    g_free (string_value);
+
+    return TRUE;
+}
+
+static gchar** list_power_supplies (cbatticon_context *context)
+{
+    GDir *directory;
+    GPtrArray *names;
+    const gchar *name;
+
+    if (context->list != NULL) {
+        return context->list (context->sysfs_path, context->read_data);
+    }
+
+    directory = g_dir_open (context->sysfs_path, 0, NULL);
+    if (directory == NULL) {
+        return NULL;
+    }
+
+    names = g_ptr_array_new ();
+
+    while ((name = g_dir_read_name (directory)) != NULL) {
+        g_ptr_array_add (names, g_strdup (name));
+    }
+
+    g_ptr_array_add (names, NULL);
+    g_dir_close (directory);
+
+    return (gchar **)g_ptr_array_free (names, FALSE);
+}
+
+static void log_event (cbatticon_context *context, gint event, gdouble a)
+{
+    if (context->log != NULL) {
+        context->log (event, NULL, a, 0, context->log_data);
+    }
+}
+
+int cbatticon_parse_status (const char *value)
+{
+    if (g_str_has_prefix (value, "Charging") == TRUE)
+        return CBATTICON_STATUS_CHARGING;
+    else if (g_str_has_prefix (value, "Discharging") == TRUE)
+        return CBATTICON_STATUS_DISCHARGING;
+    else if (g_str_has_prefix (value, "Not charging") == TRUE)
+        return CBATTICON_STATUS_NOT_CHARGING;
+    else if (g_str_has_prefix (value, "Full") == TRUE)
+        return CBATTICON_STATUS_CHARGED;
+    else
+        return CBATTICON_STATUS_UNKNOWN;
+}
+
+static gboolean is_system_battery (cbatticon_context *context, const gchar *path)
+{
+    gchar *scope;
+    gboolean system = TRUE;
+
+    /* batteries without a scope are system batteries, device batteries power peripherals */
+
+    if (read_attribute (context, path, "scope", &scope) == TRUE) {
+        system = g_str_has_prefix (scope, "Device") == FALSE;
+        g_free (scope);
+    }
+
+    return system;
+}
+
+int cbatticon_context_discover (cbatticon_context *context, struct cbatticon_battery *batteries, int max_batteries,
+                                char **ac_path, cbatticon_supply_func supply, void *user_data)
+{
+    gchar **names;
+    gint num_batteries = 0;
+
+    g_return_val_if_fail (context != NULL, -1);
+    g_return_val_if_fail (batteries != NULL || max_batteries == 0, -1);
+
+    if (ac_path != NULL) {
+        *ac_path = NULL;
+    }
+
+    names = list_power_supplies (context);
+    if (names == NULL) {
+        return -1;
+    }
+
+    for (gchar **name = names; *name != NULL; name++) {
+        gchar *path = g_build_filename (context->sysfs_path, *name, NULL);
+        gchar *type;
+        gboolean flag;
+
+        if (read_attribute (context, path, "type", &type) == FALSE) {
+            g_free (path);
+            continue;
+        }
+
+        if (g_str_has_prefix (type, "Battery") == TRUE && read_attribute_flag (context, path, "present", &flag) == TRUE) {
+            gboolean system, selected;
+
+            log_event (context, CBATTICON_LOG_BATTERY_PRESENT, flag);
+
+            /* a battery id selects a single battery, otherwise all system batteries are combined */
+
+            system   = is_system_battery (context, path);
+            selected = num_batteries < max_batteries &&
+                (context->battery != NULL ? num_batteries == 0 && g_str_has_suffix (path, context->battery) == TRUE :
+                                            system == TRUE);
+
+            if (supply != NULL) {
+                supply (path, system == TRUE ? CBATTICON_SUPPLY_BATTERY : CBATTICON_SUPPLY_DEVICE, selected, user_data);
+            }
+
+            if (selected == TRUE) {
+                struct cbatticon_battery *battery = &batteries[num_batteries++];
+
+                memset (battery, 0, sizeof (*battery));
+                battery->path               = g_strdup (path);
+                battery->status             = CBATTICON_STATUS_MISSING;
+                battery->remaining_capacity = -1;
+                battery->rate               = -1;
+            }
+        }
+
+        if (g_str_has_prefix (type, "Mains") == TRUE && read_attribute_flag (context, path, "online", &flag) == TRUE) {
+            gboolean selected = ac_path != NULL && *ac_path == NULL;
+
+            log_event (context, CBATTICON_LOG_AC_ONLINE, flag);
+
+            if (supply != NULL) {
+                supply (path, CBATTICON_SUPPLY_AC, selected, user_data);
+            }
+
+            if (selected == TRUE) {
+                *ac_path = g_strdup (path);
+            }
+        }
+
+        g_free (type);
+        g_free (path);
+    }
+
+    g_strfreev (names);
+
+    return num_batteries;
+}
+
+int cbatticon_context_read_ac_online (cbatticon_context *context, const char *ac_path)
+{
+    gboolean online;
+
+    g_return_val_if_fail (context != NULL, -1);
+
+    if (ac_path == NULL || read_attribute_flag (context, ac_path, "online", &online) == FALSE) {
+        return -1;
+    }
+
+    log_event (context, CBATTICON_LOG_AC_ONLINE, online);
+
+    return online;
+}
+
+/*
+ * battery aggregation functions
+ *
+ * A charging battery makes the whole charging, otherwise a discharging one
+ * makes it discharging. The statuses are read first and the capacities only
+ * when the aggregate status needs them; charge is converted to energy with
+ * the voltage when batteries of both kinds are mixed, and a battery that
+ * cannot be converted is left out.
+ */
+
+static gint get_aggregate_status (const struct cbatticon_battery *batteries, gint num_batteries)
+{
+    gint status = CBATTICON_STATUS_MISSING;
+    gboolean all_charged = TRUE;
+
+    for (gint i = 0; i < num_batteries; i++) {
+        if (batteries[i].present == FALSE) {
+            continue;
+        }
+
+        if (batteries[i].status == CBATTICON_STATUS_CHARGING) {
+            return CBATTICON_STATUS_CHARGING;
+        }
+
+        if (batteries[i].status == CBATTICON_STATUS_DISCHARGING || status == CBATTICON_STATUS_DISCHARGING) {
+            status = CBATTICON_STATUS_DISCHARGING;
+        } else if (batteries[i].status == CBATTICON_STATUS_NOT_CHARGING || status == CBATTICON_STATUS_NOT_CHARGING) {
+            status = CBATTICON_STATUS_NOT_CHARGING;
+        } else {
+            status = CBATTICON_STATUS_UNKNOWN;
+        }
+
+        all_charged = all_charged && batteries[i].status == CBATTICON_STATUS_CHARGED;
+    }
+
+    return status == CBATTICON_STATUS_UNKNOWN && all_charged == TRUE ? CBATTICON_STATUS_CHARGED : status;
+}
+
+int cbatticon_context_read_statuses (cbatticon_context *context, struct cbatticon_battery *batteries, int num_batteries)
+{
+    gboolean readable = FALSE;
+
+    g_return_val_if_fail (context != NULL, -1);
+
+    for (gint i = 0; i < num_batteries; i++) {
+        struct cbatticon_battery *battery = &batteries[i];
+        gchar *status;
+
+        battery->present = FALSE;
+        battery->status  = CBATTICON_STATUS_MISSING;
+
+        if (read_attribute_flag (context, battery->path, "present", &battery->present) == FALSE) {
+            continue;
+        }
+
+        log_event (context, CBATTICON_LOG_BATTERY_PRESENT, battery->present);
+        readable = TRUE;
+
+        if (battery->present == FALSE) {
+            continue;
+        }
+
+        if (read_attribute (context, battery->path, "status", &status) == FALSE) {
+            return -1;
+        }
+
+        battery->status = cbatticon_parse_status (status);
+        log_event (context, CBATTICON_LOG_BATTERY_STATUS, battery->status);
+
+        g_free (status);
+    }
+
+    return readable == TRUE ? get_aggregate_status (batteries, num_batteries) : -1;
+}
+
+static gboolean read_battery_capacity (cbatticon_context *context, struct cbatticon_battery *battery)
+{
+    battery->remaining_capacity = -1;
+    battery->rate               = -1;
+    battery->from_pct           = FALSE;
+
+    battery->use_charge = FALSE;
+    if (read_attribute_double (context, battery->path, "energy_full", &battery->full_capacity) == FALSE) {
+        battery->use_charge = TRUE;
+        if (read_attribute_double (context, battery->path, "charge_full", &battery->full_capacity) == FALSE) {
+            return FALSE;
+        }
+    }
+
+    if (read_attribute_double (context, battery->path, battery->use_charge == FALSE ? "energy_now" : "charge_now",
+                               &battery->remaining_capacity) == FALSE) {
+        if (read_attribute_double (context, battery->path, "capacity", &battery->remaining_capacity) == FALSE) {
+            battery->remaining_capacity = -1;
+            return FALSE;
+        }
+
+        /* remaining capacity is percentage, compute the actual remaining capacity */
+        battery->remaining_capacity *= battery->full_capacity / 100.0;
+        battery->from_pct = TRUE;
+    }
+
+    if (read_attribute_double (context, battery->path, battery->use_charge == FALSE ? "power_now" : "current_now",
+                               &battery->rate) == FALSE) {
+        battery->rate = -1;
+    }
+
+    return TRUE;
+}
+
+static gboolean convert_battery_to_energy (cbatticon_context *context, struct cbatticon_battery *battery)
+{
+    gdouble voltage;
+
+    /* uAh * uV / 1e6 = uWh and uA * uV / 1e6 = uW */
+
+    if (read_attribute_double (context, battery->path, "voltage_now", &voltage) == FALSE) {
+        return FALSE;
+    }
+
+    battery->use_charge          = FALSE;
+    battery->full_capacity      *= voltage / 1e6;
+    battery->remaining_capacity *= voltage / 1e6;
+
+    if (battery->rate > 0) {
+        battery->rate *= voltage / 1e6;
+    }
+
+    return TRUE;
+}
+
+int cbatticon_context_read_sample (cbatticon_context *context, struct cbatticon_battery *batteries, int num_batteries,
+                                   int status, struct cbatticon_sample *sample)
+{
+    gint num_charge = 0, num_read = 0;
+    gboolean missing_rate = FALSE;
+
+    g_return_val_if_fail (context != NULL, -1);
+    g_return_val_if_fail (sample != NULL, -1);
+
+    sample->status             = status;
+    sample->use_charge         = FALSE;
+    sample->from_pct           = FALSE;
+    sample->full_capacity      = 0;
+    sample->remaining_capacity = -1;
+    sample->rate               = -1;
+
+    for (gint i = 0; i < num_batteries; i++) {
+        batteries[i].remaining_capacity = -1;
+    }
+
+    /* a charged or missing battery needs no capacity */
+
+    if (status == CBATTICON_STATUS_MISSING || status == CBATTICON_STATUS_CHARGED) {
+        return 0;
+    }
+
+    for (gint i = 0; i < num_batteries; i++) {
+        if (batteries[i].present == TRUE && read_battery_capacity (context, &batteries[i]) == TRUE) {
+            num_charge += batteries[i].use_charge == TRUE ? 1 : 0;
+            num_read++;
+        }
+    }
+
+    if (num_read == 0) {
+        return 0;
+    }
+
+    sample->use_charge         = num_charge == num_read;
+    sample->remaining_capacity = 0;
+    sample->rate               = 0;
+
+    for (gint i = 0; i < num_batteries; i++) {
+        struct cbatticon_battery *battery = &batteries[i];
+
+        if (battery->remaining_capacity < 0) {
+            continue;
+        }
+
+        if (battery->use_charge == TRUE && sample->use_charge == FALSE &&
+            convert_battery_to_energy (context, battery) == FALSE) {
+            battery->remaining_capacity = -1;
+            continue;
+        }
+
+        sample->full_capacity      += battery->full_capacity;
+        sample->remaining_capacity += battery->remaining_capacity;
+        sample->from_pct            = sample->from_pct || battery->from_pct;
+
+        if (battery->rate > 0) {
+            sample->rate += battery->rate;
+        } else if (battery->status == CBATTICON_STATUS_CHARGING || battery->status == CBATTICON_STATUS_DISCHARGING) {
+            missing_rate = TRUE;
+        }
+    }
+
+    /* without the rate of every battery in use, the rate is computed from the capacity change */
+
+    if (missing_rate == TRUE || sample->rate < 0.01) {
+        sample->rate = -1;
+    }
+
+    return num_read;
+}
+
+/*
+ * context functions
+ */
+
+cbatticon_context* cbatticon_context_new (const char *sysfs_path, const char *battery)
+{
+    cbatticon_context *context = g_new0 (cbatticon_context, 1);
+
+    context->sysfs_path = g_strdup (sysfs_path != NULL ? sysfs_path : SYSFS_PATH);
+    context->battery    = g_strdup (battery);
+    context->interval   = DEFAULT_INTERVAL;
+    context->timer_fd   = -1;
+
+    context->snapshot.status             = CBATTICON_STATUS_MISSING;
+    context->snapshot.percentage         = -1;
+    context->snapshot.time               = -1;
+    context->snapshot.ac_online          = -1;
+    context->snapshot.full_capacity      = -1;
+    context->snapshot.remaining_capacity = -1;
+    context->snapshot.rate               = -1;
+
+    return context;
+}
+
+void cbatticon_context_free (cbatticon_context *context)
+{
+    if (context == NULL) {
+        return;
+    }
+
+    if (context->timer_fd >= 0) {
+        close (context->timer_fd);
+    }
+
+    g_free (context->sysfs_path);
+    g_free (context->battery);
+    g_free (context);
+}
+
+void cbatticon_context_set_clock (cbatticon_context *context, cbatticon_clock_func clock, void *user_data)
+{
+    g_return_if_fail (context != NULL);
+
+    context->clock      = clock;
+    context->clock_data = user_data;
+}
+
+void cbatticon_context_set_log (cbatticon_context *context, cbatticon_log_func log, void *user_data)
+{
+    g_return_if_fail (context != NULL);
+
+    context->log      = log;
+    context->log_data = user_data;
+}
+
+void cbatticon_context_set_reader (cbatticon_context *context, cbatticon_list_func list, cbatticon_read_func read,
+                                   void *user_data)
+{
+    g_return_if_fail (context != NULL);
+
+    context->list      = list;
+    context->read      = read;
+    context->read_data = user_data;
+}
+
+static gint arm_timer (cbatticon_context *context)
+{
+    struct itimerspec timer = { { context->interval, 0 }, { context->interval, 0 } };
+
+    return timerfd_settime (context->timer_fd, 0, &timer, NULL);
+}
+
+int cbatticon_context_set_interval (cbatticon_context *context, int seconds)
+{
+    g_return_val_if_fail (context != NULL, -1);
+
+    if (seconds <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    context->interval = seconds;
+
+    return context->timer_fd >= 0 ? arm_timer (context) : 0;
+}
+
+/* the rates measured before a suspend are not the ones of the running */
+/* system after it, so the filters are flushed when the default clocks */
+/* show that the system was suspended since the last poll              */
+
+static void check_sleep (cbatticon_context *context)
+{
+    struct timespec boot, monotonic;
+    gint64 boot_time, monotonic_time;
+
+    clock_gettime (CLOCK_BOOTTIME, &boot);
+    clock_gettime (CLOCK_MONOTONIC, &monotonic);
+
+    boot_time      = (gint64)boot.tv_sec * G_USEC_PER_SEC + boot.tv_nsec / 1000;
+    monotonic_time = (gint64)monotonic.tv_sec * G_USEC_PER_SEC + monotonic.tv_nsec / 1000;
+
+    if (context->poll_boot_time != 0 &&
+        (boot_time - context->poll_boot_time) - (monotonic_time - context->poll_monotonic_time) > G_USEC_PER_SEC) {
+        cbatticon_context_reset_estimate (context);
+    }
+
+    context->poll_boot_time      = boot_time;
+    context->poll_monotonic_time = monotonic_time;
+}
+
+int cbatticon_context_poll (cbatticon_context *context)
+{
+    struct cbatticon_battery batteries[MAX_BATTERIES];
+    struct cbatticon_sample sample;
+    struct cbatticon_snapshot *snapshot;
+    gint num_batteries, ac_online;
+    gchar *ac_path;
+    gboolean charging;
+
+    g_return_val_if_fail (context != NULL, -1);
+
+    snapshot = &context->snapshot;
+
+    if (context->clock == NULL) {
+        check_sleep (context);
+    }
+
+    num_batteries = cbatticon_context_discover (context, batteries, MAX_BATTERIES, &ac_path, NULL, NULL);
+    if (num_batteries < 0) {
+        return -1;
+    }
+
+    ac_online     = cbatticon_context_read_ac_online (context, ac_path);
+    sample.status = cbatticon_context_read_statuses (context, batteries, num_batteries);
+
+    if (sample.status < 0) {
+        sample.status = CBATTICON_STATUS_MISSING;
+    }
+
+    snapshot->num_batteries      = num_batteries;
+    snapshot->ac_online          = ac_online;
+    snapshot->percentage         = -1;
+    snapshot->time               = -1;
+    snapshot->full_capacity      = -1;
+    snapshot->remaining_capacity = -1;
+    snapshot->rate               = -1;
+    snapshot->use_charge         = FALSE;
+
+    cbatticon_context_read_sample (context, batteries, num_batteries, sample.status, &sample);
+
+    if (sample.full_capacity > 0 && sample.remaining_capacity >= 0) {
+        snapshot->full_capacity      = sample.full_capacity;
+        snapshot->remaining_capacity = sample.remaining_capacity;
+        snapshot->use_charge         = sample.use_charge;
+    }
+
+    for (gint i = 0; i < num_batteries; i++) {
+        g_free (batteries[i].path);
+    }
+
+    g_free (ac_path);
+
+    /* workaround for limited/bugged batteries/drivers */
+    /* that unduly return unknown status               */
+
+    if (sample.status == CBATTICON_STATUS_UNKNOWN && ac_online != -1) {
+        if (ac_online == FALSE) {
+            sample.status = CBATTICON_STATUS_DISCHARGING;
+        } else if (snapshot->full_capacity > 0 && snapshot->remaining_capacity / snapshot->full_capacity >= 0.99) {
+            sample.status = CBATTICON_STATUS_CHARGED;
+        } else {
+            sample.status = CBATTICON_STATUS_CHARGING;
+        }
+    }
+
+    snapshot->status = sample.status;
+
+    if (sample.status == CBATTICON_STATUS_CHARGED) {
+        snapshot->percentage = 100;
+        return 0;
+    }
+
+    if (sample.status != CBATTICON_STATUS_CHARGING && sample.status != CBATTICON_STATUS_DISCHARGING &&
+        sample.status != CBATTICON_STATUS_NOT_CHARGING) {
+        return 0;
+    }
+
+    /* the rate samples only make sense in one direction */
+
+    charging = sample.status == CBATTICON_STATUS_CHARGING;
+    if (charging != context->estimate_charging) {
+        cbatticon_context_reset_estimate (context);
+        context->estimate_charging = charging;
+    }
+
+    cbatticon_context_estimate (context, &sample, charging == FALSE,
+                                &snapshot->percentage, &snapshot->time, &snapshot->rate);
+
+    return 0;
+}
+
+void cbatticon_context_get_snapshot (cbatticon_context *context, struct cbatticon_snapshot *snapshot)
+{
+    g_return_if_fail (context != NULL);
+    g_return_if_fail (snapshot != NULL);
+
+    *snapshot = context->snapshot;
+}
+
+int cbatticon_context_get_fd (cbatticon_context *context)
+{
+    g_return_val_if_fail (context != NULL, -1);
+
+    if (context->timer_fd >= 0) {
+        return context->timer_fd;
+    }
+
+    /* a CLOCK_BOOTTIME timer that expired during a suspend fires on resume */
+
+    context->timer_fd = timerfd_create (CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (context->timer_fd < 0) {
+        return -1;
+    }
+
+    if (arm_timer (context) < 0) {
+        close (context->timer_fd);
+        context->timer_fd = -1;
+    }
+
+    return context->timer_fd;
+}
+
+int cbatticon_context_dispatch (cbatticon_context *context)
+{
+    uint64_t expirations;
+
+    g_return_val_if_fail (context != NULL, -1);
+
+    /* drain the timer, a poll is due whether it expired once or more */
+
+    if (context->timer_fd >= 0 &&
+        read (context->timer_fd, &expirations, sizeof (expirations)) < 0 && errno != EAGAIN) {
+        return -1;
+    }
+
+    return cbatticon_context_poll (context);
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBCBATTICON_H
+#define LIBCBATTICON_H
+
+struct timespec;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * battery core library
+ *
+ * Discovers the system batteries under a power supply directory, samples
+ * and combines them, filters the rate and estimates the charge and the time
+ * remaining. All the state lives in a context, so that several contexts
+ * (different directories, batteries or clocks) can be used in the same
+ * process; a context must only be used by one thread at a time.
+ *
+ * A client either calls cbatticon_context_poll periodically, or watches the
+ * file descriptor returned by cbatticon_context_get_fd in its event loop and
+ * calls cbatticon_context_dispatch when it is readable; the last result is
+ * then read with cbatticon_context_get_snapshot.
+ *
+ * A client that drives the reads itself (the tray icon, to record, replay
+ * and batch them) gives the context its own read and list functions, and
+ * calls the discovery, status and sample functions that the poll is made
+ * of; it feeds the combined sample to cbatticon_context_estimate, and calls
+ * cbatticon_context_reset_estimate when the status changes.
+ */
+
+#define CBATTICON_API_VERSION 2
+
+enum {
+    CBATTICON_STATUS_MISSING = 0,
+    CBATTICON_STATUS_UNKNOWN,
+    CBATTICON_STATUS_CHARGED,
+    CBATTICON_STATUS_CHARGING,
+    CBATTICON_STATUS_DISCHARGING,
+    CBATTICON_STATUS_NOT_CHARGING
+};
+
+enum {
+    CBATTICON_LOG_CAPACITY_RATE = 0, /* rate from the capacity change: a = delta, b = seconds */
+    CBATTICON_LOG_CURRENT_RATE,      /* filtered rate: a = rate reported by the batteries, b = mean */
+    CBATTICON_LOG_BATTERY_PRESENT,   /* a = whether the battery is present */
+    CBATTICON_LOG_BATTERY_STATUS,    /* a = CBATTICON_STATUS_* */
+    CBATTICON_LOG_AC_ONLINE          /* a = whether the AC is online */
+};
+
+enum {
+    CBATTICON_SUPPLY_BATTERY = 0, /* system battery */
+    CBATTICON_SUPPLY_DEVICE,      /* battery of a peripheral */
+    CBATTICON_SUPPLY_AC
+};
+
+struct cbatticon_snapshot {
+    int    status;             /* CBATTICON_STATUS_* */
+    int    percentage;         /* -1 when unknown */
+    int    time;               /* minutes remaining (to empty or full), -1 when unknown */
+    int    ac_online;          /* -1 when unknown */
+    int    num_batteries;
+    double full_capacity;      /* uWh or uAh, -1 when unknown */
+    double remaining_capacity; /* uWh or uAh, -1 when unknown */
+    double rate;               /* uW or uA, -1 when unknown */
+    int    use_charge;         /* whether the capacities are in uAh */
+};
+
+struct cbatticon_sample {
+    int    status;             /* CBATTICON_STATUS_* */
+    int    use_charge;         /* whether the capacities and the rate are in uAh and uA */
+    int    from_pct;           /* whether the remaining capacity was derived from a percentage */
+    double full_capacity;      /* -1 when unknown */
+    double remaining_capacity; /* -1 when unknown */
+    double rate;               /* rate reported by the batteries, -1 when unknown */
+};
+
+struct cbatticon_battery {
+    char  *path;               /* allocated with malloc */
+    int    present;
+    int    status;             /* CBATTICON_STATUS_*, MISSING when not present */
+    int    use_charge;
+    int    from_pct;
+    double full_capacity;
+    double remaining_capacity; /* -1 when unavailable */
+    double rate;               /* -1 when unavailable */
+};
+
+typedef struct cbatticon_context cbatticon_context;
+
+typedef void (*cbatticon_clock_func) (struct timespec *time, void *user_data);
+typedef void (*cbatticon_log_func)   (int event, const char *label, double a, double b, void *user_data);
+
+/* a read function returns 0 and the value of the attribute of the power  */
+/* supply at path (allocated with malloc, trailing newline allowed), or   */
+/* -1; a list function returns the names in the directory, NULL ended and */
+/* allocated with malloc, or NULL                                         */
+
+typedef int    (*cbatticon_read_func)   (const char *path, const char *attribute, char **value, void *user_data);
+typedef char** (*cbatticon_list_func)   (const char *path, void *user_data);
+typedef void   (*cbatticon_supply_func) (const char *path, int type, int selected, void *user_data);
+
+/* sysfs_path defaults to /sys/class/power_supply, battery selects the */
+/* batteries whose name ends with it (NULL for all the batteries)      */
+
+cbatticon_context* cbatticon_context_new  (const char *sysfs_path, const char *battery);
+void               cbatticon_context_free (cbatticon_context *context);
+
+/* the clock defaults to CLOCK_BOOTTIME, the interval to 5 seconds; with */
+/* the default clock, the filters are flushed after a suspend, and the   */
+/* file descriptor becomes readable on resume                            */
+
+void cbatticon_context_set_clock    (cbatticon_context *context, cbatticon_clock_func clock, void *user_data);
+void cbatticon_context_set_log      (cbatticon_context *context, cbatticon_log_func log, void *user_data);
+void cbatticon_context_set_reader   (cbatticon_context *context, cbatticon_list_func list, cbatticon_read_func read,
+                                     void *user_data);
+int  cbatticon_context_set_interval (cbatticon_context *context, int seconds);
+
+int  cbatticon_context_poll         (cbatticon_context *context);
+void cbatticon_context_get_snapshot (cbatticon_context *context, struct cbatticon_snapshot *snapshot);
+
+int  cbatticon_context_get_fd       (cbatticon_context *context);
+int  cbatticon_context_dispatch     (cbatticon_context *context);
+
+/* percentage and, unless minutes is NULL, the filtered rate and the time */
+/* to empty (remaining) or to full; returns -1 without a capacity, and a  */
+/* rate and a time of -1 until the rate can be estimated                  */
+
+int  cbatticon_context_estimate       (cbatticon_context *context, const struct cbatticon_sample *sample, int remaining,
+                                       int *percentage, int *minutes, double *rate);
+void cbatticon_context_reset_estimate (cbatticon_context *context);
+
+/* finds the batteries (the system ones, or the first whose name ends with */
+/* the battery of the context) and the first AC, calling supply for every */
+/* battery and AC with whether it was selected; returns the number of     */
+/* batteries, whose paths are to be freed, or -1 without a directory      */
+
+int  cbatticon_context_discover       (cbatticon_context *context, struct cbatticon_battery *batteries, int max_batteries,
+                                       char **ac_path, cbatticon_supply_func supply, void *user_data);
+int  cbatticon_context_read_ac_online (cbatticon_context *context, const char *ac_path);
+
+/* the combined status of the batteries, or -1 when none can be read or  */
+/* the status of a present one cannot; then the sample of the batteries, */
+/* read only when the status needs it, and the number of batteries read  */
+
+int  cbatticon_context_read_statuses  (cbatticon_context *context, struct cbatticon_battery *batteries, int num_batteries);
+int  cbatticon_context_read_sample    (cbatticon_context *context, struct cbatticon_battery *batteries, int num_batteries,
+                                       int status, struct cbatticon_sample *sample);
+
+int  cbatticon_parse_status (const char *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CBATTICON_PLUGIN_H
+#define CBATTICON_PLUGIN_H
+
+#include "libcbatticon.h"
+
+/*
+ * action plugin interface
+ *
+ * A plugin is a shared object loaded with --plugin=FILE. It exports
+ * cbatticon_plugin_get, which returns a plugin description whose api_version
+ * is CBATTICON_PLUGIN_API_VERSION. Every callback is optional and is called
+ * from the main loop, so it must return quickly (start a thread for anything
+ * slow). The snapshot describes the last update and is only valid during the
+ * call (see libcbatticon.h for the snapshot and the statuses).
+ *
+ * init    : called once after loading, with the text that followed the file
+ *           name after a ':' (or NULL); a non zero return unloads the plugin
+ * on_click: the tray icon was left clicked
+ * on_level: the battery reached the low or critical level while discharging,
+ *           called 5 (low) or 30 (critical) seconds later if still discharging;
+ *           only for the critical level when both are reached at startup or
+ *           after the power supplies changed
+ * on_status: the battery status changed (after --status-dwell); old_status is
+ *           -1 on the first update and after the power supplies changed, when
+ *           no status was shown before
+ * fini    : called once before exiting, whether on a signal, at the end of
+ *           the main loop or on a startup error after loading
+ */
+
+#define CBATTICON_PLUGIN_API_VERSION 1
+#define CBATTICON_PLUGIN_SYMBOL      "cbatticon_plugin_get"
+
+enum {
+    CBATTICON_LEVEL_LOW = 0,
+    CBATTICON_LEVEL_CRITICAL
+};
+
+struct cbatticon_plugin {
+    int          api_version;
+    const char  *name;
+    int        (*init)      (const char *argument);
+    void       (*on_click)  (const struct cbatticon_snapshot *snapshot);
+    void       (*on_level)  (int level, const struct cbatticon_snapshot *snapshot);
+    void       (*on_status) (int old_status, const struct cbatticon_snapshot *snapshot);
+    void       (*fini)      (void);
+};
+
+typedef const struct cbatticon_plugin* (*cbatticon_plugin_get_func) (void);
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#ifdef WITH_IO_URING
+#define _DEFAULT_SOURCE
+#endif
+
+#include "sysattr.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef WITH_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * sysfs reads
+ *
+ * Attribute files are opened once and read again with pread at offset 0,
+ * which makes sysfs regenerate their contents; the descriptors are closed
+ * when the power supplies are rediscovered, and one by one when a read
+ * fails. When built with WITH_IO_URING,
+ * the reads of a tick are also submitted up front in a single io_uring
+ * batch and get_sysattr_string takes their results instead of reading.
+ * Where io_uring is not available (old kernel, seccomp filter), or for an
+ * attribute that was not prefetched, the plain reads are used. The cache,
+ * the batch and the ring are global, so the reads are made from one thread.
+ */
+
+#define PREFETCH_MAX      64
+#define PREFETCH_LTH      256
+
+static GHashTable *sysattr_fds      = NULL; /* filename -> fd + 1 */
+static guint64     sysattr_syscalls = 0;    /* counted for bench/reads */
+
+static struct {
+    gchar *filenames[PREFETCH_MAX]; /* NULL once taken */
+    gchar  buffers[PREFETCH_MAX][PREFETCH_LTH];
+    gint   results[PREFETCH_MAX];   /* read length or -errno */
+    gint   count;
+} prefetch;
+
+#ifdef WITH_IO_URING
+static struct {
+    gint                 fd; /* -1 until set up, -2 when unavailable */
+    guint               *sq_head;
+    guint               *sq_tail;
+    guint               *sq_mask;
+    guint               *sq_array;
+    struct io_uring_sqe *sqes;
+    guint               *cq_head;
+    guint               *cq_tail;
+    guint               *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring = { -1 };
+#endif
+
+static gint sysattr_open (const gchar *filename)
+{
+    gpointer cached_fd;
+    gint fd;
+
+    if (sysattr_fds == NULL) {
+        sysattr_fds = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    cached_fd = g_hash_table_lookup (sysattr_fds, filename);
+    if (cached_fd != NULL) {
+        return GPOINTER_TO_INT (cached_fd) - 1;
+    }
+
+    /* missing attributes are not cached, they may appear later */
+
+    sysattr_syscalls++;
+    fd = open (filename, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        g_hash_table_insert (sysattr_fds, g_strdup (filename), GINT_TO_POINTER (fd + 1));
+    }
+
+    return fd;
+}
+
+/* a descriptor that failed a read (e.g. ENODEV once its battery is gone) */
+/* is closed, so that the next access opens the attribute again          */
+
+static void sysattr_evict (const gchar *filename)
+{
+    gpointer cached_fd;
+
+    if (sysattr_fds == NULL) {
+        return;
+    }
+
+    cached_fd = g_hash_table_lookup (sysattr_fds, filename);
+    if (cached_fd != NULL) {
+        close (GPOINTER_TO_INT (cached_fd) - 1);
+        g_hash_table_remove (sysattr_fds, filename);
+    }
+}
+
+void sysattr_close_all (void)
+{
+    GHashTableIter iter;
+    gpointer fd;
+
+    sysattr_clear_prefetch ();
+
+    if (sysattr_fds == NULL) {
+        return;
+    }
+
+    g_hash_table_iter_init (&iter, sysattr_fds);
+    while (g_hash_table_iter_next (&iter, NULL, &fd) == TRUE) {
+        close (GPOINTER_TO_INT (fd) - 1);
+    }
+
+    g_hash_table_remove_all (sysattr_fds);
+}
+
+gboolean sysattr_read (const gchar *filename, gchar **value)
+{
+    gchar buffer[SYSATTR_VALUE_LTH];
+    gssize length;
+    gint fd = sysattr_open (filename);
+
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    sysattr_syscalls++;
+    length = pread (fd, buffer, sizeof (buffer), 0);
+    if (length < 0) {
+        sysattr_evict (filename);
+        return FALSE;
+    }
+
+    *value = g_strndup (buffer, length);
+
+    return TRUE;
+}
+
+#ifdef WITH_IO_URING
+static gboolean uring_setup (void)
+{
+    struct io_uring_params params;
+    gsize sq_size, cq_size;
+    guchar *sq_ring, *cq_ring;
+    gpointer sqes;
+
+    if (uring.fd != -1) {
+        return uring.fd >= 0;
+    }
+
+    memset (&params, 0, sizeof (params));
+
+    /* the kernel opens the ring close on exec */
+
+    uring.fd = (gint)syscall (__NR_io_uring_setup, PREFETCH_MAX, &params);
+    if (uring.fd < 0) {
+        uring.fd = -2;
+        return FALSE;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof (guint);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        sq_size = cq_size = MAX (sq_size, cq_size);
+    }
+
+    sq_ring = (guchar *)mmap (NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, uring.fd, IORING_OFF_SQ_RING);
+    cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) != 0 ? sq_ring :
+        (guchar *)mmap (NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED, uring.fd, IORING_OFF_CQ_RING);
+    sqes = mmap (NULL, params.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED, uring.fd, IORING_OFF_SQES);
+
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        close (uring.fd);
+        uring.fd = -2;
+        return FALSE;
+    }
+
+    uring.sq_head  = (guint *)(sq_ring + params.sq_off.head);
+    uring.sq_tail  = (guint *)(sq_ring + params.sq_off.tail);
+    uring.sq_mask  = (guint *)(sq_ring + params.sq_off.ring_mask);
+    uring.sq_array = (guint *)(sq_ring + params.sq_off.array);
+    uring.sqes     = (struct io_uring_sqe *)sqes;
+    uring.cq_head  = (guint *)(cq_ring + params.cq_off.head);
+    uring.cq_tail  = (guint *)(cq_ring + params.cq_off.tail);
+    uring.cq_mask  = (guint *)(cq_ring + params.cq_off.ring_mask);
+    uring.cqes     = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+    return TRUE;
+}
+
+/* the completions of the batch tagged generation, the others are dropped */
+
+static gint uring_reap (guint32 generation, gint count)
+{
+    guint head;
+    gint completed = 0;
+
+    for (head = *uring.cq_head; head != (guint)g_atomic_int_get ((gint *)uring.cq_tail); head++) {
+        const struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        guint32 index = (guint32)(cqe->user_data & G_MAXUINT32);
+
+        if ((guint32)(cqe->user_data >> 32) == generation && index < (guint32)count) {
+            prefetch.results[index] = cqe->res;
+            completed++;
+        }
+    }
+
+    g_atomic_int_set ((gint *)uring.cq_head, (gint)head);
+
+    return completed;
+}
+
+static gboolean uring_read_batch (const gint *fds, gint count)
+{
+    static guint32 generation = 0;
+    guint tail = *uring.sq_tail;
+    gint expected = count, completed = 0;
+
+    generation++;
+
+    for (gint i = 0; i < count; i++, tail++) {
+        guint index = tail & *uring.sq_mask;
+        struct io_uring_sqe *sqe = &uring.sqes[index];
+
+        memset (sqe, 0, sizeof (*sqe));
+        sqe->opcode    = IORING_OP_READ;
+        sqe->fd        = fds[i];
+        sqe->addr      = (guint64)(guintptr)prefetch.buffers[i];
+        sqe->len       = PREFETCH_LTH;
+        sqe->off       = 0;
+        sqe->user_data = ((guint64)generation << 32) | (guint32)i;
+
+        uring.sq_array[index] = index;
+    }
+
+    /* the atomic store publishes the entries to the kernel */
+
+    g_atomic_int_set ((gint *)uring.sq_tail, (gint)tail);
+
+    /* the kernel may take only some of the entries, or be interrupted after */
+    /* taking them: the entries it took read into the buffers until they    */
+    /* complete, so they are all waited for; the ones left are taken back   */
+    /* and read with pread (their result stays -ECANCELED)                  */
+
+    while (completed < expected) {
+        guint unsubmitted = tail - (guint)g_atomic_int_get ((gint *)uring.sq_head);
+        glong submitted;
+        gboolean failed;
+
+        sysattr_syscalls++;
+        submitted = syscall (__NR_io_uring_enter, uring.fd, unsubmitted, expected - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        failed = submitted < 0 ? errno != EINTR : submitted == 0 && unsubmitted > 0;
+
+        completed += uring_reap (generation, count);
+
+        if (failed == FALSE) {
+            continue;
+        }
+
+        if (unsubmitted > 0) {
+            unsubmitted = tail - (guint)g_atomic_int_get ((gint *)uring.sq_head);
+            tail -= unsubmitted;
+            expected -= (gint)unsubmitted;
+            g_atomic_int_set ((gint *)uring.sq_tail, (gint)tail);
+            continue;
+        }
+
+        /* the reads in flight cannot be waited for: their buffers are given */
+        /* up with the ring                                                  */
+
+        close (uring.fd);
+        uring.fd = -2;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+#endif
+
+gboolean sysattr_can_prefetch (void)
+{
+#ifdef WITH_IO_URING
+    return uring_setup ();
+#else
+    return FALSE;
+#endif
+}
+
+void sysattr_clear_prefetch (void)
+{
+    for (gint i = 0; i < prefetch.count; i++) {
+        g_free (prefetch.filenames[i]);
+        prefetch.filenames[i] = NULL;
+    }
+
+    prefetch.count = 0;
+}
+
+void sysattr_prefetch (GPtrArray *filenames)
+{
+#ifndef WITH_IO_URING
+    (void)filenames;
+#else
+    gint fds[PREFETCH_MAX];
+
+    sysattr_clear_prefetch ();
+
+    for (guint i = 0; i < filenames->len && prefetch.count < PREFETCH_MAX; i++) {
+        const gchar *filename = (const gchar *)g_ptr_array_index (filenames, i);
+        gint fd = sysattr_open (filename);
+
+        if (fd >= 0) {
+            fds[prefetch.count] = fd;
+            prefetch.filenames[prefetch.count] = g_strdup (filename);
+            prefetch.results[prefetch.count] = -ECANCELED;
+            prefetch.count++;
+        }
+    }
+
+    if (prefetch.count > 0 && uring_read_batch (fds, prefetch.count) == FALSE) {
+        sysattr_clear_prefetch ();
+    }
+#endif
+}
+
+gboolean sysattr_take_prefetched (const gchar *filename, gboolean *status, gchar **value)
+{
+    for (gint i = 0; i < prefetch.count; i++) {
+        gint result = prefetch.results[i];
+
+        if (prefetch.filenames[i] == NULL || strcmp (prefetch.filenames[i], filename) != 0) {
+            continue;
+        }
+
+        g_free (prefetch.filenames[i]);
+        prefetch.filenames[i] = NULL;
+
+        /* a value that may have been truncated, or an unsupported read, is read again */
+
+        if (result >= PREFETCH_LTH || result == -EINVAL || result == -ECANCELED) {
+            return FALSE;
+        }
+
+        *status = result >= 0;
+        if (*status == TRUE) {
+            *value = g_strndup (prefetch.buffers[i], result);
+        } else {
+            sysattr_evict (filename);
+        }
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+guint64 sysattr_get_syscalls (void)
+{
+    return sysattr_syscalls;
+}
+
+void sysattr_add_syscalls (guint64 syscalls)
+{
+    sysattr_syscalls += syscalls;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CBATTICON_SYSATTR_H
+#define CBATTICON_SYSATTR_H
+
+#include <glib.h>
+
+/*
+ * sysfs attribute reads
+ *
+ * Cached descriptors read with pread, and the io_uring batches of the
+ * builds with WITH_IO_URING, shared by the tray icon and the read benchmark
+ * (bench/reads.c); not thread safe (see sysattr.c).
+ */
+
+#define SYSATTR_VALUE_LTH 4096
+
+/* the value read is allocated with g_malloc; a read that fails closes the */
+/* cached descriptor, and the descriptors are all closed by close_all      */
+
+gboolean sysattr_read            (const gchar *filename, gchar **value);
+void     sysattr_close_all       (void);
+
+/* the reads of a batch are taken one by one by take_prefetched, which */
+/* returns FALSE for a file that is to be read with sysattr_read; what */
+/* is not taken is dropped by clear_prefetch or the next batch         */
+
+gboolean sysattr_can_prefetch    (void);
+void     sysattr_prefetch        (GPtrArray *filenames);
+gboolean sysattr_take_prefetched (const gchar *filename, gboolean *status, gchar **value);
+void     sysattr_clear_prefetch  (void);
+
+/* the open, read and io_uring_enter calls made so far */
+
+guint64  sysattr_get_syscalls    (void);
+void     sysattr_add_syscalls    (guint64 syscalls);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * boottime: makes CLOCK_BOOTTIME jump as over a suspend, for the tests.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Preloaded with LD_PRELOAD, it moves CLOCK_BOOTTIME ahead of
+ * CLOCK_MONOTONIC by the seconds written in the file named by
+ * $CBATTICON_TEST_SLEPT, which is read again at each call.
+ */
+
+int clock_gettime (clockid_t clock, struct timespec *time)
+{
+    static int (*real_clock_gettime) (clockid_t clock, struct timespec *time);
+    const char *path;
+    FILE *file;
+    long slept;
+    int result;
+
+    if (real_clock_gettime == NULL) {
+        real_clock_gettime = (int (*) (clockid_t, struct timespec*))dlsym (RTLD_NEXT, "clock_gettime");
+    }
+
+    result = real_clock_gettime (clock, time);
+
+    if (result == 0 && clock == CLOCK_BOOTTIME && (path = getenv ("CBATTICON_TEST_SLEPT")) != NULL) {
+        file = fopen (path, "r");
+        if (file != NULL) {
+            if (fscanf (file, "%ld", &slept) == 1) {
+                time->tv_sec += slept;
+            }
+
+            fclose (file);
+        }
+    }
+
+    return result;
+}
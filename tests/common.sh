@@ -0,0 +1,100 @@
+# helpers of the tests, sourced by each tests/test-*.sh
+#
+# make check runs every test from the source directory under dbus-run-session;
+# the private session bus also serves as the system bus, where the stub
+# services are owned.
+
+set -e
+
+export DBUS_SYSTEM_BUS_ADDRESS="$DBUS_SESSION_BUS_ADDRESS"
+
+TEST_NAME=$(basename "$0" .sh)
+TEST_DIR=$(mktemp -d)
+SERVICES_PID=
+CBATTICON_PID=
+OUTPUT_MARK=0
+
+cleanup () {
+    [ -n "$CBATTICON_PID" ] && kill "$CBATTICON_PID" 2> /dev/null
+    [ -n "$SERVICES_PID" ] && kill "$SERVICES_PID" 2> /dev/null
+    rm -rf "$TEST_DIR"
+}
+
+trap cleanup EXIT
+
+fail () {
+    echo "$TEST_NAME: FAIL: $*"
+    [ -f "$TEST_DIR/cbatticon.out" ] && sed 's/^/    /' "$TEST_DIR/cbatticon.out"
+    exit 1
+}
+
+pass () {
+    echo "$TEST_NAME: PASS"
+}
+
+# wait_for PATTERN FILE: wait up to 10 seconds for a line of FILE to match PATTERN
+
+wait_for () {
+    for i in $(seq 100); do
+        grep -q -- "$1" "$2" 2> /dev/null && return 0
+        sleep 0.1
+    done
+
+    fail "timed out waiting for '$1' in $(basename "$2")"
+}
+
+# count PATTERN FILE: the number of lines of FILE matching PATTERN
+
+count () {
+    grep -c -- "$1" "$2" || true
+}
+
+# mark_output: wait_for_output and count_output only search what follows
+
+mark_output () {
+    OUTPUT_MARK=$(wc -l < "$TEST_DIR/cbatticon.out")
+}
+
+output_since_mark () {
+    tail -n +$((OUTPUT_MARK + 1)) "$TEST_DIR/cbatticon.out" > "$TEST_DIR/output"
+}
+
+wait_for_output () {
+    for i in $(seq 100); do
+        output_since_mark
+        grep -q -- "$1" "$TEST_DIR/output" && return 0
+        sleep 0.1
+    done
+
+    fail "timed out waiting for '$1' in the output"
+}
+
+count_output () {
+    output_since_mark
+    count "$1" "$TEST_DIR/output"
+}
+
+start_services () {
+    mkfifo "$TEST_DIR/services"
+    tests/stub-services < "$TEST_DIR/services" > "$TEST_DIR/services.out" &
+    SERVICES_PID=$!
+    exec 3> "$TEST_DIR/services"
+    wait_for "^ready" "$TEST_DIR/services.out"
+}
+
+# send COMMAND...: a command to the stub services (see tests/stub-services.c)
+
+send () {
+    echo "$*" >&3
+}
+
+start_cbatticon () {
+    ./cbatticon --toolkit=./tests/cbatticon-null.so --debug "$@" > "$TEST_DIR/cbatticon.out" 2>&1 &
+    CBATTICON_PID=$!
+}
+
+stop_cbatticon () {
+    kill -TERM "$CBATTICON_PID"
+    wait "$CBATTICON_PID" || true
+    CBATTICON_PID=
+}
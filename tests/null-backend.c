@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * null-backend: a toolkit backend without toolkit, for the tests.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "../backend.h"
+
+/*
+ * The icon is never shown: its changes are printed on the standard output,
+ * which is line buffered, and the main loop is the default glib one.
+ */
+
+struct cbatticon_tray_icon {
+    int unused;
+};
+
+static GMainLoop *main_loop;
+
+static int null_init (int *argc, char ***argv)
+{
+    /* the tests read the output while cbatticon runs */
+
+    setvbuf (stdout, NULL, _IOLBF, 0);
+
+    main_loop = g_main_loop_new (NULL, FALSE);
+
+    return 0;
+}
+
+static int null_has_icon (const char *name)
+{
+    return 1;
+}
+
+static char* null_theme_name (void)
+{
+    return NULL;
+}
+
+static cbatticon_tray_icon* null_icon_new (void)
+{
+    return calloc (1, sizeof (cbatticon_tray_icon));
+}
+
+static void null_icon_set_icon (cbatticon_tray_icon *icon, const char *name)
+{
+    printf ("icon: %s\n", name);
+}
+
+static void null_icon_set_text (cbatticon_tray_icon *icon, const char *text)
+{
+    printf ("tooltip: %s\n", text);
+}
+
+static void null_icon_show (cbatticon_tray_icon *icon)
+{
+}
+
+static void null_icon_free (cbatticon_tray_icon *icon)
+{
+    free (icon);
+}
+
+static void null_icon_on_click (cbatticon_tray_icon *icon, cbatticon_click_func func, void *user_data)
+{
+}
+
+static void null_run (void)
+{
+    g_main_loop_run (main_loop);
+}
+
+static void null_quit (void)
+{
+    g_main_loop_quit (main_loop);
+}
+
+static const struct cbatticon_backend null_backend = {
+    CBATTICON_BACKEND_API_VERSION,
+    "null",
+    null_init,
+    null_has_icon,
+    null_theme_name,
+    null_icon_new,
+    null_icon_set_icon,
+    null_icon_set_text,
+    null_icon_show,
+    null_icon_free,
+    null_icon_on_click,
+    null_run,
+    null_quit,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+const struct cbatticon_backend* cbatticon_backend_get (void)
+{
+    return &null_backend;
+}
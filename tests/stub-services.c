@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * stub-services: the system services seen by cbatticon, for the tests.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/*
+ * The services are owned on the system bus (the tests point it to a
+ * private bus), and are driven by commands read on the standard input, one
+ * per line; "ready" is printed once the names are owned:
+ *
+ * sleep true|false        : logind announces a suspend or a resume
+ *                           (PrepareForSleep)
+ * screensaver true|false  : a screensaver becomes active or inactive
+ *                           (ActiveChanged)
+ * add NAME                : UPower adds the battery NAME, discharging at 80%
+ * remove NAME             : UPower removes the battery NAME
+ * set OBJECT NAME VALUE   : set the property NAME of OBJECT (session,
+ *                           upower, display or a battery name) to VALUE, in
+ *                           the GVariant text format, and signal it
+ *                           (PropertiesChanged)
+ *
+ * The logind session of cbatticon (GetSession) is neither locked nor idle,
+ * and the UPower display device starts discharging at 80%, with no battery.
+ */
+
+#define LOGIND_NAME      "org.freedesktop.login1"
+#define LOGIND_PATH      "/org/freedesktop/login1"
+#define LOGIND_INTERFACE "org.freedesktop.login1.Manager"
+
+#define LOGIND_SESSION_PATH      "/org/freedesktop/login1/session/auto"
+#define LOGIND_SESSION_INTERFACE "org.freedesktop.login1.Session"
+
+#define SCREENSAVER_PATH      "/org/freedesktop/ScreenSaver"
+#define SCREENSAVER_INTERFACE "org.freedesktop.ScreenSaver"
+
+#define UPOWER_NAME             "org.freedesktop.UPower"
+#define UPOWER_PATH             "/org/freedesktop/UPower"
+#define UPOWER_INTERFACE        "org.freedesktop.UPower"
+#define UPOWER_DEVICE_INTERFACE "org.freedesktop.UPower.Device"
+#define UPOWER_DEVICE_PATH      "/org/freedesktop/UPower/devices/"
+
+#define PROPERTIES_INTERFACE "org.freedesktop.DBus.Properties"
+
+static const gchar introspection[] =
+    "<node>"
+    "  <interface name='" LOGIND_INTERFACE "'>"
+    "    <method name='GetSession'>"
+    "      <arg name='session_id' type='s' direction='in'/>"
+    "      <arg name='object_path' type='o' direction='out'/>"
+    "    </method>"
+    "    <signal name='PrepareForSleep'><arg name='start' type='b'/></signal>"
+    "  </interface>"
+    "  <interface name='" LOGIND_SESSION_INTERFACE "'>"
+    "    <property name='LockedHint' type='b' access='read'/>"
+    "    <property name='IdleHint' type='b' access='read'/>"
+    "  </interface>"
+    "  <interface name='" UPOWER_INTERFACE "'>"
+    "    <method name='EnumerateDevices'>"
+    "      <arg name='devices' type='ao' direction='out'/>"
+    "    </method>"
+    "    <signal name='DeviceAdded'><arg name='device' type='o'/></signal>"
+    "    <signal name='DeviceRemoved'><arg name='device' type='o'/></signal>"
+    "    <property name='OnBattery' type='b' access='read'/>"
+    "  </interface>"
+    "  <interface name='" UPOWER_DEVICE_INTERFACE "'>"
+    "    <property name='NativePath' type='s' access='read'/>"
+    "    <property name='Type' type='u' access='read'/>"
+    "    <property name='PowerSupply' type='b' access='read'/>"
+    "    <property name='IsPresent' type='b' access='read'/>"
+    "    <property name='State' type='u' access='read'/>"
+    "    <property name='Percentage' type='d' access='read'/>"
+    "    <property name='Energy' type='d' access='read'/>"
+    "    <property name='EnergyFull' type='d' access='read'/>"
+    "    <property name='EnergyRate' type='d' access='read'/>"
+    "    <property name='TimeToEmpty' type='x' access='read'/>"
+    "    <property name='TimeToFull' type='x' access='read'/>"
+    "  </interface>"
+    "</node>";
+
+/* a discharging battery at 80%, as UPower shows it */
+
+static const struct {
+    const gchar *name;
+    const gchar *value;
+} battery_properties[] = {
+    { "Type"       , "uint32 2"     },
+    { "PowerSupply", "true"         },
+    { "IsPresent"  , "true"         },
+    { "State"      , "uint32 2"     },
+    { "Percentage" , "80.0"         },
+    { "Energy"     , "40.0"         },
+    { "EnergyFull" , "50.0"         },
+    { "EnergyRate" , "10.0"         },
+    { "TimeToEmpty", "int64 14400"  },
+    { "TimeToFull" , "int64 0"      }
+};
+
+struct object {
+    gchar              *path;
+    GDBusInterfaceInfo *interface;
+    GHashTable         *properties; /* GVariant by name */
+    guint               registration;
+};
+
+static const gchar *names[] = { LOGIND_NAME, UPOWER_NAME };
+
+static GDBusConnection *connection;
+static GDBusNodeInfo *node_info;
+static GHashTable *objects; /* by name */
+static GMainLoop *main_loop;
+
+static gboolean parse_boolean (const gchar *value)
+{
+    return g_strcmp0 (value, "true") == 0;
+}
+
+static void on_sleep (gchar **arguments)
+{
+    g_dbus_connection_emit_signal (connection, NULL, LOGIND_PATH, LOGIND_INTERFACE, "PrepareForSleep",
+                                   g_variant_new ("(b)", parse_boolean (arguments[1])), NULL);
+}
+
+static void on_screensaver (gchar **arguments)
+{
+    g_dbus_connection_emit_signal (connection, NULL, SCREENSAVER_PATH, SCREENSAVER_INTERFACE, "ActiveChanged",
+                                   g_variant_new ("(b)", parse_boolean (arguments[1])), NULL);
+}
+
+/*
+ * objects
+ */
+
+static GVariant* on_get_property (GDBusConnection *connection, const gchar *sender, const gchar *object_path,
+                                  const gchar *interface_name, const gchar *property_name, GError **error, gpointer user_data)
+{
+    struct object *object = (struct object *)user_data;
+    GVariant *value = (GVariant *)g_hash_table_lookup (object->properties, property_name);
+
+    if (value == NULL) {
+        g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_PROPERTY, "no property %s", property_name);
+        return NULL;
+    }
+
+    return g_variant_ref (value);
+}
+
+static void on_method_call (GDBusConnection *connection, const gchar *sender, const gchar *object_path,
+                            const gchar *interface_name, const gchar *method_name, GVariant *parameters,
+                            GDBusMethodInvocation *invocation, gpointer user_data)
+{
+    GVariantBuilder devices;
+    GHashTableIter iter;
+    struct object *object;
+
+    if (g_strcmp0 (method_name, "EnumerateDevices") == 0) {
+        g_variant_builder_init (&devices, G_VARIANT_TYPE ("ao"));
+
+        g_hash_table_iter_init (&iter, objects);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&object) == TRUE) {
+            if (g_str_has_prefix (object->path, UPOWER_DEVICE_PATH "battery_") == TRUE) {
+                g_variant_builder_add (&devices, "o", object->path);
+            }
+        }
+
+        g_dbus_method_invocation_return_value (invocation, g_variant_new ("(ao)", &devices));
+        return;
+    }
+
+    if (g_strcmp0 (method_name, "GetSession") == 0) {
+        g_dbus_method_invocation_return_value (invocation, g_variant_new ("(o)", LOGIND_SESSION_PATH));
+        return;
+    }
+
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD, "no method %s", method_name);
+}
+
+static const GDBusInterfaceVTable object_vtable = { on_method_call, on_get_property, NULL };
+
+static void free_object (gpointer data)
+{
+    struct object *object = (struct object *)data;
+
+    g_dbus_connection_unregister_object (connection, object->registration);
+    g_hash_table_unref (object->properties);
+    g_free (object->path);
+    g_free (object);
+}
+
+static struct object* add_object (const gchar *name, const gchar *path, const gchar *interface_name)
+{
+    struct object *object = g_new0 (struct object, 1);
+
+    object->path         = g_strdup (path);
+    object->interface    = g_dbus_node_info_lookup_interface (node_info, interface_name);
+    object->properties   = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
+    object->registration = g_dbus_connection_register_object (connection, path, object->interface, &object_vtable,
+                                                              object, NULL, NULL);
+
+    g_hash_table_replace (objects, g_strdup (name), object);
+
+    return object;
+}
+
+static gboolean set_property (struct object *object, const gchar *name, const gchar *text)
+{
+    GDBusPropertyInfo *property = g_dbus_interface_info_lookup_property (object->interface, name);
+    GVariant *value;
+    GError *error = NULL;
+
+    if (property == NULL) {
+        g_printerr ("no property %s\n", name);
+        return FALSE;
+    }
+
+    value = g_variant_parse (G_VARIANT_TYPE (property->signature), text, NULL, NULL, &error);
+    if (value == NULL) {
+        g_printerr ("bad value for %s: %s\n", name, error->message);
+        g_error_free (error);
+        return FALSE;
+    }
+
+    g_hash_table_replace (object->properties, g_strdup (name), g_variant_ref_sink (value));
+
+    return TRUE;
+}
+
+static struct object* add_device (const gchar *name, const gchar *path)
+{
+    struct object *object = add_object (name, path, UPOWER_DEVICE_INTERFACE);
+
+    for (guint i = 0; i < G_N_ELEMENTS (battery_properties); i++) {
+        set_property (object, battery_properties[i].name, battery_properties[i].value);
+    }
+
+    return object;
+}
+
+/*
+ * commands
+ */
+
+static void on_add (gchar **arguments)
+{
+    gchar *path = g_strconcat (UPOWER_DEVICE_PATH "battery_", arguments[1], NULL);
+    gchar *native_path = g_strdup_printf ("'%s'", arguments[1]);
+
+    set_property (add_device (arguments[1], path), "NativePath", native_path);
+
+    g_dbus_connection_emit_signal (connection, NULL, UPOWER_PATH, UPOWER_INTERFACE, "DeviceAdded", g_variant_new ("(o)", path), NULL);
+
+    g_free (native_path);
+    g_free (path);
+}
+
+static void on_remove (gchar **arguments)
+{
+    struct object *object = (struct object *)g_hash_table_lookup (objects, arguments[1]);
+    gchar *path;
+
+    if (object == NULL) {
+        g_printerr ("no battery %s\n", arguments[1]);
+        return;
+    }
+
+    path = g_strdup (object->path);
+    g_hash_table_remove (objects, arguments[1]);
+
+    g_dbus_connection_emit_signal (connection, NULL, UPOWER_PATH, UPOWER_INTERFACE, "DeviceRemoved", g_variant_new ("(o)", path), NULL);
+
+    g_free (path);
+}
+
+static void on_set (gchar **arguments)
+{
+    struct object *object = (struct object *)g_hash_table_lookup (objects, arguments[1]);
+    const gchar *invalidated[] = { NULL };
+    GVariantBuilder changed;
+
+    if (object == NULL) {
+        g_printerr ("no object %s\n", arguments[1]);
+        return;
+    }
+
+    if (set_property (object, arguments[2], arguments[3]) == FALSE) {
+        return;
+    }
+
+    g_variant_builder_init (&changed, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&changed, "{sv}", arguments[2], g_hash_table_lookup (object->properties, arguments[2]));
+
+    g_dbus_connection_emit_signal (connection, NULL, object->path, PROPERTIES_INTERFACE, "PropertiesChanged",
+                                   g_variant_new ("(sa{sv}^as)", object->interface->name, &changed, invalidated), NULL);
+}
+
+static const struct {
+    const gchar *name;
+    gint         num_arguments;
+    void       (*run) (gchar **arguments);
+} commands[] = {
+    { "sleep"      , 1, on_sleep       },
+    { "screensaver", 1, on_screensaver },
+    { "add"        , 1, on_add         },
+    { "remove"     , 1, on_remove      },
+    { "set"        , 3, on_set         }
+};
+
+static void run_command (const gchar *line)
+{
+    gchar **arguments = g_strsplit (line, " ", 4);
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (commands); i++) {
+        if (g_strcmp0 (arguments[0], commands[i].name) == 0 && g_strv_length (arguments) == (guint)commands[i].num_arguments + 1) {
+            commands[i].run (arguments);
+            g_dbus_connection_flush_sync (connection, NULL, NULL);
+            break;
+        }
+    }
+
+    if (i == G_N_ELEMENTS (commands)) {
+        g_printerr ("unknown command: %s\n", line);
+    }
+
+    g_strfreev (arguments);
+}
+
+static gboolean on_stdin (GIOChannel *channel, GIOCondition condition, gpointer user_data)
+{
+    gchar *line;
+    gsize terminator;
+
+    do {
+        if (g_io_channel_read_line (channel, &line, NULL, &terminator, NULL) != G_IO_STATUS_NORMAL) {
+            g_main_loop_quit (main_loop);
+            return FALSE;
+        }
+
+        line[terminator] = '\0';
+        run_command (line);
+        g_free (line);
+    } while ((g_io_channel_get_buffer_condition (channel) & G_IO_IN) != 0);
+
+    return TRUE;
+}
+
+static void on_name_acquired (GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+    static guint acquired = 0;
+
+    if (++acquired == G_N_ELEMENTS (names)) {
+        printf ("ready\n");
+        fflush (stdout);
+    }
+}
+
+static void on_name_lost (GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+    /* the bus also goes away at the end of a test */
+
+    if (g_dbus_connection_is_closed (connection) == TRUE) {
+        exit (0);
+    }
+
+    g_printerr ("cannot own %s\n", name);
+    exit (1);
+}
+
+int main (int argc, char **argv)
+{
+    GError *error = NULL;
+    GIOChannel *channel;
+    struct object *session;
+    guint i;
+
+    connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+    if (connection == NULL) {
+        g_printerr ("cannot connect to the system bus: %s\n", error->message);
+        g_error_free (error);
+        return 1;
+    }
+
+    node_info = g_dbus_node_info_new_for_xml (introspection, NULL);
+    objects   = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, free_object);
+
+    add_object ("logind", LOGIND_PATH, LOGIND_INTERFACE);
+    session = add_object ("session", LOGIND_SESSION_PATH, LOGIND_SESSION_INTERFACE);
+    set_property (session, "LockedHint", "false");
+    set_property (session, "IdleHint", "false");
+
+    set_property (add_object ("upower", UPOWER_PATH, UPOWER_INTERFACE), "OnBattery", "true");
+    set_property (add_device ("display", UPOWER_DEVICE_PATH "DisplayDevice"), "NativePath", "''");
+
+    for (i = 0; i < G_N_ELEMENTS (names); i++) {
+        g_bus_own_name_on_connection (connection, names[i], G_BUS_NAME_OWNER_FLAGS_NONE, on_name_acquired, on_name_lost, NULL, NULL);
+    }
+
+    channel = g_io_channel_unix_new (0);
+    g_io_add_watch (channel, G_IO_IN | G_IO_HUP, on_stdin, NULL);
+
+    main_loop = g_main_loop_new (NULL, FALSE);
+    g_main_loop_run (main_loop);
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * sysfs: moves /sys/class/power_supply to a directory of the tests.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Preloaded with LD_PRELOAD, it makes the calls cbatticon and GLib use to
+ * list and read the power supplies find them under the directory named by
+ * $CBATTICON_TEST_SYSFS instead of /sys/class/power_supply, so that a test
+ * can write the attributes of a fake battery.
+ */
+
+#define SYSFS_PATH "/sys/class/power_supply"
+
+static const char* redirect (const char *path, char *buffer)
+{
+    const char *directory = getenv ("CBATTICON_TEST_SYSFS");
+    size_t length = strlen (SYSFS_PATH);
+
+    if (directory == NULL || path == NULL || strncmp (path, SYSFS_PATH, length) != 0 ||
+        (path[length] != '\0' && path[length] != '/')) {
+        return path;
+    }
+
+    snprintf (buffer, PATH_MAX, "%s%s", directory, path + length);
+
+    return buffer;
+}
+
+#define REAL(name) \
+    static __typeof__ (name) *real_##name; \
+    if (real_##name == NULL) { \
+        real_##name = (__typeof__ (name) *)dlsym (RTLD_NEXT, #name); \
+    }
+
+int open (const char *path, int flags, ...)
+{
+    char buffer[PATH_MAX];
+    mode_t mode = 0;
+    va_list arguments;
+
+    REAL (open);
+
+    if ((flags & O_CREAT) != 0) {
+        va_start (arguments, flags);
+        mode = va_arg (arguments, mode_t);
+        va_end (arguments);
+    }
+
+    return real_open (redirect (path, buffer), flags, mode);
+}
+
+int open64 (const char *path, int flags, ...)
+{
+    char buffer[PATH_MAX];
+    mode_t mode = 0;
+    va_list arguments;
+
+    REAL (open64);
+
+    if ((flags & O_CREAT) != 0) {
+        va_start (arguments, flags);
+        mode = va_arg (arguments, mode_t);
+        va_end (arguments);
+    }
+
+    return real_open64 (redirect (path, buffer), flags, mode);
+}
+
+DIR* opendir (const char *path)
+{
+    char buffer[PATH_MAX];
+
+    REAL (opendir);
+
+    return real_opendir (redirect (path, buffer));
+}
+
+int stat (const char *path, struct stat *status)
+{
+    char buffer[PATH_MAX];
+
+    REAL (stat);
+
+    return real_stat (redirect (path, buffer), status);
+}
+
+int stat64 (const char *path, struct stat64 *status)
+{
+    char buffer[PATH_MAX];
+
+    REAL (stat64);
+
+    return real_stat64 (redirect (path, buffer), status);
+}
+
+int access (const char *path, int mode)
+{
+    char buffer[PATH_MAX];
+
+    REAL (access);
+
+    return real_access (redirect (path, buffer), mode);
+}
@@ -0,0 +1,102 @@
+# without UPower, a locked or idle session stretches the period of the sysfs
+# polls to half the time left until the nearest level, and an active one
+# brings it back to the update interval
+
+. tests/common.sh
+
+# ticks N: wait up to 20 seconds for N updates since the mark
+
+ticks () {
+    for i in $(seq 200); do
+        [ "$(count_output " tick$")" -ge "$1" ] && return 0
+        sleep 0.1
+    done
+
+    fail "timed out waiting for $1 updates"
+}
+
+# tick_spacing min|max: the shortest or longest time between two updates since the mark
+
+tick_spacing () {
+    output_since_mark
+    awk -v which="$1" '$2 == "tick" {
+        if (last != "") {
+            spacing = $1 - last
+            if (result == "" || (which == "min" && spacing < result) || (which == "max" && spacing > result)) {
+                result = spacing
+            }
+        }
+        last = $1
+    } END { print result }' "$TEST_DIR/output"
+}
+
+# tick_spacing_is min|max OPERATOR SECONDS
+
+tick_spacing_is () {
+    awk -v spacing="$(tick_spacing "$1")" -v seconds="$3" "BEGIN { exit !(spacing $2 seconds) }" ||
+        fail "the $1 time between two updates is $(tick_spacing "$1") s, not $2 $3 s"
+}
+
+# 32% for 1 minute, with the low level at 28%: half the time to it is 3.75 s
+
+mkdir -p "$TEST_DIR/sysfs/BAT0"
+printf 'Battery\n'     > "$TEST_DIR/sysfs/BAT0/type"
+printf '1\n'           > "$TEST_DIR/sysfs/BAT0/present"
+printf 'Discharging\n' > "$TEST_DIR/sysfs/BAT0/status"
+printf '100000000\n'   > "$TEST_DIR/sysfs/BAT0/energy_full"
+printf '32000000\n'    > "$TEST_DIR/sysfs/BAT0/energy_now"
+printf '1900000000\n'  > "$TEST_DIR/sysfs/BAT0/power_now"
+
+start_services
+
+export LD_PRELOAD=./tests/sysfs.so CBATTICON_TEST_SYSFS="$TEST_DIR/sysfs"
+start_cbatticon --source=sysfs --update-interval=1 --low-level=28
+unset LD_PRELOAD
+
+wait_for "^tooltip: Battery is discharging (32% remaining)" "$TEST_DIR/cbatticon.out"
+
+mark_output
+ticks 3
+tick_spacing_is max "<" 1.5
+
+mark_output
+send set session LockedHint true
+wait_for_output "^session locked or idle"
+wait_for_output "^updates every 3 s"
+
+mark_output
+ticks 3
+tick_spacing_is min ">" 2.5
+[ "$(count_output "^tooltip: ")" = 0 ] || fail "the tooltip was built for a locked session"
+
+mark_output
+send set session LockedHint false
+wait_for_output "^session active"
+wait_for_output "^updates every 1 s"
+wait_for_output "^tooltip: Battery is discharging (32% remaining)"
+
+mark_output
+ticks 3
+tick_spacing_is max "<" 1.5
+
+mark_output
+send screensaver true
+wait_for_output "^session locked or idle"
+wait_for_output "^updates every 3 s"
+
+mark_output
+ticks 3
+tick_spacing_is min ">" 2.5
+
+mark_output
+send screensaver false
+wait_for_output "^session active"
+wait_for_output "^updates every 1 s"
+
+mark_output
+ticks 3
+tick_spacing_is max "<" 1.5
+
+stop_cbatticon
+
+pass
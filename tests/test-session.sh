@@ -0,0 +1,64 @@
+# a locked or idle session, from the logind hints or a screensaver, is updated
+# only as often as the levels need: half the time left until the nearest of
+# them, within the update interval and two minutes; an active one again every
+# update interval. UPower has no timer to set, but the update that follows a
+# change of the session still logs the interval it asks for.
+
+. tests/common.sh
+
+start_services
+send add BAT0
+
+start_cbatticon
+
+wait_for "^tooltip: Battery is discharging (80% remaining)" "$TEST_DIR/cbatticon.out"
+
+# 70% for 4 hours: the low level is 3 hours and 26 minutes away
+
+mark_output
+send set session LockedHint true
+wait_for_output "^session locked or idle"
+send set display Percentage 70.0
+wait_for_output "^updates every 120 s"
+[ "$(count_output "^tooltip: ")" = 0 ] || fail "the tooltip was built for a locked session"
+
+mark_output
+send set session LockedHint false
+wait_for_output "^session active"
+wait_for_output "^updates every 5 s"
+wait_for_output "^tooltip: Battery is discharging (70% remaining)"
+
+# 40% for 4 minutes: the low level is 2 minutes away
+
+mark_output
+send set session IdleHint true
+wait_for_output "^session locked or idle"
+send set display TimeToEmpty "int64 240"
+send set display Percentage 40.0
+wait_for_output "^updates every 60 s"
+[ "$(count_output "^tooltip: ")" = 0 ] || fail "the tooltip was built for an idle session"
+
+mark_output
+send set session IdleHint false
+wait_for_output "^session active"
+wait_for_output "^updates every 5 s"
+wait_for_output "^tooltip: Battery is discharging (40% remaining)"
+
+# charging, no level can warn
+
+mark_output
+send screensaver true
+wait_for_output "^session locked or idle"
+send set upower OnBattery false
+send set display State 1
+wait_for_output "^updates every 120 s"
+
+mark_output
+send screensaver false
+wait_for_output "^session active"
+wait_for_output "^updates every 5 s"
+wait_for_output "^tooltip: Battery is charging (40%)"
+
+stop_cbatticon
+
+pass
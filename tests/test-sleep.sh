@@ -0,0 +1,31 @@
+# a logind suspend and resume flush the filters once: the suspend must not be
+# found again from the clocks at the update that follows the resume
+
+. tests/common.sh
+
+echo 0 > "$TEST_DIR/slept"
+
+start_services
+
+export LD_PRELOAD=./tests/boottime.so CBATTICON_TEST_SLEPT="$TEST_DIR/slept"
+start_cbatticon --metrics-file="$TEST_DIR/metrics"
+unset LD_PRELOAD
+
+wait_for "^cbatticon_resumes_total 0" "$TEST_DIR/metrics"
+
+send sleep true
+wait_for "^suspending" "$TEST_DIR/cbatticon.out"
+
+echo 60 > "$TEST_DIR/slept"
+
+send sleep false
+wait_for "^resumed" "$TEST_DIR/cbatticon.out"
+wait_for "^cbatticon_resumes_total [1-9]" "$TEST_DIR/metrics"
+sleep 1
+
+stop_cbatticon
+
+[ "$(count "^resumed" "$TEST_DIR/cbatticon.out")" = 1 ] || fail "resumed more than once"
+grep -q "^cbatticon_resumes_total 1$" "$TEST_DIR/metrics" || fail "$(grep "^cbatticon_resumes_total" "$TEST_DIR/metrics")"
+
+pass
@@ -0,0 +1,42 @@
+# the batteries are read from the devices of UPower: they follow the devices
+# it adds and removes, and the icon is updated when their properties change
+
+. tests/common.sh
+
+start_services
+send add BAT0
+
+start_cbatticon
+
+wait_for "^batteries read from UPower" "$TEST_DIR/cbatticon.out"
+wait_for "^battery device: .*/battery_BAT0$" "$TEST_DIR/cbatticon.out"
+wait_for "^tooltip: Battery is discharging (80% remaining)" "$TEST_DIR/cbatticon.out"
+
+mark_output
+send add BAT1
+wait_for_output "^battery device: .*/battery_BAT1$"
+wait_for_output "BAT1: 80%"
+
+mark_output
+send set BAT1 Energy 15.0
+wait_for_output "BAT1: 30%"
+[ "$(count_output "^battery device:")" = 0 ] || fail "the devices were enumerated again on a property change"
+
+mark_output
+send set display Percentage 55.0
+wait_for_output "^tooltip: Battery is discharging (55% remaining)"
+
+mark_output
+send remove BAT1
+wait_for_output "^battery device: .*/battery_BAT0$"
+wait_for_output "^tooltip: "
+[ "$(count_output "BAT1")" = 0 ] || fail "BAT1 is still shown after its removal"
+
+mark_output
+send set upower OnBattery false
+send set display State 1
+wait_for_output "^tooltip: Battery is charging (55%)"
+
+stop_cbatticon
+
+pass
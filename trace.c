@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <glib/gi18n.h>
+
+#include <string.h>
+
+/*
+ * trace reading (see trace.h for the file format)
+ *
+ * A trace that ends in a truncated or corrupted record is read up to it.
+ */
+
+static gboolean trace_read_varint (const guchar **data, const guchar *end, guint64 *value)
+{
+    *value = 0;
+
+    for (gint shift = 0; *data < end && shift < 64; shift += 7) {
+        guchar byte = *(*data)++;
+
+        *value |= (guint64)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean trace_read_string (const guchar **data, const guchar *end, gchar **value)
+{
+    guint64 length;
+
+    if (trace_read_varint (data, end, &length) == FALSE || length > (guint64)(end - *data)) {
+        return FALSE;
+    }
+
+    *value = g_strndup ((const gchar *)*data, length);
+    *data += length;
+
+    return TRUE;
+}
+
+gboolean trace_reader_load (struct trace_reader *reader, const gchar *filename)
+{
+    GError *error = NULL;
+
+    gchar *contents;
+    gsize length;
+    const guchar *data, *end;
+    gint64 time = 0;
+
+    if (g_file_get_contents (filename, &contents, &length, &error) == FALSE) {
+        g_printerr (_("Cannot open trace file: %s (%s)\n"), filename, error->message);
+        g_error_free (error); error = NULL;
+        return FALSE;
+    }
+
+    if (length < TRACE_MAGIC_LTH || memcmp (contents, TRACE_MAGIC, TRACE_MAGIC_LTH) != 0) {
+        g_printerr (_("Invalid trace file: %s\n"), filename);
+        g_free (contents);
+        return FALSE;
+    }
+
+    reader->records   = g_array_new (FALSE, TRUE, sizeof (struct trace_record));
+    reader->key_names = g_ptr_array_new_with_free_func (g_free);
+
+    data = (const guchar *)contents + TRACE_MAGIC_LTH;
+    end  = (const guchar *)contents + length;
+
+    while (data < end) {
+        struct trace_record record = { 0 };
+        guint64 type, delta, key, status;
+        gchar *key_name;
+
+        if (trace_read_varint (&data, end, &type) == FALSE ||
+            trace_read_varint (&data, end, &delta) == FALSE) {
+            break;
+        }
+
+        time += delta;
+        record.type = (gint)type;
+        record.time = time;
+
+        if (type == TRACE_RECORD_KEY) {
+            if (trace_read_string (&data, end, &key_name) == FALSE) {
+                break;
+            }
+
+            g_ptr_array_add (reader->key_names, key_name);
+            continue;
+        }
+
+        if (type == TRACE_RECORD_READ || type == TRACE_RECORD_LIST) {
+            if (trace_read_varint (&data, end, &key) == FALSE || key >= reader->key_names->len ||
+                trace_read_varint (&data, end, &status) == FALSE ||
+                trace_read_string (&data, end, &record.value) == FALSE) {
+                break;
+            }
+
+            record.key    = (guint)key;
+            record.status = status != 0 ? TRUE : FALSE;
+        } else if (type == TRACE_RECORD_SLEEP) {
+            if (trace_read_varint (&data, end, &status) == FALSE) {
+                break;
+            }
+
+            record.status = status != 0 ? TRUE : FALSE;
+        } else if (type != TRACE_RECORD_TICK) {
+            break;
+        }
+
+        g_array_append_val (reader->records, record);
+    }
+
+    if (data < end) {
+        g_printerr (_("Trace file is truncated or corrupted: %s\n"), filename);
+    }
+
+    g_free (contents);
+
+    return TRUE;
+}
+
+void trace_reader_free (struct trace_reader *reader)
+{
+    for (guint i = 0; i < reader->records->len; i++) {
+        g_free (g_array_index (reader->records, struct trace_record, i).value);
+    }
+
+    g_array_free (reader->records, TRUE);
+    g_ptr_array_free (reader->key_names, TRUE);
+
+    reader->records   = NULL;
+    reader->key_names = NULL;
+    reader->cursor    = 0;
+}
+
+gboolean trace_reader_take (struct trace_reader *reader, gint type, const gchar *key, gboolean *status, gchar **value)
+{
+    /* look for the matching read up to the next tick so that */
+    /* reads done in a slightly different order still match  */
+
+    for (guint i = reader->cursor; i < reader->records->len; i++) {
+        struct trace_record *record = &g_array_index (reader->records, struct trace_record, i);
+
+        if (record->type == TRACE_RECORD_TICK) {
+            break;
+        }
+
+        if (record->consumed == TRUE || record->type != type ||
+            g_strcmp0 ((const gchar *)g_ptr_array_index (reader->key_names, record->key), key) != 0) {
+            continue;
+        }
+
+        record->consumed = TRUE;
+        while (reader->cursor < reader->records->len &&
+               g_array_index (reader->records, struct trace_record, reader->cursor).consumed == TRUE) {
+            reader->cursor++;
+        }
+
+        *status = record->status;
+        *value  = record->status == TRUE ? g_strdup (record->value) : NULL;
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CBATTICON_TRACE_H
+#define CBATTICON_TRACE_H
+
+#include <glib.h>
+
+/*
+ * trace file format
+ *
+ * A trace is the magic string followed by a sequence of records. Each record
+ * starts with its type and the time elapsed since the previous record (in
+ * microseconds), both varint encoded. Keys (sysfs file or directory names)
+ * are interned: a KEY record assigns the next index to a string, and READ and
+ * LIST records then refer to it by index, followed by the read status and the
+ * value that was read. A TICK record marks the start of each update, and a
+ * SLEEP record a suspend (1) or a resume (0) of the system. The times are
+ * taken from CLOCK_BOOTTIME, so they include the time spent suspended.
+ *
+ * varint: unsigned LEB128, 7 bits per byte, least significant group first
+ * string: varint length followed by the bytes (not NUL terminated)
+ *
+ * KEY  : type, delta, string
+ * READ : type, delta, key index, status (0 or 1), string
+ * LIST : type, delta, key index, status (0 or 1), names joined by '\n'
+ * TICK : type, delta
+ * SLEEP: type, delta, suspend (0 or 1)
+ */
+
+#define TRACE_MAGIC     "CBTRACE1"
+#define TRACE_MAGIC_LTH 8
+
+#define TRACE_SUFFIX    ".trace"
+
+enum {
+    TRACE_RECORD_KEY = 1,
+    TRACE_RECORD_READ,
+    TRACE_RECORD_LIST,
+    TRACE_RECORD_TICK,
+    TRACE_RECORD_SLEEP
+};
+
+/*
+ * trace reading
+ *
+ * A trace is loaded whole, its keys apart, and its reads are then taken by
+ * key one tick at a time, in whatever order they come (see trace.c). Used
+ * by the replay of the tray icon and by the estimator benchmark.
+ */
+
+struct trace_record {
+    gint     type;
+    gint64   time;     /* since the start of the trace */
+    guint    key;      /* in key_names */
+    gboolean status;
+    gboolean consumed; /* taken by a read */
+    gchar   *value;
+};
+
+struct trace_reader {
+    GArray    *records;   /* NULL until loaded */
+    GPtrArray *key_names;
+    guint      cursor;    /* first record not consumed */
+};
+
+gboolean trace_reader_load (struct trace_reader *reader, const gchar *filename);
+void     trace_reader_free (struct trace_reader *reader);
+
+/* the read or list of a key, up to the next tick from the cursor */
+
+gboolean trace_reader_take (struct trace_reader *reader, gint type, const gchar *key, gboolean *status, gchar **value);
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tray.h"
+#include "plugin.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * level rule functions
+ *
+ * The low and critical levels are two built-in rules, and --rule adds steps
+ * of their own, each with a threshold in percent or in minutes remaining, a
+ * re-arm hysteresis, a notification urgency and a command. They are
+ * compiled at startup into a rule set with a table per unit, sorted by
+ * threshold. What changes with the updates is kept apart, in a rule state
+ * that the status steps carry (see below), so that bench/simulate can run
+ * the same rules on each of its batteries: the fired flags of the rules,
+ * and the last value of each table as two cursors, one over the thresholds
+ * and one over the re-arm levels (threshold plus hysteresis). An update
+ * only compares the value with the rules next to the cursors: a rule fires
+ * when discharging brings the value down to its threshold, once, and is
+ * armed again when the value rises past its re-arm level. The percent rules
+ * follow the charge while charging too, only to be armed again; the minute
+ * rules are all armed again once charging. After a reset (a change of the
+ * power supplies), the first discharge may already be under several rules
+ * of a table: only the nearest one fires, the others are taken as fired.
+ * A reload that changes the levels sorts the rules again, and they keep
+ * whether they fired.
+ */
+
+gboolean is_charging_status (gint status)
+{
+    return status == CHARGING;
+}
+
+gboolean is_discharging_status (gint status)
+{
+    return status == DISCHARGING || status == NOT_CHARGING;
+}
+
+gboolean parse_level_rule (const gchar *specification, gint hysteresis, struct level_rule *rule)
+{
+    static const gchar *urgency_names[] = { "none", "low", "normal", "critical" };
+
+    const gchar *urgency = strchr (specification, ':');
+    const gchar *command = urgency != NULL ? strchr (urgency + 1, ':') : NULL;
+    const gchar *start;
+    gchar *end;
+    gint64 value;
+
+    value = g_ascii_strtoll (specification, &end, 10);
+    if (end == specification || value < 0) {
+        return FALSE;
+    }
+
+    if (*end == '%' && value <= 100) {
+        rule->kind = RULE_PERCENTAGE;
+        end += 1;
+    } else if (g_str_has_prefix (end, "min") == TRUE && value <= MAX_RULE_MINUTES) {
+        rule->kind = RULE_MINUTES;
+        end += 3;
+    } else {
+        return FALSE;
+    }
+
+    rule->threshold = value;
+
+    if (*end == '/') {
+        start = end + 1;
+        value = g_ascii_strtoll (start, &end, 10);
+        if (end == start || value < 0 || value > (rule->kind == RULE_PERCENTAGE ? 100 : MAX_RULE_MINUTES)) {
+            return FALSE;
+        }
+
+        hysteresis = value;
+    }
+
+    if (end != (urgency != NULL ? urgency : specification + strlen (specification))) {
+        return FALSE;
+    }
+
+    rule->rearm   = rule->threshold + hysteresis;
+    rule->urgency = RULE_URGENCY_NORMAL;
+    rule->command = NULL;
+
+    if (urgency != NULL && urgency[1] != '\0' && urgency[1] != ':') {
+        gsize length = command != NULL ? (gsize)(command - urgency - 1) : strlen (urgency + 1);
+
+        rule->urgency = RULE_URGENCY_NONE - 1;
+
+        for (guint i = 0; i < G_N_ELEMENTS (urgency_names); i++) {
+            if (strlen (urgency_names[i]) == length && strncmp (urgency + 1, urgency_names[i], length) == 0) {
+                rule->urgency = RULE_URGENCY_NONE + i;
+            }
+        }
+
+        if (rule->urgency < RULE_URGENCY_NONE) {
+            return FALSE;
+        }
+    }
+
+    if (command != NULL && command[1] != '\0') {
+        rule->command = g_strdup (command + 1);
+    }
+
+    return TRUE;
+}
+
+static gint compare_level_rules (const struct level_rule *a, const struct level_rule *b)
+{
+    if (a->kind != b->kind) {
+        return a->kind - b->kind;
+    }
+
+    if (a->threshold != b->threshold) {
+        return b->threshold - a->threshold;
+    }
+
+    return a->number - b->number;
+}
+
+/* the built-in rules of the low and critical levels, whose thresholds */
+/* are set by set_level_rule_levels                                    */
+
+void add_level_rule_levels (struct level_rule_set *set)
+{
+    for (gint level = CBATTICON_LEVEL_LOW; level <= CBATTICON_LEVEL_CRITICAL; level++) {
+        struct level_rule *rule = &set->rules[set->num_rules];
+
+        rule->kind    = RULE_PERCENTAGE;
+        rule->urgency = RULE_URGENCY_NONE;
+        rule->command = NULL;
+        rule->level   = level;
+        rule->number  = set->num_rules++;
+    }
+}
+
+void set_level_rule_levels (struct level_rule_set *set, const struct tray_config *config)
+{
+    for (gint i = 0; i < set->num_rules; i++) {
+        struct level_rule *rule = &set->rules[i];
+
+        if (rule->level != -1) {
+            rule->threshold = rule->level == CBATTICON_LEVEL_LOW ? config->low_level : config->critical_level;
+            rule->rearm     = rule->threshold + config->level_hysteresis;
+        }
+    }
+}
+
+/* sorts the rules of a set and builds its tables */
+
+void build_level_rule_set (struct level_rule_set *set)
+{
+    qsort (set->rules, set->num_rules, sizeof (struct level_rule), (gint (*)(const void *, const void *))compare_level_rules);
+
+    memset (set->tables, 0, sizeof (set->tables));
+
+    for (gint i = 0; i < set->num_rules; i++) {
+        struct level_rule_table *table = &set->tables[set->rules[i].kind];
+
+        if (table->num == 0) {
+            table->first = i;
+        }
+
+        table->num++;
+    }
+
+    /* the re-arm order by insertion, the tables are small */
+
+    for (gint kind = 0; kind < RULE_KINDS; kind++) {
+        const struct level_rule_table *table = &set->tables[kind];
+        const struct level_rule *rules = set->rules + table->first;
+        guint8 *order = set->rearm_order + table->first;
+
+        for (gint i = 0; i < table->num; i++) {
+            gint j;
+
+            for (j = i; j > 0 && rules[order[j - 1]].rearm > rules[i].rearm; j--) {
+                order[j] = order[j - 1];
+            }
+
+            order[j] = i;
+        }
+    }
+}
+
+/* the levels changed: the rules are sorted again and keep their fired flags, */
+/* while the cursors start over and find their place at the next update       */
+
+void move_level_rule_levels (struct level_rule_set *set, const struct tray_config *config, struct level_rule_state *state)
+{
+    guint8 fired[MAX_LEVEL_RULES];
+
+    for (gint i = 0; i < set->num_rules; i++) {
+        fired[set->rules[i].number] = state->fired[i];
+    }
+
+    set_level_rule_levels (set, config);
+    build_level_rule_set (set);
+
+    for (gint i = 0; i < set->num_rules; i++) {
+        state->fired[i] = fired[set->rules[i].number];
+    }
+
+    memset (state->reached, 0, sizeof (state->reached));
+    memset (state->rearmed, 0, sizeof (state->rearmed));
+}
+
+static void reset_level_rule_table (const struct level_rule_set *set, struct level_rule_state *state, gint kind)
+{
+    state->reached[kind] = 0;
+    state->rearmed[kind] = 0;
+
+    memset (state->fired + set->tables[kind].first, FALSE, set->tables[kind].num);
+}
+
+/* moves the cursors of a table to the value, and fires the armed rules */
+/* whose threshold it reached when discharging; returns how many fired  */
+
+static gint move_level_rule_table (const struct level_rule_set *set, struct level_rule_state *state, gint kind, gint value,
+                                   gboolean discharging, gint *fired_rules)
+{
+    const struct level_rule_table *table = &set->tables[kind];
+    const struct level_rule *rules = set->rules + table->first;
+    const guint8 *order = set->rearm_order + table->first;
+    guint8 *fired = state->fired + table->first;
+    gint *reached = &state->reached[kind];
+    gint *rearmed = &state->rearmed[kind];
+    gint num_fired = 0;
+
+    while (*rearmed < table->num && rules[order[*rearmed]].rearm < value) {
+        fired[order[*rearmed]] = FALSE;
+        (*rearmed)++;
+    }
+
+    while (*rearmed > 0 && rules[order[*rearmed - 1]].rearm >= value) {
+        (*rearmed)--;
+    }
+
+    while (*reached > 0 && rules[*reached - 1].threshold < value) {
+        (*reached)--;
+    }
+
+    if (discharging == FALSE) {
+        return 0;
+    }
+
+    while (*reached < table->num && rules[*reached].threshold >= value) {
+        if (fired[*reached] == FALSE) {
+            fired[*reached] = TRUE;
+            fired_rules[num_fired++] = table->first + *reached;
+        }
+
+        (*reached)++;
+    }
+
+    /* after a reset, only the nearest rules fire (the last, by decreasing threshold) */
+
+    if (state->started[kind] == FALSE) {
+        gint nearest = num_fired - 1;
+
+        while (nearest > 0 && set->rules[fired_rules[nearest - 1]].threshold == set->rules[fired_rules[num_fired - 1]].threshold) {
+            nearest--;
+        }
+
+        if (nearest > 0) {
+            memmove (fired_rules, fired_rules + nearest, (num_fired - nearest) * sizeof (gint));
+            num_fired -= nearest;
+        }
+
+        state->started[kind] = TRUE;
+    }
+
+    return num_fired;
+}
+
+static gint step_level_rules (const struct level_rule_set *set, struct level_rule_state *state, gint status, gint percentage,
+                              gint time, gint *fired_rules)
+{
+    gboolean discharging = is_discharging_status (status);
+    gint num_fired = 0;
+
+    if (set->num_rules == 0) {
+        return 0;
+    }
+
+    if (discharging == TRUE || status == CHARGING || status == CHARGED) {
+        num_fired += move_level_rule_table (set, state, RULE_PERCENTAGE, percentage, discharging, fired_rules);
+    }
+
+    if (status == CHARGING || status == CHARGED) {
+        reset_level_rule_table (set, state, RULE_MINUTES);
+    } else if (discharging == TRUE && time >= 0) {
+        num_fired += move_level_rule_table (set, state, RULE_MINUTES, time, TRUE, fired_rules + num_fired);
+    }
+
+    return num_fired;
+}
+
+/* the threshold of the first armed rule under the last value of a table */
+
+static gboolean get_next_level_rule (const struct level_rule_set *set, const struct level_rule_state *state, gint kind,
+                                     gint *threshold)
+{
+    const struct level_rule_table *table = &set->tables[kind];
+
+    for (gint i = state->reached[kind]; i < table->num; i++) {
+        if (state->fired[table->first + i] == FALSE) {
+            *threshold = set->rules[table->first + i].threshold;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * status step functions
+ *
+ * The decisions of an update are taken by tray_step, from the state kept
+ * between the updates, a snapshot of the batteries and the session, the
+ * configuration and the rule set, and come out as a new state and the
+ * actions that update_tray_icon_status carries out (notifications, hooks,
+ * fired rules, tooltip and icon, and the interval until the next update).
+ * Nothing is read or shown there, so bench/simulate runs the same decisions
+ * on synthetic batteries. The status is resolved before the
+ * charge is read, since the rate filter must be reset on a new status
+ * before estimating the time.
+ */
+
+#define UNKNOWN_CHARGED_HYSTERESIS 3   /* percent */
+
+void tray_state_init (struct tray_state *state)
+{
+    state->status          = -1;
+    state->ac_only         = FALSE;
+    state->unknown_charged = FALSE;
+
+    memset (&state->rules, 0, sizeof (state->rules));
+}
+
+/* workaround for limited/bugged batteries/drivers that unduly return   */
+/* unknown status: ac_online is -1 when unknown, and the percentage is  */
+/* only used on AC (-1 when it cannot be read)                          */
+
+gint tray_resolve_status (const struct tray_state *state, gint status, gint ac_online, gint percentage,
+                          struct tray_state *next)
+{
+    gint resolved = status;
+
+    *next = *state;
+
+    if (status != UNKNOWN || ac_online == -1) {
+        return status;
+    }
+
+    if (ac_online == TRUE) {
+        resolved = CHARGING;
+
+        /* once charged, stay so until the level drops a few percent, */
+        /* so that a full battery does not flip between the two       */
+
+        if (percentage >= 99 - (state->unknown_charged == TRUE ? UNKNOWN_CHARGED_HYSTERESIS : 0)) {
+            resolved = CHARGED;
+        }
+    } else {
+        resolved = DISCHARGING;
+    }
+
+    next->unknown_charged = resolved == CHARGED;
+
+    return resolved;
+}
+
+gboolean tray_needs_rate_reset (const struct tray_state *state, gint status)
+{
+    if (status == CHARGING) {
+        return state->status != CHARGING;
+    }
+
+    return is_discharging_status (status) == TRUE && state->status != DISCHARGING;
+}
+
+static void tray_step_status (const struct tray_state *state, const struct tray_snapshot *snapshot,
+                              struct tray_state *next, struct tray_actions *actions)
+{
+    *next = *state;
+
+    actions->flags      = 0;
+    actions->old_status = state->status;
+    actions->status     = snapshot->status;
+    actions->percentage = snapshot->percentage;
+    actions->time       = snapshot->time;
+
+    if (snapshot->num_batteries == 0) {
+        if (state->ac_only == FALSE) {
+            next->ac_only   = TRUE;
+            actions->flags |= TRAY_ACTION_AC_ONLY;
+        }
+
+        return;
+    }
+
+    actions->flags |= TRAY_ACTION_ICON;
+
+    switch (snapshot->status) {
+        case MISSING:
+        case UNKNOWN:
+            actions->percentage = 0;
+            actions->time       = -1;
+            break;
+
+        case CHARGED:
+            actions->percentage = 100;
+            actions->time       = -1;
+            break;
+    }
+
+    if (is_discharging_status (snapshot->status) == FALSE) {
+        if (state->status != snapshot->status) {
+            next->status    = snapshot->status;
+            actions->flags |= TRAY_ACTION_STATUS;
+        }
+
+        return;
+    }
+
+    /* not charging is shown as discharging, without a notification between them */
+
+    if (state->status != DISCHARGING) {
+        next->status    = DISCHARGING;
+        actions->flags |= TRAY_ACTION_STATUS;
+    }
+}
+
+/* seconds until the discharge reaches a percentage, 0 when already there */
+
+static gdouble tray_seconds_to_percentage (const struct tray_actions *actions, gint level)
+{
+    if (actions->percentage <= level) {
+        return 0;
+    }
+
+    return (gdouble)(actions->percentage - level) / actions->percentage * actions->time * 60;
+}
+
+/* the interval of the updates of a locked or idle session (see the session */
+/* activity functions of cbatticon.c)                                        */
+
+static guint tray_get_interval (const struct tray_state *state, const struct tray_config *config,
+                                const struct level_rule_set *rules, const struct tray_actions *actions)
+{
+    gdouble seconds = SESSION_MAX_INTERVAL * 2;
+    gint level;
+
+    if (is_discharging_status (actions->status) == FALSE) {
+        return SESSION_MAX_INTERVAL;
+    }
+
+    /* without an estimate, a level may come at any update */
+
+    if (actions->time <= 0 || actions->percentage <= 0) {
+        return config->update_interval;
+    }
+
+    if (get_next_level_rule (rules, &state->rules, RULE_PERCENTAGE, &level) == TRUE) {
+        seconds = MIN (seconds, tray_seconds_to_percentage (actions, level));
+    }
+
+    if (get_next_level_rule (rules, &state->rules, RULE_MINUTES, &level) == TRUE) {
+        seconds = MIN (seconds, MAX (actions->time - level, 0) * 60);
+    }
+
+    return MAX ((guint)config->update_interval, MIN ((guint)(seconds / 2), SESSION_MAX_INTERVAL));
+}
+
+void tray_step (const struct tray_state *state, const struct tray_snapshot *snapshot,
+                const struct tray_config *config, const struct level_rule_set *rules,
+                struct tray_state *next, struct tray_actions *actions)
+{
+    gint fired_rules[MAX_LEVEL_RULES], num_fired;
+
+    tray_step_status (state, snapshot, next, actions);
+
+    actions->num_fired = 0;
+    actions->interval  = 0;
+
+    /* without a battery, only a new power supply can change anything */
+
+    if (snapshot->num_batteries == 0) {
+        actions->interval = snapshot->visible == TRUE ? 0 : SESSION_MAX_INTERVAL;
+        return;
+    }
+
+    /* the low and critical levels have their own notifications and hooks */
+
+    num_fired = step_level_rules (rules, &next->rules, actions->status, actions->percentage, actions->time, fired_rules);
+
+    for (gint i = 0; i < num_fired; i++) {
+        switch (rules->rules[fired_rules[i]].level) {
+            case CBATTICON_LEVEL_LOW:
+                actions->flags |= TRAY_ACTION_LOW | TRAY_ACTION_LOW_HOOKS;
+                break;
+
+            case CBATTICON_LEVEL_CRITICAL:
+                actions->flags |= TRAY_ACTION_CRITICAL | TRAY_ACTION_CRITICAL_HOOKS;
+                break;
+
+            default:
+                actions->fired_rules[actions->num_fired++] = fired_rules[i];
+                break;
+        }
+    }
+
+    if (snapshot->visible == FALSE) {
+        actions->interval = tray_get_interval (next, config, rules, actions);
+    }
+}
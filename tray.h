@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2014-2022 Valère Monseur
+ *
+ * cbatticon: a lightweight and fast battery icon that sits in your system tray.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CBATTICON_TRAY_H
+#define CBATTICON_TRAY_H
+
+#include <glib.h>
+
+/*
+ * status steps and level rules
+ *
+ * The decisions of an update, taken without reading or showing anything, so
+ * that the tray icon and the status simulator (bench/simulate.c) run the
+ * same code (see tray.c).
+ */
+
+enum {
+    MISSING = 0,
+    UNKNOWN,
+    CHARGED,
+    CHARGING,
+    DISCHARGING,
+    NOT_CHARGING,
+    LOW_LEVEL,
+    CRITICAL_LEVEL
+};
+
+#define MAX_LEVEL_RULES  32
+#define MAX_RULE_MINUTES 100000
+
+enum {
+    RULE_PERCENTAGE = 0,
+    RULE_MINUTES,
+    RULE_KINDS
+};
+
+enum {
+    RULE_URGENCY_NONE = -1, /* no notification */
+    RULE_URGENCY_LOW,
+    RULE_URGENCY_NORMAL,
+    RULE_URGENCY_CRITICAL
+};
+
+struct level_rule {
+    gint   kind;      /* RULE_PERCENTAGE or RULE_MINUTES */
+    gint   threshold;
+    gint   rearm;     /* threshold plus hysteresis */
+    gint   urgency;   /* RULE_URGENCY_* */
+    gchar *command;   /* NULL when none */
+    gint   level;     /* CBATTICON_LEVEL_* for the built-in rules, -1 for the others */
+    gint   number;    /* in the order given, the built-in rules first */
+};
+
+struct level_rule_table {
+    gint first; /* of the table in rules and rearm_order */
+    gint num;
+};
+
+struct level_rule_set {
+    struct level_rule       rules[MAX_LEVEL_RULES];       /* by unit, then by decreasing threshold */
+    guint8                  rearm_order[MAX_LEVEL_RULES]; /* by unit, then by increasing re-arm level, from the first of the table */
+    struct level_rule_table tables[RULE_KINDS];
+    gint                    num_rules;
+};
+
+/* all zero when reset */
+
+struct level_rule_state {
+    guint8   fired[MAX_LEVEL_RULES];
+    gint     reached[RULE_KINDS]; /* the first rules of each table, whose threshold is at or above the value */
+    gint     rearmed[RULE_KINDS]; /* the first rules of each table in rearm_order, whose re-arm level is below the value */
+    gboolean started[RULE_KINDS]; /* discharged since the reset */
+};
+
+enum {
+    TRAY_ACTION_AC_ONLY        = 1 << 0, /* show that there is no battery */
+    TRAY_ACTION_ICON           = 1 << 1, /* update the metrics, the tooltip and the icon */
+    TRAY_ACTION_STATUS         = 1 << 2, /* run the status hooks and notify the new status */
+    TRAY_ACTION_LOW            = 1 << 3, /* notify the low level */
+    TRAY_ACTION_CRITICAL       = 1 << 4, /* notify the critical level */
+    TRAY_ACTION_LOW_HOOKS      = 1 << 5, /* run the low level command and plugins */
+    TRAY_ACTION_CRITICAL_HOOKS = 1 << 6  /* run the critical level command and plugins */
+};
+
+/* the settings the steps depend on */
+
+struct tray_config {
+    gint update_interval;  /* seconds */
+    gint low_level;
+    gint critical_level;
+    gint level_hysteresis;
+};
+
+struct tray_state {
+    gint                    status;          /* last notified status, -1 when none */
+    gboolean                ac_only;         /* no battery notified */
+    gboolean                unknown_charged; /* unknown status taken as charged */
+    struct level_rule_state rules;           /* the low and critical levels too */
+};
+
+struct tray_snapshot {
+    gint     num_batteries;
+    gint     status;     /* resolved and debounced */
+    gint     percentage; /* read when charging or discharging */
+    gint     time;       /* minutes, -1 when unknown */
+    gboolean visible;    /* the session is active */
+};
+
+struct tray_actions {
+    guint flags;      /* TRAY_ACTION_* */
+    gint  old_status; /* for the status hooks */
+    gint  status;
+    gint  percentage;
+    gint  time;
+    gint  fired_rules[MAX_LEVEL_RULES]; /* but the low and critical levels */
+    gint  num_fired;
+    guint interval;   /* of the updates, 0 for the update interval */
+};
+
+#define SESSION_MAX_INTERVAL 120 /* seconds */
+
+gboolean is_charging_status    (gint status);
+gboolean is_discharging_status (gint status);
+
+/* LEVEL[/HYSTERESIS][:URGENCY[:COMMAND]], LEVEL being a number followed */
+/* by % or min; the hysteresis defaults to the level hysteresis          */
+
+gboolean parse_level_rule       (const gchar *specification, gint hysteresis, struct level_rule *rule);
+
+/* a rule set is the built-in levels, added first, then the rules; it is */
+/* built once they are all added, and moved when the levels change       */
+
+void     add_level_rule_levels  (struct level_rule_set *set);
+void     set_level_rule_levels  (struct level_rule_set *set, const struct tray_config *config);
+void     build_level_rule_set   (struct level_rule_set *set);
+void     move_level_rule_levels (struct level_rule_set *set, const struct tray_config *config, struct level_rule_state *state);
+
+void     tray_state_init        (struct tray_state *state);
+gint     tray_resolve_status    (const struct tray_state *state, gint status, gint ac_online, gint percentage,
+                                 struct tray_state *next);
+gboolean tray_needs_rate_reset  (const struct tray_state *state, gint status);
+void     tray_step              (const struct tray_state *state, const struct tray_snapshot *snapshot,
+                                 const struct tray_config *config, const struct level_rule_set *rules,
+                                 struct tray_state *next, struct tray_actions *actions);
+
+#endif